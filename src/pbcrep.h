@@ -6,6 +6,8 @@
 
 #define PBCREP_SUPPORTS_STDIO 1
 #include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
 
 /* --- enums --- */
 
@@ -72,11 +74,30 @@ typedef enum
 // binary data handling
 #include "pbcrep/binary-data-reader.h"
 #include "pbcrep/binary-data-writer.h"
+#include "pbcrep/io-uring.h"
 
 // message-based record-driven files
 #include "pbcrep/reader.h"
 #include "pbcrep/writer.h"
 
+// precomputed per-descriptor tables, shared by parsers and printers
+#include "pbcrep/message-plan.h"
+
+// reading fields from packed messages, without unpacking them
+#include "pbcrep/message-view.h"
+
+// unpacking messages into one allocation each, using a plan
+#include "pbcrep/unpacker.h"
+
+// packing messages straight into a buffer, measuring them once
+#include "pbcrep/packer.h"
+
+// checking packed messages without unpacking them
+#include "pbcrep/validate.h"
+
+// where the records of length-prefixed files begin, and index files
+#include "pbcrep/frame-index.h"
+
 // Parsers convert binary-data -> messages.
 // Printers convert messages -> binary data.
 
@@ -144,12 +165,50 @@ typedef struct {
 } PBCREP_TransferResult;
 
 
+// Transfer every message from input to output.
+// Between length-prefixed formats, records are re-framed without
+// being unpacked (see pbcrep_transfer_reframed()), though still
+// checked with pbcrep_validate_wire_unpackable(), if the reader
+// and writer come straight from pbcrep_reader_new_parser()
+// and pbcrep_writer_new_printer() and the reader hasn't been advanced.
 PBCREP_TransferResult pbcrep_try_transfer_messages (PBCREP_Reader *input,
                                                     PBCREP_Writer *output,
                                                     PBCREP_Error **error);
 PBCREP_TransferResult pbcrep_transfer_messages (PBCREP_Reader *input,
                                                 PBCREP_Writer *output);
 
+// Copy all of 'input' to 'output' without interpreting it.
+// Between file descriptors the kernel does the copying (with
+// copy_file_range, sendfile or splice);  otherwise data goes through
+// a buffer and out with writev.  n_transferred counts bytes.
+PBCREP_TransferResult pbcrep_binary_data_transfer (PBCREP_BinaryDataReader *input,
+                                                   PBCREP_BinaryDataWriter *output);
+
+// Copy length-prefixed records, changing only their length-prefixes;
+// the payloads are not unpacked.  If 'check_wire' is set, each payload
+// must be a well-formed sequence of fields (valid tags and wire types,
+// values in bounds), which is checked without allocating.
+// If 'output' is NULL, nothing is written:  the input is only checked.
+// n_transferred counts records.
+PBCREP_TransferResult pbcrep_transfer_reframed (PBCREP_BinaryDataReader     *input,
+                                                PBCREP_LengthPrefixed_Format input_format,
+                                                PBCREP_BinaryDataWriter     *output,
+                                                PBCREP_LengthPrefixed_Format output_format,
+                                                bool                         check_wire);
+
+// Route length-prefixed records to one of 'n_outputs' outputs
+// (at least one), chosen by the hash of the 'key' field
+// (see pbcrep_field_path_hash()):  the output is the hash modulo
+// n_outputs, so records with equal keys go to the same output.
+// The payloads are copied as they are, re-framed in output_format.
+// n_transferred counts records.
+PBCREP_TransferResult pbcrep_transfer_sharded (PBCREP_BinaryDataReader     *input,
+                                               PBCREP_LengthPrefixed_Format input_format,
+                                               const PBCREP_FieldPath      *key,
+                                               unsigned                     n_outputs,
+                                               PBCREP_BinaryDataWriter    **outputs,
+                                               PBCREP_LengthPrefixed_Format output_format);
+
 
 /* Various parsers. */
 #include "pbcrep/parsers/json.h"
@@ -161,6 +220,12 @@ PBCREP_TransferResult pbcrep_transfer_messages (PBCREP_Reader *input,
 #include "pbcrep/printers/length-prefixed.h"
 #include "pbcrep/printers/columnar.h"
 
+/* Factories of parsers and printers. */
+#include "pbcrep/representation.h"
+
+/* Transferring messages with a thread per stage. */
+#include "pbcrep/pipeline.h"
+
 
 /* Allocator configuration */
 
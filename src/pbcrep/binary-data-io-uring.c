@@ -0,0 +1,703 @@
+/*
+ * io_uring binary-data reader and writer.
+ *
+ * We talk to the kernel with the raw system calls,
+ * so there is no dependency on liburing.
+ *
+ * Each object has a slab of queue_depth blocks, registered with
+ * the kernel when it lets us (otherwise we fall back to readv/writev
+ * operations on the same memory), and one slot per block.
+ */
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include "../pbcrep.h"
+
+#if defined(HAVE_LINUX_IO_URING_H)
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#endif
+
+#if defined(HAVE_LINUX_IO_URING_H) && defined(__NR_io_uring_setup)
+#define CAN_USE_IO_URING        1
+#else
+#define CAN_USE_IO_URING        0
+#endif
+
+#define DEFAULT_QUEUE_DEPTH     8
+#define MAX_QUEUE_DEPTH         256
+#define DEFAULT_BLOCK_SIZE      (256*1024)
+
+#if CAN_USE_IO_URING
+/* --- the ring --- */
+typedef struct {
+  int fd;
+  unsigned sq_entries;
+  unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+  unsigned sq_tail_local;               // including unsubmitted entries
+  unsigned sq_submitted;
+  unsigned *cq_head, *cq_tail, *cq_mask;
+  struct io_uring_cqe *cqes;
+  struct io_uring_sqe *sqes;
+
+  void *sq_ring;
+  size_t sq_ring_size;
+  void *cq_ring;                        // may == sq_ring
+  size_t cq_ring_size;
+  size_t sqes_size;
+} Ring;
+
+static bool
+ring_init (Ring *ring, unsigned entries)
+{
+  struct io_uring_params p;
+  memset (&p, 0, sizeof (p));
+  int fd = syscall (__NR_io_uring_setup, entries, &p);
+  if (fd < 0)
+    return false;
+
+  ring->fd = fd;
+  ring->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof (unsigned);
+  ring->cq_ring_size = p.cq_off.cqes + p.cq_entries * sizeof (struct io_uring_cqe);
+  if (p.features & IORING_FEAT_SINGLE_MMAP)
+    {
+      if (ring->cq_ring_size > ring->sq_ring_size)
+        ring->sq_ring_size = ring->cq_ring_size;
+      ring->cq_ring_size = ring->sq_ring_size;
+    }
+  ring->sq_ring = mmap (NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE,
+                        MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+  if (ring->sq_ring == MAP_FAILED)
+    goto fail_close;
+  if (p.features & IORING_FEAT_SINGLE_MMAP)
+    ring->cq_ring = ring->sq_ring;
+  else
+    {
+      ring->cq_ring = mmap (NULL, ring->cq_ring_size, PROT_READ | PROT_WRITE,
+                            MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+      if (ring->cq_ring == MAP_FAILED)
+        goto fail_unmap_sq;
+    }
+  ring->sqes_size = p.sq_entries * sizeof (struct io_uring_sqe);
+  ring->sqes = mmap (NULL, ring->sqes_size, PROT_READ | PROT_WRITE,
+                     MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+  if (ring->sqes == MAP_FAILED)
+    goto fail_unmap_cq;
+
+  uint8_t *sq = ring->sq_ring, *cq = ring->cq_ring;
+  ring->sq_entries = p.sq_entries;
+  ring->sq_head = (unsigned *) (sq + p.sq_off.head);
+  ring->sq_tail = (unsigned *) (sq + p.sq_off.tail);
+  ring->sq_mask = (unsigned *) (sq + p.sq_off.ring_mask);
+  ring->sq_array = (unsigned *) (sq + p.sq_off.array);
+  ring->sq_tail_local = ring->sq_submitted = *ring->sq_tail;
+  ring->cq_head = (unsigned *) (cq + p.cq_off.head);
+  ring->cq_tail = (unsigned *) (cq + p.cq_off.tail);
+  ring->cq_mask = (unsigned *) (cq + p.cq_off.ring_mask);
+  ring->cqes = (struct io_uring_cqe *) (cq + p.cq_off.cqes);
+  return true;
+
+fail_unmap_cq:
+  if (ring->cq_ring != ring->sq_ring)
+    munmap (ring->cq_ring, ring->cq_ring_size);
+fail_unmap_sq:
+  munmap (ring->sq_ring, ring->sq_ring_size);
+fail_close:
+  close (fd);
+  return false;
+}
+
+static void
+ring_clear (Ring *ring)
+{
+  munmap (ring->sqes, ring->sqes_size);
+  if (ring->cq_ring != ring->sq_ring)
+    munmap (ring->cq_ring, ring->cq_ring_size);
+  munmap (ring->sq_ring, ring->sq_ring_size);
+  close (ring->fd);
+}
+
+// Never NULL:  callers keep no more operations
+// outstanding than the ring has entries.
+static struct io_uring_sqe *
+ring_get_sqe (Ring *ring)
+{
+  unsigned index = ring->sq_tail_local & *ring->sq_mask;
+  struct io_uring_sqe *sqe = ring->sqes + index;
+  ring->sq_array[index] = index;
+  ring->sq_tail_local++;
+  memset (sqe, 0, sizeof (*sqe));
+  return sqe;
+}
+
+// Submit new entries, and wait for min_complete completions.
+// Returns 0 or -errno.
+static int
+ring_enter (Ring *ring, unsigned min_complete)
+{
+  __atomic_store_n (ring->sq_tail, ring->sq_tail_local, __ATOMIC_RELEASE);
+  for (;;)
+    {
+      unsigned to_submit = ring->sq_tail_local - ring->sq_submitted;
+      if (to_submit == 0 && min_complete == 0)
+        return 0;
+      int rv = syscall (__NR_io_uring_enter, ring->fd, to_submit, min_complete,
+                        min_complete > 0 ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+      if (rv >= 0)
+        {
+          ring->sq_submitted += rv;
+          if (rv == (int) to_submit)
+            return 0;
+          min_complete = 0;             // submit the rest
+        }
+      else if (errno != EINTR && errno != EAGAIN && errno != EBUSY)
+        return -errno;
+    }
+}
+
+static struct io_uring_cqe *
+ring_peek_cqe (Ring *ring)
+{
+  unsigned head = *ring->cq_head;
+  if (head == __atomic_load_n (ring->cq_tail, __ATOMIC_ACQUIRE))
+    return NULL;
+  return ring->cqes + (head & *ring->cq_mask);
+}
+
+static inline void
+ring_cqe_seen (Ring *ring)
+{
+  __atomic_store_n (ring->cq_head, *ring->cq_head + 1, __ATOMIC_RELEASE);
+}
+
+/* --- what readers and writers share --- */
+typedef struct {
+  uint64_t offset;                      // (uint64_t)-1 for streams
+  unsigned start;                       // offset in block of the operation
+  unsigned length;
+  int result;                           // once complete
+  unsigned consumed;                    // reader:  bytes delivered
+  bool in_flight;
+  struct iovec iov;                     // for readv/writev
+} Slot;
+
+typedef struct {
+  Ring ring;
+  int fd;
+  bool do_close;
+  bool seekable;
+  bool fixed_buffers;
+  unsigned depth;
+  unsigned block_size;
+  uint8_t *slab;
+  Slot *slots;
+  uint64_t next_offset;
+} Queue;
+
+static bool
+queue_init (Queue                       *queue,
+            int                          fd,
+            bool                         do_close,
+            const PBCREP_IOUringOptions *options)
+{
+  unsigned depth = options && options->queue_depth ? options->queue_depth : DEFAULT_QUEUE_DEPTH;
+  unsigned block_size = options && options->block_size ? options->block_size : DEFAULT_BLOCK_SIZE;
+  if (depth > MAX_QUEUE_DEPTH)
+    depth = MAX_QUEUE_DEPTH;
+  block_size = (block_size + 4095) & ~4095u;
+
+  struct stat st;
+  off_t pos = -1;
+  if (fstat (fd, &st) == 0 && (S_ISREG (st.st_mode) || S_ISBLK (st.st_mode)))
+    pos = lseek (fd, 0, SEEK_CUR);
+  queue->seekable = pos >= 0;
+  queue->next_offset = queue->seekable ? (uint64_t) pos : (uint64_t) -1;
+  if (!queue->seekable)
+    depth = 1;
+
+  if (!ring_init (&queue->ring, depth))
+    return false;
+  queue->slab = mmap (NULL, (size_t) depth * block_size, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (queue->slab == MAP_FAILED)
+    {
+      ring_clear (&queue->ring);
+      return false;
+    }
+  queue->fd = fd;
+  queue->do_close = do_close;
+  queue->depth = depth;
+  queue->block_size = block_size;
+  queue->slots = pbcrep_malloc (sizeof (Slot) * depth);
+  memset (queue->slots, 0, sizeof (Slot) * depth);
+
+  // Registration needs locked memory, which may be limited (RLIMIT_MEMLOCK).
+  struct iovec iovs[MAX_QUEUE_DEPTH];
+  for (unsigned i = 0; i < depth; i++)
+    {
+      iovs[i].iov_base = queue->slab + (size_t) i * block_size;
+      iovs[i].iov_len = block_size;
+    }
+  queue->fixed_buffers = syscall (__NR_io_uring_register, queue->ring.fd,
+                                  IORING_REGISTER_BUFFERS, iovs, depth) == 0;
+  return true;
+}
+
+static void
+queue_clear (Queue *queue)
+{
+  ring_clear (&queue->ring);
+  munmap (queue->slab, (size_t) queue->depth * queue->block_size);
+  pbcrep_free (queue->slots);
+  if (queue->do_close)
+    close (queue->fd);
+}
+
+static inline uint8_t *
+queue_block (Queue *queue, unsigned index)
+{
+  return queue->slab + (size_t) index * queue->block_size;
+}
+
+static void
+queue_submit (Queue *queue, unsigned index, bool is_write)
+{
+  Slot *slot = queue->slots + index;
+  struct io_uring_sqe *sqe = ring_get_sqe (&queue->ring);
+  uint8_t *data = queue_block (queue, index) + slot->start;
+  if (queue->fixed_buffers)
+    {
+      sqe->opcode = is_write ? IORING_OP_WRITE_FIXED : IORING_OP_READ_FIXED;
+      sqe->addr = (uintptr_t) data;
+      sqe->len = slot->length;
+      sqe->buf_index = index;
+    }
+  else
+    {
+      slot->iov.iov_base = data;
+      slot->iov.iov_len = slot->length;
+      sqe->opcode = is_write ? IORING_OP_WRITEV : IORING_OP_READV;
+      sqe->addr = (uintptr_t) &slot->iov;
+      sqe->len = 1;
+    }
+  sqe->fd = queue->fd;
+  sqe->off = slot->offset;
+  sqe->user_data = index;
+  slot->in_flight = true;
+}
+
+// Record completed operations in their slots;  returns the number reaped.
+static unsigned
+queue_reap (Queue *queue)
+{
+  struct io_uring_cqe *cqe;
+  unsigned n = 0;
+  while ((cqe = ring_peek_cqe (&queue->ring)) != NULL)
+    {
+      Slot *slot = queue->slots + cqe->user_data;
+      slot->result = cqe->res;
+      slot->in_flight = false;
+      ring_cqe_seen (&queue->ring);
+      n++;
+    }
+  return n;
+}
+
+static void
+queue_wait_idle (Queue *queue)
+{
+  for (;;)
+    {
+      bool any = false;
+      for (unsigned i = 0; i < queue->depth; i++)
+        any |= queue->slots[i].in_flight;
+      if (!any)
+        return;
+      if (ring_enter (&queue->ring, 1) < 0)
+        return;
+      queue_reap (queue);
+    }
+}
+
+/* --- reader --- */
+/*
+ * Slots [head, head+n_queued) (mod depth) are queued in file order;
+ * data is delivered from the head slot once it has completed.
+ */
+typedef struct {
+  PBCREP_BinaryDataReader base;
+  Queue queue;
+  bool nonblocking;
+  unsigned head, n_queued;
+  bool at_eof;
+} IOUringReader;
+
+static void
+reader_queue_read (IOUringReader *r, unsigned index, uint64_t offset, unsigned length)
+{
+  Slot *slot = r->queue.slots + index;
+  slot->offset = offset;
+  slot->start = 0;
+  slot->length = length;
+  slot->result = 0;
+  slot->consumed = 0;
+  queue_submit (&r->queue, index, false);
+}
+
+static void
+reader_fill (IOUringReader *r)
+{
+  Queue *q = &r->queue;
+  while (r->n_queued < q->depth)
+    {
+      unsigned index = (r->head + r->n_queued) % q->depth;
+      reader_queue_read (r, index, q->next_offset, q->block_size);
+      if (q->seekable)
+        q->next_offset += q->block_size;
+      r->n_queued++;
+    }
+}
+
+static PBCREP_ReadResult
+io_uring_reader_read (PBCREP_BinaryDataReader *reader,
+                      size_t                   max_length,
+                      uint8_t                 *data,
+                      size_t                  *amt_read,
+                      PBCREP_Error           **error)
+{
+  IOUringReader *r = (IOUringReader *) reader;
+  Queue *q = &r->queue;
+  int err;
+  if (r->at_eof)
+    return PBCREP_READ_RESULT_EOF;
+  if (r->n_queued == 0)
+    reader_fill (r);
+
+  for (;;)
+    {
+      Slot *slot = q->slots + r->head;
+      if (!slot->in_flight)
+        {
+          if (slot->result == -EINTR || slot->result == -EAGAIN)
+            {
+              reader_queue_read (r, r->head, slot->offset, slot->length);
+              continue;
+            }
+          if (slot->result < 0)
+            {
+              err = -slot->result;
+              goto failed;
+            }
+          if (slot->result == 0)
+            {
+              // Later reads are past the end too;  they are
+              // reaped by destroy.
+              r->at_eof = true;
+              return PBCREP_READ_RESULT_EOF;
+            }
+          size_t n = slot->result - slot->consumed;
+          if (n > max_length)
+            n = max_length;
+          memcpy (data, queue_block (q, r->head) + slot->consumed, n);
+          slot->consumed += n;
+          *amt_read = n;
+          if (slot->consumed == (unsigned) slot->result)
+            {
+              if (q->seekable && (unsigned) slot->result < slot->length)
+                {
+                  // Short read:  read the rest of the block, in place.
+                  reader_queue_read (r, r->head,
+                                     slot->offset + slot->result,
+                                     slot->length - slot->result);
+                }
+              else
+                {
+                  r->head = (r->head + 1) % q->depth;
+                  r->n_queued--;
+                  reader_fill (r);
+                }
+            }
+          if ((err = -ring_enter (&q->ring, 0)) != 0)
+            goto failed;
+          return PBCREP_READ_RESULT_OK;
+        }
+
+      if (queue_reap (q) > 0)
+        continue;
+      if (r->nonblocking)
+        {
+          if ((err = -ring_enter (&q->ring, 0)) != 0)
+            goto failed;
+          return PBCREP_READ_RESULT_BLOCKED;
+        }
+      if ((err = -ring_enter (&q->ring, 1)) != 0)
+        goto failed;
+    }
+
+failed:
+  if (error != NULL)
+    *error = pbcrep_error_new_printf ("READ_FAILED",
+                                      "error reading fd %d: %s",
+                                      q->fd, strerror (err));
+  return PBCREP_READ_RESULT_ERROR;
+}
+
+static void
+io_uring_reader_destroy (PBCREP_BinaryDataReader *reader)
+{
+  IOUringReader *r = (IOUringReader *) reader;
+  ring_enter (&r->queue.ring, 0);
+  queue_wait_idle (&r->queue);
+  queue_clear (&r->queue);
+  pbcrep_free (r);
+}
+
+/* --- writer --- */
+typedef struct {
+  PBCREP_BinaryDataWriter base;
+  Queue queue;
+  int filling;                          // slot being filled, or -1
+  unsigned fill_length;
+  int failed_errno;                     // reported by the next call
+} IOUringWriter;
+
+static void
+writer_handle_completions (IOUringWriter *w)
+{
+  Queue *q = &w->queue;
+  queue_reap (q);
+  for (unsigned i = 0; i < q->depth; i++)
+    {
+      Slot *slot = q->slots + i;
+      if (slot->in_flight || slot->length == 0)
+        continue;
+      if (slot->result == -EINTR || slot->result == -EAGAIN)
+        queue_submit (q, i, true);
+      else if (slot->result < 0)
+        {
+          if (w->failed_errno == 0)
+            w->failed_errno = -slot->result;
+          slot->length = 0;
+        }
+      else if (slot->result == 0)
+        {
+          if (w->failed_errno == 0)
+            w->failed_errno = EIO;
+          slot->length = 0;
+        }
+      else if ((unsigned) slot->result < slot->length)
+        {
+          // Short write:  write the rest.
+          slot->start += slot->result;
+          slot->length -= slot->result;
+          if (q->seekable)
+            slot->offset += slot->result;
+          queue_submit (q, i, true);
+        }
+      else
+        slot->length = 0;               // free
+    }
+}
+
+// A slot that is neither in flight nor being filled.
+static int
+writer_get_free_slot (IOUringWriter *w)
+{
+  Queue *q = &w->queue;
+  for (;;)
+    {
+      for (unsigned i = 0; i < q->depth; i++)
+        if (!q->slots[i].in_flight && q->slots[i].length == 0)
+          return i;
+      int err = ring_enter (&q->ring, 1);
+      if (err < 0)
+        {
+          w->failed_errno = -err;
+          return -1;
+        }
+      writer_handle_completions (w);
+    }
+}
+
+static void
+writer_submit_filling (IOUringWriter *w)
+{
+  Queue *q = &w->queue;
+  Slot *slot = q->slots + w->filling;
+  slot->offset = q->next_offset;
+  slot->start = 0;
+  slot->length = w->fill_length;
+  slot->result = 0;
+  if (q->seekable)
+    q->next_offset += w->fill_length;
+  queue_submit (q, w->filling, true);
+  int err = ring_enter (&q->ring, 0);
+  if (err < 0 && w->failed_errno == 0)
+    w->failed_errno = -err;
+  w->filling = -1;
+}
+
+static bool
+writer_check_failed (IOUringWriter *w, PBCREP_Error **error)
+{
+  if (w->failed_errno == 0)
+    return true;
+  if (error != NULL)
+    *error = pbcrep_error_new_printf ("WRITE_FAILED",
+                                      "error writing fd %d: %s",
+                                      w->queue.fd, strerror (w->failed_errno));
+  w->failed_errno = 0;
+  return false;
+}
+
+static bool
+io_uring_writer_write (PBCREP_BinaryDataWriter *writer,
+                       size_t                   max_length,
+                       uint8_t                 *data,
+                       PBCREP_Error           **error)
+{
+  IOUringWriter *w = (IOUringWriter *) writer;
+  Queue *q = &w->queue;
+  writer_handle_completions (w);
+  if (!writer_check_failed (w, error))
+    return false;
+  while (max_length > 0)
+    {
+      if (w->filling < 0)
+        {
+          w->filling = writer_get_free_slot (w);
+          if (w->filling < 0)
+            return writer_check_failed (w, error);
+          w->fill_length = 0;
+        }
+      size_t n = q->block_size - w->fill_length;
+      if (n > max_length)
+        n = max_length;
+      memcpy (queue_block (q, w->filling) + w->fill_length, data, n);
+      w->fill_length += n;
+      data += n;
+      max_length -= n;
+      if (w->fill_length == q->block_size)
+        writer_submit_filling (w);
+    }
+  return true;
+}
+
+static bool
+io_uring_writer_flush (PBCREP_BinaryDataWriter *writer,
+                       PBCREP_Error           **error)
+{
+  IOUringWriter *w = (IOUringWriter *) writer;
+  Queue *q = &w->queue;
+  if (w->filling >= 0 && w->fill_length > 0)
+    writer_submit_filling (w);
+  w->filling = -1;
+  for (;;)
+    {
+      writer_handle_completions (w);
+      bool any = false;
+      for (unsigned i = 0; i < q->depth; i++)
+        any |= q->slots[i].in_flight;
+      if (!any)
+        break;
+      int err = ring_enter (&q->ring, 1);
+      if (err < 0)
+        {
+          w->failed_errno = -err;
+          break;
+        }
+    }
+
+  // Leave the file position where a plain writer would have.
+  if (q->seekable)
+    lseek (q->fd, q->next_offset, SEEK_SET);
+  return writer_check_failed (w, error);
+}
+
+static void
+io_uring_writer_destroy (PBCREP_BinaryDataWriter *writer)
+{
+  IOUringWriter *w = (IOUringWriter *) writer;
+  io_uring_writer_flush (writer, NULL);
+  queue_wait_idle (&w->queue);
+  queue_clear (&w->queue);
+  pbcrep_free (w);
+}
+#endif  /* CAN_USE_IO_URING */
+
+/* --- public API --- */
+bool
+pbcrep_io_uring_is_available (void)
+{
+#if CAN_USE_IO_URING
+  // 0 = unknown, 1 = yes, 2 = no
+  static int available;
+  int a = __atomic_load_n (&available, __ATOMIC_RELAXED);
+  if (a == 0)
+    {
+      Ring ring;
+      bool ok = ring_init (&ring, 1);
+      if (ok)
+        ring_clear (&ring);
+      a = ok ? 1 : 2;
+      __atomic_store_n (&available, a, __ATOMIC_RELAXED);
+    }
+  return a == 1;
+#else
+  return false;
+#endif
+}
+
+PBCREP_BinaryDataReader *
+pbcrep_binary_data_reader_from_fileno_io_uring (int fd,
+                                                bool do_close,
+                                                const PBCREP_IOUringOptions *options)
+{
+#if CAN_USE_IO_URING
+  IOUringReader *r = pbcrep_malloc (sizeof (IOUringReader));
+  if (queue_init (&r->queue, fd, do_close, options))
+    {
+      r->base.read = io_uring_reader_read;
+      r->base.read_buffer = NULL;
+      r->base.get_fd = NULL;
+      r->base.destroy = io_uring_reader_destroy;
+      r->nonblocking = options != NULL && options->nonblocking;
+      r->head = r->n_queued = 0;
+      r->at_eof = false;
+      return &r->base;
+    }
+  pbcrep_free (r);
+#else
+  (void) options;
+#endif
+  return pbcrep_binary_data_reader_from_fileno (fd, do_close);
+}
+
+PBCREP_BinaryDataWriter *
+pbcrep_binary_data_writer_to_fileno_io_uring (int fd,
+                                              bool do_close,
+                                              const PBCREP_IOUringOptions *options)
+{
+#if CAN_USE_IO_URING
+  IOUringWriter *w = pbcrep_malloc (sizeof (IOUringWriter));
+  if (queue_init (&w->queue, fd, do_close, options))
+    {
+      w->base.write = io_uring_writer_write;
+      w->base.flush = io_uring_writer_flush;
+      w->base.get_fd = NULL;
+      w->base.destroy = io_uring_writer_destroy;
+      w->filling = -1;
+      w->fill_length = 0;
+      w->failed_errno = 0;
+      return &w->base;
+    }
+  pbcrep_free (w);
+#else
+  (void) options;
+#endif
+  return pbcrep_binary_data_writer_to_fileno (fd, do_close);
+}
@@ -0,0 +1,244 @@
+/*
+ * Memory-mapped file reader.
+ *
+ * The file is mapped a window at a time.  read_buffer() appends
+ * the rest of the current window to the buffer as one foreign
+ * fragment, which holds a reference to the window;  the window is
+ * unmapped once the reader has moved past it and every fragment
+ * of it has been consumed (on whatever thread that happens).
+ *
+ * Each window is madvise()d MADV_SEQUENTIAL, and the range of the
+ * next one is fadvise()d WILLNEED so the kernel reads ahead of us.
+ *
+ * The file size is taken when the reader is created;  as with any
+ * mapping, truncating the file underneath it will raise SIGBUS.
+ */
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include "../pbcrep.h"
+
+/* Must be a multiple of the page size. */
+#define MMAP_WINDOW_SIZE        (16*1024*1024)
+
+typedef struct {
+  uint8_t *base;
+  size_t length;
+  unsigned ref_count;
+} Window;
+
+typedef struct {
+  PBCREP_BinaryDataReader base;
+  int fd;
+  bool do_close;
+  uint64_t file_size;
+  uint64_t window_offset;               // file offset of 'window'
+  Window *window;                       // NULL until data is needed
+  size_t window_pos;                    // bytes of 'window' read
+
+  // The fd has been read directly (see get_fd);  take up at its offset.
+  bool resync;
+} MmapReader;
+
+static void
+window_unref (void *data)
+{
+  Window *window = data;
+  if (__atomic_sub_fetch (&window->ref_count, 1, __ATOMIC_ACQ_REL) == 0)
+    {
+      munmap (window->base, window->length);
+      pbcrep_free (window);
+    }
+}
+
+// Continue reading from 'pos'.  Windows start on page boundaries,
+// so the first one begins at the page holding 'pos'.
+static void
+mmap_reader_seek (MmapReader *r, uint64_t pos)
+{
+  uint64_t page_size = sysconf (_SC_PAGESIZE);
+  if (r->window != NULL)
+    {
+      window_unref (r->window);
+      r->window = NULL;
+    }
+  r->window_offset = pos - pos % page_size;
+  r->window_pos = pos % page_size;
+}
+
+// Make sure there is unread data in r->window, or return EOF/ERROR.
+static PBCREP_ReadResult
+mmap_reader_ensure_window (MmapReader *r, PBCREP_Error **error)
+{
+  if (r->window != NULL)
+    {
+      if (r->window_pos < r->window->length)
+        return PBCREP_READ_RESULT_OK;
+      r->window_offset += r->window->length;
+      r->window_pos = 0;
+      window_unref (r->window);
+      r->window = NULL;
+    }
+  if (r->resync)
+    {
+      off_t pos = lseek (r->fd, 0, SEEK_CUR);
+      if (pos < 0)
+        {
+          if (error != NULL)
+            *error = pbcrep_error_new_printf ("READ_FAILED",
+                                              "error seeking fd %d: %s",
+                                              r->fd, strerror (errno));
+          return PBCREP_READ_RESULT_ERROR;
+        }
+      mmap_reader_seek (r, pos);
+      r->resync = false;
+    }
+
+  uint64_t offset = r->window_offset;
+  if (offset + r->window_pos >= r->file_size)
+    return PBCREP_READ_RESULT_EOF;
+
+  size_t length = MMAP_WINDOW_SIZE;
+  if (length > r->file_size - offset)
+    length = r->file_size - offset;
+  void *base = mmap (NULL, length, PROT_READ, MAP_PRIVATE, r->fd, offset);
+  if (base == MAP_FAILED)
+    {
+      if (error != NULL)
+        *error = pbcrep_error_new_printf ("READ_FAILED",
+                                          "error mapping fd %d: %s",
+                                          r->fd, strerror (errno));
+      return PBCREP_READ_RESULT_ERROR;
+    }
+  madvise (base, length, MADV_SEQUENTIAL);
+  if (offset + length < r->file_size)
+    {
+      // Start reading the next window.
+      size_t next_length = r->file_size - (offset + length);
+      if (next_length > MMAP_WINDOW_SIZE)
+        next_length = MMAP_WINDOW_SIZE;
+      posix_fadvise (r->fd, offset + length, next_length, POSIX_FADV_WILLNEED);
+    }
+
+  Window *window = pbcrep_malloc (sizeof (Window));
+  window->base = base;
+  window->length = length;
+  window->ref_count = 1;                // the reader's
+  r->window = window;
+  return PBCREP_READ_RESULT_OK;
+}
+
+static PBCREP_ReadResult
+mmap_reader_read (PBCREP_BinaryDataReader *reader,
+                  size_t                   max_length,
+                  uint8_t                 *data,
+                  size_t                  *amt_read,
+                  PBCREP_Error           **error)
+{
+  MmapReader *r = (MmapReader *) reader;
+  PBCREP_ReadResult rv = mmap_reader_ensure_window (r, error);
+  if (rv != PBCREP_READ_RESULT_OK)
+    return rv;
+  size_t n = r->window->length - r->window_pos;
+  if (n > max_length)
+    n = max_length;
+  memcpy (data, r->window->base + r->window_pos, n);
+  r->window_pos += n;
+  *amt_read = n;
+  return PBCREP_READ_RESULT_OK;
+}
+
+static PBCREP_ReadResult
+mmap_reader_read_buffer (PBCREP_BinaryDataReader *reader,
+                         PBCREP_Buffer           *buffer,
+                         size_t                  *amt_read,
+                         PBCREP_Error           **error)
+{
+  MmapReader *r = (MmapReader *) reader;
+  PBCREP_ReadResult rv = mmap_reader_ensure_window (r, error);
+  if (rv != PBCREP_READ_RESULT_OK)
+    return rv;
+  Window *window = r->window;
+  size_t n = window->length - r->window_pos;
+  __atomic_add_fetch (&window->ref_count, 1, __ATOMIC_RELAXED);
+  pbcrep_buffer_append_foreign (buffer, n, window->base + r->window_pos,
+                                window_unref, window);
+  r->window_pos += n;
+  *amt_read = n;
+  return PBCREP_READ_RESULT_OK;
+}
+
+static int
+mmap_reader_get_fd (PBCREP_BinaryDataReader *reader)
+{
+  MmapReader *r = (MmapReader *) reader;
+  if (!r->resync)
+    {
+      if (lseek (r->fd, r->window_offset + r->window_pos, SEEK_SET) < 0)
+        return -1;
+      if (r->window != NULL)
+        {
+          window_unref (r->window);
+          r->window = NULL;
+        }
+      r->resync = true;
+    }
+  return r->fd;
+}
+
+static void
+mmap_reader_destroy (PBCREP_BinaryDataReader *reader)
+{
+  MmapReader *r = (MmapReader *) reader;
+  if (r->window != NULL)
+    window_unref (r->window);
+  if (r->do_close)
+    close (r->fd);
+  pbcrep_free (r);
+}
+
+PBCREP_BinaryDataReader *
+pbcrep_binary_data_reader_from_fileno_mmap (int fd, bool do_close)
+{
+  struct stat st;
+  off_t pos;
+  if (fstat (fd, &st) < 0
+   || !S_ISREG (st.st_mode)
+   || (pos = lseek (fd, 0, SEEK_CUR)) < 0)
+    return pbcrep_binary_data_reader_from_fileno (fd, do_close);
+
+  MmapReader *r = pbcrep_malloc (sizeof (MmapReader));
+  r->base.read = mmap_reader_read;
+  r->base.read_buffer = mmap_reader_read_buffer;
+  r->base.get_fd = mmap_reader_get_fd;
+  r->base.destroy = mmap_reader_destroy;
+  r->fd = fd;
+  r->do_close = do_close;
+  r->file_size = st.st_size;
+  r->window = NULL;
+  r->resync = false;
+  mmap_reader_seek (r, pos);
+  return &r->base;
+}
+
+PBCREP_BinaryDataReader *
+pbcrep_binary_data_reader_from_file_mmap (const char *filename, PBCREP_Error **error)
+{
+  int fd;
+  do
+    fd = open (filename, O_RDONLY);
+  while (fd < 0 && errno == EINTR);
+  if (fd < 0)
+    {
+      if (error != NULL)
+        *error = pbcrep_error_new_printf ("OPEN_FAILED",
+                                          "error opening %s: %s",
+                                          filename, strerror (errno));
+      return NULL;
+    }
+  return pbcrep_binary_data_reader_from_fileno_mmap (fd, true);
+}
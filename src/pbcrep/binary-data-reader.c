@@ -0,0 +1,188 @@
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <stdlib.h>
+#include "../pbcrep.h"
+
+/* Space to reserve at the end of a buffer for
+ * pbcrep_binary_data_reader_read_buffer(). */
+#define READ_BUFFER_MIN_SPACE   4096
+
+PBCREP_ReadResult
+pbcrep_binary_data_reader_read (PBCREP_BinaryDataReader *reader,
+                                size_t                   max_length,
+                                uint8_t                 *data,
+                                size_t                  *amt_read,
+                                PBCREP_Error           **error)
+{
+  return reader->read (reader, max_length, data, amt_read, error);
+}
+
+PBCREP_ReadResult
+pbcrep_binary_data_reader_read_buffer (PBCREP_BinaryDataReader *reader,
+                                       PBCREP_Buffer           *buffer,
+                                       size_t                  *amt_read,
+                                       PBCREP_Error           **error)
+{
+  if (reader->read_buffer != NULL)
+    return reader->read_buffer (reader, buffer, amt_read, error);
+
+  uint8_t *ptr;
+  unsigned avail;
+  size_t got = 0;
+  pbcrep_buffer_reserve (buffer, READ_BUFFER_MIN_SPACE, &ptr, &avail);
+  PBCREP_ReadResult rv = reader->read (reader, avail, ptr, &got, error);
+  pbcrep_buffer_commit (buffer, rv == PBCREP_READ_RESULT_OK ? got : 0);
+  *amt_read = rv == PBCREP_READ_RESULT_OK ? got : 0;
+  return rv;
+}
+
+void
+pbcrep_binary_data_reader_destroy (PBCREP_BinaryDataReader *reader)
+{
+  reader->destroy (reader);
+}
+
+/* --- file descriptors --- */
+typedef struct {
+  PBCREP_BinaryDataReader base;
+  int fd;
+  bool do_close;
+} FdReader;
+
+static PBCREP_ReadResult
+fd_reader_read (PBCREP_BinaryDataReader *reader,
+                size_t                   max_length,
+                uint8_t                 *data,
+                size_t                  *amt_read,
+                PBCREP_Error           **error)
+{
+  FdReader *r = (FdReader *) reader;
+  ssize_t rv;
+  do
+    rv = read (r->fd, data, max_length);
+  while (rv < 0 && errno == EINTR);
+  if (rv < 0)
+    {
+      if (errno == EAGAIN || errno == EWOULDBLOCK)
+        return PBCREP_READ_RESULT_BLOCKED;
+      if (error != NULL)
+        *error = pbcrep_error_new_printf ("READ_FAILED",
+                                          "error reading fd %d: %s",
+                                          r->fd, strerror (errno));
+      return PBCREP_READ_RESULT_ERROR;
+    }
+  if (rv == 0)
+    return PBCREP_READ_RESULT_EOF;
+  *amt_read = rv;
+  return PBCREP_READ_RESULT_OK;
+}
+
+static int
+fd_reader_get_fd (PBCREP_BinaryDataReader *reader)
+{
+  return ((FdReader *) reader)->fd;
+}
+
+static void
+fd_reader_destroy (PBCREP_BinaryDataReader *reader)
+{
+  FdReader *r = (FdReader *) reader;
+  if (r->do_close)
+    close (r->fd);
+  pbcrep_free (r);
+}
+
+PBCREP_BinaryDataReader *
+pbcrep_binary_data_reader_from_fileno (int fd, bool do_close)
+{
+  FdReader *r = pbcrep_malloc (sizeof (FdReader));
+  r->base.read = fd_reader_read;
+  r->base.read_buffer = NULL;
+  r->base.get_fd = fd_reader_get_fd;
+  r->base.destroy = fd_reader_destroy;
+  r->fd = fd;
+  r->do_close = do_close;
+  return &r->base;
+}
+
+PBCREP_BinaryDataReader *
+pbcrep_binary_data_reader_from_file (const char *filename, PBCREP_Error **error)
+{
+  int fd;
+  do
+    fd = open (filename, O_RDONLY);
+  while (fd < 0 && errno == EINTR);
+  if (fd < 0)
+    {
+      if (error != NULL)
+        *error = pbcrep_error_new_printf ("OPEN_FAILED",
+                                          "error opening %s: %s",
+                                          filename, strerror (errno));
+      return NULL;
+    }
+  return pbcrep_binary_data_reader_from_fileno (fd, true);
+}
+
+/* --- memory --- */
+typedef struct {
+  PBCREP_BinaryDataReader base;
+  size_t length;
+  const uint8_t *data;
+  size_t offset;
+  uint8_t *to_free;
+} DataReader;
+
+static PBCREP_ReadResult
+data_reader_read (PBCREP_BinaryDataReader *reader,
+                  size_t                   max_length,
+                  uint8_t                 *data,
+                  size_t                  *amt_read,
+                  PBCREP_Error           **error)
+{
+  DataReader *r = (DataReader *) reader;
+  (void) error;
+  if (r->offset == r->length)
+    return PBCREP_READ_RESULT_EOF;
+  size_t n = r->length - r->offset;
+  if (n > max_length)
+    n = max_length;
+  memcpy (data, r->data + r->offset, n);
+  r->offset += n;
+  *amt_read = n;
+  return PBCREP_READ_RESULT_OK;
+}
+
+static void
+data_reader_destroy (PBCREP_BinaryDataReader *reader)
+{
+  DataReader *r = (DataReader *) reader;
+  free (r->to_free);
+  pbcrep_free (r);
+}
+
+PBCREP_BinaryDataReader *
+pbcrep_binary_data_reader_from_data (size_t len, const uint8_t *data)
+{
+  DataReader *r = pbcrep_malloc (sizeof (DataReader));
+  r->base.read = data_reader_read;
+  r->base.read_buffer = NULL;
+  r->base.get_fd = NULL;
+  r->base.destroy = data_reader_destroy;
+  r->length = len;
+  r->data = data;
+  r->offset = 0;
+  r->to_free = NULL;
+  return &r->base;
+}
+
+PBCREP_BinaryDataReader *
+pbcrep_binary_data_reader_take_data (size_t len, uint8_t *data)
+{
+  PBCREP_BinaryDataReader *rv = pbcrep_binary_data_reader_from_data (len, data);
+  ((DataReader *) rv)->to_free = data;
+  return rv;
+}
@@ -7,6 +7,19 @@ struct PBCREP_BinaryDataReader
                             uint8_t                 *data,
                             size_t                  *amt_read,
                             PBCREP_Error           **error);
+
+  // Optional:  append data to the buffer without copying it,
+  // typically as foreign fragments.
+  PBCREP_ReadResult (*read_buffer)(PBCREP_BinaryDataReader *reader,
+                                   PBCREP_Buffer           *buffer,
+                                   size_t                  *amt_read,
+                                   PBCREP_Error           **error);
+
+  // Optional:  the file descriptor being read, positioned at the
+  // next byte the reader would return, or -1.  This lets data be
+  // moved by the kernel;  the reader carries on from wherever
+  // the descriptor's offset is left.
+  int (*get_fd)(PBCREP_BinaryDataReader *reader);
   void (*destroy)(PBCREP_BinaryDataReader *reader);
 };
 
@@ -16,3 +29,24 @@ PBCREP_BinaryDataReader *pbcrep_binary_data_reader_from_data (size_t len, const
 // data will be free()d
 PBCREP_BinaryDataReader *pbcrep_binary_data_reader_take_data (size_t len, uint8_t *data);
 
+// Map the file into memory, a window at a time;
+// pbcrep_binary_data_reader_read_buffer() then appends the file's
+// pages to the buffer as foreign fragments, without copying.
+// Non-regular files get a plain reader.
+PBCREP_BinaryDataReader *pbcrep_binary_data_reader_from_fileno_mmap (int fd, bool do_close);
+PBCREP_BinaryDataReader *pbcrep_binary_data_reader_from_file_mmap (const char *filename, PBCREP_Error **error);
+
+PBCREP_ReadResult pbcrep_binary_data_reader_read (PBCREP_BinaryDataReader *reader,
+                                                  size_t                   max_length,
+                                                  uint8_t                 *data,
+                                                  size_t                  *amt_read,
+                                                  PBCREP_Error           **error);
+
+// Read into the end of 'buffer':  without copying if the reader
+// supports it, otherwise straight into its free space.
+PBCREP_ReadResult pbcrep_binary_data_reader_read_buffer (PBCREP_BinaryDataReader *reader,
+                                                         PBCREP_Buffer           *buffer,
+                                                         size_t                  *amt_read,
+                                                         PBCREP_Error           **error);
+void              pbcrep_binary_data_reader_destroy (PBCREP_BinaryDataReader *reader);
+
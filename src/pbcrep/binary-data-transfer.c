@@ -0,0 +1,222 @@
+/*
+ * Copying everything from a binary-data reader to a writer.
+ *
+ * When both ends are file descriptors the kernel moves the data,
+ * with the first of these that the pair of descriptors supports:
+ *    copy_file_range()   file to file (may share extents, or offload)
+ *    sendfile()          file to anything
+ *    splice()            to or from a pipe
+ * Otherwise data comes through a PBCREP_Buffer (without copying,
+ * from readers that implement read_buffer) and goes out with writev()
+ * if the writer has a descriptor, or its write method if not.
+ */
+#define _GNU_SOURCE
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include "../pbcrep.h"
+
+#if defined(__linux__)
+#include <sys/sendfile.h>
+#define CAN_USE_SENDFILE        1
+#define CAN_USE_SPLICE          1
+#else
+#define CAN_USE_SENDFILE        0
+#define CAN_USE_SPLICE          0
+#endif
+
+#if defined(HAVE_COPY_FILE_RANGE)
+#define CAN_USE_COPY_FILE_RANGE 1
+#else
+#define CAN_USE_COPY_FILE_RANGE 0
+#endif
+
+/* Largest request to make of the kernel at once
+ * (sendfile() stops at 0x7ffff000 anyway). */
+#define MAX_KERNEL_TRANSFER     (1 << 30)
+
+typedef enum {
+  METHOD_COPY_FILE_RANGE,
+  METHOD_SENDFILE,
+  METHOD_SPLICE,
+  METHOD_NONE
+} Method;
+
+// Errors meaning "this method won't work for these descriptors".
+static bool
+is_unsupported_errno (int e)
+{
+  return e == EINVAL || e == ENOSYS || e == EXDEV
+      || e == EOPNOTSUPP || e == EBADF || e == ESPIPE;
+}
+
+static Method
+next_method (Method method, const struct stat *in_st, const struct stat *out_st)
+{
+  switch (method)
+    {
+    case METHOD_COPY_FILE_RANGE:
+      if (CAN_USE_COPY_FILE_RANGE && S_ISREG (in_st->st_mode) && S_ISREG (out_st->st_mode))
+        return METHOD_COPY_FILE_RANGE;
+      /* fallthrough */
+    case METHOD_SENDFILE:
+      if (CAN_USE_SENDFILE && S_ISREG (in_st->st_mode))
+        return METHOD_SENDFILE;
+      /* fallthrough */
+    case METHOD_SPLICE:
+      if (CAN_USE_SPLICE && (S_ISFIFO (in_st->st_mode) || S_ISFIFO (out_st->st_mode)))
+        return METHOD_SPLICE;
+      /* fallthrough */
+    case METHOD_NONE:
+      break;
+    }
+  return METHOD_NONE;
+}
+
+// Wait until a nonblocking descriptor is ready.
+static void
+wait_fd (int fd, short events)
+{
+  struct pollfd pfd = { fd, events, 0 };
+  poll (&pfd, 1, -1);
+}
+
+// Returns false if no method worked, having moved nothing
+// since the last method (if any) gave up, so the caller can carry on
+// with a buffer.  Otherwise the transfer is finished, for good or ill.
+static bool
+transfer_fds (int in_fd, int out_fd, PBCREP_TransferResult *res)
+{
+  struct stat in_st, out_st;
+  if (fstat (in_fd, &in_st) < 0 || fstat (out_fd, &out_st) < 0)
+    return false;
+
+  Method method = next_method (METHOD_COPY_FILE_RANGE, &in_st, &out_st);
+  while (method != METHOD_NONE)
+    {
+      ssize_t rv = -1;
+      switch (method)
+        {
+#if CAN_USE_COPY_FILE_RANGE
+        case METHOD_COPY_FILE_RANGE:
+          rv = copy_file_range (in_fd, NULL, out_fd, NULL, MAX_KERNEL_TRANSFER, 0);
+          break;
+#endif
+#if CAN_USE_SENDFILE
+        case METHOD_SENDFILE:
+          rv = sendfile (out_fd, in_fd, NULL, MAX_KERNEL_TRANSFER);
+          break;
+#endif
+#if CAN_USE_SPLICE
+        case METHOD_SPLICE:
+          rv = splice (in_fd, NULL, out_fd, NULL, MAX_KERNEL_TRANSFER,
+                       SPLICE_F_MOVE | SPLICE_F_MORE);
+          break;
+#endif
+        default:
+          errno = ENOSYS;
+          break;
+        }
+      if (rv > 0)
+        {
+          res->n_transferred += rv;
+          continue;
+        }
+      if (rv == 0)
+        return true;                    // end-of-file
+      if (errno == EINTR)
+        continue;
+      if (errno == EAGAIN)
+        {
+          // Either end may be nonblocking.
+          wait_fd (out_fd, POLLOUT);
+          wait_fd (in_fd, POLLIN);
+          continue;
+        }
+      if (is_unsupported_errno (errno))
+        {
+          method = next_method ((Method) (method + 1), &in_st, &out_st);
+          continue;
+        }
+
+      // The error could belong to either end.
+      res->code = PBCREP_TRANSFER_RESULT_WRITE_FAILED;
+      res->error = pbcrep_error_new_printf ("TRANSFER_FAILED",
+                                            "error copying fd %d to fd %d: %s",
+                                            in_fd, out_fd, strerror (errno));
+      return true;
+    }
+  return false;
+}
+
+static bool
+write_buffer_to_writer (PBCREP_Buffer *buffer,
+                        PBCREP_BinaryDataWriter *writer,
+                        PBCREP_Error **error)
+{
+  bool ok = true;
+  for (PBCREP_BufferFragment *frag = buffer->first_frag;
+       frag != NULL && ok;
+       frag = frag->next)
+    ok = writer->write (writer, frag->buf_length, frag->buf + frag->buf_start, error);
+  pbcrep_buffer_discard (buffer, buffer->size);
+  return ok;
+}
+
+PBCREP_TransferResult
+pbcrep_binary_data_transfer (PBCREP_BinaryDataReader *input,
+                             PBCREP_BinaryDataWriter *output)
+{
+  PBCREP_TransferResult res = { PBCREP_TRANSFER_RESULT_SUCCESS, NULL, 0 };
+
+  // Writers may be holding data that must go out first.
+  if (!pbcrep_binary_data_writer_flush (output, &res.error))
+    {
+      res.code = PBCREP_TRANSFER_RESULT_WRITE_FAILED;
+      return res;
+    }
+  int out_fd = output->get_fd != NULL ? output->get_fd (output) : -1;
+  int in_fd = input->get_fd != NULL ? input->get_fd (input) : -1;
+  if (in_fd >= 0 && out_fd >= 0 && transfer_fds (in_fd, out_fd, &res))
+    return res;
+
+  PBCREP_Buffer buffer = PBCREP_BUFFER_INIT;
+  for (;;)
+    {
+      size_t amt;
+      PBCREP_ReadResult rv = pbcrep_binary_data_reader_read_buffer (input, &buffer,
+                                                                   &amt, &res.error);
+      if (rv == PBCREP_READ_RESULT_EOF)
+        break;
+      if (rv == PBCREP_READ_RESULT_BLOCKED)
+        {
+          if (in_fd < 0)
+            {
+              res.code = PBCREP_TRANSFER_RESULT_READ_FAILED;
+              res.error = pbcrep_error_new ("READ_BLOCKED",
+                                            "transfer from a nonblocking reader");
+              break;
+            }
+          wait_fd (in_fd, POLLIN);
+          continue;
+        }
+      if (rv == PBCREP_READ_RESULT_ERROR)
+        {
+          res.code = PBCREP_TRANSFER_RESULT_READ_FAILED;
+          break;
+        }
+      if (!(out_fd >= 0 ? pbcrep_buffer_write_all_to_fd (&buffer, out_fd, &res.error)
+                        : write_buffer_to_writer (&buffer, output, &res.error)))
+        {
+          res.code = PBCREP_TRANSFER_RESULT_WRITE_FAILED;
+          break;
+        }
+      res.n_transferred += amt;
+    }
+  pbcrep_buffer_clear (&buffer);
+  return res;
+}
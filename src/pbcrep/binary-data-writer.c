@@ -0,0 +1,210 @@
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include "../pbcrep.h"
+
+bool
+pbcrep_binary_data_writer_write (PBCREP_BinaryDataWriter *writer,
+                                 size_t                   length,
+                                 const uint8_t           *data,
+                                 PBCREP_Error           **error)
+{
+  return writer->write (writer, length, (uint8_t *) data, error);
+}
+
+bool
+pbcrep_binary_data_writer_flush (PBCREP_BinaryDataWriter *writer,
+                                 PBCREP_Error           **error)
+{
+  if (writer->flush != NULL)
+    return writer->flush (writer, error);
+  return true;
+}
+
+void
+pbcrep_binary_data_writer_destroy (PBCREP_BinaryDataWriter *writer)
+{
+  writer->destroy (writer);
+}
+
+/* --- file descriptors --- */
+typedef struct {
+  PBCREP_BinaryDataWriter base;
+  int fd;
+  bool do_close;
+} FdWriter;
+
+static bool
+fd_writer_write (PBCREP_BinaryDataWriter *writer,
+                 size_t                   max_length,
+                 uint8_t                 *data,
+                 PBCREP_Error           **error)
+{
+  FdWriter *w = (FdWriter *) writer;
+  while (max_length > 0)
+    {
+      ssize_t rv = write (w->fd, data, max_length);
+      if (rv < 0)
+        {
+          if (errno == EINTR)
+            continue;
+          if (errno == EAGAIN || errno == EWOULDBLOCK)
+            {
+              // Writers have no way to report "blocked":  wait.
+              struct pollfd pfd = { w->fd, POLLOUT, 0 };
+              poll (&pfd, 1, -1);
+              continue;
+            }
+          if (error != NULL)
+            *error = pbcrep_error_new_printf ("WRITE_FAILED",
+                                              "error writing fd %d: %s",
+                                              w->fd, strerror (errno));
+          return false;
+        }
+      data += rv;
+      max_length -= rv;
+    }
+  return true;
+}
+
+static int
+fd_writer_get_fd (PBCREP_BinaryDataWriter *writer)
+{
+  return ((FdWriter *) writer)->fd;
+}
+
+static void
+fd_writer_destroy (PBCREP_BinaryDataWriter *writer)
+{
+  FdWriter *w = (FdWriter *) writer;
+  if (w->do_close)
+    close (w->fd);
+  pbcrep_free (w);
+}
+
+PBCREP_BinaryDataWriter *
+pbcrep_binary_data_writer_to_fileno (int fd, bool do_close)
+{
+  FdWriter *w = pbcrep_malloc (sizeof (FdWriter));
+  w->base.write = fd_writer_write;
+  w->base.flush = NULL;
+  w->base.get_fd = fd_writer_get_fd;
+  w->base.destroy = fd_writer_destroy;
+  w->fd = fd;
+  w->do_close = do_close;
+  return &w->base;
+}
+
+PBCREP_BinaryDataWriter *
+pbcrep_binary_data_writer_to_file (const char *filename, PBCREP_Error **error)
+{
+  int fd;
+  do
+    fd = open (filename, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+  while (fd < 0 && errno == EINTR);
+  if (fd < 0)
+    {
+      if (error != NULL)
+        *error = pbcrep_error_new_printf ("OPEN_FAILED",
+                                          "error creating %s: %s",
+                                          filename, strerror (errno));
+      return NULL;
+    }
+  return pbcrep_binary_data_writer_to_fileno (fd, true);
+}
+
+/* --- memory --- */
+typedef struct {
+  PBCREP_BinaryDataWriter base;
+  size_t max_length;
+  uint8_t *data;
+  size_t length;
+} DataWriter;
+
+static bool
+data_writer_write (PBCREP_BinaryDataWriter *writer,
+                   size_t                   max_length,
+                   uint8_t                 *data,
+                   PBCREP_Error           **error)
+{
+  DataWriter *w = (DataWriter *) writer;
+  if (max_length > w->max_length - w->length)
+    {
+      if (error != NULL)
+        *error = pbcrep_error_new_printf ("DATA_TOO_LONG",
+                                          "writing more than %zu bytes",
+                                          w->max_length);
+      return false;
+    }
+  memcpy (w->data + w->length, data, max_length);
+  w->length += max_length;
+  return true;
+}
+
+static void
+data_writer_destroy (PBCREP_BinaryDataWriter *writer)
+{
+  pbcrep_free (writer);
+}
+
+PBCREP_BinaryDataWriter *
+pbcrep_binary_data_writer_to_data_max (size_t len, const uint8_t *data)
+{
+  DataWriter *w = pbcrep_malloc (sizeof (DataWriter));
+  w->base.write = data_writer_write;
+  w->base.flush = NULL;
+  w->base.get_fd = NULL;
+  w->base.destroy = data_writer_destroy;
+  w->max_length = len;
+  w->data = (uint8_t *) data;
+  w->length = 0;
+  return &w->base;
+}
+
+/* --- callbacks --- */
+typedef struct {
+  PBCREP_BinaryDataWriter base;
+  PBCREP_BinaryDataCallback callback;
+  void *callback_data;
+} CallbackWriter;
+
+static bool
+callback_writer_write (PBCREP_BinaryDataWriter *writer,
+                       size_t                   max_length,
+                       uint8_t                 *data,
+                       PBCREP_Error           **error)
+{
+  CallbackWriter *w = (CallbackWriter *) writer;
+  if (!w->callback (max_length, data, w->callback_data))
+    {
+      if (error != NULL)
+        *error = pbcrep_error_new ("CALLBACK_FAILED",
+                                   "binary-data callback failed");
+      return false;
+    }
+  return true;
+}
+
+static void
+callback_writer_destroy (PBCREP_BinaryDataWriter *writer)
+{
+  pbcrep_free (writer);
+}
+
+PBCREP_BinaryDataWriter *
+pbcrep_binary_data_writer_to_buffer_cb (PBCREP_BinaryDataCallback callback,
+                                        void                     *callback_data)
+{
+  CallbackWriter *w = pbcrep_malloc (sizeof (CallbackWriter));
+  w->base.write = callback_writer_write;
+  w->base.flush = NULL;
+  w->base.get_fd = NULL;
+  w->base.destroy = callback_writer_destroy;
+  w->callback = callback;
+  w->callback_data = callback_data;
+  return &w->base;
+}
@@ -11,6 +11,15 @@ struct PBCREP_BinaryDataWriter
                             size_t                   max_length,
                             uint8_t                 *data,
                             PBCREP_Error           **error);
+
+  // Optional:  for writers that hold onto data.
+  // Write it all out, and report any errors.
+  bool (*flush)            (PBCREP_BinaryDataWriter *writer,
+                            PBCREP_Error           **error);
+
+  // Optional:  the file descriptor written to, or -1.
+  // Only called after a successful flush.
+  int  (*get_fd)           (PBCREP_BinaryDataWriter *writer);
   void (*destroy)          (PBCREP_BinaryDataWriter *reader);
 };
 
@@ -19,3 +28,12 @@ PBCREP_BinaryDataWriter *pbcrep_binary_data_writer_to_file (const char *filename
 PBCREP_BinaryDataWriter *pbcrep_binary_data_writer_to_data_max (size_t len, const uint8_t *data);
 PBCREP_BinaryDataWriter *pbcrep_binary_data_writer_to_buffer_cb (PBCREP_BinaryDataCallback callback, void *callback_data);
 
+bool pbcrep_binary_data_writer_write   (PBCREP_BinaryDataWriter *writer,
+                                        size_t                   length,
+                                        const uint8_t           *data,
+                                        PBCREP_Error           **error);
+bool pbcrep_binary_data_writer_flush   (PBCREP_BinaryDataWriter *writer,
+                                        PBCREP_Error           **error);
+
+// Flushes, but errors are lost:  call pbcrep_binary_data_writer_flush() first.
+void pbcrep_binary_data_writer_destroy (PBCREP_BinaryDataWriter *writer);
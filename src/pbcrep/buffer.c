@@ -19,14 +19,23 @@
         daveb@ffem.org <Dave Benson>
 */
 
-/* Free blocks to hold around to avoid repeated mallocs... */
+/* Default number of free blocks each thread holds onto,
+ * to avoid repeated mallocs... */
 #define MAX_RECYCLED		16
 
-/* Size of allocations to make. */
+/* Size of allocations to make, unless the buffer's sizing says otherwise. */
 #define BUF_CHUNK_SIZE		32768
 
-/* Max fragments in the iovector to writev. */
-#define MAX_FRAGMENTS_TO_WRITE	16
+/* Max fragments in the iovector to writev (see IOV_MAX below). */
+#define MAX_FRAGMENTS_TO_WRITE	IOV_MAX
+
+/* Runs of fragments shorter than this are copied together
+ * into one iovec, up to WRITEV_STAGING_SIZE bytes per writev. */
+#define WRITEV_COALESCE_SIZE	256
+#define WRITEV_STAGING_SIZE	16384
+
+/* Most bytes to pass to one writev, so the count fits an int. */
+#define WRITEV_MAX_BYTES	(1U << 30)
 
 /* This causes fragments not to be transferred from buffer to buffer,
  * and not to be allocated in pools.  The result is that stack-trace
@@ -37,14 +46,35 @@
  */ 
 #define PBCREP_DEBUG_BUFFER_ALLOCATIONS	(0 && PBCREP_DEBUG)
 
-#include <alloca.h>
+#include <assert.h>
+#include <limits.h>
+#include <pthread.h>
 #include <sys/types.h>
 #include <sys/uio.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <poll.h>
 #include <unistd.h>
+#include <stdarg.h>
+#include <stdlib.h>
 #include <string.h>
 #include <stdio.h>      /* for vsnprintf() */
 #include <errno.h>
-#include "pbcrep.h"
+#if defined(__SSSE3__)
+#include <tmmintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+#include "../pbcrep.h"
+
+/* glibc only defines IOV_MAX for XOPEN;  16 is the POSIX minimum. */
+#ifndef IOV_MAX
+# ifdef UIO_MAXIOV
+#  define IOV_MAX       UIO_MAXIOV
+# else
+#  define IOV_MAX       16
+# endif
+#endif
 
 /* --- PBCREP_BufferFragment implementation --- */
 static inline int 
@@ -63,40 +93,413 @@ pbcrep_buffer_fragment_end (PBCREP_BufferFragment *fragment)
   return fragment->buf + fragment->buf_start + fragment->buf_length;
 }
 
+static inline bool
+fragment_is_shared (PBCREP_BufferFragment *fragment)
+{
+  return __atomic_load_n (&fragment->ref_count, __ATOMIC_ACQUIRE) > 1;
+}
+
+// Forbid writing past the current end of the fragment.
+static inline void
+seal_fragment (PBCREP_BufferFragment *fragment)
+{
+  fragment->buf_max_size = fragment->buf_start + fragment->buf_length;
+}
+
+/* --- PBCREP_BufferFragment size classes --- */
+/*
+ * Native fragments are allocated in power-of-two sizes,
+ * header included, from 4K (class 0) to 2M.  HUGE_CLASS is also 2M,
+ * but mmap()ed on a 2M boundary so it can be backed by a huge page.
+ * Fragments bigger than 2M (only made by pbcrep_buffer_reserve())
+ * are NO_CLASS and are not recycled.
+ */
+#define MIN_CLASS_SHIFT         12
+#define N_MALLOC_CLASSES        10
+#define HUGE_CLASS              N_MALLOC_CLASSES
+#define N_CLASSES               (N_MALLOC_CLASSES + 1)
+#define NO_CLASS                0xff
+#define HUGE_PAGE_SIZE          ((size_t) 1 << 21)
+
+const PBCREP_BufferSizing pbcrep_buffer_sizing_default = { BUF_CHUNK_SIZE, BUF_CHUNK_SIZE, false };
+const PBCREP_BufferSizing pbcrep_buffer_sizing_small = { 4096, 4096, false };
+const PBCREP_BufferSizing pbcrep_buffer_sizing_bulk = { 65536, HUGE_PAGE_SIZE, true };
+
+static const PBCREP_BufferSizing *default_sizing = &pbcrep_buffer_sizing_default;
+
+static inline size_t
+class_size (unsigned size_class)
+{
+  return size_class == HUGE_CLASS ? HUGE_PAGE_SIZE
+                                  : (size_t) 1 << (MIN_CLASS_SHIFT + size_class);
+}
+
+// Smallest malloc class holding 'alloc_size' (header included),
+// or the largest one.
+static unsigned
+class_for_size (size_t alloc_size)
+{
+  unsigned size_class = 0;
+  while (size_class < N_MALLOC_CLASSES - 1 && class_size (size_class) < alloc_size)
+    size_class++;
+  return size_class;
+}
+
+// Class of the next fragment for 'buffer':  twice the size of its last
+// fragment, within the buffer's sizing.
+static unsigned
+next_fragment_class (const PBCREP_Buffer *buffer)
+{
+  const PBCREP_BufferSizing *sizing = buffer->sizing;
+  if (sizing == NULL)
+    sizing = __atomic_load_n (&default_sizing, __ATOMIC_RELAXED);
+  unsigned min_class = class_for_size (sizing->min_fragment_size);
+  unsigned max_class = class_for_size (sizing->max_fragment_size);
+  unsigned size_class = min_class;
+  const PBCREP_BufferFragment *last = buffer->last_frag;
+  if (max_class > min_class && last != NULL && !last->is_foreign)
+    {
+      if (last->size_class >= N_MALLOC_CLASSES - 1)
+        size_class = max_class;
+      else if (last->size_class >= min_class)
+        size_class = last->size_class + 1;
+    }
+  if (size_class > max_class && max_class >= min_class)
+    size_class = max_class;
+#if !PBCREP_DEBUG_BUFFER_ALLOCATIONS
+  if (size_class == N_MALLOC_CLASSES - 1 && sizing->use_huge_pages)
+    size_class = HUGE_CLASS;
+#endif
+  return size_class;
+}
+
+// NULL if we couldn't map anything.
+static void *
+map_huge_page (void)
+{
+  void *mem;
+#ifdef MAP_HUGETLB
+  mem = mmap (NULL, HUGE_PAGE_SIZE, PROT_READ | PROT_WRITE,
+              MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+  if (mem != MAP_FAILED)
+    return mem;
+#endif
+
+  // No reserved huge pages:  map an aligned 2M region
+  // and ask for a transparent huge page.
+  mem = mmap (NULL, 2 * HUGE_PAGE_SIZE, PROT_READ | PROT_WRITE,
+              MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (mem == MAP_FAILED)
+    return NULL;
+  uint8_t *start = mem;
+  uint8_t *aligned = (uint8_t *) (((uintptr_t) start + HUGE_PAGE_SIZE - 1)
+                                  & ~(uintptr_t) (HUGE_PAGE_SIZE - 1));
+  if (aligned > start)
+    munmap (start, aligned - start);
+  munmap (aligned + HUGE_PAGE_SIZE, start + HUGE_PAGE_SIZE - aligned);
+#ifdef MADV_HUGEPAGE
+  madvise (aligned, HUGE_PAGE_SIZE, MADV_HUGEPAGE);
+#endif
+  return aligned;
+}
+
+static PBCREP_BufferFragment *
+allocate_fragment (unsigned size_class)
+{
+  PBCREP_BufferFragment *fragment = NULL;
+  if (size_class == HUGE_CLASS)
+    {
+      fragment = map_huge_page ();
+      if (fragment == NULL)
+        size_class = N_MALLOC_CLASSES - 1;
+    }
+  if (fragment == NULL)
+    fragment = (PBCREP_BufferFragment *) pbcrep_malloc (class_size (size_class));
+  fragment->size_class = size_class;
+  fragment->buf_max_size = class_size (size_class) - sizeof (PBCREP_BufferFragment);
+  return fragment;
+}
+
+// Free a native fragment's memory.
+static void
+free_fragment (PBCREP_BufferFragment *fragment)
+{
+  if (fragment->size_class == HUGE_CLASS)
+    munmap (fragment, HUGE_PAGE_SIZE);
+  else
+    pbcrep_free (fragment);
+}
+
 /* --- PBCREP_BufferFragment recycling --- */
+/*
+ * Each thread keeps a small stack of free fragments per size class
+ * (in its ThreadCache);  that is the fast path, and needs no
+ * synchronization.
+ *
+ * When one of a thread's stacks overflows, half of it moves to the
+ * depot as one batch;  when it runs dry, it takes a batch from
+ * the depot before falling back to malloc.
+ *
+ * The depot is a fixed array of slots per class, each NULL or holding
+ * a batch (a list linked through ->next).  Batches go in by
+ * compare-and-swap against NULL and come out by atomic exchange,
+ * so there is no lock and no ABA problem.
+ *
+ * The per-thread limit is in 32K fragments;  other classes get the
+ * same number of bytes (but always at least one fragment).
+ */
 #if !PBCREP_DEBUG_BUFFER_ALLOCATIONS
-static int num_recycled = 0;
-static PBCREP_BufferFragment* recycling_stack = 0;
+#define DEPOT_MAX_SLOTS         64
+
+typedef struct ThreadCache ThreadCache;
+struct ThreadCache
+{
+  PBCREP_BufferFragment *stacks[N_CLASSES];
+  unsigned n_fragments[N_CLASSES];
+  // Only written by the owning thread; read by get_recycling_stats().
+  size_t bytes_held;
+  uint64_t n_hits;
+  uint64_t n_misses;
+
+  ThreadCache *prev, *next;             // in all_thread_caches
+};
+
+static unsigned max_recycled_per_thread = MAX_RECYCLED;
+static unsigned max_depot_batches = DEPOT_MAX_SLOTS / 2;
+
+static PBCREP_BufferFragment *depot[N_CLASSES][DEPOT_MAX_SLOTS];
+static size_t depot_bytes_held;
+
+static pthread_mutex_t thread_caches_mutex = PTHREAD_MUTEX_INITIALIZER;
+static ThreadCache *all_thread_caches;
+static uint64_t retired_hits, retired_misses;   // from exited threads
+static pthread_key_t thread_cache_key;
+static pthread_once_t thread_cache_key_once = PTHREAD_ONCE_INIT;
+static __thread ThreadCache *thread_cache;
+
+// (buf_max_size may have been cut down by seal_fragment().)
+static inline size_t
+fragment_allocation_size (PBCREP_BufferFragment *fragment)
+{
+  return class_size (fragment->size_class);
+}
+
+static inline unsigned
+class_cache_limit (unsigned size_class)
+{
+  unsigned max = __atomic_load_n (&max_recycled_per_thread, __ATOMIC_RELAXED);
+  size_t limit = (size_t) max * BUF_CHUNK_SIZE / class_size (size_class);
+  return max == 0 ? 0 : limit == 0 ? 1 : limit;
+}
+
+static inline void
+counter_increment (uint64_t *counter)
+{
+  __atomic_store_n (counter, *counter + 1, __ATOMIC_RELAXED);
+}
+
+static inline void
+bytes_held_set (ThreadCache *tc, size_t bytes)
+{
+  __atomic_store_n (&tc->bytes_held, bytes, __ATOMIC_RELAXED);
+}
+
+static bool
+depot_put (unsigned size_class, PBCREP_BufferFragment *batch, size_t batch_bytes)
+{
+  PBCREP_BufferFragment **slots = depot[size_class];
+  unsigned n_slots = __atomic_load_n (&max_depot_batches, __ATOMIC_RELAXED);
+  __atomic_add_fetch (&depot_bytes_held, batch_bytes, __ATOMIC_RELAXED);
+  for (unsigned i = 0; i < n_slots; i++)
+    {
+      PBCREP_BufferFragment *expected = NULL;
+      if (__atomic_load_n (&slots[i], __ATOMIC_RELAXED) == NULL
+       && __atomic_compare_exchange_n (&slots[i], &expected, batch, false,
+                                       __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+        return true;
+    }
+  __atomic_sub_fetch (&depot_bytes_held, batch_bytes, __ATOMIC_RELAXED);
+  return false;
+}
+
+static PBCREP_BufferFragment *
+depot_take (unsigned size_class)
+{
+  PBCREP_BufferFragment **slots = depot[size_class];
+  for (unsigned i = 0; i < DEPOT_MAX_SLOTS; i++)
+    if (__atomic_load_n (&slots[i], __ATOMIC_RELAXED) != NULL)
+      {
+        PBCREP_BufferFragment *batch = __atomic_exchange_n (&slots[i], NULL, __ATOMIC_ACQUIRE);
+        if (batch != NULL)
+          return batch;
+      }
+  return NULL;
+}
 
+static void
+free_fragment_list (PBCREP_BufferFragment *list)
+{
+  while (list != NULL)
+    {
+      PBCREP_BufferFragment *next = list->next;
+      free_fragment (list);
+      list = next;
+    }
+}
+
+static size_t
+fragment_list_bytes (PBCREP_BufferFragment *list, unsigned *count_out)
+{
+  size_t bytes = 0;
+  unsigned n = 0;
+  for (PBCREP_BufferFragment *at = list; at != NULL; at = at->next)
+    {
+      bytes += fragment_allocation_size (at);
+      n++;
+    }
+  if (count_out != NULL)
+    *count_out = n;
+  return bytes;
+}
+
+// Move the whole cache to the depot (or free it).
+static void
+thread_cache_flush (ThreadCache *tc)
+{
+  for (unsigned c = 0; c < N_CLASSES; c++)
+    {
+      PBCREP_BufferFragment *list = tc->stacks[c];
+      if (list != NULL && !depot_put (c, list, fragment_list_bytes (list, NULL)))
+        free_fragment_list (list);
+      tc->stacks[c] = NULL;
+      tc->n_fragments[c] = 0;
+    }
+  bytes_held_set (tc, 0);
+}
+
+static void
+thread_cache_destroy (void *data)
+{
+  ThreadCache *tc = data;
+  thread_cache_flush (tc);
+  pthread_mutex_lock (&thread_caches_mutex);
+  if (tc->prev != NULL)
+    tc->prev->next = tc->next;
+  else
+    all_thread_caches = tc->next;
+  if (tc->next != NULL)
+    tc->next->prev = tc->prev;
+  retired_hits += tc->n_hits;
+  retired_misses += tc->n_misses;
+  pthread_mutex_unlock (&thread_caches_mutex);
+  pbcrep_free (tc);
+  thread_cache = NULL;
+}
+
+static void
+make_thread_cache_key (void)
+{
+  pthread_key_create (&thread_cache_key, thread_cache_destroy);
+}
+
+static ThreadCache *
+create_thread_cache (void)
+{
+  pthread_once (&thread_cache_key_once, make_thread_cache_key);
+  ThreadCache *tc = pbcrep_malloc (sizeof (ThreadCache));
+  memset (tc, 0, sizeof (ThreadCache));
+  pthread_mutex_lock (&thread_caches_mutex);
+  tc->next = all_thread_caches;
+  if (all_thread_caches != NULL)
+    all_thread_caches->prev = tc;
+  all_thread_caches = tc;
+  pthread_mutex_unlock (&thread_caches_mutex);
+  pthread_setspecific (thread_cache_key, tc);
+  thread_cache = tc;
+  return tc;
+}
+
+static inline ThreadCache *
+get_thread_cache (void)
+{
+  ThreadCache *tc = thread_cache;
+  if (PBCREP_LIKELY (tc != NULL))
+    return tc;
+  return create_thread_cache ();
+}
+
+// Refill an empty stack from the depot.
+static bool
+thread_cache_refill (ThreadCache *tc, unsigned size_class)
+{
+  PBCREP_BufferFragment *batch = depot_take (size_class);
+  if (batch == NULL)
+    return false;
+  unsigned n;
+  size_t bytes = fragment_list_bytes (batch, &n);
+  __atomic_sub_fetch (&depot_bytes_held, bytes, __ATOMIC_RELAXED);
+  tc->stacks[size_class] = batch;
+  tc->n_fragments[size_class] = n;
+  bytes_held_set (tc, tc->bytes_held + bytes);
+  return true;
+}
+
+// Move the older half of an overfull stack to the depot.
+static void
+thread_cache_spill (ThreadCache *tc, unsigned size_class)
+{
+  unsigned keep = tc->n_fragments[size_class] / 2;
+  PBCREP_BufferFragment **p = &tc->stacks[size_class];
+  for (unsigned i = 0; i < keep; i++)
+    p = &((*p)->next);
+  PBCREP_BufferFragment *batch = *p;
+  *p = NULL;
+  size_t batch_bytes = fragment_list_bytes (batch, NULL);
+  tc->n_fragments[size_class] = keep;
+  bytes_held_set (tc, tc->bytes_held - batch_bytes);
+  if (!depot_put (size_class, batch, batch_bytes))
+    free_fragment_list (batch);
+}
 #endif
 
 static PBCREP_BufferFragment *
-new_native_fragment()
+new_native_fragment_of_class (unsigned size_class)
 {
   PBCREP_BufferFragment *fragment;
 #if PBCREP_DEBUG_BUFFER_ALLOCATIONS
-  fragment = (PBCREP_BufferFragment *) pbcrep_malloc (BUF_CHUNK_SIZE);
-  fragment->buf_max_size = BUF_CHUNK_SIZE - sizeof (PBCREP_BufferFragment);
+  fragment = allocate_fragment (size_class);
 #else  /* optimized (?) */
-  if (recycling_stack)
+  ThreadCache *tc = get_thread_cache ();
+  if (tc->stacks[size_class] != NULL || thread_cache_refill (tc, size_class))
     {
-      fragment = recycling_stack;
-      recycling_stack = recycling_stack->next;
-      num_recycled--;
+      fragment = tc->stacks[size_class];
+      tc->stacks[size_class] = fragment->next;
+      tc->n_fragments[size_class]--;
+      bytes_held_set (tc, tc->bytes_held - fragment_allocation_size (fragment));
+      counter_increment (&tc->n_hits);
+      fragment->buf_max_size = class_size (size_class) - sizeof (PBCREP_BufferFragment);
     }
   else
     {
-      fragment = (PBCREP_BufferFragment *) pbcrep_malloc (BUF_CHUNK_SIZE);
-      fragment->buf_max_size = BUF_CHUNK_SIZE - sizeof (PBCREP_BufferFragment);
+      fragment = allocate_fragment (size_class);
+      counter_increment (&tc->n_misses);
     }
 #endif	/* !PBCREP_DEBUG_BUFFER_ALLOCATIONS */
   fragment->buf_start = fragment->buf_length = 0;
   fragment->next = 0;
   fragment->buf = (uint8_t *) (fragment + 1);
   fragment->is_foreign = 0;
+  fragment->ref_count = 1;
   return fragment;
 }
 
+// A fresh fragment to put at the end of 'buffer'.
+static inline PBCREP_BufferFragment *
+new_native_fragment (const PBCREP_Buffer *buffer)
+{
+  return new_native_fragment_of_class (next_fragment_class (buffer));
+}
+
 static PBCREP_BufferFragment *
 new_foreign_fragment (unsigned             length,
                       const void          *ptr,
@@ -104,8 +507,10 @@ new_foreign_fragment (unsigned             length,
 		      void                *ddata)
 {
   PBCREP_BufferFragment *fragment;
-  fragment = PBCREP_NEW (PBCREP_BufferFragment);
+  fragment = pbcrep_malloc (sizeof (PBCREP_BufferFragment));
   fragment->is_foreign = 1;
+  fragment->size_class = NO_CLASS;
+  fragment->ref_count = 1;
   fragment->buf_start = 0;
   fragment->buf_length = length;
   fragment->buf_max_size = length;
@@ -116,16 +521,16 @@ new_foreign_fragment (unsigned             length,
   return fragment;
 }
 
-#if PBCREP_DEBUG_BUFFER_ALLOCATIONS
-#define recycle(fragment) do{ \
-    if (fragment->is_foreign && fragment->destroy != NULL) \
-      fragment->destroy (fragment->destroy_data); \
-    pbcrep_free (fragment); \
-   }while(0)
-#else	/* optimized (?) */
+/* Drop a reference to the fragment:  the last one destroys
+ * (foreign) or recycles (native) it. */
 static void
 recycle(PBCREP_BufferFragment* fragment)
 {
+  // With a single reference there is no one to race with.
+  if (__atomic_load_n (&fragment->ref_count, __ATOMIC_ACQUIRE) != 1
+   && __atomic_sub_fetch (&fragment->ref_count, 1, __ATOMIC_ACQ_REL) != 0)
+    return;
+
   if (fragment->is_foreign)
     {
       if (fragment->destroy)
@@ -133,38 +538,100 @@ recycle(PBCREP_BufferFragment* fragment)
       pbcrep_free (fragment);
       return;
     }
-#if defined(MAX_RECYCLED)
-  if (num_recycled >= MAX_RECYCLED)
+
+#if PBCREP_DEBUG_BUFFER_ALLOCATIONS
+  free_fragment (fragment);
+#else	/* optimized (?) */
+  // oversized fragments from pbcrep_buffer_reserve() aren't reused.
+  unsigned size_class = fragment->size_class;
+  if (size_class == NO_CLASS)
     {
       pbcrep_free (fragment);
       return;
     }
-#endif
-  fragment->next = recycling_stack;
-  recycling_stack = fragment;
-  num_recycled++;
-}
+
+  ThreadCache *tc = get_thread_cache ();
+  fragment->next = tc->stacks[size_class];
+  tc->stacks[size_class] = fragment;
+  tc->n_fragments[size_class]++;
+  bytes_held_set (tc, tc->bytes_held + fragment_allocation_size (fragment));
+  if (tc->n_fragments[size_class] > class_cache_limit (size_class))
+    thread_cache_spill (tc, size_class);
 #endif	/* !PBCREP_DEBUG_BUFFER_ALLOCATIONS */
+}
 
 /* --- Global public methods --- */
 /**
  * _pbcrep_buffer_cleanup_recycling_bin:
  * 
- * Free unused buffer fragments.  (Normally some are
+ * Free unused buffer fragments:  those cached by this thread,
+ * and those in the shared depot.  (Normally some are
  * kept around to reduce strain on the global allocator.)
  */
 void
 _pbcrep_buffer_cleanup_recycling_bin ()
 {
 #if !PBCREP_DEBUG_BUFFER_ALLOCATIONS
-  while (recycling_stack != NULL)
+  ThreadCache *tc = thread_cache;
+  for (unsigned c = 0; c < N_CLASSES; c++)
     {
-      PBCREP_BufferFragment *next;
-      next = recycling_stack->next;
-      pbcrep_free (recycling_stack);
-      recycling_stack = next;
+      if (tc != NULL)
+        {
+          free_fragment_list (tc->stacks[c]);
+          tc->stacks[c] = NULL;
+          tc->n_fragments[c] = 0;
+        }
+      PBCREP_BufferFragment *batch;
+      while ((batch = depot_take (c)) != NULL)
+        {
+          __atomic_sub_fetch (&depot_bytes_held, fragment_list_bytes (batch, NULL), __ATOMIC_RELAXED);
+          free_fragment_list (batch);
+        }
     }
-  num_recycled = 0;
+  if (tc != NULL)
+    bytes_held_set (tc, 0);
+#endif
+}
+
+void
+pbcrep_buffer_set_recycling_limits (unsigned max_per_thread,
+                                    unsigned max_depot_batch_count)
+{
+#if !PBCREP_DEBUG_BUFFER_ALLOCATIONS
+  if (max_depot_batch_count > DEPOT_MAX_SLOTS)
+    max_depot_batch_count = DEPOT_MAX_SLOTS;
+  __atomic_store_n (&max_recycled_per_thread, max_per_thread, __ATOMIC_RELAXED);
+  __atomic_store_n (&max_depot_batches, max_depot_batch_count, __ATOMIC_RELAXED);
+#else
+  (void) max_per_thread;
+  (void) max_depot_batch_count;
+#endif
+}
+
+void
+pbcrep_buffer_set_default_sizing (const PBCREP_BufferSizing *sizing)
+{
+  if (sizing == NULL)
+    sizing = &pbcrep_buffer_sizing_default;
+  __atomic_store_n (&default_sizing, sizing, __ATOMIC_RELAXED);
+}
+
+void
+pbcrep_buffer_get_recycling_stats (PBCREP_BufferRecyclingStats *stats_out)
+{
+  memset (stats_out, 0, sizeof (PBCREP_BufferRecyclingStats));
+#if !PBCREP_DEBUG_BUFFER_ALLOCATIONS
+  pthread_mutex_lock (&thread_caches_mutex);
+  stats_out->n_hits = retired_hits;
+  stats_out->n_misses = retired_misses;
+  for (ThreadCache *tc = all_thread_caches; tc != NULL; tc = tc->next)
+    {
+      stats_out->n_hits += __atomic_load_n (&tc->n_hits, __ATOMIC_RELAXED);
+      stats_out->n_misses += __atomic_load_n (&tc->n_misses, __ATOMIC_RELAXED);
+      stats_out->bytes_held += __atomic_load_n (&tc->bytes_held, __ATOMIC_RELAXED);
+    }
+  pthread_mutex_unlock (&thread_caches_mutex);
+  stats_out->bytes_held += __atomic_load_n (&depot_bytes_held, __ATOMIC_RELAXED);
 #endif
 }
       
@@ -181,10 +648,28 @@ pbcrep_buffer_init(PBCREP_Buffer *buffer)
 {
   buffer->first_frag = buffer->last_frag = NULL;
   buffer->size = 0;
+  buffer->sizing = NULL;
+}
+
+/**
+ * pbcrep_buffer_init_with_sizing:
+ * @buffer: buffer to initialize (as empty).
+ * @sizing: how big to make the buffer's fragments;  must outlive the buffer.
+ *
+ * Construct an empty buffer whose fragments are sized by @sizing
+ * instead of the global default.
+ */
+void
+pbcrep_buffer_init_with_sizing (PBCREP_Buffer             *buffer,
+                                const PBCREP_BufferSizing *sizing)
+{
+  buffer->first_frag = buffer->last_frag = NULL;
+  buffer->size = 0;
+  buffer->sizing = sizing;
 }
 
 #if defined(PBCREP_DEBUG) || PBCREP_DEBUG_BUFFER_ALLOCATIONS
-static inline pbcrep_boolean
+static inline bool
 verify_buffer (const PBCREP_Buffer *buffer)
 {
   const PBCREP_BufferFragment *fragment;
@@ -192,12 +677,12 @@ verify_buffer (const PBCREP_Buffer *buffer)
   for (fragment = buffer->first_frag; fragment != NULL; fragment = fragment->next)
     {
       if (fragment->buf_length == 0)
-        return PBCREP_FALSE;
+        return false;
       total += fragment->buf_length;
     }
   return total == buffer->size;
 }
-#define CHECK_INTEGRITY(buffer)	pbcrep_assert (verify_buffer (buffer))
+#define CHECK_INTEGRITY(buffer)	assert (verify_buffer (buffer))
 #else
 #define CHECK_INTEGRITY(buffer)
 #endif
@@ -222,7 +707,7 @@ pbcrep_buffer_append(PBCREP_Buffer    *buffer,
       unsigned avail;
       if (!buffer->last_frag)
 	{
-	  buffer->last_frag = buffer->first_frag = new_native_fragment ();
+	  buffer->last_frag = buffer->first_frag = new_native_fragment (buffer);
 	  avail = pbcrep_buffer_fragment_avail (buffer->last_frag);
 	}
       else
@@ -230,7 +715,7 @@ pbcrep_buffer_append(PBCREP_Buffer    *buffer,
 	  avail = pbcrep_buffer_fragment_avail (buffer->last_frag);
 	  if (avail <= 0)
 	    {
-	      buffer->last_frag->next = new_native_fragment ();
+	      buffer->last_frag->next = new_native_fragment (buffer);
 	      avail = pbcrep_buffer_fragment_avail (buffer->last_frag);
 	      buffer->last_frag = buffer->last_frag->next;
 	    }
@@ -257,7 +742,7 @@ pbcrep_buffer_append_repeated_byte (PBCREP_Buffer    *buffer,
       unsigned avail;
       if (!buffer->last_frag)
 	{
-	  buffer->last_frag = buffer->first_frag = new_native_fragment ();
+	  buffer->last_frag = buffer->first_frag = new_native_fragment (buffer);
 	  avail = pbcrep_buffer_fragment_avail (buffer->last_frag);
 	}
       else
@@ -265,7 +750,7 @@ pbcrep_buffer_append_repeated_byte (PBCREP_Buffer    *buffer,
 	  avail = pbcrep_buffer_fragment_avail (buffer->last_frag);
 	  if (avail <= 0)
 	    {
-	      buffer->last_frag->next = new_native_fragment ();
+	      buffer->last_frag->next = new_native_fragment (buffer);
 	      avail = pbcrep_buffer_fragment_avail (buffer->last_frag);
 	      buffer->last_frag = buffer->last_frag->next;
 	    }
@@ -302,7 +787,7 @@ void
 pbcrep_buffer_append_string(PBCREP_Buffer  *buffer,
                          const char *string)
 {
-  pbcrep_return_if_fail (string != NULL, "string must be non-null");
+  assert (string != NULL);
   pbcrep_buffer_append (buffer, strlen (string), string);
 }
 
@@ -380,7 +865,7 @@ pbcrep_buffer_read(PBCREP_Buffer    *buffer,
 	}
     }
   buffer->size -= rv;
-  pbcrep_assert (rv == orig_max_length || buffer->size == 0);
+  assert (rv == orig_max_length || buffer->size == 0);
   CHECK_INTEGRITY (buffer);
   return rv;
 }
@@ -577,6 +1062,83 @@ pbcrep_buffer_discard(PBCREP_Buffer *buffer,
   return rv;
 }
 
+/* iovecs and staging memory for writev_fragments().  */
+static __thread struct iovec writev_iov[MAX_FRAGMENTS_TO_WRITE];
+static __thread uint8_t writev_staging[WRITEV_STAGING_SIZE];
+
+/* Write the start of the buffer, at most max_bytes, with one writev:
+ * up to MAX_FRAGMENTS_TO_WRITE iovecs, where each run of small
+ * fragments (printers make lots of them) is copied into
+ * one staging iovec.  */
+static int
+writev_fragments (PBCREP_Buffer *read_from,
+                  int            fd,
+                  unsigned       max_bytes)
+{
+  PBCREP_BufferFragment *frag_at = read_from->first_frag;
+  unsigned n_iov = 0;
+  unsigned staging_used = 0;
+  unsigned bytes = 0;
+  int rv;
+
+  CHECK_INTEGRITY (read_from);
+  if (max_bytes > WRITEV_MAX_BYTES)
+    max_bytes = WRITEV_MAX_BYTES;
+  while (frag_at != NULL && bytes < max_bytes && n_iov < MAX_FRAGMENTS_TO_WRITE)
+    {
+      unsigned frag_bytes = frag_at->buf_length;
+      if (frag_bytes > max_bytes - bytes)
+        frag_bytes = max_bytes - bytes;
+      const uint8_t *start = pbcrep_buffer_fragment_start (frag_at);
+      PBCREP_BufferFragment *next = frag_at->next;
+
+      if (frag_bytes < WRITEV_COALESCE_SIZE
+       && next != NULL
+       && next->buf_length < WRITEV_COALESCE_SIZE
+       && staging_used + frag_bytes + next->buf_length <= WRITEV_STAGING_SIZE)
+        {
+          // Gather this fragment and as many small ones
+          // after it as will fit.
+          uint8_t *stage = writev_staging + staging_used;
+          unsigned stage_len = 0;
+          for (;;)
+            {
+              memcpy (stage + stage_len, start, frag_bytes);
+              stage_len += frag_bytes;
+              bytes += frag_bytes;
+              frag_at = frag_at->next;
+              if (frag_at == NULL || bytes >= max_bytes)
+                break;
+              frag_bytes = frag_at->buf_length;
+              if (frag_bytes > max_bytes - bytes)
+                frag_bytes = max_bytes - bytes;
+              if (frag_bytes >= WRITEV_COALESCE_SIZE
+               || staging_used + stage_len + frag_bytes > WRITEV_STAGING_SIZE)
+                break;
+              start = pbcrep_buffer_fragment_start (frag_at);
+            }
+          writev_iov[n_iov].iov_base = stage;
+          writev_iov[n_iov].iov_len = stage_len;
+          staging_used += stage_len;
+          n_iov++;
+          continue;
+        }
+
+      writev_iov[n_iov].iov_base = (void *) start;
+      writev_iov[n_iov].iov_len = frag_bytes;
+      n_iov++;
+      bytes += frag_bytes;
+      frag_at = next;
+    }
+  rv = writev (fd, writev_iov, n_iov);
+  if (rv < 0 && (errno == EINTR || errno == EAGAIN))
+    return 0;
+  if (rv <= 0)
+    return rv;
+  pbcrep_buffer_discard (read_from, rv);
+  return rv;
+}
+
 /**
  * pbcrep_buffer_writev:
  * @read_from: buffer to take data from.
@@ -594,32 +1156,7 @@ int
 pbcrep_buffer_writev (PBCREP_Buffer       *read_from,
 		   int              fd)
 {
-  int rv;
-  struct iovec *iov;
-  int nfrag, i;
-  PBCREP_BufferFragment *frag_at = read_from->first_frag;
-  CHECK_INTEGRITY (read_from);
-  for (nfrag = 0; frag_at != NULL
-#ifdef MAX_FRAGMENTS_TO_WRITE
-       && nfrag < MAX_FRAGMENTS_TO_WRITE
-#endif
-       ; nfrag++)
-    frag_at = frag_at->next;
-  iov = (struct iovec *) alloca (sizeof (struct iovec) * nfrag);
-  frag_at = read_from->first_frag;
-  for (i = 0; i < nfrag; i++)
-    {
-      iov[i].iov_len = frag_at->buf_length;
-      iov[i].iov_base = pbcrep_buffer_fragment_start (frag_at);
-      frag_at = frag_at->next;
-    }
-  rv = writev (fd, iov, nfrag);
-  if (rv < 0 && (errno == EINTR || errno == EAGAIN))
-    return 0;
-  if (rv <= 0)
-    return rv;
-  pbcrep_buffer_discard (read_from, rv);
-  return rv;
+  return writev_fragments (read_from, fd, WRITEV_MAX_BYTES);
 }
 
 /**
@@ -641,57 +1178,33 @@ pbcrep_buffer_writev_len (PBCREP_Buffer *read_from,
 		       int        fd,
 		       unsigned      max_bytes)
 {
-  int rv;
-  struct iovec *iov;
-  int nfrag, i;
-  unsigned bytes;
-  PBCREP_BufferFragment *frag_at = read_from->first_frag;
-  CHECK_INTEGRITY (read_from);
-  for (nfrag = 0, bytes = 0; frag_at != NULL && bytes < max_bytes
-#ifdef MAX_FRAGMENTS_TO_WRITE
-       && nfrag < MAX_FRAGMENTS_TO_WRITE
-#endif
-       ; nfrag++)
-    {
-      bytes += frag_at->buf_length;
-      frag_at = frag_at->next;
-    }
-  iov = (struct iovec *) alloca (sizeof (struct iovec) * nfrag);
-  frag_at = read_from->first_frag;
-  for (bytes = max_bytes, i = 0; i < nfrag && bytes > 0; i++)
-    {
-      unsigned frag_bytes = frag_at->buf_length;
-      if (frag_bytes > bytes)
-        frag_bytes = bytes;
-      iov[i].iov_len = frag_bytes;
-      iov[i].iov_base = pbcrep_buffer_fragment_start (frag_at);
-      frag_at = frag_at->next;
-      bytes -= frag_bytes;
-    }
-  rv = writev (fd, iov, i);
-  if (rv < 0 && (errno == EINTR || errno == EAGAIN))
-    return 0;
-  if (rv <= 0)
-    return rv;
-  pbcrep_buffer_discard (read_from, rv);
-  return rv;
+  return writev_fragments (read_from, fd, max_bytes);
 }
 
-pbcrep_boolean
+bool
 pbcrep_buffer_write_all_to_fd (PBCREP_Buffer       *read_from,
 		            int              fd,
                             PBCREP_Error       **error)
 {
   while (read_from->size > 0)
     {
-      if (pbcrep_buffer_writev (read_from, fd) < 0)
+      int rv = pbcrep_buffer_writev (read_from, fd);
+      if (rv < 0)
         {
-          pbcrep_set_error (error, "error writing to fd %d: %s",
-                         fd, strerror (errno));
-          return PBCREP_FALSE;
+          if (error != NULL)
+            *error = pbcrep_error_new_printf ("WRITE_FAILED",
+                                              "error writing to fd %d: %s",
+                                              fd, strerror (errno));
+          return false;
+        }
+      if (rv == 0)
+        {
+          // EAGAIN (or EINTR):  wait for room.
+          struct pollfd pfd = { fd, POLLOUT, 0 };
+          poll (&pfd, 1, -1);
         }
     }
-  return PBCREP_TRUE;
+  return true;
 }
 
 /**
@@ -752,6 +1265,40 @@ pbcrep_buffer_reset(PBCREP_Buffer *to_destroy)
 }
 
 
+/* --- searching --- */
+/* Test to see if a sequence of buffer fragments
+ * starts with a particular string, at frag_index
+ * in the first fragment.
+ */
+static bool
+fragment_n_str(const PBCREP_BufferFragment *fragment,
+               unsigned                     frag_index,
+               const uint8_t               *string,
+               size_t                       length)
+{
+  for (;;)
+    {
+      size_t test_len = fragment->buf_length - frag_index;
+      if (test_len > length)
+        test_len = length;
+
+      if (memcmp (string,
+                  pbcrep_buffer_fragment_start ((PBCREP_BufferFragment *) fragment) + frag_index,
+                  test_len) != 0)
+        return false;
+
+      length -= test_len;
+      string += test_len;
+      if (length == 0)
+        return true;
+
+      fragment = fragment->next;
+      if (fragment == NULL)
+        return false;
+      frag_index = 0;
+    }
+}
+
 /**
  * pbcrep_buffer_index_of:
  * @buffer: buffer to scan.
@@ -762,14 +1309,15 @@ pbcrep_buffer_reset(PBCREP_Buffer *to_destroy)
  * is not in the buffer.
  */
 int
-pbcrep_buffer_index_of(PBCREP_Buffer *buffer,
-                    char       char_to_find)
+pbcrep_buffer_index_of(const PBCREP_Buffer *buffer,
+                       char                 char_to_find)
 {
   PBCREP_BufferFragment *at = buffer->first_frag;
   int rv = 0;
   while (at)
     {
       uint8_t *start = pbcrep_buffer_fragment_start (at);
+      // memchr() is vectorized in any libc worth using.
       uint8_t *saught = memchr (start, char_to_find, at->buf_length);
       if (saught)
 	return (saught - start) + rv;
@@ -780,68 +1328,95 @@ pbcrep_buffer_index_of(PBCREP_Buffer *buffer,
   return -1;
 }
 
+/* Find the first occurrence of needle (n >= 2 bytes) lying
+ * entirely within hay.  Candidates must match needle's first
+ * and last bytes, which we test 16 positions at a time.
+ */
+static const uint8_t *
+find_in_fragment (const uint8_t *hay,
+                  size_t         hay_len,
+                  const uint8_t *needle,
+                  size_t         n)
+{
+  if (hay_len < n)
+    return NULL;
+  const uint8_t *last_start = hay + hay_len - n;
+  const uint8_t *at = hay;
+#if defined(__SSE2__)
+  __m128i first = _mm_set1_epi8 (needle[0]);
+  __m128i last = _mm_set1_epi8 (needle[n - 1]);
+  while (last_start - at >= 15)
+    {
+      __m128i a = _mm_loadu_si128 ((const __m128i *) at);
+      __m128i b = _mm_loadu_si128 ((const __m128i *) (at + n - 1));
+      unsigned mask = _mm_movemask_epi8 (_mm_and_si128 (_mm_cmpeq_epi8 (a, first),
+                                                        _mm_cmpeq_epi8 (b, last)));
+      while (mask != 0)
+        {
+          unsigned bit = __builtin_ctz (mask);
+          if (memcmp (at + bit + 1, needle + 1, n - 2) == 0)
+            return at + bit;
+          mask &= mask - 1;
+        }
+      at += 16;
+    }
+#endif
+  while (at <= last_start)
+    {
+      at = memchr (at, needle[0], last_start - at + 1);
+      if (at == NULL)
+        return NULL;
+      if (at[n - 1] == needle[n - 1]
+       && memcmp (at + 1, needle + 1, n - 2) == 0)
+        return at;
+      at++;
+    }
+  return NULL;
+}
+
 /**
  * pbcrep_buffer_str_index_of:
  * @buffer: buffer to scan.
  * @str_to_find: a string to look for.
  *
- * Scans for the first instance of the given string.
+ * Scans for the first instance of the given string,
+ * which may span fragments.
  * returns: its index in the buffer, or -1 if the string
  * is not in the buffer.
  */
 int 
-pbcrep_buffer_str_index_of (PBCREP_Buffer *buffer,
-                         const char *str_to_find)
+pbcrep_buffer_str_index_of (const PBCREP_Buffer *buffer,
+                            const char          *str_to_find)
 {
-  PBCREP_BufferFragment *fragment = buffer->first_frag;
+  const uint8_t *needle = (const uint8_t *) str_to_find;
+  size_t n = strlen (str_to_find);
+  if (n == 0)
+    return 0;
+  if (n == 1)
+    return pbcrep_buffer_index_of (buffer, str_to_find[0]);
+
   unsigned rv = 0;
-  for (fragment = buffer->first_frag; fragment; fragment = fragment->next)
+  for (PBCREP_BufferFragment *fragment = buffer->first_frag;
+       fragment != NULL;
+       fragment = fragment->next)
     {
-      const uint8_t *frag_at = fragment->buf + fragment->buf_start;
-      unsigned frag_rem = fragment->buf_length;
-      while (frag_rem > 0)
+      const uint8_t *start = pbcrep_buffer_fragment_start (fragment);
+      unsigned len = fragment->buf_length;
+      const uint8_t *hit = find_in_fragment (start, len, needle, n);
+      if (hit != NULL)
+        return rv + (hit - start);
+
+      // Matches that start in the last n-1 bytes
+      // run into the next fragments.
+      const uint8_t *at = len >= n ? start + len - (n - 1) : start;
+      const uint8_t *end = start + len;
+      while ((at = memchr (at, needle[0], end - at)) != NULL)
         {
-          PBCREP_BufferFragment *subfrag;
-          const uint8_t *subfrag_at;
-          unsigned subfrag_rem;
-          const char *str_at;
-          if (*frag_at != str_to_find[0])
-            {
-              frag_at++;
-              frag_rem--;
-              rv++;
-              continue;
-            }
-          subfrag = fragment;
-          subfrag_at = frag_at + 1;
-          subfrag_rem = frag_rem - 1;
-          str_at = str_to_find + 1;
-          if (*str_at == '\0')
-            return rv;
-          while (subfrag != NULL)
-            {
-              while (subfrag_rem == 0)
-                {
-                  subfrag = subfrag->next;
-                  if (subfrag == NULL)
-                    goto bad_guess;
-                  subfrag_at = subfrag->buf + subfrag->buf_start;
-                  subfrag_rem = subfrag->buf_length;
-                }
-              while (*str_at != '\0' && subfrag_rem != 0)
-                {
-                  if (*str_at++ != *subfrag_at++)
-                    goto bad_guess;
-                  subfrag_rem--;
-                }
-              if (*str_at == '\0')
-                return rv;
-            }
-bad_guess:
-          frag_at++;
-          frag_rem--;
-          rv++;
+          if (fragment_n_str (fragment, at - start, needle, n))
+            return rv + (at - start);
+          at++;
         }
+      rv += len;
     }
   return -1;
 }
@@ -1037,39 +1612,126 @@ void pbcrep_buffer_append_foreign (PBCREP_Buffer        *buffer,
 }
 
 /* --- pbcrep_buffer_polystr_index_of implementation --- */
-/* Test to see if a sequence of buffer fragments
- * starts with a particular NUL-terminated string.
+/*
+ * Candidates are found by the first byte of the strings:
+ * with SSSE3, by a "shufti" classifier (a byte is in the set
+ * if the table entries for its low and high nibbles share a bit);
+ * with plain SSE2, by comparing against each first byte
+ * if there are only a few;  otherwise, with a bitmap.
+ * At each candidate, only the strings with that first byte
+ * are tested, across fragments if need be.
  */
-static pbcrep_boolean
-fragment_n_str(PBCREP_BufferFragment   *fragment,
-               unsigned                frag_index,
-               const char          *string)
+#define POLYSTR_MAX_CMPEQ_BYTES  4
+
+typedef struct {
+  uint8_t first_byte_map[32];
+  unsigned n_first_bytes;
+  uint8_t first_bytes[POLYSTR_MAX_CMPEQ_BYTES];
+  uint8_t lo_nibble_table[16];
+  uint8_t hi_nibble_table[16];
+
+  // strings[group_start[c] ... group_start[c+1]-1] begin with c.
+  unsigned group_start[257];
+  const uint8_t **strings;
+  size_t *lengths;
+} PolystrMatcher;
+
+static inline bool
+polystr_is_first_byte (const PolystrMatcher *m, uint8_t c)
 {
-  unsigned length = strlen (string);
-  for (;;)
-    {
-      unsigned test_len = fragment->buf_length - frag_index;
-      if (test_len > length)
-        test_len = length;
+  return (m->first_byte_map[c / 8] & (1 << (c % 8))) != 0;
+}
 
-      if (memcmp (string,
-                  pbcrep_buffer_fragment_start (fragment) + frag_index,
-                  test_len) != 0)
-        return PBCREP_FALSE;
+static void
+polystr_matcher_init (PolystrMatcher *m, char **strings, unsigned n_strings)
+{
+  memset (m, 0, sizeof (PolystrMatcher));
+  m->strings = pbcrep_malloc (sizeof (const uint8_t *) * n_strings);
+  m->lengths = pbcrep_malloc (sizeof (size_t) * n_strings);
+  for (unsigned i = 0; i < n_strings; i++)
+    m->group_start[(uint8_t) strings[i][0] + 1]++;
+  for (unsigned c = 0; c < 256; c++)
+    m->group_start[c + 1] += m->group_start[c];
+
+  unsigned fill[256];
+  memcpy (fill, m->group_start, sizeof (fill));
+  for (unsigned i = 0; i < n_strings; i++)
+    {
+      uint8_t c = strings[i][0];
+      unsigned at = fill[c]++;
+      m->strings[at] = (const uint8_t *) strings[i];
+      m->lengths[at] = strlen (strings[i]);
+      if (!polystr_is_first_byte (m, c))
+        {
+          unsigned bucket = m->n_first_bytes % 8;
+          m->first_byte_map[c / 8] |= 1 << (c % 8);
+          if (m->n_first_bytes < POLYSTR_MAX_CMPEQ_BYTES)
+            m->first_bytes[m->n_first_bytes] = c;
+          m->lo_nibble_table[c & 15] |= 1 << bucket;
+          m->hi_nibble_table[c >> 4] |= 1 << bucket;
+          m->n_first_bytes++;
+        }
+    }
+}
 
-      length -= test_len;
-      string += test_len;
+static inline void
+polystr_matcher_clear (PolystrMatcher *m)
+{
+  pbcrep_free (m->strings);
+  pbcrep_free (m->lengths);
+}
 
-      if (length <= 0)
-        return PBCREP_TRUE;
-      frag_index += test_len;
-      if (frag_index >= fragment->buf_length)
+static const uint8_t *
+polystr_next_candidate (const PolystrMatcher *m,
+                        const uint8_t        *at,
+                        const uint8_t        *end)
+{
+  if (m->n_first_bytes == 1)
+    return memchr (at, m->first_bytes[0], end - at);
+#if defined(__SSSE3__)
+  __m128i lo_table = _mm_loadu_si128 ((const __m128i *) m->lo_nibble_table);
+  __m128i hi_table = _mm_loadu_si128 ((const __m128i *) m->hi_nibble_table);
+  __m128i nibble_mask = _mm_set1_epi8 (0x0f);
+  while (end - at >= 16)
+    {
+      __m128i v = _mm_loadu_si128 ((const __m128i *) at);
+      __m128i lo = _mm_shuffle_epi8 (lo_table, _mm_and_si128 (v, nibble_mask));
+      __m128i hi = _mm_shuffle_epi8 (hi_table, _mm_and_si128 (_mm_srli_epi16 (v, 4), nibble_mask));
+      __m128i hits = _mm_and_si128 (lo, hi);
+      unsigned mask = ~_mm_movemask_epi8 (_mm_cmpeq_epi8 (hits, _mm_setzero_si128 ())) & 0xffff;
+      while (mask != 0)
         {
-          fragment = fragment->next;
-          if (fragment == NULL)
-            return PBCREP_FALSE;
+          // With more than 8 first bytes, buckets are shared:  check.
+          unsigned bit = __builtin_ctz (mask);
+          if (polystr_is_first_byte (m, at[bit]))
+            return at + bit;
+          mask &= mask - 1;
+        }
+      at += 16;
+    }
+#elif defined(__SSE2__)
+  if (m->n_first_bytes <= POLYSTR_MAX_CMPEQ_BYTES)
+    {
+      __m128i bytes[POLYSTR_MAX_CMPEQ_BYTES];
+      for (unsigned i = 0; i < m->n_first_bytes; i++)
+        bytes[i] = _mm_set1_epi8 (m->first_bytes[i]);
+      while (end - at >= 16)
+        {
+          __m128i v = _mm_loadu_si128 ((const __m128i *) at);
+          __m128i hits = _mm_cmpeq_epi8 (v, bytes[0]);
+          for (unsigned i = 1; i < m->n_first_bytes; i++)
+            hits = _mm_or_si128 (hits, _mm_cmpeq_epi8 (v, bytes[i]));
+          unsigned mask = _mm_movemask_epi8 (hits);
+          if (mask != 0)
+            return at + __builtin_ctz (mask);
+          at += 16;
         }
     }
+#endif
+  for (; at < end; at++)
+    if (polystr_is_first_byte (m, *at))
+      return at;
+  return NULL;
 }
 
 /**
@@ -1078,82 +1740,56 @@ fragment_n_str(PBCREP_BufferFragment   *fragment,
  * @strings: NULL-terminated set of string.
  *
  * Scans for the first instance of any of the strings
- * in the buffer.
+ * in the buffer;  matches may span fragments.
  *
  * returns: the index of that instance, or -1 if not found.
  */
 int     
-pbcrep_buffer_polystr_index_of    (PBCREP_Buffer    *buffer,
-                                char        **strings)
+pbcrep_buffer_polystr_index_of    (const PBCREP_Buffer *buffer,
+                                   char               **strings)
 {
-  uint8_t init_char_map[16];
-  int num_strings;
-  int num_bits = 0;
-  int total_index = 0;
-  PBCREP_BufferFragment *fragment;
-  memset (init_char_map, 0, sizeof (init_char_map));
-  for (num_strings = 0; strings[num_strings] != NULL; num_strings++)
+  unsigned n_strings = 0;
+  while (strings[n_strings] != NULL)
     {
-      uint8_t c = strings[num_strings][0];
-      uint8_t mask = (1 << (c % 8));
-      uint8_t *rack = init_char_map + (c / 8);
-      if ((*rack & mask) == 0)
-        {
-          *rack |= mask;
-          num_bits++;
-        }
+      if (strings[n_strings][0] == '\0')
+        return 0;
+      n_strings++;
     }
-  if (num_bits == 0)
-    return 0;
-  for (fragment = buffer->first_frag; fragment != NULL; fragment = fragment->next)
+  if (n_strings == 0)
+    return -1;
+  if (n_strings == 1)
+    return pbcrep_buffer_str_index_of (buffer, strings[0]);
+
+  PolystrMatcher matcher;
+  polystr_matcher_init (&matcher, strings, n_strings);
+  int total_index = 0;
+  int rv = -1;
+  for (PBCREP_BufferFragment *fragment = buffer->first_frag;
+       fragment != NULL && rv < 0;
+       fragment = fragment->next)
     {
-      const uint8_t *frag_start;
-      const uint8_t *at;
-      int remaining = fragment->buf_length;
-      frag_start = pbcrep_buffer_fragment_start (fragment);
-      at = frag_start;
-      while (at != NULL)
+      const uint8_t *frag_start = pbcrep_buffer_fragment_start (fragment);
+      const uint8_t *end = frag_start + fragment->buf_length;
+      const uint8_t *at = frag_start;
+      while ((at = polystr_next_candidate (&matcher, at, end)) != NULL)
         {
-          const uint8_t *start = at;
-          if (num_bits == 1)
+          unsigned offset = at - frag_start;
+          unsigned g = matcher.group_start[*at];
+          unsigned g_end = matcher.group_start[*at + 1];
+          for (; g < g_end; g++)
+            if (fragment_n_str (fragment, offset, matcher.strings[g], matcher.lengths[g]))
+              break;
+          if (g < g_end)
             {
-              at = memchr (start, strings[0][0], remaining);
-              if (at == NULL)
-                remaining = 0;
-              else
-                remaining -= (at - start);
+              rv = total_index + offset;
+              break;
             }
-          else
-            {
-              while (remaining > 0)
-                {
-                  uint8_t i = (uint8_t) (*at);
-                  if (init_char_map[i / 8] & (1 << (i % 8)))
-                    break;
-                  remaining--;
-                  at++;
-                }
-              if (remaining == 0)
-                at = NULL;
-            }
-
-          if (at == NULL)
-            break;
-
-          /* Now test each of the strings manually. */
-          {
-            char **test;
-            for (test = strings; *test != NULL; test++)
-              {
-                if (fragment_n_str(fragment, at - frag_start, *test))
-                  return total_index + (at - frag_start);
-              }
-            at++;
-          }
+          at++;
         }
       total_index += fragment->buf_length;
     }
-  return -1;
+  polystr_matcher_clear (&matcher);
+  return rv;
 }
 
 void     pbcrep_buffer_printf              (PBCREP_Buffer    *buffer,
@@ -1181,7 +1817,7 @@ void     pbcrep_buffer_vprintf             (PBCREP_Buffer    *buffer,
     }
   if (rem == 0)
     {
-      frag = new_native_fragment ();
+      frag = new_native_fragment (buffer);
       rem = pbcrep_buffer_fragment_avail (frag);
       at = pbcrep_buffer_fragment_end (frag);
     }
@@ -1549,7 +2185,7 @@ pbcrep_buffer_fragment_peek (PBCREP_BufferFragment *fragment,
   return rv;
 }
 
-pbcrep_boolean pbcrep_buffer_fragment_advance (PBCREP_BufferFragment **frag_inout,
+bool pbcrep_buffer_fragment_advance (PBCREP_BufferFragment **frag_inout,
                                          unsigned           *offset_inout,
                                          unsigned            skip)
 {
@@ -1557,7 +2193,7 @@ pbcrep_boolean pbcrep_buffer_fragment_advance (PBCREP_BufferFragment **frag_inou
   if (fragment->buf_length >= *offset_inout + skip)
     {
       *offset_inout += skip;
-      return PBCREP_TRUE;
+      return true;
     }
   skip -= (fragment->buf_length - *offset_inout);
   while (skip > 0 && fragment != NULL)
@@ -1571,21 +2207,115 @@ pbcrep_boolean pbcrep_buffer_fragment_advance (PBCREP_BufferFragment **frag_inou
         {
           *offset_inout = skip;
           *frag_inout = fragment;
-          return PBCREP_TRUE;
+          return true;
         }
     }
-  return PBCREP_FALSE;
+  return false;
 }
 
 void
 pbcrep_buffer_append_empty_fragment (PBCREP_Buffer *buffer)
 {
-  PBCREP_BufferFragment *fragment = new_native_fragment ();
+  PBCREP_BufferFragment *fragment = new_native_fragment (buffer);
+  if (buffer->last_frag)
+    buffer->last_frag->next = fragment;
+  else
+    buffer->first_frag = fragment;
+  buffer->last_frag = fragment;
+}
+
+// A fresh fragment to put at the end of 'buffer',
+// with room for at least min_length bytes.
+static PBCREP_BufferFragment *
+new_native_fragment_for_length (const PBCREP_Buffer *buffer,
+                                unsigned             min_length)
+{
+  PBCREP_BufferFragment *fragment;
+  size_t alloc_size = sizeof (PBCREP_BufferFragment) + (size_t) min_length;
+  if (alloc_size > HUGE_PAGE_SIZE)
+    {
+      fragment = pbcrep_malloc (alloc_size);
+      fragment->size_class = NO_CLASS;
+      fragment->buf_max_size = min_length;
+      fragment->buf_start = fragment->buf_length = 0;
+      fragment->next = NULL;
+      fragment->buf = (uint8_t *) (fragment + 1);
+      fragment->is_foreign = 0;
+      fragment->ref_count = 1;
+    }
+  else
+    {
+      unsigned size_class = next_fragment_class (buffer);
+      if (class_size (size_class) < alloc_size)
+        size_class = class_for_size (alloc_size);
+      fragment = new_native_fragment_of_class (size_class);
+    }
+  return fragment;
+}
+
+/* Slow path of pbcrep_buffer_reserve():  the last fragment
+ * is missing, foreign or too full, so start a new one. */
+void
+pbcrep_buffer_reserve_slow (PBCREP_Buffer *buffer,
+                            unsigned       min_length,
+                            uint8_t      **ptr_out,
+                            unsigned      *avail_out)
+{
+  PBCREP_BufferFragment *fragment = new_native_fragment_for_length (buffer, min_length);
   if (buffer->last_frag)
     buffer->last_frag->next = fragment;
   else
     buffer->first_frag = fragment;
   buffer->last_frag = fragment;
+  *ptr_out = fragment->buf;
+  *avail_out = fragment->buf_max_size;
+}
+
+void
+pbcrep_buffer_truncate (PBCREP_Buffer *buffer,
+                        unsigned       new_size)
+{
+  if (new_size >= buffer->size)
+    return;
+  CHECK_INTEGRITY (buffer);
+  PBCREP_BufferFragment *prev = NULL;
+  PBCREP_BufferFragment *frag = buffer->first_frag;
+  unsigned offset = 0;
+  while (offset + frag->buf_length <= new_size)
+    {
+      offset += frag->buf_length;
+      prev = frag;
+      frag = frag->next;
+    }
+
+  // 'frag' contains the first byte to remove.
+  PBCREP_BufferFragment *kill;
+  if (offset == new_size)
+    {
+      kill = frag;
+      if (prev != NULL)
+        prev->next = NULL;
+      else
+        buffer->first_frag = NULL;
+      buffer->last_frag = prev;
+    }
+  else
+    {
+      frag->buf_length = new_size - offset;
+      if (fragment_is_shared (frag))
+        seal_fragment (frag);
+      kill = frag->next;
+      frag->next = NULL;
+      buffer->last_frag = frag;
+    }
+  while (kill != NULL)
+    {
+      PBCREP_BufferFragment *next = kill->next;
+      recycle (kill);
+      kill = next;
+    }
+  buffer->size = new_size;
+  CHECK_INTEGRITY (buffer);
 }
 
 void     pbcrep_buffer_append_placeholder  (PBCREP_Buffer    *buffer,
@@ -1607,7 +2337,7 @@ void     pbcrep_buffer_append_placeholder  (PBCREP_Buffer    *buffer,
       unsigned avail;
       if (!buffer->last_frag)
 	{
-	  buffer->last_frag = buffer->first_frag = new_native_fragment ();
+	  buffer->last_frag = buffer->first_frag = new_native_fragment (buffer);
 	  avail = pbcrep_buffer_fragment_avail (buffer->last_frag);
 	}
       else
@@ -1615,7 +2345,7 @@ void     pbcrep_buffer_append_placeholder  (PBCREP_Buffer    *buffer,
 	  avail = pbcrep_buffer_fragment_avail (buffer->last_frag);
 	  if (avail <= 0)
 	    {
-	      buffer->last_frag->next = new_native_fragment ();
+	      buffer->last_frag->next = new_native_fragment (buffer);
 	      avail = pbcrep_buffer_fragment_avail (buffer->last_frag);
 	      buffer->last_frag = buffer->last_frag->next;
 	    }
@@ -1631,6 +2361,73 @@ void     pbcrep_buffer_append_placeholder  (PBCREP_Buffer    *buffer,
 }
 
 
+/* --- sharing fragments --- */
+/*
+ * A slice of a buffer is a list of foreign fragments pointing into
+ * the original fragments (the owners), each holding a reference
+ * to its owner.  Slices of slices reference the original owner.
+ *
+ * The bytes a slice covers are never written again:  appends only
+ * go past them, a shared fragment that is truncated is sealed
+ * against further appends, and pbcrep_buffer_placeholder_set()
+ * copies a shared fragment before writing into it.
+ */
+
+// Pieces shorter than this are copied instead of shared.
+#define MIN_SHARED_LENGTH       128
+
+static void
+shared_view_release (void *destroy_data)
+{
+  recycle (destroy_data);
+}
+
+static PBCREP_BufferFragment *
+new_shared_view (PBCREP_BufferFragment *fragment,
+                 unsigned               offset,
+                 unsigned               length)
+{
+  PBCREP_BufferFragment *owner = fragment;
+  if (fragment->is_foreign && fragment->destroy == shared_view_release)
+    owner = fragment->destroy_data;
+  __atomic_add_fetch (&owner->ref_count, 1, __ATOMIC_RELAXED);
+  return new_foreign_fragment (length,
+                               pbcrep_buffer_fragment_start (fragment) + offset,
+                               shared_view_release, owner);
+}
+
+// Replace 'fragment' in 'buffer' by a private copy, and return it.
+// The caller still holds buffer's reference to the original.
+static PBCREP_BufferFragment *
+unshare_fragment (PBCREP_Buffer         *buffer,
+                  PBCREP_BufferFragment *fragment)
+{
+  PBCREP_BufferFragment *copy = new_native_fragment_for_length (buffer, fragment->buf_length);
+  memcpy (copy->buf, pbcrep_buffer_fragment_start (fragment), fragment->buf_length);
+  copy->buf_length = fragment->buf_length;
+  copy->next = fragment->next;
+
+  PBCREP_BufferFragment **p = &buffer->first_frag;
+  while (*p != fragment)
+    p = &((*p)->next);
+  *p = copy;
+  if (buffer->last_frag == fragment)
+    buffer->last_frag = copy;
+  return copy;
+}
+
+static inline void
+append_fragment (PBCREP_Buffer         *buffer,
+                 PBCREP_BufferFragment *fragment)
+{
+  if (buffer->last_frag)
+    buffer->last_frag->next = fragment;
+  else
+    buffer->first_frag = fragment;
+  buffer->last_frag = fragment;
+  buffer->size += fragment->buf_length;
+}
+
 void     pbcrep_buffer_placeholder_set     (PBCREP_BufferPlaceholder *placeholder,
                                          const void       *data)
 {
@@ -1640,6 +2437,19 @@ void     pbcrep_buffer_placeholder_set     (PBCREP_BufferPlaceholder *placeholde
   if (rem > 0)
     for (;;)
       {
+        // Copy-on-write:  slices of this fragment must not see the change.
+        if (PBCREP_UNLIKELY (fragment_is_shared (frag)))
+          {
+            PBCREP_BufferFragment *copy = unshare_fragment (placeholder->buffer, frag);
+            offset = offset - frag->buf_start + copy->buf_start;
+            if (frag == placeholder->fragment)
+              {
+                placeholder->fragment = copy;
+                placeholder->offset = offset;
+              }
+            recycle (frag);
+            frag = copy;
+          }
         unsigned avail = frag->buf_start + frag->buf_length - offset;
         if (PBCREP_LIKELY (avail >= rem))
           {
@@ -1652,23 +2462,89 @@ void     pbcrep_buffer_placeholder_set     (PBCREP_BufferPlaceholder *placeholde
             rem -= avail;
             data = (const char *) data + avail;
             frag = frag->next;
-            offset = 0;
+            offset = frag->buf_start;
           }
       }
 }
 
+/**
+ * pbcrep_buffer_append_slice:
+ * @dst: the buffer to append to.
+ * @src: the buffer to take data from;  it is unchanged.
+ * @offset: the offset in @src of the data.
+ * @length: the number of bytes to append.
+ *
+ * Append bytes [offset, offset+length) of @src to @dst,
+ * sharing @src's memory instead of copying it (except for
+ * short pieces).  Either buffer may then be modified,
+ * or used from another thread, without affecting the other.
+ *
+ * returns: the number of bytes appended,
+ * less than @length if @src is too short.
+ */
+unsigned
+pbcrep_buffer_append_slice (PBCREP_Buffer       *dst,
+                            const PBCREP_Buffer *src,
+                            unsigned             offset,
+                            unsigned             length)
+{
+  unsigned rv = 0;
+  CHECK_INTEGRITY (dst);
+  CHECK_INTEGRITY (src);
+  assert (dst != src);
+  PBCREP_BufferFragment *frag = src->first_frag;
+  while (frag != NULL && offset >= frag->buf_length)
+    {
+      offset -= frag->buf_length;
+      frag = frag->next;
+    }
+  for (; frag != NULL && length > 0; frag = frag->next)
+    {
+      unsigned piece = frag->buf_length - offset;
+      if (piece > length)
+        piece = length;
+      if (piece < MIN_SHARED_LENGTH)
+        pbcrep_buffer_append (dst, piece, pbcrep_buffer_fragment_start (frag) + offset);
+      else
+        append_fragment (dst, new_shared_view (frag, offset, piece));
+      rv += piece;
+      length -= piece;
+      offset = 0;
+    }
+  CHECK_INTEGRITY (dst);
+  return rv;
+}
 
+/**
+ * pbcrep_buffer_clone:
+ * @dst: the buffer to initialize.
+ * @src: the buffer to copy.
+ *
+ * Initialize @dst with the same contents (and sizing) as @src,
+ * sharing @src's memory;  see pbcrep_buffer_append_slice().
+ */
+void
+pbcrep_buffer_clone (PBCREP_Buffer       *dst,
+                     const PBCREP_Buffer *src)
+{
+  pbcrep_buffer_init_with_sizing (dst, src->sizing);
+  pbcrep_buffer_append_slice (dst, src, 0, src->size);
+}
 
 void pbcrep_buffer_maybe_remove_empty_fragment (PBCREP_Buffer *buffer)
 {
   if (buffer->last_frag->buf_length == 0)
     {
+      PBCREP_BufferFragment *prev = NULL;
       PBCREP_BufferFragment **p = &(buffer->first_frag);
       while (*p != buffer->last_frag)
-        p = &((*p)->next);
+        {
+          prev = *p;
+          p = &((*p)->next);
+        }
       *p = NULL;
       pbcrep_buffer_fragment_free (buffer->last_frag);
-      buffer->last_frag = NULL;
+      buffer->last_frag = prev;
     }
 }
 
@@ -1686,7 +2562,7 @@ char *pbcrep_buffer_empty_to_string (PBCREP_Buffer *buffer)
   return rv;
 }
 
-pbcrep_boolean pbcrep_buffer_dump (PBCREP_Buffer          *buffer,
+bool pbcrep_buffer_dump (PBCREP_Buffer          *buffer,
                              const char         *filename,
                              PBCREP_BufferDumpFlags  flags,
                              PBCREP_Error          **error)
@@ -1694,25 +2570,29 @@ pbcrep_boolean pbcrep_buffer_dump (PBCREP_Buffer          *buffer,
   // exactly one of PBCREP_BUFFER_DUMP_NO_DRAIN or PBCREP_BUFFER_DUMP_DRAIN
   // must be given.
   PBCREP_BufferDumpFlags drain_flags = (flags & (PBCREP_BUFFER_DUMP_DRAIN|PBCREP_BUFFER_DUMP_NO_DRAIN));
-  pbcrep_assert (drain_flags == PBCREP_BUFFER_DUMP_NO_DRAIN
+  assert (drain_flags == PBCREP_BUFFER_DUMP_NO_DRAIN
            || drain_flags == PBCREP_BUFFER_DUMP_DRAIN);
 
   PBCREP_Error *fatal_error_buf = NULL;
   if (flags & PBCREP_BUFFER_DUMP_FATAL_ERRORS)
     error = &fatal_error_buf;
-  PBCREP_DirOpenfdFlags open_flags = PBCREP_DIR_OPENFD_MAY_CREATE
-                               | PBCREP_DIR_OPENFD_WRITABLE
-                               | PBCREP_DIR_OPENFD_TRUNCATE
-                               | ((flags & PBCREP_BUFFER_DUMP_NO_CREATE_DIRS) ? PBCREP_DIR_OPENFD_NO_MKDIR : 0)
-                               ;
+  // Parent directories are never created, so
+  // PBCREP_BUFFER_DUMP_NO_CREATE_DIRS is implied.
   unsigned mode = (flags & PBCREP_BUFFER_DUMP_EXECUTABLE) ? 0777 : 0666;
-  int fd = pbcrep_dir_openfd (NULL, filename, open_flags, mode, error);
+  int fd = open (filename, O_WRONLY | O_CREAT | O_TRUNC, mode);
   if (fd < 0)
-    goto error;
+    {
+      if (error != NULL)
+        *error = pbcrep_error_new_printf ("OPEN_FAILED",
+                                          "error opening '%s': %s",
+                                          filename, strerror (errno));
+      goto error;
+    }
   unsigned n_frags = 0;
   for (PBCREP_BufferFragment *frag = buffer->first_frag; frag; frag = frag->next)
     n_frags++;
-  struct iovec *iov = alloca (sizeof (struct iovec) * n_frags);
+  struct iovec *iov_alloced = pbcrep_malloc (sizeof (struct iovec) * (n_frags + 1));
+  struct iovec *iov = iov_alloced;
   unsigned iov_index = 0;
   for (PBCREP_BufferFragment *frag = buffer->first_frag; frag; frag = frag->next)
     {
@@ -1720,25 +2600,31 @@ pbcrep_boolean pbcrep_buffer_dump (PBCREP_Buffer          *buffer,
       iov[iov_index].iov_len = frag->buf_length;
       iov_index++;
     }
-  ssize_t writev_rv;
   size_t rem = buffer->size;
-retry_writev:
-  writev_rv = writev (fd, iov, n_frags);
-  if (writev_rv < 0)
-    {
-      if (errno == EINTR)
-        goto retry_writev;
-      pbcrep_set_error (error, "error writing to '%s': %s",
-                     filename, strerror (errno));
-      unlink (filename);
-      goto error;
-    }
-  size_t written = writev_rv;
-  if (written < rem)
+  while (rem > 0)
     {
+      ssize_t writev_rv = writev (fd, iov, n_frags < MAX_FRAGMENTS_TO_WRITE
+                                           ? n_frags : MAX_FRAGMENTS_TO_WRITE);
+      if (writev_rv < 0)
+        {
+          if (errno == EINTR)
+            continue;
+          if (error != NULL)
+            *error = pbcrep_error_new_printf ("WRITE_FAILED",
+                                              "error writing to '%s': %s",
+                                              filename, strerror (errno));
+          pbcrep_free (iov_alloced);
+          close (fd);
+          unlink (filename);
+          goto error;
+        }
+      rem -= writev_rv;
+
+      // Skip what was written.
+      size_t written = writev_rv;
       while (written > 0)
         {
-          if (iov->iov_len <= (size_t) writev_rv)
+          if (iov->iov_len <= written)
             {
               written -= iov->iov_len;
               iov++;
@@ -1746,23 +2632,29 @@ retry_writev:
             }
           else
             {
-              iov->iov_len -= writev_rv;
-              iov->iov_base += writev_rv;
+              iov->iov_len -= written;
+              iov->iov_base = (uint8_t *) iov->iov_base + written;
               written = 0;
             }
         }
-      rem -= writev_rv;
-      goto retry_writev;
+      while (n_frags > 0 && iov->iov_len == 0)
+        {
+          iov++;
+          n_frags--;
+        }
     }
-  else
-    pbcrep_assert ((size_t) writev_rv == buffer->size);
+  pbcrep_free (iov_alloced);
   close (fd);
   if (flags & PBCREP_BUFFER_DUMP_DRAIN)
     pbcrep_buffer_discard (buffer, buffer->size);
-  return PBCREP_TRUE;
+  return true;
 
 error:
   if (flags & PBCREP_BUFFER_DUMP_FATAL_ERRORS)
-    pbcrep_error ("error writing to %s: %s", filename, fatal_error_buf->message);
-  return PBCREP_FALSE;
+    {
+      fprintf (stderr, "error writing to %s: %s\n",
+               filename, fatal_error_buf->error_message);
+      abort ();
+    }
+  return false;
 }
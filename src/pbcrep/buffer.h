@@ -6,6 +6,33 @@ typedef struct PBCREP_BufferFragment PBCREP_BufferFragment;
 
 typedef void (*PBCREP_DestroyNotify)(void *destroy_data);
 
+/* --- fragment sizes --- */
+/*
+ * Native fragments come in power-of-two sizes from 4K to 2M
+ * (including a small header).  A buffer's first fragment is
+ * min_fragment_size;  each one after that is twice the size
+ * of the buffer's last fragment, up to max_fragment_size.
+ *
+ * With use_huge_pages, 2M fragments are mmap()ed and backed by
+ * huge pages where possible (MAP_HUGETLB, else transparent huge pages).
+ *
+ * A buffer whose sizing is NULL uses the global default,
+ * initially pbcrep_buffer_sizing_default.  Sizings must outlive
+ * the buffers (or the period as default) they are used for.
+ */
+typedef struct {
+  unsigned min_fragment_size;
+  unsigned max_fragment_size;
+  bool use_huge_pages;
+} PBCREP_BufferSizing;
+
+extern const PBCREP_BufferSizing pbcrep_buffer_sizing_default;  // 32K
+extern const PBCREP_BufferSizing pbcrep_buffer_sizing_small;    // 4K, for many mostly-idle buffers
+extern const PBCREP_BufferSizing pbcrep_buffer_sizing_bulk;     // 64K doubling to 2M huge pages
+
+/* NULL restores pbcrep_buffer_sizing_default. */
+void     pbcrep_buffer_set_default_sizing  (const PBCREP_BufferSizing *sizing);
+
 struct PBCREP_BufferFragment
 {
   PBCREP_BufferFragment    *next;
@@ -15,6 +42,8 @@ struct PBCREP_BufferFragment
   unsigned                  buf_length;	/* length of valid data in buf; != 0 */
   
   bool                      is_foreign;
+  uint8_t                   size_class;         /* private to buffer.c */
+  unsigned                  ref_count;          /* >1 if shared by slices */
   PBCREP_DestroyNotify      destroy;
   void                     *destroy_data;
 };
@@ -25,17 +54,21 @@ struct PBCREP_Buffer
 
   PBCREP_BufferFragment    *first_frag;
   PBCREP_BufferFragment    *last_frag;
+
+  const PBCREP_BufferSizing *sizing;    /* NULL for the default */
 };
 
-#define PBCREP_BUFFER_INIT		{ 0, NULL, NULL }
+#define PBCREP_BUFFER_INIT		{ 0, NULL, NULL, NULL }
 
 
 void     pbcrep_buffer_init                (PBCREP_Buffer       *buffer);
+void     pbcrep_buffer_init_with_sizing    (PBCREP_Buffer       *buffer,
+                                            const PBCREP_BufferSizing *sizing);
 
 unsigned pbcrep_buffer_read                (PBCREP_Buffer    *buffer,
                                             unsigned          max_length,
                                             void             *data);
-unsigned pbcrep_buffer_peek                (PBCREP_Buffer* buffer,
+unsigned pbcrep_buffer_peek                (const PBCREP_Buffer *buffer,
                                             unsigned          max_length,
                                             void             *data);
 int      pbcrep_buffer_discard             (PBCREP_Buffer    *buffer,
@@ -94,6 +127,27 @@ uint8_t  pbcrep_buffer_get_byte_at         (PBCREP_Buffer    *buffer,
                                             size_t            idx);
 
 
+/* --- writing directly into the buffer's free space --- */
+/*
+ * pbcrep_buffer_reserve() finds at least min_length writable bytes
+ * at the end of the buffer, starting a new fragment only if the last
+ * one is too full.  Write up to *avail_out bytes at *ptr_out,
+ * then call pbcrep_buffer_commit() with the number of bytes actually
+ * written (0 is fine).
+ *
+ * No other operation on the buffer may come between the two calls.
+ */
+PBCREP_INLINE void pbcrep_buffer_reserve   (PBCREP_Buffer    *buffer,
+                                            unsigned          min_length,
+                                            uint8_t         **ptr_out,
+                                            unsigned         *avail_out);
+PBCREP_INLINE void pbcrep_buffer_commit    (PBCREP_Buffer    *buffer,
+                                            unsigned          used);
+void     pbcrep_buffer_reserve_slow        (PBCREP_Buffer    *buffer,
+                                            unsigned          min_length,
+                                            uint8_t         **ptr_out,
+                                            unsigned         *avail_out);
+
 /* --- appending data that will be filled in later --- */
 typedef struct {
   PBCREP_Buffer *buffer;
@@ -120,6 +174,21 @@ unsigned pbcrep_buffer_transfer            (PBCREP_Buffer    *dst,
                                             PBCREP_Buffer    *src,
 					    unsigned          max_transfer);
 
+/* --- sharing data between buffers --- */
+/* Append part of src to dst without copying it:  the fragments
+ * are shared (copy-on-write), and src is unchanged.  Returns the number
+ * of bytes appended.  Each buffer may then be used independently,
+ * even from different threads.
+ */
+unsigned pbcrep_buffer_append_slice        (PBCREP_Buffer       *dst,
+                                            const PBCREP_Buffer *src,
+                                            unsigned             offset,
+                                            unsigned             length);
+
+/* Initialize dst as a shared copy of all of src. */
+void     pbcrep_buffer_clone               (PBCREP_Buffer       *dst,
+                                            const PBCREP_Buffer *src);
+
 /* --- file-descriptor mucking --- */
 int      pbcrep_buffer_writev              (PBCREP_Buffer       *read_from,
                                             int                  fd);
@@ -142,6 +211,10 @@ void     pbcrep_buffer_clear               (PBCREP_Buffer    *to_destroy);
 /* Same as calling clear/init */
 void     pbcrep_buffer_reset               (PBCREP_Buffer    *to_reset);
 
+/* Remove everything after the first new_size bytes. */
+void     pbcrep_buffer_truncate            (PBCREP_Buffer    *buffer,
+                                            unsigned          new_size);
+
 /* Return a string and clear the buffer;
  * a NUL character is appended. */
 char *pbcrep_buffer_empty_to_string (PBCREP_Buffer *buffer);
@@ -156,6 +229,24 @@ PBCREP_BufferFragment *pbcrep_buffer_find_fragment (PBCREP_Buffer   *buffer,
 /* Free all unused buffer fragments. */
 void     _pbcrep_buffer_cleanup_recycling_bin ();
 
+/* --- fragment recycling --- */
+/* Free fragments are kept in per-thread caches, with overflow
+ * going to a shared depot, in batches, for other threads to use.
+ * Buffers may be used from any thread (one thread at a time, per buffer).
+ *
+ * Defaults: 16 fragments per thread, 32 batches in the depot
+ * (at most 64).
+ */
+void     pbcrep_buffer_set_recycling_limits (unsigned max_per_thread,
+                                             unsigned max_depot_batches);
+
+typedef struct {
+  uint64_t n_hits;              // fragments reused
+  uint64_t n_misses;            // fragments newly allocated
+  size_t bytes_held;            // by all caches and the depot
+} PBCREP_BufferRecyclingStats;
+void     pbcrep_buffer_get_recycling_stats  (PBCREP_BufferRecyclingStats *stats_out);
+
 typedef enum {
   PBCREP_BUFFER_DUMP_DRAIN = (1<<0),
   PBCREP_BUFFER_DUMP_NO_DRAIN = (1<<1),
@@ -171,8 +262,18 @@ bool     pbcrep_buffer_dump (PBCREP_Buffer          *buffer,
                              PBCREP_Error          **error);
                           
 
+/* --- searching --- */
+/* Each returns the index of the first match, or -1;
+ * matches may span fragments.  polystr takes a NULL-terminated
+ * array of strings. */
+int pbcrep_buffer_index_of         (const PBCREP_Buffer *buffer,
+                                    char                 char_to_find);
+int pbcrep_buffer_str_index_of     (const PBCREP_Buffer *buffer,
+                                    const char          *str_to_find);
+int pbcrep_buffer_polystr_index_of (const PBCREP_Buffer *buffer,
+                                    char               **strings);
+
 /* misc */
-int pbcrep_buffer_index_of(PBCREP_Buffer *buffer, char char_to_find);
 
 unsigned pbcrep_buffer_fragment_peek (PBCREP_BufferFragment *fragment,
                                    unsigned           offset,
@@ -216,6 +317,35 @@ pbcrep_buffer_append_small(PBCREP_Buffer    *buffer,
     pbcrep_buffer_append (buffer, length, data);
 }
 PBCREP_INLINE void
+pbcrep_buffer_reserve   (PBCREP_Buffer    *buffer,
+                         unsigned          min_length,
+                         uint8_t         **ptr_out,
+                         unsigned         *avail_out)
+{
+  PBCREP_BufferFragment *f = buffer->last_frag;
+  if (f != NULL && !f->is_foreign)
+    {
+      unsigned end = f->buf_start + f->buf_length;
+      if (f->buf_max_size - end >= min_length)
+        {
+          *ptr_out = f->buf + end;
+          *avail_out = f->buf_max_size - end;
+          return;
+        }
+    }
+  pbcrep_buffer_reserve_slow (buffer, min_length, ptr_out, avail_out);
+}
+PBCREP_INLINE void
+pbcrep_buffer_commit    (PBCREP_Buffer    *buffer,
+                         unsigned          used)
+{
+  PBCREP_BufferFragment *f = buffer->last_frag;
+  f->buf_length += used;
+  buffer->size += used;
+  if (PBCREP_UNLIKELY (f->buf_length == 0))
+    pbcrep_buffer_maybe_remove_empty_fragment (buffer);
+}
+PBCREP_INLINE void
 pbcrep_buffer_append_byte(PBCREP_Buffer    *buffer, 
                           uint8_t           byte)
 {
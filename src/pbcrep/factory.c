@@ -0,0 +1,223 @@
+#include <assert.h>
+#include "../pbcrep.h"
+#include "length-prefix.h"
+
+/* --- generic factory handling --- */
+
+PBCREP_ParserFactory *
+pbcrep_parser_factory_new_protected (const ProtobufCMessageDescriptor *desc,
+                                     size_t                    sizeof_factory)
+{
+  assert (sizeof_factory >= sizeof (PBCREP_ParserFactory));
+  PBCREP_ParserFactory *rv = pbcrep_malloc (sizeof_factory);
+  memset (rv, 0, sizeof_factory);
+  rv->ref_count = 1;
+  rv->descriptor = desc;
+  return rv;
+}
+
+PBCREP_Parser *
+pbcrep_parser_factory_create_parser (PBCREP_ParserFactory *factory)
+{
+  return factory->create_parser (factory);
+}
+
+PBCREP_ParserFactory *
+pbcrep_parser_factory_ref           (PBCREP_ParserFactory *factory)
+{
+  assert (factory->ref_count > 0);
+  __atomic_add_fetch (&factory->ref_count, 1, __ATOMIC_RELAXED);
+  return factory;
+}
+
+void
+pbcrep_parser_factory_unref         (PBCREP_ParserFactory *factory)
+{
+  assert (factory->ref_count > 0);
+  if (__atomic_sub_fetch (&factory->ref_count, 1, __ATOMIC_ACQ_REL) == 0)
+    {
+      if (factory->destroy != NULL)
+        factory->destroy (factory);
+      pbcrep_free (factory);
+    }
+}
+
+PBCREP_PrinterFactory *
+pbcrep_printer_factory_new_protected(const ProtobufCMessageDescriptor *desc,
+                                     size_t                    sizeof_factory)
+{
+  assert (sizeof_factory >= sizeof (PBCREP_PrinterFactory));
+  PBCREP_PrinterFactory *rv = pbcrep_malloc (sizeof_factory);
+  memset (rv, 0, sizeof_factory);
+  rv->ref_count = 1;
+  rv->descriptor = desc;
+  return rv;
+}
+
+PBCREP_Printer *
+pbcrep_printer_factory_create_printer (PBCREP_PrinterFactory *factory)
+{
+  return factory->create_printer (factory);
+}
+
+PBCREP_PrinterFactory *
+pbcrep_printer_factory_ref          (PBCREP_PrinterFactory *factory)
+{
+  assert (factory->ref_count > 0);
+  __atomic_add_fetch (&factory->ref_count, 1, __ATOMIC_RELAXED);
+  return factory;
+}
+
+void
+pbcrep_printer_factory_unref        (PBCREP_PrinterFactory *factory)
+{
+  assert (factory->ref_count > 0);
+  if (__atomic_sub_fetch (&factory->ref_count, 1, __ATOMIC_ACQ_REL) == 0)
+    {
+      if (factory->destroy != NULL)
+        factory->destroy (factory);
+      pbcrep_free (factory);
+    }
+}
+
+/* --- json --- */
+
+typedef struct {
+  PBCREP_ParserFactory base;
+  PBCREP_Plan *plan;
+  PBCREP_Parser_JSONOptions options;
+} JSONParserFactory;
+
+static PBCREP_Parser *
+json_parser_factory_create_parser (PBCREP_ParserFactory *factory)
+{
+  JSONParserFactory *jf = (JSONParserFactory *) factory;
+  return pbcrep_parser_new_json_from_plan (jf->plan, &jf->options);
+}
+
+static void
+json_parser_factory_destroy (PBCREP_ParserFactory *factory)
+{
+  JSONParserFactory *jf = (JSONParserFactory *) factory;
+  pbcrep_plan_unref (jf->plan);
+}
+
+PBCREP_ParserFactory *
+pbcrep_parser_factory_new_json      (const ProtobufCMessageDescriptor *desc,
+                                     const PBCREP_Parser_JSONOptions  *options)
+{
+  static const PBCREP_Parser_JSONOptions default_options = PBCREP_PARSER_JSON_OPTIONS_INIT;
+  JSONParserFactory *jf = (JSONParserFactory *)
+    pbcrep_parser_factory_new_protected (desc, sizeof (JSONParserFactory));
+  jf->base.create_parser = json_parser_factory_create_parser;
+  jf->base.destroy = json_parser_factory_destroy;
+  jf->plan = pbcrep_plan_new (desc);
+  jf->options = options != NULL ? *options : default_options;
+  return &jf->base;
+}
+
+typedef struct {
+  PBCREP_PrinterFactory base;
+  PBCREP_Plan *plan;
+  PBCREP_JSON_PrinterOptions options;
+} JSONPrinterFactory;
+
+static PBCREP_Printer *
+json_printer_factory_create_printer (PBCREP_PrinterFactory *factory)
+{
+  JSONPrinterFactory *jf = (JSONPrinterFactory *) factory;
+  return pbcrep_printer_new_json_from_plan (jf->plan, &jf->options);
+}
+
+static void
+json_printer_factory_destroy (PBCREP_PrinterFactory *factory)
+{
+  JSONPrinterFactory *jf = (JSONPrinterFactory *) factory;
+  pbcrep_plan_unref (jf->plan);
+}
+
+PBCREP_PrinterFactory *
+pbcrep_printer_factory_new_json     (const ProtobufCMessageDescriptor *desc,
+                                     const PBCREP_JSON_PrinterOptions *options)
+{
+  JSONPrinterFactory *jf = (JSONPrinterFactory *)
+    pbcrep_printer_factory_new_protected (desc, sizeof (JSONPrinterFactory));
+  jf->base.create_printer = json_printer_factory_create_printer;
+  jf->base.destroy = json_printer_factory_destroy;
+  jf->plan = pbcrep_plan_new (desc);
+  if (options != NULL)
+    jf->options = *options;
+  return &jf->base;
+}
+
+/* --- length-prefixed --- */
+
+// The length-prefixed formats need nothing beyond the descriptor.
+typedef struct {
+  PBCREP_ParserFactory base;
+  PBCREP_LengthPrefixed_Format format;
+} LengthPrefixedParserFactory;
+
+static PBCREP_Parser *
+lp_parser_factory_create_parser (PBCREP_ParserFactory *factory)
+{
+  LengthPrefixedParserFactory *lf = (LengthPrefixedParserFactory *) factory;
+  return pbcrep_parser_new_length_prefixed (lf->format, factory->descriptor);
+}
+
+static size_t
+lp_parser_factory_split (PBCREP_ParserFactory *factory,
+                         size_t                length,
+                         const uint8_t        *data)
+{
+  LengthPrefixedParserFactory *lf = (LengthPrefixedParserFactory *) factory;
+  size_t at = 0;
+  for (;;)
+    {
+      size_t record_len;
+      int prefix_len = pbcrep_length_prefix_decode (lf->format, length - at,
+                                                    data + at, &record_len);
+      if (prefix_len < 0)
+        return length;
+      if (prefix_len == 0 || length - at - prefix_len < record_len)
+        return at;
+      at += prefix_len + record_len;
+    }
+}
+
+PBCREP_ParserFactory *
+pbcrep_parser_factory_new_length_prefixed
+                                    (PBCREP_LengthPrefixed_Format      lp_format,
+                                     const ProtobufCMessageDescriptor *desc)
+{
+  LengthPrefixedParserFactory *lf = (LengthPrefixedParserFactory *)
+    pbcrep_parser_factory_new_protected (desc, sizeof (LengthPrefixedParserFactory));
+  lf->base.create_parser = lp_parser_factory_create_parser;
+  lf->base.split = lp_parser_factory_split;
+  lf->format = lp_format;
+  return &lf->base;
+}
+
+typedef struct {
+  PBCREP_PrinterFactory base;
+  PBCREP_LengthPrefixed_Format format;
+} LengthPrefixedPrinterFactory;
+
+static PBCREP_Printer *
+lp_printer_factory_create_printer (PBCREP_PrinterFactory *factory)
+{
+  LengthPrefixedPrinterFactory *lf = (LengthPrefixedPrinterFactory *) factory;
+  return pbcrep_printer_new_length_prefixed (lf->format, factory->descriptor);
+}
+
+PBCREP_PrinterFactory *
+pbcrep_printer_factory_new_length_prefixed
+                                    (PBCREP_LengthPrefixed_Format      lp_format,
+                                     const ProtobufCMessageDescriptor *desc)
+{
+  LengthPrefixedPrinterFactory *lf = (LengthPrefixedPrinterFactory *)
+    pbcrep_printer_factory_new_protected (desc, sizeof (LengthPrefixedPrinterFactory));
+  lf->base.create_printer = lp_printer_factory_create_printer;
+  lf->format = lp_format;
+  return &lf->base;
+}
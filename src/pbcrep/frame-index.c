@@ -0,0 +1,397 @@
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <limits.h>
+#include "../pbcrep.h"
+#include "length-prefix.h"
+#include "wire-format.h"
+
+#define FRAME_INDEX_MAGIC       "PBCRIDX1"
+#define FRAME_INDEX_MAGIC_SIZE  8
+
+/* --- Decoding prefixes --- */
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+# define HAVE_FAST_PREFIXES     1
+#else
+# define HAVE_FAST_PREFIXES     0
+#endif
+
+// A base-128 prefix of up to 8 bytes, decoded from one 64-bit load:
+// the terminating byte is found from the continuation bits,
+// and the 7-bit groups are packed together in three steps.
+// Returns 0 if the prefix is longer (or there are fewer than 8 bytes).
+static inline unsigned
+decode_b128_swar (size_t avail, const uint8_t *data, uint64_t *length_out)
+{
+  if (avail < 8)
+    return 0;
+  uint64_t w;
+  memcpy (&w, data, 8);
+  uint64_t ends = ~w & 0x8080808080808080ULL;
+  if (ends == 0)
+    return 0;
+  unsigned n_bits = __builtin_ctzll (ends) + 1;         // through the last byte
+  uint64_t x = w & 0x7f7f7f7f7f7f7f7fULL;
+  if (n_bits < 64)
+    x &= ((uint64_t) 1 << n_bits) - 1;
+  x = ((x & 0x7f007f007f007f00ULL) >> 1) | (x & 0x007f007f007f007fULL);
+  x = ((x & 0x3fff00003fff0000ULL) >> 2) | (x & 0x00003fff00003fffULL);
+  x = ((x & 0x0fffffff00000000ULL) >> 4) | (x & 0x000000000fffffffULL);
+  *length_out = x;
+  return n_bits / 8;
+}
+
+// Like pbcrep_length_prefix_decode(), with fast paths
+// for the common cases.
+static inline int
+decode_prefix (PBCREP_LengthPrefixed_Format format,
+               size_t                       avail,
+               const uint8_t               *data,
+               size_t                      *length_out)
+{
+#if HAVE_FAST_PREFIXES
+  if (format == PBCREP_LENGTH_PREFIXED_B128)
+    {
+      if (avail > 0 && data[0] < 0x80)
+        {
+          *length_out = data[0];
+          return 1;
+        }
+      uint64_t v;
+      unsigned rv = decode_b128_swar (avail, data, &v);
+      if (rv > 0)
+        {
+          *length_out = v;
+          return rv;
+        }
+    }
+  else
+    {
+      unsigned size = pbcrep_length_prefix_fixed_size (format);
+      if (size > 1 && avail >= 4)
+        {
+          uint32_t w;
+          memcpy (&w, data, 4);
+          switch (format)
+            {
+            case PBCREP_LENGTH_PREFIXED_UINT16_LE:
+            case PBCREP_LENGTH_PREFIXED_UINT24_LE:
+            case PBCREP_LENGTH_PREFIXED_UINT32_LE:
+              *length_out = size == 4 ? w : w & ((1U << (8 * size)) - 1);
+              return size;
+            case PBCREP_LENGTH_PREFIXED_UINT16_BE:
+            case PBCREP_LENGTH_PREFIXED_UINT24_BE:
+            case PBCREP_LENGTH_PREFIXED_UINT32_BE:
+              *length_out = __builtin_bswap32 (w) >> (32 - 8 * size);
+              return size;
+            default:
+              break;
+            }
+        }
+    }
+#endif
+  return pbcrep_length_prefix_decode (format, avail, data, length_out);
+}
+
+/* --- Building --- */
+PBCREP_FrameIndex *
+pbcrep_frame_index_build      (PBCREP_LengthPrefixed_Format format,
+                               unsigned                     stride,
+                               size_t                       length,
+                               const uint8_t               *data,
+                               PBCREP_Error               **error)
+{
+  if (stride == 0)
+    stride = 1;
+  size_t offsets_alloced = 64;
+  uint64_t *offsets = pbcrep_malloc (sizeof (uint64_t) * offsets_alloced);
+  size_t n_offsets = 0;
+  uint64_t n_records = 0;
+  unsigned until_next = 0;              // records until the next indexed one
+  size_t at = 0;
+  while (at < length)
+    {
+      size_t record_length;
+      int prefix_len = decode_prefix (format, length - at, data + at, &record_length);
+      if (prefix_len <= 0)
+        {
+          pbcrep_free (offsets);
+          if (error == NULL)
+            return NULL;
+          if (prefix_len < 0)
+            *error = pbcrep_error_new_printf ("BAD_B128",
+                                              "record %llu: overlong or bad B128-encoded length-prefix",
+                                              (unsigned long long) n_records);
+          else
+            *error = pbcrep_error_new_printf ("PARTIAL_RECORD",
+                                              "record %llu: terminated in length-prefix itself",
+                                              (unsigned long long) n_records);
+          return NULL;
+        }
+      if (record_length > length - at - prefix_len)
+        {
+          pbcrep_free (offsets);
+          if (error != NULL)
+            *error = pbcrep_error_new_printf ("PARTIAL_RECORD",
+                                              "record %llu: terminated in data body",
+                                              (unsigned long long) n_records);
+          return NULL;
+        }
+      if (until_next == 0)
+        {
+          if (n_offsets == offsets_alloced)
+            {
+              offsets_alloced *= 2;
+              offsets = pbcrep_realloc (offsets, sizeof (uint64_t) * offsets_alloced);
+            }
+          offsets[n_offsets++] = at;
+          until_next = stride;
+        }
+      until_next--;
+      n_records++;
+      at += prefix_len + record_length;
+    }
+
+  PBCREP_FrameIndex *index = pbcrep_malloc (sizeof (PBCREP_FrameIndex));
+  index->format = format;
+  index->stride = stride;
+  index->n_records = n_records;
+  index->data_size = length;
+  index->n_offsets = n_offsets;
+  index->offsets = offsets;
+  return index;
+}
+
+PBCREP_FrameIndex *
+pbcrep_frame_index_build_file (PBCREP_LengthPrefixed_Format format,
+                               unsigned                     stride,
+                               const char                  *filename,
+                               PBCREP_Error               **error)
+{
+  int fd = open (filename, O_RDONLY);
+  if (fd < 0)
+    {
+      if (error != NULL)
+        *error = pbcrep_error_new_printf ("OPEN_FAILED",
+                                          "error opening %s: %s",
+                                          filename, strerror (errno));
+      return NULL;
+    }
+  struct stat st;
+  if (fstat (fd, &st) < 0)
+    {
+      if (error != NULL)
+        *error = pbcrep_error_new_printf ("READ_FAILED",
+                                          "error statting %s: %s",
+                                          filename, strerror (errno));
+      close (fd);
+      return NULL;
+    }
+  size_t size = st.st_size;
+  if (size == 0)
+    {
+      close (fd);
+      return pbcrep_frame_index_build (format, stride, 0, NULL, error);
+    }
+  void *data = mmap (NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close (fd);
+  if (data == MAP_FAILED)
+    {
+      if (error != NULL)
+        *error = pbcrep_error_new_printf ("READ_FAILED",
+                                          "error mapping %s: %s",
+                                          filename, strerror (errno));
+      return NULL;
+    }
+  PBCREP_FrameIndex *index = pbcrep_frame_index_build (format, stride, size, data, error);
+  munmap (data, size);
+  return index;
+}
+
+void
+pbcrep_frame_index_destroy (PBCREP_FrameIndex *index)
+{
+  pbcrep_free (index->offsets);
+  pbcrep_free (index);
+}
+
+/* --- Using --- */
+uint64_t
+pbcrep_frame_index_seek  (const PBCREP_FrameIndex *index,
+                          uint64_t                 record,
+                          uint64_t                *n_skip_out)
+{
+  *n_skip_out = record % index->stride;
+  return index->offsets[record / index->stride];
+}
+
+unsigned
+pbcrep_frame_index_split (const PBCREP_FrameIndex *index,
+                          unsigned                 max_chunks,
+                          uint64_t                *offsets_out,
+                          uint64_t                *first_records_out)
+{
+  if (index->n_offsets == 0 || max_chunks == 0)
+    return 0;
+
+  // Each chunk starts at the first indexed record at or after
+  // its share of the data;  chunks that would be empty are dropped.
+  unsigned n = 0;
+  size_t i = 0;
+  for (unsigned c = 0; c < max_chunks; c++)
+    {
+      uint64_t target = index->data_size / max_chunks * c
+                      + index->data_size % max_chunks * c / max_chunks;
+      while (i < index->n_offsets && index->offsets[i] < target)
+        i++;
+      if (i == index->n_offsets)
+        break;
+      if (n > 0 && offsets_out[n - 1] == index->offsets[i])
+        continue;
+      offsets_out[n] = index->offsets[i];
+      first_records_out[n] = (uint64_t) i * index->stride;
+      n++;
+    }
+  return n;
+}
+
+/* --- Index files --- */
+void
+pbcrep_frame_index_serialize (const PBCREP_FrameIndex *index,
+                              PBCREP_Buffer           *out)
+{
+  uint8_t varint[PBCREP_WIRE_MAX_VARINT_SIZE];
+  pbcrep_buffer_append (out, FRAME_INDEX_MAGIC_SIZE, FRAME_INDEX_MAGIC);
+  uint64_t header[4] = { index->format, index->stride, index->n_records, index->data_size };
+  for (unsigned i = 0; i < 4; i++)
+    pbcrep_buffer_append_small (out, pbcrep_wire_encode_varint (header[i], varint), varint);
+  uint64_t prev = 0;
+  for (size_t i = 0; i < index->n_offsets; i++)
+    {
+      pbcrep_buffer_append_small (out, pbcrep_wire_encode_varint (index->offsets[i] - prev, varint), varint);
+      prev = index->offsets[i];
+    }
+}
+
+static PBCREP_FrameIndex *
+bad_index (PBCREP_Error **error, const char *what)
+{
+  if (error != NULL)
+    *error = pbcrep_error_new_printf ("BAD_FRAME_INDEX", "frame index: %s", what);
+  return NULL;
+}
+
+PBCREP_FrameIndex *
+pbcrep_frame_index_parse      (size_t                       length,
+                               const uint8_t               *data,
+                               PBCREP_Error               **error)
+{
+  if (length < FRAME_INDEX_MAGIC_SIZE
+   || memcmp (data, FRAME_INDEX_MAGIC, FRAME_INDEX_MAGIC_SIZE) != 0)
+    return bad_index (error, "bad magic");
+  size_t at = FRAME_INDEX_MAGIC_SIZE;
+  uint64_t header[4];
+  for (unsigned i = 0; i < 4; i++)
+    {
+      unsigned used = pbcrep_wire_decode_varint (length - at, data + at, header + i);
+      if (used == 0)
+        return bad_index (error, "truncated header");
+      at += used;
+    }
+  if (header[0] > PBCREP_LENGTH_PREFIXED_B128_BE)
+    return bad_index (error, "unknown format");
+  if (header[1] == 0 || header[1] > UINT_MAX)
+    return bad_index (error, "bad stride");
+  uint64_t n_offsets = header[2] / header[1] + (header[2] % header[1] != 0);
+  // Each offset takes at least a byte.
+  if (n_offsets > length - at)
+    return bad_index (error, "truncated offsets");
+
+  uint64_t *offsets = pbcrep_malloc (sizeof (uint64_t) * (n_offsets > 0 ? n_offsets : 1));
+  uint64_t prev = 0;
+  for (size_t i = 0; i < n_offsets; i++)
+    {
+      uint64_t delta;
+      unsigned used = pbcrep_wire_decode_varint (length - at, data + at, &delta);
+      if (used == 0
+       || (i > 0 && delta == 0)
+       || delta >= header[3] - prev)
+        {
+          pbcrep_free (offsets);
+          return bad_index (error, "bad offset");
+        }
+      at += used;
+      offsets[i] = prev += delta;
+    }
+  if (at != length)
+    {
+      pbcrep_free (offsets);
+      return bad_index (error, "trailing garbage");
+    }
+
+  PBCREP_FrameIndex *index = pbcrep_malloc (sizeof (PBCREP_FrameIndex));
+  index->format = header[0];
+  index->stride = header[1];
+  index->n_records = header[2];
+  index->data_size = header[3];
+  index->n_offsets = n_offsets;
+  index->offsets = offsets;
+  return index;
+}
+
+bool
+pbcrep_frame_index_save (const PBCREP_FrameIndex *index,
+                         const char              *filename,
+                         PBCREP_Error           **error)
+{
+  PBCREP_BinaryDataWriter *writer = pbcrep_binary_data_writer_to_file (filename, error);
+  if (writer == NULL)
+    return false;
+  PBCREP_Buffer buffer = PBCREP_BUFFER_INIT;
+  pbcrep_frame_index_serialize (index, &buffer);
+  bool ok = true;
+  for (PBCREP_BufferFragment *frag = buffer.first_frag; ok && frag != NULL; frag = frag->next)
+    ok = pbcrep_binary_data_writer_write (writer, frag->buf_length,
+                                          frag->buf + frag->buf_start, error);
+  if (ok)
+    ok = pbcrep_binary_data_writer_flush (writer, error);
+  pbcrep_buffer_clear (&buffer);
+  pbcrep_binary_data_writer_destroy (writer);
+  return ok;
+}
+
+PBCREP_FrameIndex *
+pbcrep_frame_index_load (const char    *filename,
+                         PBCREP_Error **error)
+{
+  PBCREP_BinaryDataReader *reader = pbcrep_binary_data_reader_from_file (filename, error);
+  if (reader == NULL)
+    return NULL;
+  PBCREP_Buffer buffer = PBCREP_BUFFER_INIT;
+  for (;;)
+    {
+      size_t amt_read;
+      PBCREP_ReadResult rv = pbcrep_binary_data_reader_read_buffer (reader, &buffer, &amt_read, error);
+      if (rv == PBCREP_READ_RESULT_EOF)
+        break;
+      if (rv == PBCREP_READ_RESULT_ERROR)
+        {
+          pbcrep_buffer_clear (&buffer);
+          pbcrep_binary_data_reader_destroy (reader);
+          return NULL;
+        }
+    }
+  pbcrep_binary_data_reader_destroy (reader);
+
+  size_t length = buffer.size;
+  uint8_t *data = pbcrep_malloc (length > 0 ? length : 1);
+  pbcrep_buffer_read (&buffer, length, data);
+  pbcrep_buffer_clear (&buffer);
+  PBCREP_FrameIndex *index = pbcrep_frame_index_parse (length, data, error);
+  pbcrep_free (data);
+  return index;
+}
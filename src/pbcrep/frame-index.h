@@ -0,0 +1,77 @@
+/*
+ * PBCREP_FrameIndex: where the records of a length-prefixed file begin.
+ *
+ * Building an index reads only the length-prefixes, skipping from each
+ * to the next, so a file of large records is barely touched.  Every
+ * 'stride'th record's offset is kept (every record's, for stride 1).
+ * With an index, a reader can seek near any record, a file can be split
+ * into chunks of about equal size that start on record boundaries,
+ * and the records can be counted, without parsing the file.
+ *
+ * Index files ("sidecars") are compact:  after a header of the
+ * magic "PBCRIDX1" and the format, stride, number of records and
+ * size of the data as base-128 varints, come the offsets, each as
+ * a varint of its difference from the previous one.
+ */
+
+typedef struct PBCREP_FrameIndex PBCREP_FrameIndex;
+struct PBCREP_FrameIndex
+{
+  PBCREP_LengthPrefixed_Format format;
+  unsigned stride;
+  uint64_t n_records;
+  uint64_t data_size;
+
+  // offsets[i] is where record i*stride begins.
+  size_t n_offsets;
+  uint64_t *offsets;
+};
+
+// Index the length-prefixed records in data[0..length), which must
+// hold nothing but whole records.  Returns NULL on error.
+PBCREP_FrameIndex *
+pbcrep_frame_index_build      (PBCREP_LengthPrefixed_Format format,
+                               unsigned                     stride,
+                               size_t                       length,
+                               const uint8_t               *data,
+                               PBCREP_Error               **error);
+
+// Index a file, mapping it into memory.
+PBCREP_FrameIndex *
+pbcrep_frame_index_build_file (PBCREP_LengthPrefixed_Format format,
+                               unsigned                     stride,
+                               const char                  *filename,
+                               PBCREP_Error               **error);
+
+void pbcrep_frame_index_destroy (PBCREP_FrameIndex *index);
+
+// The offset of the nearest indexed record at or before 'record'
+// (which must be less than n_records);  *n_skip_out is set to the
+// number of records to skip from there to reach it.
+uint64_t pbcrep_frame_index_seek  (const PBCREP_FrameIndex *index,
+                                   uint64_t                 record,
+                                   uint64_t                *n_skip_out);
+
+// Split the records into at most 'max_chunks' chunks of about equal
+// size, each starting at an indexed record.  Chunk i covers bytes
+// [offsets_out[i], offsets_out[i+1]) (ending at data_size for the
+// last) and starts at record first_records_out[i].  Returns the number
+// of chunks, which is fewer if there are too few indexed records.
+unsigned pbcrep_frame_index_split (const PBCREP_FrameIndex *index,
+                                   unsigned                 max_chunks,
+                                   uint64_t                *offsets_out,
+                                   uint64_t                *first_records_out);
+
+// Reading and writing index files.
+void pbcrep_frame_index_serialize (const PBCREP_FrameIndex *index,
+                                   PBCREP_Buffer           *out);
+PBCREP_FrameIndex *
+pbcrep_frame_index_parse      (size_t                       length,
+                               const uint8_t               *data,
+                               PBCREP_Error               **error);
+bool pbcrep_frame_index_save      (const PBCREP_FrameIndex *index,
+                                   const char              *filename,
+                                   PBCREP_Error           **error);
+PBCREP_FrameIndex *
+pbcrep_frame_index_load       (const char                  *filename,
+                               PBCREP_Error               **error);
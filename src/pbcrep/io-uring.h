@@ -0,0 +1,36 @@
+/*
+ * Binary-data readers and writers on io_uring, for bulk file I/O:
+ * they keep up to queue_depth reads (or writes) of block_size bytes
+ * in flight, in buffers registered with the kernel.
+ *
+ * Regular files and block devices are read ahead at increasing
+ * offsets;  anything else (pipes, sockets) gets a queue depth of 1,
+ * since concurrent reads of a stream would come back in any order.
+ *
+ * Where io_uring is unavailable (old kernels, seccomp, non-Linux),
+ * these return the plain pbcrep_binary_data_{reader_from,writer_to}_fileno
+ * objects instead.
+ */
+
+typedef struct {
+  unsigned queue_depth;                 // 0 means 8
+  unsigned block_size;                  // 0 means 256K
+  // Reader only:  return PBCREP_READ_RESULT_BLOCKED if no read
+  // has completed, instead of waiting.
+  bool nonblocking;
+} PBCREP_IOUringOptions;
+
+#define PBCREP_IO_URING_OPTIONS_INIT    { 0, 0, false }
+
+bool pbcrep_io_uring_is_available (void);
+
+// options may be NULL.
+PBCREP_BinaryDataReader *pbcrep_binary_data_reader_from_fileno_io_uring (int fd,
+                                                                         bool do_close,
+                                                                         const PBCREP_IOUringOptions *options);
+
+// Data is written in the background:  call pbcrep_binary_data_writer_flush()
+// to wait for it and collect any errors.
+PBCREP_BinaryDataWriter *pbcrep_binary_data_writer_to_fileno_io_uring (int fd,
+                                                                       bool do_close,
+                                                                       const PBCREP_IOUringOptions *options);
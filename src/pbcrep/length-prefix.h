@@ -0,0 +1,193 @@
+/* Encoding and decoding the prefixes of the PBCREP_LengthPrefixed_Format's.
+ *
+ * Private to the length-prefixed parser, printer, factories
+ * and frame index;  include after pbcrep.h.
+ */
+
+#ifndef __PBCREP_LENGTH_PREFIX_H_
+#define __PBCREP_LENGTH_PREFIX_H_
+
+// enough for a 64-bit length in base-128
+#define PBCREP_LENGTH_PREFIX_MAX_SIZE   10
+
+// Returns 0 for the variable-length (B128) formats.
+static inline unsigned
+pbcrep_length_prefix_fixed_size (PBCREP_LengthPrefixed_Format format)
+{
+  switch (format)
+    {
+    case PBCREP_LENGTH_PREFIXED_UINT8:
+      return 1;
+    case PBCREP_LENGTH_PREFIXED_UINT16_LE:
+    case PBCREP_LENGTH_PREFIXED_UINT16_BE:
+      return 2;
+    case PBCREP_LENGTH_PREFIXED_UINT24_LE:
+    case PBCREP_LENGTH_PREFIXED_UINT24_BE:
+      return 3;
+    case PBCREP_LENGTH_PREFIXED_UINT32_LE:
+    case PBCREP_LENGTH_PREFIXED_UINT32_BE:
+      return 4;
+    case PBCREP_LENGTH_PREFIXED_B128:
+    case PBCREP_LENGTH_PREFIXED_B128_BE:
+      return 0;
+    }
+  return 0;
+}
+
+// The largest length representable in the format.
+static inline size_t
+pbcrep_length_prefix_max_length (PBCREP_LengthPrefixed_Format format)
+{
+  unsigned size = pbcrep_length_prefix_fixed_size (format);
+  return size == 0 ? SIZE_MAX : (size_t) (((uint64_t) 1 << (8 * size)) - 1);
+}
+
+// Write the prefix for 'length' (which must be at most
+// pbcrep_length_prefix_max_length()); returns the number of bytes used.
+static inline unsigned
+pbcrep_length_prefix_encode (PBCREP_LengthPrefixed_Format format,
+                             size_t                       length,
+                             uint8_t                     *out)
+{
+  switch (format)
+    {
+    case PBCREP_LENGTH_PREFIXED_UINT8:
+      out[0] = length;
+      return 1;
+    case PBCREP_LENGTH_PREFIXED_UINT16_LE:
+      out[0] = length;
+      out[1] = length >> 8;
+      return 2;
+    case PBCREP_LENGTH_PREFIXED_UINT24_LE:
+      out[0] = length;
+      out[1] = length >> 8;
+      out[2] = length >> 16;
+      return 3;
+    case PBCREP_LENGTH_PREFIXED_UINT32_LE:
+      out[0] = length;
+      out[1] = length >> 8;
+      out[2] = length >> 16;
+      out[3] = length >> 24;
+      return 4;
+    case PBCREP_LENGTH_PREFIXED_UINT16_BE:
+      out[0] = length >> 8;
+      out[1] = length;
+      return 2;
+    case PBCREP_LENGTH_PREFIXED_UINT24_BE:
+      out[0] = length >> 16;
+      out[1] = length >> 8;
+      out[2] = length;
+      return 3;
+    case PBCREP_LENGTH_PREFIXED_UINT32_BE:
+      out[0] = length >> 24;
+      out[1] = length >> 16;
+      out[2] = length >> 8;
+      out[3] = length;
+      return 4;
+    case PBCREP_LENGTH_PREFIXED_B128:
+      {
+        unsigned n = 0;
+        while (length >= 0x80)
+          {
+            out[n++] = 0x80 | (length & 0x7f);
+            length >>= 7;
+          }
+        out[n++] = length;
+        return n;
+      }
+    case PBCREP_LENGTH_PREFIXED_B128_BE:
+      {
+        unsigned n = 1;
+        while ((length >> (7 * n)) != 0)
+          n++;
+        for (unsigned i = 0; i < n; i++)
+          {
+            uint8_t group = (length >> (7 * (n - 1 - i))) & 0x7f;
+            out[i] = (i + 1 < n) ? (0x80 | group) : group;
+          }
+        return n;
+      }
+    }
+  return 0;
+}
+
+// Read the prefix at the start of data[0..avail).  Returns the
+// number of bytes it occupies, 0 if it is incomplete, or -1 if it is
+// malformed (a B128 length of more than PBCREP_LENGTH_PREFIX_MAX_SIZE bytes).
+static inline int
+pbcrep_length_prefix_decode (PBCREP_LengthPrefixed_Format format,
+                             size_t                       avail,
+                             const uint8_t               *data,
+                             size_t                      *length_out)
+{
+  unsigned size = pbcrep_length_prefix_fixed_size (format);
+  if (size > avail)
+    return 0;
+  switch (format)
+    {
+    case PBCREP_LENGTH_PREFIXED_UINT8:
+      *length_out = data[0];
+      return 1;
+    case PBCREP_LENGTH_PREFIXED_UINT16_LE:
+      *length_out = (size_t) data[0]
+                  | ((size_t) data[1] << 8);
+      return 2;
+    case PBCREP_LENGTH_PREFIXED_UINT24_LE:
+      *length_out = (size_t) data[0]
+                  | ((size_t) data[1] << 8)
+                  | ((size_t) data[2] << 16);
+      return 3;
+    case PBCREP_LENGTH_PREFIXED_UINT32_LE:
+      *length_out = (size_t) data[0]
+                  | ((size_t) data[1] << 8)
+                  | ((size_t) data[2] << 16)
+                  | ((size_t) data[3] << 24);
+      return 4;
+    case PBCREP_LENGTH_PREFIXED_UINT16_BE:
+      *length_out = (size_t) data[1]
+                  | ((size_t) data[0] << 8);
+      return 2;
+    case PBCREP_LENGTH_PREFIXED_UINT24_BE:
+      *length_out = (size_t) data[2]
+                  | ((size_t) data[1] << 8)
+                  | ((size_t) data[0] << 16);
+      return 3;
+    case PBCREP_LENGTH_PREFIXED_UINT32_BE:
+      *length_out = (size_t) data[3]
+                  | ((size_t) data[2] << 8)
+                  | ((size_t) data[1] << 16)
+                  | ((size_t) data[0] << 24);
+      return 4;
+    case PBCREP_LENGTH_PREFIXED_B128:
+      {
+        uint64_t v = 0;
+        for (unsigned i = 0; i < avail && i < PBCREP_LENGTH_PREFIX_MAX_SIZE; i++)
+          {
+            v |= (uint64_t) (data[i] & 0x7f) << (7 * i);
+            if ((data[i] & 0x80) == 0)
+              {
+                *length_out = v;
+                return i + 1;
+              }
+          }
+        return avail >= PBCREP_LENGTH_PREFIX_MAX_SIZE ? -1 : 0;
+      }
+    case PBCREP_LENGTH_PREFIXED_B128_BE:
+      {
+        uint64_t v = 0;
+        for (unsigned i = 0; i < avail && i < PBCREP_LENGTH_PREFIX_MAX_SIZE; i++)
+          {
+            v = (v << 7) | (data[i] & 0x7f);
+            if ((data[i] & 0x80) == 0)
+              {
+                *length_out = v;
+                return i + 1;
+              }
+          }
+        return avail >= PBCREP_LENGTH_PREFIX_MAX_SIZE ? -1 : 0;
+      }
+    }
+  return -1;
+}
+
+#endif
@@ -0,0 +1,388 @@
+#include "../pbcrep.h"
+#include "wire-format.h"
+#include <stdlib.h>
+#include <string.h>
+
+/* Size estimates stop descending after this many nested messages;
+ * this also keeps recursive message types finite. */
+#define ESTIMATE_MAX_DEPTH        4
+
+/* Repeated fields are assumed to have this many elements. */
+#define ESTIMATE_REPEATED_COUNT   4
+
+/* Field numbers up to this (plus 4 per field) are indexed directly. */
+#define MAX_SPARSE_FIELD_BY_ID    64
+
+/* --- hashing --- */
+uint32_t
+pbcrep_plan_hash_name (unsigned length, const char *name)
+{
+  // FNV-1a
+  uint32_t h = 0x811c9dc5;
+  for (unsigned i = 0; i < length; i++)
+    {
+      h ^= (uint8_t) name[i];
+      h *= 0x01000193;
+    }
+  return h;
+}
+
+static unsigned
+hash_size_for (unsigned n)
+{
+  unsigned size = 4;
+  while (size < n * 2)
+    size *= 2;
+  return size;
+}
+
+/* --- discovering all the types reachable from the root --- */
+typedef struct {
+  unsigned n_messages, messages_alloced;
+  const ProtobufCMessageDescriptor **messages;
+  unsigned n_enums, enums_alloced;
+  const ProtobufCEnumDescriptor **enums;
+} TypeSet;
+
+static int
+typeset_message_index (const TypeSet *ts, const ProtobufCMessageDescriptor *desc)
+{
+  for (unsigned i = 0; i < ts->n_messages; i++)
+    if (ts->messages[i] == desc)
+      return i;
+  return -1;
+}
+
+static int
+typeset_enum_index (const TypeSet *ts, const ProtobufCEnumDescriptor *desc)
+{
+  for (unsigned i = 0; i < ts->n_enums; i++)
+    if (ts->enums[i] == desc)
+      return i;
+  return -1;
+}
+
+static void
+typeset_add_message (TypeSet *ts, const ProtobufCMessageDescriptor *desc)
+{
+  if (typeset_message_index (ts, desc) >= 0)
+    return;
+  if (ts->n_messages == ts->messages_alloced)
+    {
+      ts->messages_alloced = ts->messages_alloced ? ts->messages_alloced * 2 : 8;
+      ts->messages = pbcrep_realloc (ts->messages, sizeof (void *) * ts->messages_alloced);
+    }
+  ts->messages[ts->n_messages++] = desc;
+}
+
+static void
+typeset_add_enum (TypeSet *ts, const ProtobufCEnumDescriptor *desc)
+{
+  if (typeset_enum_index (ts, desc) >= 0)
+    return;
+  if (ts->n_enums == ts->enums_alloced)
+    {
+      ts->enums_alloced = ts->enums_alloced ? ts->enums_alloced * 2 : 8;
+      ts->enums = pbcrep_realloc (ts->enums, sizeof (void *) * ts->enums_alloced);
+    }
+  ts->enums[ts->n_enums++] = desc;
+}
+
+/* --- per-message and per-enum construction --- */
+static void
+init_enum_plan (PBCREP_EnumPlan *eplan,
+                unsigned index,
+                const ProtobufCEnumDescriptor *desc)
+{
+  eplan->descriptor = desc;
+  eplan->index = index;
+
+  unsigned hsize = hash_size_for (desc->n_values);
+  uint16_t *hash = pbcrep_malloc (sizeof (uint16_t) * hsize);
+  memset (hash, 0, sizeof (uint16_t) * hsize);
+  for (unsigned i = 0; i < desc->n_values; i++)
+    {
+      const char *name = desc->values[i].name;
+      unsigned at = pbcrep_plan_hash_name (strlen (name), name) & (hsize - 1);
+      while (hash[at] != 0)
+        at = (at + 1) & (hsize - 1);
+      hash[at] = i + 1;
+    }
+  eplan->name_hash_mask = hsize - 1;
+  eplan->name_hash = hash;
+
+  eplan->min_value = 0;
+  eplan->n_dense_names = 0;
+  eplan->dense_names = NULL;
+  if (desc->n_values == 0)
+    return;
+  int min = desc->values[0].value, max = min;
+  for (unsigned i = 1; i < desc->n_values; i++)
+    {
+      int v = desc->values[i].value;
+      if (v < min) min = v;
+      if (v > max) max = v;
+    }
+  uint64_t range = (uint64_t) ((int64_t) max - min) + 1;
+  if (range <= (uint64_t) desc->n_values * 2 + 16)
+    {
+      const char **names = pbcrep_malloc (sizeof (char *) * range);
+      memset (names, 0, sizeof (char *) * range);
+      // The first name listed for a value wins (aliases come later).
+      for (unsigned i = desc->n_values; i > 0; i--)
+        names[desc->values[i - 1].value - min] = desc->values[i - 1].name;
+      eplan->min_value = min;
+      eplan->n_dense_names = range;
+      eplan->dense_names = names;
+    }
+}
+
+static void
+init_message_plan (PBCREP_MessagePlan *mplan,
+                   unsigned index,
+                   const ProtobufCMessageDescriptor *desc,
+                   const TypeSet *ts,
+                   const PBCREP_MessagePlan *all_messages,
+                   const PBCREP_EnumPlan *all_enums)
+{
+  mplan->descriptor = desc;
+  mplan->index = index;
+  mplan->n_fields = desc->n_fields;
+
+  // All the JSON keys live in one allocation:
+  //    "\"name\":" NUL "name:" NUL
+  size_t keys_size = 0;
+  for (unsigned i = 0; i < desc->n_fields; i++)
+    keys_size += strlen (desc->fields[i].name) * 2 + 6;
+  char *keys = pbcrep_malloc (keys_size > 0 ? keys_size : 1);
+
+  PBCREP_FieldPlan *fields = pbcrep_malloc (sizeof (PBCREP_FieldPlan) * (desc->n_fields > 0 ? desc->n_fields : 1));
+  unsigned hsize = hash_size_for (desc->n_fields);
+  uint16_t *hash = pbcrep_malloc (sizeof (uint16_t) * hsize);
+  memset (hash, 0, sizeof (uint16_t) * hsize);
+
+  char *keys_at = keys;
+  for (unsigned i = 0; i < desc->n_fields; i++)
+    {
+      const ProtobufCFieldDescriptor *f = desc->fields + i;
+      PBCREP_FieldPlan *fp = fields + i;
+      unsigned len = strlen (f->name);
+      fp->field = f;
+      fp->name_length = len;
+      fp->name_hash = pbcrep_plan_hash_name (len, f->name);
+
+      fp->json_key = keys_at;
+      *keys_at++ = '"';
+      memcpy (keys_at, f->name, len);
+      keys_at += len;
+      *keys_at++ = '"';
+      *keys_at++ = ':';
+      *keys_at++ = 0;
+      fp->json_key_length = len + 3;
+
+      fp->json_key_quoteless = keys_at;
+      memcpy (keys_at, f->name, len);
+      keys_at += len;
+      *keys_at++ = ':';
+      *keys_at++ = 0;
+      fp->json_key_quoteless_length = len + 1;
+
+      fp->message_plan = NULL;
+      fp->enum_plan = NULL;
+      if (f->type == PROTOBUF_C_TYPE_MESSAGE)
+        fp->message_plan = all_messages + typeset_message_index (ts, f->descriptor);
+      else if (f->type == PROTOBUF_C_TYPE_ENUM)
+        fp->enum_plan = all_enums + typeset_enum_index (ts, f->descriptor);
+
+      unsigned at = fp->name_hash & (hsize - 1);
+      while (hash[at] != 0)
+        at = (at + 1) & (hsize - 1);
+      hash[at] = i + 1;
+    }
+  mplan->fields = fields;
+  mplan->json_keys = keys;
+  mplan->field_hash_mask = hsize - 1;
+  mplan->field_hash = hash;
+
+  // Index by field number unless that would be mostly empty.
+  unsigned max_id = 0;
+  for (unsigned i = 0; i < desc->n_fields; i++)
+    if (desc->fields[i].id > max_id)
+      max_id = desc->fields[i].id;
+  if (desc->n_fields > 0 && max_id <= MAX_SPARSE_FIELD_BY_ID + desc->n_fields * 4)
+    {
+      uint16_t *by_id = pbcrep_malloc (sizeof (uint16_t) * (max_id + 1));
+      memset (by_id, 0, sizeof (uint16_t) * (max_id + 1));
+      for (unsigned i = 0; i < desc->n_fields; i++)
+        by_id[desc->fields[i].id] = i + 1;
+      mplan->n_field_by_id = max_id + 1;
+      mplan->field_by_id = by_id;
+    }
+  else
+    {
+      mplan->n_field_by_id = 0;
+      mplan->field_by_id = NULL;
+    }
+
+  void *image = pbcrep_malloc (desc->sizeof_message);
+  protobuf_c_message_init (desc, image);
+  mplan->default_image = image;
+
+  mplan->estimated_slab_size = 0;
+  mplan->estimated_json_size = 0;
+}
+
+/* --- size estimates --- */
+static void
+estimate_sizes (const PBCREP_MessagePlan *mplan,
+                unsigned depth,
+                size_t *slab_out,
+                size_t *json_out)
+{
+  size_t slab = 0, json = 2;            // braces
+  for (unsigned i = 0; i < mplan->n_fields; i++)
+    {
+      const PBCREP_FieldPlan *fp = mplan->fields + i;
+      const ProtobufCFieldDescriptor *f = fp->field;
+      bool repeated = f->label == PROTOBUF_C_LABEL_REPEATED;
+      unsigned count = repeated ? ESTIMATE_REPEATED_COUNT : 1;
+      size_t value_slab = 0, value_json;
+      switch (f->type)
+        {
+        case PROTOBUF_C_TYPE_STRING:
+        case PROTOBUF_C_TYPE_BYTES:
+          value_slab = 16;
+          value_json = 18;
+          break;
+        case PROTOBUF_C_TYPE_BOOL:
+          value_json = 5;
+          break;
+        case PROTOBUF_C_TYPE_ENUM:
+          value_json = 10;
+          break;
+        case PROTOBUF_C_TYPE_MESSAGE:
+          {
+            size_t sub_slab = 0, sub_json = 2;
+            if (depth < ESTIMATE_MAX_DEPTH)
+              estimate_sizes (fp->message_plan, depth + 1, &sub_slab, &sub_json);
+            value_slab = fp->message_plan->descriptor->sizeof_message + sub_slab;
+            value_json = sub_json;
+          }
+          break;
+        default:
+          value_json = 8;
+          break;
+        }
+      if (repeated)
+        {
+          slab += count * (pbcrep_wire_member_size (f->type) + value_slab);
+          json += 2;                      // brackets
+        }
+      else
+        slab += value_slab;
+      json += fp->json_key_length + 1 + count * (value_json + 1);
+    }
+  *slab_out = slab;
+  *json_out = json;
+}
+
+/* --- public API --- */
+PBCREP_Plan *
+pbcrep_plan_new (const ProtobufCMessageDescriptor *desc)
+{
+  assert (desc->magic == PROTOBUF_C__MESSAGE_DESCRIPTOR_MAGIC);
+
+  // Find all reachable types; messages[0] will be the root.
+  TypeSet ts = { 0, 0, NULL, 0, 0, NULL };
+  typeset_add_message (&ts, desc);
+  for (unsigned m = 0; m < ts.n_messages; m++)
+    {
+      const ProtobufCMessageDescriptor *md = ts.messages[m];
+      for (unsigned i = 0; i < md->n_fields; i++)
+        if (md->fields[i].type == PROTOBUF_C_TYPE_MESSAGE)
+          typeset_add_message (&ts, md->fields[i].descriptor);
+        else if (md->fields[i].type == PROTOBUF_C_TYPE_ENUM)
+          typeset_add_enum (&ts, md->fields[i].descriptor);
+    }
+
+  PBCREP_Plan *plan = pbcrep_malloc (sizeof (PBCREP_Plan));
+  PBCREP_MessagePlan *messages = pbcrep_malloc (sizeof (PBCREP_MessagePlan) * ts.n_messages);
+  PBCREP_EnumPlan *enums = pbcrep_malloc (sizeof (PBCREP_EnumPlan) * (ts.n_enums > 0 ? ts.n_enums : 1));
+  for (unsigned i = 0; i < ts.n_enums; i++)
+    init_enum_plan (enums + i, i, ts.enums[i]);
+  for (unsigned i = 0; i < ts.n_messages; i++)
+    init_message_plan (messages + i, i, ts.messages[i], &ts, messages, enums);
+  for (unsigned i = 0; i < ts.n_messages; i++)
+    estimate_sizes (messages + i, 0,
+                    &messages[i].estimated_slab_size,
+                    &messages[i].estimated_json_size);
+
+  plan->ref_count = 1;
+  plan->root = messages;
+  plan->n_messages = ts.n_messages;
+  plan->messages = messages;
+  plan->n_enums = ts.n_enums;
+  plan->enums = enums;
+
+  pbcrep_free (ts.messages);
+  pbcrep_free (ts.enums);
+  return plan;
+}
+
+PBCREP_Plan *
+pbcrep_plan_ref (PBCREP_Plan *plan)
+{
+  __atomic_add_fetch (&plan->ref_count, 1, __ATOMIC_RELAXED);
+  return plan;
+}
+
+void
+pbcrep_plan_unref (PBCREP_Plan *plan)
+{
+  if (__atomic_sub_fetch (&plan->ref_count, 1, __ATOMIC_ACQ_REL) != 0)
+    return;
+
+  for (unsigned i = 0; i < plan->n_messages; i++)
+    {
+      const PBCREP_MessagePlan *mplan = plan->messages + i;
+      pbcrep_free ((char *) mplan->json_keys);
+      pbcrep_free ((void *) mplan->fields);
+      pbcrep_free ((void *) mplan->field_hash);
+      if (mplan->field_by_id != NULL)
+        pbcrep_free ((void *) mplan->field_by_id);
+      pbcrep_free ((void *) mplan->default_image);
+    }
+  for (unsigned i = 0; i < plan->n_enums; i++)
+    {
+      pbcrep_free ((void *) plan->enums[i].name_hash);
+      if (plan->enums[i].dense_names != NULL)
+        pbcrep_free ((void *) plan->enums[i].dense_names);
+    }
+  pbcrep_free ((void *) plan->messages);
+  pbcrep_free ((void *) plan->enums);
+  pbcrep_free (plan);
+}
+
+const PBCREP_MessagePlan *
+pbcrep_plan_get_message_plan   (const PBCREP_Plan *plan,
+                                const ProtobufCMessageDescriptor *desc)
+{
+  for (unsigned i = 0; i < plan->n_messages; i++)
+    if (plan->messages[i].descriptor == desc)
+      return plan->messages + i;
+  return NULL;
+}
+
+const char *
+pbcrep_enum_plan_get_name      (const PBCREP_EnumPlan *eplan,
+                                int                    value)
+{
+  if (eplan->dense_names != NULL)
+    {
+      uint64_t i = (uint64_t) ((int64_t) value - eplan->min_value);
+      return i < eplan->n_dense_names ? eplan->dense_names[i] : NULL;
+    }
+  const ProtobufCEnumValue *ev
+    = protobuf_c_enum_descriptor_get_value (eplan->descriptor, value);
+  return ev ? ev->name : NULL;
+}
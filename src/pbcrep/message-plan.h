@@ -0,0 +1,189 @@
+/*
+ * PBCREP_Plan: everything derivable from a ProtobufCMessageDescriptor,
+ * computed once.
+ *
+ * A plan covers a message type and every message and enum type
+ * reachable from it.  It is immutable once built and refcounted
+ * (atomically), so it can be shared between parsers and printers
+ * running in different threads.
+ *
+ * Per message type we precompute:
+ *   - a hash-table from field name to field
+ *   - a direct index from field number to field, if the numbers are compact
+ *   - the JSON key fragments: "\"name\":" and "name:"
+ *   - the default image: a message initialized with
+ *     protobuf_c_message_init(), ready to memcpy.
+ *   - size estimates.
+ * Per enum type:
+ *   - a hash-table from name to value
+ *   - a dense value-to-name table, where the values are compact.
+ */
+
+typedef struct PBCREP_Plan PBCREP_Plan;
+typedef struct PBCREP_MessagePlan PBCREP_MessagePlan;
+typedef struct PBCREP_FieldPlan PBCREP_FieldPlan;
+typedef struct PBCREP_EnumPlan PBCREP_EnumPlan;
+
+struct PBCREP_FieldPlan
+{
+  const ProtobufCFieldDescriptor *field;
+  uint32_t name_hash;
+  unsigned name_length;
+
+  // JSON keys, including the colon.
+  const char *json_key;                 // "\"name\":"
+  unsigned json_key_length;
+  const char *json_key_quoteless;       // "name:"
+  unsigned json_key_quoteless_length;
+
+  const PBCREP_MessagePlan *message_plan;       // MESSAGE fields only
+  const PBCREP_EnumPlan *enum_plan;             // ENUM fields only
+};
+
+struct PBCREP_MessagePlan
+{
+  const ProtobufCMessageDescriptor *descriptor;
+  unsigned index;                       // in plan->messages
+
+  unsigned n_fields;
+  const PBCREP_FieldPlan *fields;       // same order as descriptor->fields
+  const char *json_keys;                // storage for the fields' JSON keys
+
+  // open-addressed: field-index + 1, or 0 for an empty slot.
+  unsigned field_hash_mask;
+  const uint16_t *field_hash;
+
+  // field_by_id[id] is field-index + 1, or 0 for no such field,
+  // for id < n_field_by_id.  n_field_by_id is 0 if the
+  // field numbers are too sparse to index this way.
+  unsigned n_field_by_id;
+  const uint16_t *field_by_id;
+
+  const void *default_image;            // descriptor->sizeof_message bytes
+
+  // Rough sizes of a typical message.
+  size_t estimated_slab_size;           // memory hanging off the message
+  size_t estimated_json_size;           // compact JSON rendering
+};
+
+struct PBCREP_EnumPlan
+{
+  const ProtobufCEnumDescriptor *descriptor;
+  unsigned index;                       // in plan->enums
+
+  // open-addressed: value-index + 1, or 0 for an empty slot.
+  unsigned name_hash_mask;
+  const uint16_t *name_hash;
+
+  // if non-NULL, dense_names[v - min_value] is the name for value v,
+  // or NULL if v is not a valid value.
+  int min_value;
+  unsigned n_dense_names;
+  const char *const *dense_names;
+};
+
+struct PBCREP_Plan
+{
+  unsigned ref_count;
+  const PBCREP_MessagePlan *root;
+
+  unsigned n_messages;
+  const PBCREP_MessagePlan *messages;
+  unsigned n_enums;
+  const PBCREP_EnumPlan *enums;
+};
+
+PBCREP_Plan *pbcrep_plan_new   (const ProtobufCMessageDescriptor *desc);
+PBCREP_Plan *pbcrep_plan_ref   (PBCREP_Plan *plan);
+void         pbcrep_plan_unref (PBCREP_Plan *plan);
+
+// Returns NULL if desc is not reachable from the plan's root.
+const PBCREP_MessagePlan *
+pbcrep_plan_get_message_plan   (const PBCREP_Plan *plan,
+                                const ProtobufCMessageDescriptor *desc);
+
+uint32_t pbcrep_plan_hash_name (unsigned length, const char *name);
+
+PBCREP_INLINE const PBCREP_FieldPlan *
+pbcrep_message_plan_find_field (const PBCREP_MessagePlan *mplan,
+                                unsigned                  name_length,
+                                const char               *name);
+PBCREP_INLINE void
+pbcrep_message_plan_init_message (const PBCREP_MessagePlan *mplan,
+                                  void                     *message);
+// Returns the field's index in mplan->fields, or -1 if there is no such field.
+PBCREP_INLINE int
+pbcrep_message_plan_find_field_by_id (const PBCREP_MessagePlan *mplan,
+                                      uint32_t                  id);
+
+PBCREP_INLINE const ProtobufCEnumValue *
+pbcrep_enum_plan_find_by_name  (const PBCREP_EnumPlan *eplan,
+                                unsigned               name_length,
+                                const char            *name);
+// Returns NULL for an unknown value.
+const char *
+pbcrep_enum_plan_get_name      (const PBCREP_EnumPlan *eplan,
+                                int                    value);
+
+
+#if PBCREP_CAN_INLINE || defined(PBCREP_IMPLEMENT_INLINES)
+PBCREP_INLINE const PBCREP_FieldPlan *
+pbcrep_message_plan_find_field (const PBCREP_MessagePlan *mplan,
+                                unsigned                  name_length,
+                                const char               *name)
+{
+  uint32_t h = pbcrep_plan_hash_name (name_length, name);
+  unsigned at = h & mplan->field_hash_mask;
+  for (;;)
+    {
+      unsigned idx = mplan->field_hash[at];
+      if (idx == 0)
+        return NULL;
+      const PBCREP_FieldPlan *fp = mplan->fields + (idx - 1);
+      if (fp->name_hash == h
+       && fp->name_length == name_length
+       && memcmp (fp->field->name, name, name_length) == 0)
+        return fp;
+      at = (at + 1) & mplan->field_hash_mask;
+    }
+}
+
+PBCREP_INLINE void
+pbcrep_message_plan_init_message (const PBCREP_MessagePlan *mplan,
+                                  void                     *message)
+{
+  memcpy (message, mplan->default_image, mplan->descriptor->sizeof_message);
+}
+
+PBCREP_INLINE int
+pbcrep_message_plan_find_field_by_id (const PBCREP_MessagePlan *mplan,
+                                      uint32_t                  id)
+{
+  if (id < mplan->n_field_by_id)
+    return (int) mplan->field_by_id[id] - 1;
+  if (mplan->n_field_by_id > 0)
+    return -1;
+  const ProtobufCFieldDescriptor *f = protobuf_c_message_descriptor_get_field (mplan->descriptor, id);
+  return f == NULL ? -1 : (int) (f - mplan->descriptor->fields);
+}
+
+PBCREP_INLINE const ProtobufCEnumValue *
+pbcrep_enum_plan_find_by_name  (const PBCREP_EnumPlan *eplan,
+                                unsigned               name_length,
+                                const char            *name)
+{
+  uint32_t h = pbcrep_plan_hash_name (name_length, name);
+  unsigned at = h & eplan->name_hash_mask;
+  for (;;)
+    {
+      unsigned idx = eplan->name_hash[at];
+      if (idx == 0)
+        return NULL;
+      const ProtobufCEnumValue *ev = eplan->descriptor->values + (idx - 1);
+      if (strncmp (ev->name, name, name_length) == 0
+       && ev->name[name_length] == '\0')
+        return ev;
+      at = (at + 1) & eplan->name_hash_mask;
+    }
+}
+#endif
@@ -0,0 +1,739 @@
+#include "../pbcrep.h"
+#include "length-prefix.h"
+#include "wire-format.h"
+
+// Where a field occurs in the packed message.
+typedef struct {
+  uint32_t first;               // offset of the first occurrence's tag
+  uint32_t last;                // offset of the last occurrence's tag
+  uint32_t count;               // occurrences, not values
+
+  // decoded on request:  the values of a repeated field,
+  // or the view of a non-repeated message.
+  size_t n_values;
+  void *values;
+} ViewField;
+
+struct PBCREP_MessageView
+{
+  const ProtobufCMessageDescriptor *descriptor;
+  size_t length;
+  const uint8_t *data;
+  uint8_t *merged_data;         // owned:  the occurrences of a merged message
+  ViewField *fields;            // same order as descriptor->fields;  NULL until indexed
+};
+
+PBCREP_MessageView *
+pbcrep_message_view_new (const ProtobufCMessageDescriptor *desc,
+                         size_t                            length,
+                         const uint8_t                    *data)
+{
+  PBCREP_MessageView *view = pbcrep_malloc (sizeof (PBCREP_MessageView));
+  view->descriptor = desc;
+  view->length = length;
+  view->data = data;
+  view->merged_data = NULL;
+  view->fields = NULL;
+  return view;
+}
+
+PBCREP_MessageView *
+pbcrep_message_view_new_from_frame (const ProtobufCMessageDescriptor *desc,
+                                    PBCREP_LengthPrefixed_Format      format,
+                                    size_t                            avail,
+                                    const uint8_t                    *frame,
+                                    size_t                           *frame_size_out,
+                                    PBCREP_Error                    **error)
+{
+  size_t length;
+  int prefix_len = pbcrep_length_prefix_decode (format, avail, frame, &length);
+  if (prefix_len < 0)
+    {
+      if (error != NULL)
+        *error = pbcrep_error_new ("BAD_B128",
+                                   "overlong or bad B128-encoded length-prefix");
+      return NULL;
+    }
+  if (prefix_len == 0 || avail - prefix_len < length)
+    {
+      if (error != NULL)
+        *error = pbcrep_error_new ("PARTIAL_RECORD",
+                                   "frame ends within a record");
+      return NULL;
+    }
+  if (frame_size_out != NULL)
+    *frame_size_out = prefix_len + length;
+  return pbcrep_message_view_new (desc, length, frame + prefix_len);
+}
+
+static void
+view_field_clear (const ProtobufCFieldDescriptor *f, ViewField *vf)
+{
+  if (vf->values == NULL)
+    return;
+  if (f->type == PROTOBUF_C_TYPE_MESSAGE)
+    {
+      if (f->label == PROTOBUF_C_LABEL_REPEATED)
+        {
+          PBCREP_MessageView **subs = vf->values;
+          for (size_t i = 0; i < vf->n_values; i++)
+            pbcrep_message_view_destroy (subs[i]);
+        }
+      else
+        {
+          pbcrep_message_view_destroy (vf->values);
+          return;
+        }
+    }
+  pbcrep_free (vf->values);
+}
+
+void
+pbcrep_message_view_destroy (PBCREP_MessageView *view)
+{
+  if (view->fields != NULL)
+    {
+      for (unsigned i = 0; i < view->descriptor->n_fields; i++)
+        view_field_clear (view->descriptor->fields + i, view->fields + i);
+      pbcrep_free (view->fields);
+    }
+  if (view->merged_data != NULL)
+    pbcrep_free (view->merged_data);
+  pbcrep_free (view);
+}
+
+const ProtobufCMessageDescriptor *
+pbcrep_message_view_get_descriptor (const PBCREP_MessageView *view)
+{
+  return view->descriptor;
+}
+
+/* --- Indexing --- */
+static bool
+view_malformed (PBCREP_MessageView *view,
+                size_t              offset,
+                PBCREP_Error      **error)
+{
+  if (error != NULL)
+    *error = pbcrep_error_new_printf ("PROTOBUF_MALFORMED",
+                                      "%s: bad field at offset %zu",
+                                      view->descriptor->name, offset);
+  return false;
+}
+
+bool
+pbcrep_message_view_index (PBCREP_MessageView *view,
+                           PBCREP_Error      **error)
+{
+  if (view->fields != NULL)
+    return true;
+
+  const ProtobufCMessageDescriptor *desc = view->descriptor;
+  size_t len = view->length;
+  const uint8_t *data = view->data;
+  if (len > UINT32_MAX)
+    {
+      if (error != NULL)
+        *error = pbcrep_error_new_printf ("RECORD_TOO_LONG",
+                                          "%s: message of %zu bytes is too long to view",
+                                          desc->name, len);
+      return false;
+    }
+  ViewField *fields = pbcrep_malloc (sizeof (ViewField) * (desc->n_fields > 0 ? desc->n_fields : 1));
+  memset (fields, 0, sizeof (ViewField) * desc->n_fields);
+
+  unsigned guess = 0;
+  PBCREP_WireField wf;
+  for (size_t at = 0; at < len; at = wf.end)
+    {
+      if (!pbcrep_wire_decode_field (len, data, at, &wf))
+        goto malformed;
+      int i = pbcrep_wire_find_field (desc, wf.number, &guess);
+      if (i < 0)
+        continue;               // unknown fields are skipped
+      if (!pbcrep_wire_type_matches (desc->fields + i, wf.wire_type))
+        goto malformed;
+      if (fields[i].count++ == 0)
+        fields[i].first = at;
+      fields[i].last = at;
+      continue;
+
+    malformed:
+      pbcrep_free (fields);
+      return view_malformed (view, at, error);
+    }
+
+  for (unsigned i = 0; i < desc->n_fields; i++)
+    {
+      const ProtobufCFieldDescriptor *f = desc->fields + i;
+      if (fields[i].count == 0 && f->label == PROTOBUF_C_LABEL_REQUIRED)
+        {
+          pbcrep_free (fields);
+          if (error != NULL)
+            *error = pbcrep_error_new_printf ("PROTOBUF_MALFORMED",
+                                              "%s: required field %s missing",
+                                              desc->name, f->name);
+          return false;
+        }
+    }
+
+  // Forget the oneof members that a later one overrides.
+  for (unsigned i = 0; i < desc->n_fields; i++)
+    if ((desc->fields[i].flags & PROTOBUF_C_FIELD_FLAG_ONEOF) != 0
+     && fields[i].count > 0
+     && !pbcrep_wire_oneof_member_is_last (desc, i, &fields[0].count, &fields[0].last,
+                                           sizeof (ViewField)))
+      fields[i].count = 0;
+
+  view->fields = fields;
+  return true;
+}
+
+// Index the view if need be, and find the field.
+static const ProtobufCFieldDescriptor *
+view_lookup (PBCREP_MessageView *view,
+             unsigned            field_id,
+             ViewField         **vf_out,
+             PBCREP_Error      **error)
+{
+  if (!pbcrep_message_view_index (view, error))
+    return NULL;
+  const ProtobufCFieldDescriptor *f = protobuf_c_message_descriptor_get_field (view->descriptor, field_id);
+  if (f == NULL)
+    {
+      if (error != NULL)
+        *error = pbcrep_error_new_printf ("UNKNOWN_FIELD",
+                                          "%s has no field %u",
+                                          view->descriptor->name, field_id);
+      return NULL;
+    }
+  *vf_out = view->fields + (f - view->descriptor->fields);
+  return f;
+}
+
+static bool
+bad_label (const ProtobufCFieldDescriptor *f,
+           PBCREP_Error                  **error)
+{
+  if (error != NULL)
+    *error = pbcrep_error_new_printf ("BAD_FIELD_LABEL",
+                                      f->label == PROTOBUF_C_LABEL_REPEATED
+                                      ? "field %s is repeated"
+                                      : "field %s is not repeated",
+                                      f->name);
+  return false;
+}
+
+/* --- Decoding --- */
+// Strings are viewed as ProtobufCBinaryData, and messages as views.
+static inline size_t
+sizeof_value (ProtobufCType type)
+{
+  return type == PROTOBUF_C_TYPE_STRING ? sizeof (ProtobufCBinaryData)
+                                        : pbcrep_wire_member_size (type);
+}
+
+// The number of values of a repeated field, counting packed ones.
+static bool
+count_repeated (PBCREP_MessageView             *view,
+                const ProtobufCFieldDescriptor *f,
+                const ViewField                *vf,
+                size_t                         *count_out,
+                PBCREP_Error                  **error)
+{
+  if (vf->count == 0 || !pbcrep_wire_type_is_packable (f->type))
+    {
+      *count_out = vf->count;
+      return true;
+    }
+  unsigned fixed_size = pbcrep_wire_fixed_size (f->type);
+  size_t count = 0;
+  PBCREP_WireField wf;
+  for (size_t at = vf->first; at <= vf->last; at = wf.end)
+    {
+      pbcrep_wire_decode_field (view->length, view->data, at, &wf);
+      if (wf.number != f->id)
+        continue;
+      if (wf.wire_type != PBCREP_WIRE_TYPE_LENGTH_PREFIXED)
+        {
+          count++;
+          continue;
+        }
+      const uint8_t *value = view->data + wf.value_start;
+      size_t rem = wf.value_length;
+      if (fixed_size > 0)
+        {
+          if (rem % fixed_size != 0)
+            return view_malformed (view, at, error);
+          count += rem / fixed_size;
+        }
+      else
+        while (rem > 0)
+          {
+            uint64_t v;
+            unsigned used = pbcrep_wire_decode_varint (rem, value, &v);
+            if (used == 0)
+              return view_malformed (view, at, error);
+            value += used;
+            rem -= used;
+            count++;
+          }
+    }
+  *count_out = count;
+  return true;
+}
+
+// Decode one (unpacked) value.
+static void
+decode_value (const ProtobufCFieldDescriptor *f,
+              size_t                          length,
+              const uint8_t                  *data,
+              void                           *value_out)
+{
+  switch (f->type)
+    {
+    case PROTOBUF_C_TYPE_STRING:
+    case PROTOBUF_C_TYPE_BYTES:
+      {
+        ProtobufCBinaryData *bd = value_out;
+        bd->len = length;
+        bd->data = (uint8_t *) data;
+        break;
+      }
+    case PROTOBUF_C_TYPE_MESSAGE:
+      * (PBCREP_MessageView **) value_out = pbcrep_message_view_new (f->descriptor, length, data);
+      break;
+    default:
+      pbcrep_wire_decode_scalar (f->type, length, data, value_out);
+      break;
+    }
+}
+
+// As the message member would be, if the field is absent.
+static void
+default_value (const ProtobufCFieldDescriptor *f,
+               void                           *value_out)
+{
+  switch (f->type)
+    {
+    case PROTOBUF_C_TYPE_STRING:
+      {
+        ProtobufCBinaryData *bd = value_out;
+        const char *str = f->default_value != NULL ? f->default_value : "";
+        bd->len = strlen (str);
+        bd->data = (uint8_t *) str;
+        break;
+      }
+    case PROTOBUF_C_TYPE_BYTES:
+      if (f->default_value != NULL)
+        * (ProtobufCBinaryData *) value_out = * (const ProtobufCBinaryData *) f->default_value;
+      else
+        {
+          ProtobufCBinaryData *bd = value_out;
+          bd->len = 0;
+          bd->data = NULL;
+        }
+      break;
+    case PROTOBUF_C_TYPE_MESSAGE:
+      * (PBCREP_MessageView **) value_out = NULL;
+      break;
+    default:
+      if (f->default_value != NULL)
+        memcpy (value_out, f->default_value, sizeof_value (f->type));
+      else
+        memset (value_out, 0, sizeof_value (f->type));
+      break;
+    }
+}
+
+// Occurrences of a non-repeated message are merged,
+// which is the same as concatenating them.
+static PBCREP_MessageView *
+merged_message_view (PBCREP_MessageView             *view,
+                     const ProtobufCFieldDescriptor *f,
+                     const ViewField                *vf)
+{
+  size_t merged_len = 0;
+  uint8_t *merged = pbcrep_malloc (view->length - vf->first);
+  PBCREP_WireField wf;
+  for (size_t at = vf->first; at <= vf->last; at = wf.end)
+    {
+      pbcrep_wire_decode_field (view->length, view->data, at, &wf);
+      if (wf.number != f->id)
+        continue;
+      memcpy (merged + merged_len, view->data + wf.value_start, wf.value_length);
+      merged_len += wf.value_length;
+    }
+  PBCREP_MessageView *sub = pbcrep_message_view_new (f->descriptor, merged_len, merged);
+  sub->merged_data = merged;
+  return sub;
+}
+
+bool
+pbcrep_message_view_get_count (PBCREP_MessageView *view,
+                               unsigned            field_id,
+                               size_t             *count_out,
+                               PBCREP_Error      **error)
+{
+  ViewField *vf;
+  const ProtobufCFieldDescriptor *f = view_lookup (view, field_id, &vf, error);
+  if (f == NULL)
+    return false;
+  if (f->label != PROTOBUF_C_LABEL_REPEATED)
+    {
+      *count_out = vf->count > 0 ? 1 : 0;
+      return true;
+    }
+  if (vf->values != NULL)
+    {
+      *count_out = vf->n_values;
+      return true;
+    }
+  return count_repeated (view, f, vf, count_out, error);
+}
+
+bool
+pbcrep_message_view_get_value (PBCREP_MessageView *view,
+                               unsigned            field_id,
+                               void               *value_out,
+                               PBCREP_Error      **error)
+{
+  ViewField *vf;
+  const ProtobufCFieldDescriptor *f = view_lookup (view, field_id, &vf, error);
+  if (f == NULL)
+    return false;
+  if (f->label == PROTOBUF_C_LABEL_REPEATED)
+    return bad_label (f, error);
+  if (vf->count == 0)
+    {
+      default_value (f, value_out);
+      return true;
+    }
+  if (f->type == PROTOBUF_C_TYPE_MESSAGE)
+    {
+      if (vf->values == NULL)
+        {
+          if (vf->count > 1)
+            vf->values = merged_message_view (view, f, vf);
+          else
+            {
+              PBCREP_WireField wf;
+              pbcrep_wire_decode_field (view->length, view->data, vf->last, &wf);
+              decode_value (f, wf.value_length, view->data + wf.value_start, &vf->values);
+            }
+        }
+      * (PBCREP_MessageView **) value_out = vf->values;
+      return true;
+    }
+  PBCREP_WireField wf;
+  pbcrep_wire_decode_field (view->length, view->data, vf->last, &wf);
+  decode_value (f, wf.value_length, view->data + wf.value_start, value_out);
+  return true;
+}
+
+bool
+pbcrep_message_view_get_values (PBCREP_MessageView *view,
+                                unsigned            field_id,
+                                size_t             *n_values_out,
+                                const void        **values_out,
+                                PBCREP_Error      **error)
+{
+  ViewField *vf;
+  const ProtobufCFieldDescriptor *f = view_lookup (view, field_id, &vf, error);
+  if (f == NULL)
+    return false;
+  if (f->label != PROTOBUF_C_LABEL_REPEATED)
+    return bad_label (f, error);
+  if (vf->values == NULL && vf->count > 0)
+    {
+      size_t n;
+      if (!count_repeated (view, f, vf, &n, error))
+        return false;
+      size_t value_size = sizeof_value (f->type);
+      uint8_t *values = pbcrep_malloc (value_size * (n > 0 ? n : 1));
+      uint8_t *v = values;
+      PBCREP_WireField wf;
+      for (size_t at = vf->first; at <= vf->last; at = wf.end)
+        {
+          pbcrep_wire_decode_field (view->length, view->data, at, &wf);
+          if (wf.number != f->id)
+            continue;
+          const uint8_t *value = view->data + wf.value_start;
+          size_t rem = wf.value_length;
+          if (wf.wire_type == PBCREP_WIRE_TYPE_LENGTH_PREFIXED
+           && pbcrep_wire_type_is_packable (f->type))
+            {
+              // counted above, so the values are well-formed
+              while (rem > 0)
+                {
+                  size_t used = pbcrep_wire_decode_scalar (f->type, rem, value, v);
+                  value += used;
+                  rem -= used;
+                  v += value_size;
+                }
+            }
+          else
+            {
+              decode_value (f, rem, value, v);
+              v += value_size;
+            }
+        }
+      vf->n_values = n;
+      vf->values = values;
+    }
+  *n_values_out = vf->n_values;
+  *values_out = vf->values;
+  return true;
+}
+
+/* --- Single fields --- */
+struct PBCREP_FieldPath
+{
+  unsigned n_fields;
+  const ProtobufCMessageDescriptor **descs;     // the message each field is in
+  const ProtobufCFieldDescriptor **fields;      // outermost first
+};
+
+static PBCREP_FieldPath *
+bad_field_path (PBCREP_FieldPath *fpath,
+                char             *names,
+                PBCREP_Error     *e,
+                PBCREP_Error    **error)
+{
+  pbcrep_field_path_destroy (fpath);
+  pbcrep_free (names);
+  if (error != NULL)
+    *error = e;
+  else
+    pbcrep_error_destroy (e);
+  return NULL;
+}
+
+PBCREP_FieldPath *
+pbcrep_field_path_new (const ProtobufCMessageDescriptor *desc,
+                       const char                       *path,
+                       PBCREP_Error                    **error)
+{
+  unsigned n = 1;
+  for (const char *at = path; *at; at++)
+    if (*at == '.')
+      n++;
+  PBCREP_FieldPath *fpath = pbcrep_malloc (sizeof (PBCREP_FieldPath));
+  fpath->n_fields = n;
+  fpath->descs = pbcrep_malloc (sizeof (const ProtobufCMessageDescriptor *) * n);
+  fpath->fields = pbcrep_malloc (sizeof (const ProtobufCFieldDescriptor *) * n);
+
+  size_t path_len = strlen (path);
+  char *names = pbcrep_malloc (path_len + 1);
+  memcpy (names, path, path_len + 1);
+  char *name = names;
+  for (unsigned i = 0; i < n; i++)
+    {
+      char *dot = strchr (name, '.');
+      if (dot != NULL)
+        *dot = 0;
+      const ProtobufCFieldDescriptor *f = *name == 0
+                                        ? NULL
+                                        : protobuf_c_message_descriptor_get_field_by_name (desc, name);
+      if (f == NULL)
+        return bad_field_path (fpath, names,
+                               pbcrep_error_new_printf ("BAD_FIELD_PATH",
+                                                        "%s: no field '%s' in path '%s'",
+                                                        desc->name,
+                                                        name, path),
+                               error);
+      bool last = i + 1 == n;
+      if (f->label == PROTOBUF_C_LABEL_REPEATED
+       || (f->type == PROTOBUF_C_TYPE_MESSAGE) == last)
+        return bad_field_path (fpath, names,
+                               pbcrep_error_new_printf ("BAD_FIELD_PATH",
+                                                        "field %s in path '%s' is %s",
+                                                        f->name, path,
+                                                        f->label == PROTOBUF_C_LABEL_REPEATED ? "repeated"
+                                                        : last ? "a message"
+                                                        : "not a message"),
+                               error);
+      fpath->descs[i] = desc;
+      fpath->fields[i] = f;
+      if (!last)
+        {
+          desc = f->descriptor;
+          name = dot + 1;
+        }
+    }
+  pbcrep_free (names);
+  return fpath;
+}
+
+void
+pbcrep_field_path_destroy (PBCREP_FieldPath *path)
+{
+  pbcrep_free (path->descs);
+  pbcrep_free (path->fields);
+  pbcrep_free (path);
+}
+
+const ProtobufCFieldDescriptor *
+pbcrep_field_path_get_field (const PBCREP_FieldPath *path)
+{
+  return path->fields[path->n_fields - 1];
+}
+
+typedef enum
+{
+  EXTRACT_ERROR,
+  EXTRACT_ABSENT,               // nothing in this message
+  EXTRACT_FOUND,
+  EXTRACT_CLEARED               // found, then cleared by another oneof member
+} ExtractResult;
+
+// Find the value of path->fields[level...] in data[0..len).
+static ExtractResult
+extract_at (const PBCREP_FieldPath *path,
+            unsigned                level,
+            size_t                  len,
+            const uint8_t          *data,
+            const uint8_t         **value_out,
+            size_t                 *value_length_out,
+            PBCREP_Error          **error)
+{
+  const ProtobufCFieldDescriptor *f = path->fields[level];
+  bool in_oneof = (f->flags & PROTOBUF_C_FIELD_FLAG_ONEOF) != 0;
+  bool last_level = level + 1 == path->n_fields;
+  ExtractResult rv = EXTRACT_ABSENT;
+  PBCREP_WireField wf;
+  for (size_t at = 0; at < len; at = wf.end)
+    {
+      if (!pbcrep_wire_decode_field (len, data, at, &wf))
+        goto malformed;
+      if (wf.number != f->id)
+        {
+          if (in_oneof)
+            {
+              const ProtobufCFieldDescriptor *g = protobuf_c_message_descriptor_get_field (path->descs[level], wf.number);
+              if (g != NULL && pbcrep_wire_fields_share_oneof (f, g))
+                rv = EXTRACT_CLEARED;
+            }
+          continue;
+        }
+      if (!pbcrep_wire_type_matches (f, wf.wire_type))
+        goto malformed;
+      if (last_level)
+        {
+          *value_out = data + wf.value_start;
+          *value_length_out = wf.value_length;
+          rv = EXTRACT_FOUND;
+          continue;
+        }
+
+      // Occurrences of the sub-message are merged,
+      // so the value (if any) in the last one wins.
+      ExtractResult sub_rv = extract_at (path, level + 1, wf.value_length, data + wf.value_start,
+                                         value_out, value_length_out, error);
+      switch (sub_rv)
+        {
+        case EXTRACT_ERROR:
+          return EXTRACT_ERROR;
+        case EXTRACT_ABSENT:
+          break;
+        default:
+          rv = sub_rv;
+          break;
+        }
+      continue;
+
+    malformed:
+      if (error != NULL)
+        *error = pbcrep_error_new_printf ("PROTOBUF_MALFORMED",
+                                          "%s: bad field at offset %zu",
+                                          path->descs[level]->name, at);
+      return EXTRACT_ERROR;
+    }
+  return rv;
+}
+
+bool
+pbcrep_field_path_extract (const PBCREP_FieldPath *path,
+                           size_t                  length,
+                           const uint8_t          *data,
+                           void                   *value_out,
+                           bool                   *found_out,
+                           PBCREP_Error          **error)
+{
+  const ProtobufCFieldDescriptor *f = pbcrep_field_path_get_field (path);
+  const uint8_t *value;
+  size_t value_length;
+  switch (extract_at (path, 0, length, data, &value, &value_length, error))
+    {
+    case EXTRACT_ERROR:
+      return false;
+    case EXTRACT_FOUND:
+      decode_value (f, value_length, value, value_out);
+      if (found_out != NULL)
+        *found_out = true;
+      return true;
+    default:
+      default_value (f, value_out);
+      if (found_out != NULL)
+        *found_out = false;
+      return true;
+    }
+}
+
+bool
+pbcrep_field_path_hash (const PBCREP_FieldPath *path,
+                        size_t                  length,
+                        const uint8_t          *data,
+                        uint64_t               *hash_out,
+                        PBCREP_Error          **error)
+{
+  const ProtobufCFieldDescriptor *f = pbcrep_field_path_get_field (path);
+  union {
+    ProtobufCBinaryData v_binary;
+    int32_t v_int32;
+    uint32_t v_uint32;
+    uint64_t v_uint64;
+    protobuf_c_boolean v_boolean;
+  } value;
+  if (!pbcrep_field_path_extract (path, length, data, &value, NULL, error))
+    return false;
+
+  // Hash the value's bytes, or the value widened to 64 bits.
+  uint8_t wide[8];
+  const uint8_t *bytes = wide;
+  size_t n_bytes = 8;
+  uint64_t v = 0;
+  switch (f->type)
+    {
+    case PROTOBUF_C_TYPE_STRING:
+    case PROTOBUF_C_TYPE_BYTES:
+      bytes = value.v_binary.data;
+      n_bytes = value.v_binary.len;
+      break;
+    case PROTOBUF_C_TYPE_INT32:
+    case PROTOBUF_C_TYPE_SINT32:
+    case PROTOBUF_C_TYPE_SFIXED32:
+    case PROTOBUF_C_TYPE_ENUM:
+      v = (uint64_t) (int64_t) value.v_int32;
+      break;
+    case PROTOBUF_C_TYPE_BOOL:
+      v = value.v_boolean != 0;
+      break;
+    default:
+      v = sizeof_value (f->type) == 8 ? value.v_uint64 : value.v_uint32;
+      break;
+    }
+  if (bytes == wide)
+    for (unsigned i = 0; i < 8; i++)
+      wide[i] = v >> (8 * i);
+
+  // FNV-1a
+  uint64_t h = 0xcbf29ce484222325ULL;
+  for (size_t i = 0; i < n_bytes; i++)
+    {
+      h ^= bytes[i];
+      h *= 0x100000001b3ULL;
+    }
+  *hash_out = h;
+  return true;
+}
@@ -0,0 +1,120 @@
+/*
+ * PBCREP_MessageView: read fields from a packed message
+ * without unpacking all of it.
+ *
+ * A view refers to the packed data (which must outlive it) and
+ * decodes only what is asked for.  The first access indexes the
+ * message:  one pass over its tags records where each field occurs,
+ * and checks the framing and wire types.  Fields are then decoded
+ * from their occurrences on request.  Sub-messages are views too,
+ * indexed only when they are accessed themselves.
+ *
+ * Values are as protobuf_c_message_unpack() would give them:
+ * the last occurrence of a non-repeated field wins, repeated fields
+ * may be packed or not, only the last member of a oneof is present,
+ * and a non-repeated message given more than once is merged.
+ *
+ * Fields are named by their field number, for example from
+ * protobuf_c_message_descriptor_get_field_by_name().
+ */
+
+typedef struct PBCREP_MessageView PBCREP_MessageView;
+
+// The view does not copy 'data'.
+PBCREP_MessageView *
+pbcrep_message_view_new             (const ProtobufCMessageDescriptor *desc,
+                                     size_t                            length,
+                                     const uint8_t                    *data);
+
+// A view of the record at the start of frame[0..avail), which must be
+// complete;  *frame_size_out (if non-NULL) is set to the record's size,
+// including its length-prefix.  Returns NULL on error.
+PBCREP_MessageView *
+pbcrep_message_view_new_from_frame  (const ProtobufCMessageDescriptor *desc,
+                                     PBCREP_LengthPrefixed_Format      format,
+                                     size_t                            avail,
+                                     const uint8_t                    *frame,
+                                     size_t                           *frame_size_out,
+                                     PBCREP_Error                    **error);
+
+void pbcrep_message_view_destroy    (PBCREP_MessageView               *view);
+
+const ProtobufCMessageDescriptor *
+pbcrep_message_view_get_descriptor  (const PBCREP_MessageView         *view);
+
+// Index the message now, rather than on first access;
+// this checks the message's own fields (but not its sub-messages').
+bool pbcrep_message_view_index      (PBCREP_MessageView               *view,
+                                     PBCREP_Error                    **error);
+
+// The number of values:  0 or 1 for non-repeated fields.
+bool pbcrep_message_view_get_count  (PBCREP_MessageView               *view,
+                                     unsigned                          field_id,
+                                     size_t                           *count_out,
+                                     PBCREP_Error                    **error);
+
+// The value of a non-repeated field, or its default if it is absent.
+//
+// Scalars are written as the message member would hold them.
+// Strings and bytes are written as a ProtobufCBinaryData pointing
+// into the packed data (strings are not NUL-terminated).
+// Messages are written as a PBCREP_MessageView* belonging to
+// 'view', or NULL if absent.
+bool pbcrep_message_view_get_value  (PBCREP_MessageView               *view,
+                                     unsigned                          field_id,
+                                     void                             *value_out,
+                                     PBCREP_Error                    **error);
+
+// The values of a repeated field, as an array of the types
+// pbcrep_message_view_get_value() gives, belonging to 'view'.
+bool pbcrep_message_view_get_values (PBCREP_MessageView               *view,
+                                     unsigned                          field_id,
+                                     size_t                           *n_values_out,
+                                     const void                      **values_out,
+                                     PBCREP_Error                    **error);
+
+
+/*
+ * PBCREP_FieldPath: one scalar field, possibly inside non-repeated
+ * sub-messages, to be read straight from packed messages.
+ *
+ * Extracting scans the tags of the message, skipping the values
+ * of the fields not on the path, and descends into the sub-messages
+ * on it;  nothing is unpacked or allocated.  The value is the one
+ * protobuf_c_message_unpack() would give, but only the fields on
+ * the path are checked.
+ */
+
+typedef struct PBCREP_FieldPath PBCREP_FieldPath;
+
+// 'path' is the field names, separated by '.', like "id" or "address.zip".
+// All but the last must be non-repeated messages;  the last must be
+// non-repeated and not a message.
+PBCREP_FieldPath *pbcrep_field_path_new      (const ProtobufCMessageDescriptor *desc,
+                                              const char                       *path,
+                                              PBCREP_Error                    **error);
+void              pbcrep_field_path_destroy  (PBCREP_FieldPath                 *path);
+
+// The last field on the path.
+const ProtobufCFieldDescriptor *
+                  pbcrep_field_path_get_field(const PBCREP_FieldPath           *path);
+
+// Read the field from a packed message into 'value_out', in the
+// layout that pbcrep_message_view_get_value() uses:  strings and bytes
+// as a ProtobufCBinaryData pointing into 'data'.  If the field
+// is absent, its default is given and *found_out is set to false.
+bool              pbcrep_field_path_extract  (const PBCREP_FieldPath           *path,
+                                              size_t                            length,
+                                              const uint8_t                    *data,
+                                              void                             *value_out,
+                                              bool                             *found_out,
+                                              PBCREP_Error                    **error);
+
+// A 64-bit hash of the field's value in a packed message,
+// for choosing a shard.  Equal values hash equally, whatever
+// their encoding.
+bool              pbcrep_field_path_hash     (const PBCREP_FieldPath           *path,
+                                              size_t                            length,
+                                              const uint8_t                    *data,
+                                              uint64_t                         *hash_out,
+                                              PBCREP_Error                    **error);
@@ -0,0 +1,562 @@
+#include "../pbcrep.h"
+#include "wire-format.h"
+#include <assert.h>
+#include <string.h>
+
+// Packed numbers are written in batches of this many,
+// reserving room for their longest encoding once per batch.
+#define PACKED_BATCH            64
+
+struct PBCREP_Packer
+{
+  // The sizes of the sub-messages and packed fields
+  // of the message last measured, in the order they are written.
+  size_t *sizes;
+  size_t n_sizes;
+  size_t sizes_alloced;
+  size_t next_size;             // while packing
+
+  const ProtobufCMessage *measured;
+};
+
+PBCREP_Packer *
+pbcrep_packer_new (void)
+{
+  PBCREP_Packer *packer = pbcrep_malloc (sizeof (PBCREP_Packer));
+  packer->sizes_alloced = 32;
+  packer->sizes = pbcrep_malloc (sizeof (size_t) * packer->sizes_alloced);
+  packer->n_sizes = 0;
+  packer->next_size = 0;
+  packer->measured = NULL;
+  return packer;
+}
+
+void
+pbcrep_packer_destroy (PBCREP_Packer *packer)
+{
+  pbcrep_free (packer->sizes);
+  pbcrep_free (packer);
+}
+
+static inline size_t
+new_size_slot (PBCREP_Packer *packer)
+{
+  if (PBCREP_UNLIKELY (packer->n_sizes == packer->sizes_alloced))
+    {
+      packer->sizes_alloced *= 2;
+      packer->sizes = pbcrep_realloc (packer->sizes, sizeof (size_t) * packer->sizes_alloced);
+    }
+  return packer->n_sizes++;
+}
+
+/* --- Writing into the tail of the output buffer --- */
+typedef struct {
+  PBCREP_Buffer *buffer;
+  uint8_t *start;               // from pbcrep_buffer_reserve()
+  uint8_t *at;
+  uint8_t *end;
+} Out;
+
+static void
+out_start (Out *o, PBCREP_Buffer *buffer)
+{
+  unsigned avail;
+  o->buffer = buffer;
+  pbcrep_buffer_reserve (buffer, 1, &o->start, &avail);
+  o->at = o->start;
+  o->end = o->start + avail;
+}
+
+static inline void
+out_commit (Out *o)
+{
+  pbcrep_buffer_commit (o->buffer, o->at - o->start);
+}
+
+static void
+out_grow (Out *o, size_t min_size)
+{
+  unsigned avail;
+  out_commit (o);
+  pbcrep_buffer_reserve (o->buffer, min_size, &o->start, &avail);
+  o->at = o->start;
+  o->end = o->start + avail;
+}
+
+static inline uint8_t *
+out_reserve (Out *o, size_t min_size)
+{
+  if (PBCREP_UNLIKELY ((size_t) (o->end - o->at) < min_size))
+    out_grow (o, min_size);
+  return o->at;
+}
+
+static void
+out_bytes (Out *o, size_t length, const void *data)
+{
+  const uint8_t *d = data;
+  while (length > 0)
+    {
+      size_t avail = o->end - o->at;
+      if (avail == 0)
+        {
+          out_grow (o, 1);
+          avail = o->end - o->at;
+        }
+      size_t n = length < avail ? length : avail;
+      memcpy (o->at, d, n);
+      o->at += n;
+      d += n;
+      length -= n;
+    }
+}
+
+/* --- Values --- */
+// Branch-free pbcrep_wire_varint_size().
+static inline unsigned
+varint_size (uint64_t value)
+{
+  return ((63 - __builtin_clzll (value | 1)) * 9 + 73) / 64;
+}
+
+static inline unsigned
+tag_size (uint32_t id)
+{
+  return varint_size ((uint64_t) id << 3);
+}
+
+static inline uint8_t *
+write_varint (uint8_t *w, uint64_t value)
+{
+  if (value < 0x80)
+    {
+      *w = value;
+      return w + 1;
+    }
+  return w + pbcrep_wire_encode_varint (value, w);
+}
+
+static inline uint8_t *
+write_tag (uint8_t *w, uint32_t id, PBCREP_WireType wire_type)
+{
+  return write_varint (w, ((uint64_t) id << 3) | wire_type);
+}
+
+static PBCREP_WireType
+wire_type_for (ProtobufCType type)
+{
+  switch (pbcrep_wire_fixed_size (type))
+    {
+    case 4:  return PBCREP_WIRE_TYPE_32BIT;
+    case 8:  return PBCREP_WIRE_TYPE_64BIT;
+    default:
+      return pbcrep_wire_type_is_packable (type) ? PBCREP_WIRE_TYPE_VARINT
+                                                 : PBCREP_WIRE_TYPE_LENGTH_PREFIXED;
+    }
+}
+
+// The varint a scalar is encoded as.
+static inline uint64_t
+varint_value (ProtobufCType type, const void *member)
+{
+  switch (type)
+    {
+    case PROTOBUF_C_TYPE_INT32:
+    case PROTOBUF_C_TYPE_ENUM:
+      return (uint64_t) (int64_t) * (const int32_t *) member;
+    case PROTOBUF_C_TYPE_SINT32:
+      return pbcrep_wire_zigzag32 (* (const int32_t *) member);
+    case PROTOBUF_C_TYPE_UINT32:
+      return * (const uint32_t *) member;
+    case PROTOBUF_C_TYPE_SINT64:
+      return pbcrep_wire_zigzag64 (* (const int64_t *) member);
+    case PROTOBUF_C_TYPE_BOOL:
+      return * (const protobuf_c_boolean *) member != 0;
+    default:
+      return * (const uint64_t *) member;
+    }
+}
+
+// Size of a scalar, not counting its tag.
+static inline size_t
+scalar_size (ProtobufCType type, const void *member)
+{
+  unsigned fixed_size = pbcrep_wire_fixed_size (type);
+  if (fixed_size > 0)
+    return fixed_size;
+  if (type == PROTOBUF_C_TYPE_BOOL)
+    return 1;
+  return varint_size (varint_value (type, member));
+}
+
+static inline uint8_t *
+write_fixed (uint8_t *w, unsigned size, const void *member)
+{
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+  memcpy (w, member, size);
+#else
+  uint64_t v = size == 4 ? * (const uint32_t *) member : * (const uint64_t *) member;
+  for (unsigned i = 0; i < size; i++)
+    w[i] = v >> (8 * i);
+#endif
+  return w + size;
+}
+
+// Room for any scalar.
+#define MAX_SCALAR_SIZE         PBCREP_WIRE_MAX_VARINT_SIZE
+
+static inline uint8_t *
+write_scalar (uint8_t *w, ProtobufCType type, const void *member)
+{
+  unsigned fixed_size = pbcrep_wire_fixed_size (type);
+  if (fixed_size > 0)
+    return write_fixed (w, fixed_size, member);
+  return write_varint (w, varint_value (type, member));
+}
+
+static bool
+value_is_zero (ProtobufCType type, const void *member)
+{
+  switch (type)
+    {
+    case PROTOBUF_C_TYPE_BOOL:
+      return * (const protobuf_c_boolean *) member == 0;
+    case PROTOBUF_C_TYPE_FLOAT:
+      return * (const float *) member == 0;
+    case PROTOBUF_C_TYPE_DOUBLE:
+      return * (const double *) member == 0;
+    case PROTOBUF_C_TYPE_BYTES:
+      return ((const ProtobufCBinaryData *) member)->len == 0;
+    default:
+      return pbcrep_wire_member_size (type) == 4 ? * (const uint32_t *) member == 0
+                                    : * (const uint64_t *) member == 0;
+    }
+}
+
+// Whether a non-repeated field is packed, by the rules
+// of protobuf_c_message_pack().
+static bool
+field_is_packed (const char *m, const ProtobufCFieldDescriptor *f)
+{
+  const void *member = m + f->offset;
+  if (f->label == PROTOBUF_C_LABEL_REQUIRED)
+    return true;
+  if ((f->flags & PROTOBUF_C_FIELD_FLAG_ONEOF)
+   && * (const uint32_t *) (m + f->quantifier_offset) != f->id)
+    return false;
+  if (f->type == PROTOBUF_C_TYPE_STRING || f->type == PROTOBUF_C_TYPE_MESSAGE)
+    {
+      const char *ptr = * (const void * const *) member;
+      if (ptr == NULL)
+        return false;
+      if (f->label == PROTOBUF_C_LABEL_OPTIONAL || (f->flags & PROTOBUF_C_FIELD_FLAG_ONEOF))
+        return ptr != f->default_value;
+      return f->type == PROTOBUF_C_TYPE_MESSAGE || *ptr != 0;     // proto3
+    }
+  if (f->flags & PROTOBUF_C_FIELD_FLAG_ONEOF)
+    return true;
+  if (f->label == PROTOBUF_C_LABEL_OPTIONAL)
+    return * (const protobuf_c_boolean *) (m + f->quantifier_offset);
+  return !value_is_zero (f->type, member);                      // proto3
+}
+
+static inline bool
+field_is_packed_repeated (const ProtobufCFieldDescriptor *f)
+{
+  return (f->flags & PROTOBUF_C_FIELD_FLAG_PACKED)
+      && pbcrep_wire_type_is_packable (f->type);
+}
+
+/* --- Measuring --- */
+static size_t measure_message (PBCREP_Packer *packer, const ProtobufCMessage *message);
+
+// Size of a string, bytes or message value, including its length-prefix.
+static inline size_t
+measure_length_prefixed (PBCREP_Packer *packer, ProtobufCType type, const void *member)
+{
+  size_t length;
+  switch (type)
+    {
+    case PROTOBUF_C_TYPE_STRING:
+      {
+        const char *str = * (const char * const *) member;
+        length = str == NULL ? 0 : strlen (str);
+        break;
+      }
+    case PROTOBUF_C_TYPE_BYTES:
+      length = ((const ProtobufCBinaryData *) member)->len;
+      break;
+    default:
+      {
+        // A NULL required or repeated message is packed as an empty one.
+        const ProtobufCMessage *sub = * (const ProtobufCMessage * const *) member;
+        size_t slot = new_size_slot (packer);
+        length = sub == NULL ? 0 : measure_message (packer, sub);
+        packer->sizes[slot] = length;
+        break;
+      }
+    }
+  return varint_size (length) + length;
+}
+
+static size_t
+measure_packed (ProtobufCType type, size_t n, const void *array)
+{
+  unsigned fixed_size = pbcrep_wire_fixed_size (type);
+  if (fixed_size > 0)
+    return fixed_size * n;
+  size_t rv = 0;
+  switch (type)
+    {
+    case PROTOBUF_C_TYPE_BOOL:
+      return n;
+    case PROTOBUF_C_TYPE_INT32:
+    case PROTOBUF_C_TYPE_ENUM:
+      for (size_t i = 0; i < n; i++)
+        rv += varint_size ((uint64_t) (int64_t) ((const int32_t *) array)[i]);
+      return rv;
+    case PROTOBUF_C_TYPE_UINT32:
+      for (size_t i = 0; i < n; i++)
+        rv += varint_size (((const uint32_t *) array)[i]);
+      return rv;
+    case PROTOBUF_C_TYPE_SINT32:
+      for (size_t i = 0; i < n; i++)
+        rv += varint_size (pbcrep_wire_zigzag32 (((const int32_t *) array)[i]));
+      return rv;
+    case PROTOBUF_C_TYPE_SINT64:
+      for (size_t i = 0; i < n; i++)
+        rv += varint_size (pbcrep_wire_zigzag64 (((const int64_t *) array)[i]));
+      return rv;
+    default:
+      for (size_t i = 0; i < n; i++)
+        rv += varint_size (((const uint64_t *) array)[i]);
+      return rv;
+    }
+}
+
+static size_t
+measure_message (PBCREP_Packer *packer, const ProtobufCMessage *message)
+{
+  const ProtobufCMessageDescriptor *desc = message->descriptor;
+  const char *m = (const char *) message;
+  size_t rv = 0;
+  for (unsigned i = 0; i < desc->n_fields; i++)
+    {
+      const ProtobufCFieldDescriptor *f = desc->fields + i;
+      const void *member = m + f->offset;
+      if (f->label != PROTOBUF_C_LABEL_REPEATED)
+        {
+          if (!field_is_packed (m, f))
+            continue;
+          rv += tag_size (f->id);
+          if (pbcrep_wire_type_is_packable (f->type))
+            rv += scalar_size (f->type, member);
+          else
+            rv += measure_length_prefixed (packer, f->type, member);
+          continue;
+        }
+
+      size_t n = * (const size_t *) (m + f->quantifier_offset);
+      if (n == 0)
+        continue;
+      const char *array = * (const char * const *) member;
+      if (field_is_packed_repeated (f))
+        {
+          size_t slot = new_size_slot (packer);
+          size_t length = measure_packed (f->type, n, array);
+          packer->sizes[slot] = length;
+          rv += tag_size (f->id) + varint_size (length) + length;
+          continue;
+        }
+      rv += tag_size (f->id) * n;
+      size_t elt_size = pbcrep_wire_member_size (f->type);
+      if (pbcrep_wire_type_is_packable (f->type))
+        {
+          unsigned fixed_size = pbcrep_wire_fixed_size (f->type);
+          rv += fixed_size > 0 ? fixed_size * n : measure_packed (f->type, n, array);
+        }
+      else
+        for (size_t j = 0; j < n; j++)
+          rv += measure_length_prefixed (packer, f->type, array + elt_size * j);
+    }
+  for (unsigned i = 0; i < message->n_unknown_fields; i++)
+    rv += tag_size (message->unknown_fields[i].tag) + message->unknown_fields[i].len;
+  return rv;
+}
+
+size_t
+pbcrep_packer_measure (PBCREP_Packer          *packer,
+                       const ProtobufCMessage *message)
+{
+  packer->n_sizes = 0;
+  packer->measured = message;
+  return measure_message (packer, message);
+}
+
+/* --- Packing --- */
+static void pack_message (PBCREP_Packer *packer, Out *o, const ProtobufCMessage *message);
+
+static void
+pack_length_prefixed (PBCREP_Packer                  *packer,
+                      Out                            *o,
+                      const ProtobufCFieldDescriptor *f,
+                      const void                     *member)
+{
+  uint8_t *w = out_reserve (o, 2 * PBCREP_WIRE_MAX_VARINT_SIZE);
+  w = write_tag (w, f->id, PBCREP_WIRE_TYPE_LENGTH_PREFIXED);
+  switch (f->type)
+    {
+    case PROTOBUF_C_TYPE_STRING:
+      {
+        const char *str = * (const char * const *) member;
+        size_t length = str == NULL ? 0 : strlen (str);
+        o->at = write_varint (w, length);
+        out_bytes (o, length, str);
+        break;
+      }
+    case PROTOBUF_C_TYPE_BYTES:
+      {
+        const ProtobufCBinaryData *bd = member;
+        o->at = write_varint (w, bd->len);
+        out_bytes (o, bd->len, bd->data);
+        break;
+      }
+    default:
+      {
+        const ProtobufCMessage *sub = * (const ProtobufCMessage * const *) member;
+        o->at = write_varint (w, packer->sizes[packer->next_size++]);
+        if (sub != NULL)
+          pack_message (packer, o, sub);
+        break;
+      }
+    }
+}
+
+// Write the values of a packed field, without tag or length.
+static void
+pack_packed (Out *o, ProtobufCType type, size_t n, const void *array)
+{
+  unsigned fixed_size = pbcrep_wire_fixed_size (type);
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+  if (fixed_size > 0)
+    {
+      out_bytes (o, fixed_size * n, array);
+      return;
+    }
+#endif
+  size_t elt_size = pbcrep_wire_member_size (type);
+  unsigned max_size = fixed_size > 0 ? fixed_size : PBCREP_WIRE_MAX_VARINT_SIZE;
+  const char *at = array;
+  while (n > 0)
+    {
+      size_t batch = n < PACKED_BATCH ? n : PACKED_BATCH;
+      uint8_t *w = out_reserve (o, batch * max_size);
+      switch (type)
+        {
+        case PROTOBUF_C_TYPE_BOOL:
+          for (size_t i = 0; i < batch; i++)
+            *w++ = ((const protobuf_c_boolean *) at)[i] != 0;
+          break;
+        case PROTOBUF_C_TYPE_INT32:
+        case PROTOBUF_C_TYPE_ENUM:
+          for (size_t i = 0; i < batch; i++)
+            w = write_varint (w, (uint64_t) (int64_t) ((const int32_t *) at)[i]);
+          break;
+        case PROTOBUF_C_TYPE_UINT32:
+          for (size_t i = 0; i < batch; i++)
+            w = write_varint (w, ((const uint32_t *) at)[i]);
+          break;
+        default:
+          for (size_t i = 0; i < batch; i++)
+            w = write_scalar (w, type, at + elt_size * i);
+          break;
+        }
+      o->at = w;
+      at += elt_size * batch;
+      n -= batch;
+    }
+}
+
+static void
+pack_message (PBCREP_Packer *packer, Out *o, const ProtobufCMessage *message)
+{
+  const ProtobufCMessageDescriptor *desc = message->descriptor;
+  const char *m = (const char *) message;
+  for (unsigned i = 0; i < desc->n_fields; i++)
+    {
+      const ProtobufCFieldDescriptor *f = desc->fields + i;
+      const void *member = m + f->offset;
+      if (f->label != PROTOBUF_C_LABEL_REPEATED)
+        {
+          if (!field_is_packed (m, f))
+            continue;
+          if (pbcrep_wire_type_is_packable (f->type))
+            {
+              uint8_t *w = out_reserve (o, PBCREP_WIRE_MAX_VARINT_SIZE + MAX_SCALAR_SIZE);
+              w = write_tag (w, f->id, wire_type_for (f->type));
+              o->at = write_scalar (w, f->type, member);
+            }
+          else
+            pack_length_prefixed (packer, o, f, member);
+          continue;
+        }
+
+      size_t n = * (const size_t *) (m + f->quantifier_offset);
+      if (n == 0)
+        continue;
+      const char *array = * (const char * const *) member;
+      if (field_is_packed_repeated (f))
+        {
+          uint8_t *w = out_reserve (o, 2 * PBCREP_WIRE_MAX_VARINT_SIZE);
+          w = write_tag (w, f->id, PBCREP_WIRE_TYPE_LENGTH_PREFIXED);
+          o->at = write_varint (w, packer->sizes[packer->next_size++]);
+          pack_packed (o, f->type, n, array);
+          continue;
+        }
+      size_t elt_size = pbcrep_wire_member_size (f->type);
+      if (pbcrep_wire_type_is_packable (f->type))
+        {
+          PBCREP_WireType wire_type = wire_type_for (f->type);
+          for (size_t j = 0; j < n; j++)
+            {
+              uint8_t *w = out_reserve (o, PBCREP_WIRE_MAX_VARINT_SIZE + MAX_SCALAR_SIZE);
+              w = write_tag (w, f->id, wire_type);
+              o->at = write_scalar (w, f->type, array + elt_size * j);
+            }
+        }
+      else
+        for (size_t j = 0; j < n; j++)
+          pack_length_prefixed (packer, o, f, array + elt_size * j);
+    }
+  for (unsigned i = 0; i < message->n_unknown_fields; i++)
+    {
+      const ProtobufCMessageUnknownField *uf = message->unknown_fields + i;
+      uint8_t *w = out_reserve (o, PBCREP_WIRE_MAX_VARINT_SIZE);
+      o->at = write_tag (w, uf->tag, (PBCREP_WireType) uf->wire_type);
+      out_bytes (o, uf->len, uf->data);
+    }
+}
+
+void
+pbcrep_packer_pack_measured (PBCREP_Packer          *packer,
+                             const ProtobufCMessage *message,
+                             PBCREP_Buffer          *out)
+{
+  assert (message == packer->measured);
+  Out o;
+  out_start (&o, out);
+  packer->next_size = 0;
+  pack_message (packer, &o, message);
+  assert (packer->next_size == packer->n_sizes);
+  out_commit (&o);
+}
+
+size_t
+pbcrep_packer_pack (PBCREP_Packer          *packer,
+                    const ProtobufCMessage *message,
+                    PBCREP_Buffer          *out)
+{
+  size_t size = pbcrep_packer_measure (packer, message);
+  pbcrep_packer_pack_measured (packer, message, out);
+  return size;
+}
@@ -0,0 +1,33 @@
+/*
+ * PBCREP_Packer: packs messages as protobuf_c_message_pack() does,
+ * byte for byte, straight into a PBCREP_Buffer.
+ *
+ * protobuf_c_message_pack() measures each sub-message again at every
+ * level it is nested in.  The packer measures the whole message once,
+ * keeping the size of each sub-message (and packed repeated field)
+ * in a side array, in the order they will be written;  then encodes
+ * it in one pass into the free space at the end of the buffer.
+ * Packed repeated numbers are measured and written in bulk.
+ */
+
+typedef struct PBCREP_Packer PBCREP_Packer;
+
+// A packer packs messages of any type.  It is not thread-safe.
+PBCREP_Packer *pbcrep_packer_new            (void);
+
+// Measure a message:  returns its packed size.
+size_t         pbcrep_packer_measure        (PBCREP_Packer          *packer,
+                                             const ProtobufCMessage *message);
+
+// Append the message last measured (which must not have changed since)
+// to 'out'.
+void           pbcrep_packer_pack_measured  (PBCREP_Packer          *packer,
+                                             const ProtobufCMessage *message,
+                                             PBCREP_Buffer          *out);
+
+// Measure and pack.  Returns the packed size.
+size_t         pbcrep_packer_pack           (PBCREP_Packer          *packer,
+                                             const ProtobufCMessage *message,
+                                             PBCREP_Buffer          *out);
+
+void           pbcrep_packer_destroy        (PBCREP_Packer          *packer);
@@ -1,4 +1,5 @@
 #include <stdlib.h>
+#include <limits.h>
 #include "../pbcrep.h"
 
 
@@ -11,12 +12,56 @@ pbcrep_parser_feed       (PBCREP_Parser               *parser,
   return parser->feed(parser, data_length, data, error);
 }
 bool
+pbcrep_parser_feed_buffer(PBCREP_Parser               *parser,
+                          PBCREP_Buffer               *buffer,
+                          PBCREP_Error               **error)
+{
+  if (parser->feed_buffer != NULL)
+    return parser->feed_buffer(parser, buffer, error);
+
+  // Discard what was fed, even if a later fragment fails;
+  // pbcrep_buffer_discard() takes at most UINT_MAX at a time.
+  size_t fed = 0;
+  bool ok = true;
+  for (PBCREP_BufferFragment *frag = buffer->first_frag;
+       frag != NULL && ok;
+       frag = frag->next)
+    {
+      ok = parser->feed(parser, frag->buf_length,
+                        frag->buf + frag->buf_start, error);
+      if (ok)
+        fed += frag->buf_length;
+    }
+  while (fed > 0)
+    {
+      unsigned n = fed > UINT_MAX ? UINT_MAX : fed;
+      pbcrep_buffer_discard (buffer, n);
+      fed -= n;
+    }
+  return ok;
+}
+bool
 pbcrep_parser_end_feed   (PBCREP_Parser               *parser,
                           PBCREP_Error               **error)
 {
   return parser->end_feed(parser, error);
 }
 void
+pbcrep_parser_advance    (PBCREP_Parser               *parser)
+{
+  if (parser->advance != NULL)
+    parser->advance(parser, NULL);
+}
+ProtobufCMessage *
+pbcrep_parser_take_message(PBCREP_Parser              *parser)
+{
+  if (parser->free_message == NULL)
+    return NULL;
+  ProtobufCMessage *rv = parser->current_message;
+  parser->current_message = NULL;
+  return rv;
+}
+void
 pbcrep_parser_destroy    (PBCREP_Parser               *parser)
 {
   assert (parser->parser_magic == PBCREP_PARSER_MAGIC_VALUE);
@@ -39,9 +84,13 @@ pbcrep_parser_create_protected (const ProtobufCMessageDescriptor*message_desc,
   rv->parser_magic = PBCREP_PARSER_MAGIC_VALUE;
   rv->content_type = PBCREP_PARSER_CONTENT_TYPE_ANY;
   rv->message_desc = message_desc;
+  rv->current_message = NULL;
   rv->feed = NULL;
+  rv->feed_buffer = NULL;
   rv->end_feed = NULL;
+  rv->advance = NULL;
   rv->destruct = NULL;
+  rv->free_message = NULL;
   return rv;
 }
 
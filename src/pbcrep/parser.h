@@ -6,9 +6,24 @@ bool pbcrep_parser_feed       (PBCREP_Parser               *parser,
                                size_t                       data_length,
                                const uint8_t               *data,
                                PBCREP_Error               **error);
+// Feed the contents of 'buffer' without first copying it into
+// a flat array.  Fed data is removed from 'buffer';  the parser
+// may keep fragments it needs (eg of an incomplete record)
+// by moving them into buffers of its own.
+bool pbcrep_parser_feed_buffer(PBCREP_Parser               *parser,
+                               PBCREP_Buffer               *buffer,
+                               PBCREP_Error               **error);
 bool pbcrep_parser_end_feed   (PBCREP_Parser               *parser,
                                PBCREP_Error               **error);
 void pbcrep_parser_advance    (PBCREP_Parser               *parser);
+
+// Take ownership of parser->current_message, which is then NULL,
+// so that advancing won't free it.  Free the message with the parser's
+// free_message(), which may be done from any thread, even after
+// the parser is destroyed.  Returns NULL if there is no current message
+// or if the parser doesn't implement free_message().
+ProtobufCMessage *
+     pbcrep_parser_take_message(PBCREP_Parser              *parser);
 void pbcrep_parser_destroy    (PBCREP_Parser               *parser);
 
 
@@ -30,11 +45,19 @@ struct PBCREP_Parser {
                      size_t           data_length,
                      const uint8_t   *data,
                      PBCREP_Error   **error);
+  // Optional:  otherwise each fragment is passed to feed() in place.
+  bool  (*feed_buffer)(PBCREP_Parser *parser,
+                     PBCREP_Buffer   *buffer,
+                     PBCREP_Error   **error);
   bool  (*end_feed) (PBCREP_Parser   *parser,
                      PBCREP_Error   **error);
   bool  (*advance)  (PBCREP_Parser   *parser,
                      PBCREP_Error   **error);
   void  (*destruct) (PBCREP_Parser   *parser);
+
+  // Optional:  frees a message taken with pbcrep_parser_take_message().
+  // Must not depend on the parser.
+  void  (*free_message)(ProtobufCMessage *message);
 };
 
 PBCREP_Parser *
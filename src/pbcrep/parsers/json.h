@@ -16,14 +16,26 @@ struct PBCREP_Parser_JSONOptions {
 
   PBCREP_JSON_Dialect json_dialect;
 
+  // initial size of the per-message slab;
+  // 0 means: guess from the message type.
   size_t estimated_message_size;
+
+  // Slabs are resized to cover this percentile of recently
+  // parsed message sizes.  0 disables adaptive sizing,
+  // so the slab stays at estimated_message_size.
+  unsigned slab_size_percentile;
+
+  // adaptive sizing never grows the slab beyond this.
+  size_t max_reusable_slab_size;
 };
 
 #define PBCREP_PARSER_JSON_OPTIONS_INIT                              \
   (PBCREP_Parser_JSONOptions) {                                      \
     64,                     /* max_stack_depth */                    \
     PBCREP_JSON_DIALECT_JSON,                                        \
-    512                     /* estimated_message_size */             \
+    512,                    /* estimated_message_size */             \
+    95,                     /* slab_size_percentile */               \
+    1 << 20                 /* max_reusable_slab_size */             \
   }
 
 
@@ -33,6 +45,83 @@ PBCREP_Parser *
 pbcrep_parser_new_json  (const ProtobufCMessageDescriptor  *message_desc,
                          const PBCREP_Parser_JSONOptions*json_options);
 
+// Like pbcrep_parser_new_json(), but shares a precomputed plan
+// (the parser takes a reference); message_desc is plan->root's.
+PBCREP_Parser *
+pbcrep_parser_new_json_from_plan (PBCREP_Plan                     *plan,
+                                  const PBCREP_Parser_JSONOptions *json_options);
+
 
 bool
 pbcrep_parser_is_json   (PBCREP_Parser *parser);
+
+// The plan a JSON parser was made from (it keeps its reference),
+// and, if options_out is non-NULL, its options.
+PBCREP_Plan *
+pbcrep_parser_json_peek_plan (PBCREP_Parser             *parser,
+                              PBCREP_Parser_JSONOptions *options_out);
+
+
+// === Size Statistics ===
+//
+// The parser keeps lightweight per-field statistics for every message
+// type it encounters.  They are only exposed through
+// pbcrep_parser_json_peek_field_stats(); the per-message slabs are
+// sized from the separate per-message size histogram (note_message_size).
+//
+typedef struct {
+  uint64_t n_occurrences;               // times the field was given
+  uint64_t n_repeated_values;           // total elements (repeated fields)
+  uint64_t max_repeated_values;         // largest array seen
+  uint64_t string_bytes;                // total string/bytes payload
+} PBCREP_Parser_JSONFieldStats;
+
+// Returns an array of desc->n_fields stats (in the order of desc->fields),
+// or NULL if no message of that type has been parsed.
+// The array is owned by the parser and is updated in place.
+const PBCREP_Parser_JSONFieldStats *
+pbcrep_parser_json_peek_field_stats (PBCREP_Parser                    *parser,
+                                     const ProtobufCMessageDescriptor *desc,
+                                     uint64_t                 *n_messages_out);
+
+// The size of the slab that new messages will be parsed into.
+size_t
+pbcrep_parser_json_get_slab_size    (PBCREP_Parser *parser);
+
+
+// === Transcoding to Length-Prefixed Protobuf ===
+//
+// Converts JSON straight to length-prefixed records,
+// encoding the fields as they are parsed, without building
+// ProtobufCMessages.  It accepts the same JSON as the JSON parser,
+// and gives the same records as printing what that returns
+// with the length-prefixed printer, when the fields are given
+// in the order of the descriptor (otherwise, the fields
+// are encoded in the order given).
+//
+typedef struct PBCREP_JSON_Transcoder PBCREP_JSON_Transcoder;
+
+// The transcoder takes a reference to the plan.
+// Returns NULL for an unknown json_dialect.
+PBCREP_JSON_Transcoder *
+pbcrep_json_transcoder_new      (PBCREP_Plan                     *plan,
+                                 const PBCREP_Parser_JSONOptions *json_options,
+                                 PBCREP_LengthPrefixed_Format     lp_format);
+
+// Each record is appended to 'output' once its object is complete.
+bool
+pbcrep_json_transcoder_feed     (PBCREP_JSON_Transcoder *transcoder,
+                                 size_t                  data_length,
+                                 const uint8_t          *data,
+                                 PBCREP_Buffer          *output,
+                                 PBCREP_Error          **error);
+bool
+pbcrep_json_transcoder_end_feed (PBCREP_JSON_Transcoder *transcoder,
+                                 PBCREP_Buffer          *output,
+                                 PBCREP_Error          **error);
+
+uint64_t
+pbcrep_json_transcoder_get_n_records (PBCREP_JSON_Transcoder *transcoder);
+
+void
+pbcrep_json_transcoder_destroy  (PBCREP_JSON_Transcoder *transcoder);
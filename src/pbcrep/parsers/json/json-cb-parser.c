@@ -2171,10 +2171,10 @@ json_callback_parser_feed (JSON_CallbackParser *parser,
     DEBUG_PRINTF(("POP: current depth=%u", parser->stack_depth));\
     assert(parser->stack_depth > 0);                                  \
     DEBUG_PRINTF(("  ... stack-top.is_object=%u", parser->stack_nodes[parser->stack_depth - 1].is_object));       \
-    if (parser->stack_nodes[parser->stack_depth - 1].is_object)       \
-      do_callback_end_object(parser);                                 \
-    else                                                              \
-      do_callback_end_array(parser);                                  \
+    if (parser->stack_nodes[parser->stack_depth - 1].is_object        \
+        ? !do_callback_end_object(parser)                             \
+        : !do_callback_end_array(parser))                             \
+      return false;                                                   \
     --parser->stack_depth;                                            \
     if (parser->stack_depth == 0)                                     \
       GOTO_STATE(INTERIM_EXPECTING_COMMA);                            \
@@ -2257,6 +2257,8 @@ json_callback_parser_feed (JSON_CallbackParser *parser,
 
           CASE(INTERIM_EXPECTING_COMMA):
             SKIP_WS();
+            if (at == end)
+              goto at_end;
             if (*at == ',') 
               {
                 at++;
@@ -2333,7 +2335,8 @@ json_callback_parser_feed (JSON_CallbackParser *parser,
             switch (scan_flat_value (parser, &at, end))
               {
               case SCAN_END:
-                do_callback_flat_value (parser);
+                if (!do_callback_flat_value (parser))
+                  return false;
                 GOTO_STATE(INTERIM_EXPECTING_COMMA);
 
               case SCAN_ERROR:
@@ -2442,7 +2445,8 @@ json_callback_parser_feed (JSON_CallbackParser *parser,
             switch (scan_flat_value (parser, &at, end))
               {
               case SCAN_END:
-                do_callback_object_key (parser);
+                if (!do_callback_object_key (parser))
+                  return false;
                 GOTO_STATE(IN_OBJECT_EXPECTING_COLON);
 
               case SCAN_IN_VALUE:
@@ -2465,13 +2469,15 @@ json_callback_parser_feed (JSON_CallbackParser *parser,
               goto at_end;
             if (IS_SPACE (*at))
               {
-                do_callback_object_key (parser);
+                if (!do_callback_object_key (parser))
+                  return false;
                 at++;
                 GOTO_STATE(IN_OBJECT_EXPECTING_COLON);
               }
             else if (*at == ':')
               {
-                do_callback_object_key (parser);
+                if (!do_callback_object_key (parser))
+                  return false;
                 at++;
                 GOTO_STATE(IN_OBJECT_GOT_COLON);
               }
@@ -2531,7 +2537,8 @@ json_callback_parser_feed (JSON_CallbackParser *parser,
             switch (scan_flat_value (parser, &at, end))
               {
               case SCAN_END:
-                do_callback_flat_value (parser);
+                if (!do_callback_flat_value (parser))
+                  return false;
                 GOTO_STATE(IN_OBJECT_EXPECTING_COMMA);
 
               case SCAN_IN_VALUE:
@@ -2609,7 +2616,8 @@ json_callback_parser_feed (JSON_CallbackParser *parser,
                 do_callback_error (parser);
                 return false;
               case SCAN_END:
-                do_callback_flat_value (parser);
+                if (!do_callback_flat_value (parser))
+                  return false;
                 GOTO_STATE(IN_ARRAY_EXPECTING_COMMA);
 
               case SCAN_IN_VALUE:
@@ -2736,6 +2744,7 @@ json_callback_parser_end_feed (JSON_CallbackParser *parser)
       else
         {
           parser->error_code = JSON_CALLBACK_PARSER_ERROR_TRAILING_COMMA;
+          do_callback_error (parser);
           return false;
         }
         
@@ -2744,23 +2753,28 @@ json_callback_parser_end_feed (JSON_CallbackParser *parser)
         {
           if (flat_value_state_is_string (parser->flat_value_state))
             {
-              do_callback_string(parser);
+              if (!do_callback_string(parser))
+                return false;
             }
           else if (flat_value_state_is_number (parser->flat_value_state))
             {
-              do_callback_number(parser);
+              if (!do_callback_number(parser))
+                return false;
             }
           else if (parser->flat_value_state == FLAT_VALUE_STATE_IN_TRUE && parser->flat_len == 4)
             {
-              do_callback_boolean(parser, true);
+              if (!do_callback_boolean(parser, true))
+                return false;
             }
           else if (parser->flat_value_state == FLAT_VALUE_STATE_IN_FALSE && parser->flat_len == 5)
             {
-              do_callback_boolean(parser, false);
+              if (!do_callback_boolean(parser, false))
+                return false;
             }
           else if (parser->flat_value_state == FLAT_VALUE_STATE_IN_NULL && parser->flat_len == 4)
             {
-              do_callback_null(parser);
+              if (!do_callback_null(parser))
+                return false;
             }
           else
             {
@@ -2771,6 +2785,7 @@ json_callback_parser_end_feed (JSON_CallbackParser *parser)
       else
         {
           parser->error_code = JSON_CALLBACK_PARSER_ERROR_PARTIAL_RECORD;
+          do_callback_error (parser);
           return false;
         }
 
@@ -2788,6 +2803,7 @@ json_callback_parser_end_feed (JSON_CallbackParser *parser)
     case JSON_CALLBACK_PARSER_STATE_IN_OBJECT_GOT_COLON:
     case JSON_CALLBACK_PARSER_STATE_IN_OBJECT_EXPECTING_COMMA:
       parser->error_code = JSON_CALLBACK_PARSER_ERROR_PARTIAL_RECORD;
+      do_callback_error (parser);
       return false;
     }
 
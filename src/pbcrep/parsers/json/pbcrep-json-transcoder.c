@@ -0,0 +1,1026 @@
+/*
+ * JSON to length-prefixed protobuf, without ProtobufCMessages.
+ *
+ * The JSON callbacks walk the plan as they do in the JSON parser,
+ * but each value is encoded as soon as it is seen (tag, then value)
+ * into a flat per-record scratch area, using the tag and type
+ * from its ProtobufCFieldDescriptor.
+ *
+ * The length of a nested message (or of a packed array, or of bytes
+ * given as hex) is not known until it ends, so a one-byte placeholder
+ * is left for it.  When it ends, the length is written there;
+ * in the rare case that it needs more than one byte, the contents
+ * are moved up to make room.  So the encoding is the canonical one:
+ * byte-for-byte what protobuf_c_message_pack() gives for the message
+ * the JSON parser would have returned, as long as the JSON gives
+ * the fields in the order of the descriptor.
+ *
+ * A finished record is appended to the caller's buffer
+ * with its length-prefix.
+ *
+ * JSON values are converted as the JSON parser converts them,
+ * and required fields that are not given get their default values,
+ * as they do there.  A key that is given again replaces its earlier
+ * value, as in the parser:  what was encoded for it is cut out of
+ * the object's fields (which are all complete by then), so that
+ * repeated fields are not appended to, messages are not merged,
+ * and null clears the field.  Likewise a member of a oneof cuts out
+ * the other members given before it.
+ */
+#include "json-cb-parser.h"
+#include "../../../pbcrep.h"
+#include "../../length-prefix.h"
+#include "../../wire-format.h"
+#include <stdlib.h>
+#include <string.h>
+
+#define INITIAL_RECORD_ALLOCED  256
+
+typedef struct {
+  const PBCREP_MessagePlan *plan;
+  const PBCREP_FieldPlan *field_plan;   // the current key's, or NULL
+  size_t start;                         // of this message's fields in 'record'
+
+  bool got_start_array;
+  bool packed;                          // got_start_array for a packed field
+  size_t array_tag_start;               // packed: where its tag begins
+  size_t array_start;                   // packed: where its values begin
+
+  uint64_t *seen;                       // keys given, by field index
+} TranscoderStack;
+
+struct PBCREP_JSON_Transcoder {
+  PBCREP_Plan *plan;
+  PBCREP_LengthPrefixed_Format lp_format;
+  size_t max_length;
+
+  JSON_CallbackParser *json_parser;
+  PBCREP_Error *error;
+  PBCREP_Buffer *output;                // only during feed/end_feed
+
+  // As in the JSON parser:  1 after an unknown key;
+  // beyond that, tracks the depth within its value.
+  unsigned skip_depth;
+
+  unsigned stack_depth;
+  unsigned max_stack_depth;
+  TranscoderStack *stack;
+
+  // Indexed by PBCREP_MessagePlan.index.
+  unsigned *n_required;
+  uint64_t *seen_bits;
+
+  uint8_t *record;
+  size_t record_length;
+  size_t record_alloced;
+
+  uint64_t n_records;
+};
+typedef struct PBCREP_JSON_Transcoder Transcoder;
+
+typedef union {
+  int32_t v_int32;
+  uint32_t v_uint32;
+  int64_t v_int64;
+  uint64_t v_uint64;
+  float v_float;
+  double v_double;
+  protobuf_c_boolean v_boolean;
+} ScalarValue;
+
+static inline void
+maybe_set_error (Transcoder *t, const char *code, const char *msg)
+{
+  if (t->error == NULL)
+    t->error = pbcrep_error_new (code, msg);
+}
+
+/* --- writing the record --- */
+static inline uint8_t *
+record_reserve (Transcoder *t, size_t n)
+{
+  if (PBCREP_UNLIKELY (t->record_length + n > t->record_alloced))
+    {
+      size_t new_alloced = t->record_alloced * 2;
+      while (t->record_length + n > new_alloced)
+        new_alloced *= 2;
+      t->record = pbcrep_realloc (t->record, new_alloced);
+      t->record_alloced = new_alloced;
+    }
+  return t->record + t->record_length;
+}
+
+static inline void
+record_append_varint (Transcoder *t, uint64_t value)
+{
+  uint8_t *at = record_reserve (t, PBCREP_WIRE_MAX_VARINT_SIZE);
+  t->record_length += pbcrep_wire_encode_varint (value, at);
+}
+
+static inline void
+record_append_fixed (Transcoder *t, unsigned size, uint64_t value)
+{
+  uint8_t *at = record_reserve (t, size);
+  for (unsigned i = 0; i < size; i++)
+    at[i] = value >> (8 * i);
+  t->record_length += size;
+}
+
+static inline void
+record_append_tag (Transcoder *t,
+                   const ProtobufCFieldDescriptor *f,
+                   PBCREP_WireType wire_type)
+{
+  record_append_varint (t, ((uint64_t) f->id << 3) | wire_type);
+}
+
+// Leave a byte for a length;  returns where the contents begin.
+static inline size_t
+record_begin_length (Transcoder *t)
+{
+  record_reserve (t, 1);
+  return ++(t->record_length);
+}
+
+// Write the length of everything since 'start'.
+static void
+record_end_length (Transcoder *t, size_t start)
+{
+  size_t length = t->record_length - start;
+  unsigned n = pbcrep_wire_varint_size (length);
+  if (n > 1)
+    {
+      record_reserve (t, n - 1);
+      memmove (t->record + start + n - 1, t->record + start, length);
+      t->record_length += n - 1;
+    }
+  pbcrep_wire_encode_varint (length, t->record + start - 1);
+}
+
+/* --- encoding values --- */
+static inline PBCREP_WireType
+wire_type_from_type (ProtobufCType type)
+{
+  switch (type)
+    {
+    case PROTOBUF_C_TYPE_SFIXED32:
+    case PROTOBUF_C_TYPE_FIXED32:
+    case PROTOBUF_C_TYPE_FLOAT:
+      return PBCREP_WIRE_TYPE_32BIT;
+
+    case PROTOBUF_C_TYPE_SFIXED64:
+    case PROTOBUF_C_TYPE_FIXED64:
+    case PROTOBUF_C_TYPE_DOUBLE:
+      return PBCREP_WIRE_TYPE_64BIT;
+
+    case PROTOBUF_C_TYPE_STRING:
+    case PROTOBUF_C_TYPE_BYTES:
+    case PROTOBUF_C_TYPE_MESSAGE:
+      return PBCREP_WIRE_TYPE_LENGTH_PREFIXED;
+
+    default:
+      return PBCREP_WIRE_TYPE_VARINT;
+    }
+}
+
+// Proto3 fields (outside of oneofs) are not packed if they are zero.
+static inline bool
+field_omits_zero (const ProtobufCFieldDescriptor *f)
+{
+  return f->label == PROTOBUF_C_LABEL_NONE
+      && (f->flags & PROTOBUF_C_FIELD_FLAG_ONEOF) == 0;
+}
+
+static bool
+scalar_is_zero (ProtobufCType type, const void *value)
+{
+  switch (type)
+    {
+    case PROTOBUF_C_TYPE_FLOAT:
+      return * (const float *) value == 0;
+    case PROTOBUF_C_TYPE_DOUBLE:
+      return * (const double *) value == 0;
+    case PROTOBUF_C_TYPE_INT64:
+    case PROTOBUF_C_TYPE_SINT64:
+    case PROTOBUF_C_TYPE_SFIXED64:
+    case PROTOBUF_C_TYPE_UINT64:
+    case PROTOBUF_C_TYPE_FIXED64:
+      return * (const uint64_t *) value == 0;
+    case PROTOBUF_C_TYPE_BOOL:
+      return * (const protobuf_c_boolean *) value == 0;
+    default:
+      return * (const uint32_t *) value == 0;
+    }
+}
+
+// 'value' is laid out as the message member would be.
+static void
+emit_scalar (Transcoder                     *t,
+             const ProtobufCFieldDescriptor *f,
+             bool                            in_packed_array,
+             const void                     *value)
+{
+  if (!in_packed_array)
+    {
+      if (field_omits_zero (f) && scalar_is_zero (f->type, value))
+        return;
+      record_append_tag (t, f, wire_type_from_type (f->type));
+    }
+  switch (f->type)
+    {
+    case PROTOBUF_C_TYPE_INT32:
+    case PROTOBUF_C_TYPE_ENUM:
+      record_append_varint (t, (uint64_t) (int64_t) * (const int32_t *) value);
+      break;
+    case PROTOBUF_C_TYPE_SINT32:
+      record_append_varint (t, pbcrep_wire_zigzag32 (* (const int32_t *) value));
+      break;
+    case PROTOBUF_C_TYPE_UINT32:
+      record_append_varint (t, * (const uint32_t *) value);
+      break;
+    case PROTOBUF_C_TYPE_SFIXED32:
+    case PROTOBUF_C_TYPE_FIXED32:
+    case PROTOBUF_C_TYPE_FLOAT:
+      {
+        uint32_t bits;
+        memcpy (&bits, value, 4);
+        record_append_fixed (t, 4, bits);
+        break;
+      }
+    case PROTOBUF_C_TYPE_INT64:
+    case PROTOBUF_C_TYPE_UINT64:
+      record_append_varint (t, * (const uint64_t *) value);
+      break;
+    case PROTOBUF_C_TYPE_SINT64:
+      record_append_varint (t, pbcrep_wire_zigzag64 (* (const int64_t *) value));
+      break;
+    case PROTOBUF_C_TYPE_SFIXED64:
+    case PROTOBUF_C_TYPE_FIXED64:
+    case PROTOBUF_C_TYPE_DOUBLE:
+      {
+        uint64_t bits;
+        memcpy (&bits, value, 8);
+        record_append_fixed (t, 8, bits);
+        break;
+      }
+    case PROTOBUF_C_TYPE_BOOL:
+      record_append_varint (t, * (const protobuf_c_boolean *) value ? 1 : 0);
+      break;
+    default:
+      assert (0);
+    }
+}
+
+static void
+emit_length_delimited (Transcoder                     *t,
+                       const ProtobufCFieldDescriptor *f,
+                       size_t                          length,
+                       const void                     *data)
+{
+  if (length == 0 && field_omits_zero (f))
+    return;
+  record_append_tag (t, f, PBCREP_WIRE_TYPE_LENGTH_PREFIXED);
+  record_append_varint (t, length);
+  memcpy (record_reserve (t, length), data, length);
+  t->record_length += length;
+}
+
+/* --- keys given --- */
+static inline void
+init_stack_node (TranscoderStack *s,
+                 const PBCREP_MessagePlan *plan, size_t start)
+{
+  s->plan = plan;
+  s->field_plan = NULL;
+  s->start = start;
+  s->got_start_array = false;
+  s->packed = false;
+  memset (s->seen, 0, (plan->n_fields + 63) / 64 * sizeof (uint64_t));
+}
+
+// Cut whatever was encoded for field 'id' out of the object's fields.
+static void
+remove_field (Transcoder *t, TranscoderStack *s, uint32_t id)
+{
+  size_t out = s->start;
+  PBCREP_WireField wf;
+  for (size_t at = s->start; at < t->record_length; at = wf.end)
+    {
+      bool ok = pbcrep_wire_decode_field (t->record_length, t->record, at, &wf);
+      assert (ok);
+      (void) ok;
+      if (wf.number == id)
+        continue;
+      if (out < at)
+        memmove (t->record + out, t->record + at, wf.end - at);
+      out += wf.end - at;
+    }
+  t->record_length = out;
+}
+
+// Setting one member of a oneof unsets the others.
+static void
+forget_oneof (Transcoder *t, TranscoderStack *s,
+              const ProtobufCFieldDescriptor *f)
+{
+  for (unsigned j = 0; j < s->plan->n_fields; j++)
+    {
+      const ProtobufCFieldDescriptor *g = s->plan->fields[j].field;
+      uint64_t bit = (uint64_t) 1 << (j % 64);
+      if ((s->seen[j / 64] & bit) != 0
+       && pbcrep_wire_fields_share_oneof (f, g))
+        {
+          remove_field (t, s, g->id);
+          s->seen[j / 64] &= ~bit;
+        }
+    }
+}
+
+// Encode the defaults of the required fields that were not given,
+// as the message the JSON parser returns would have them.
+static void
+emit_missing_required (Transcoder *t, TranscoderStack *s)
+{
+  unsigned n_required = t->n_required[s->plan->index];
+  for (unsigned i = 0; n_required > 0; i++)
+    {
+      const ProtobufCFieldDescriptor *f = s->plan->fields[i].field;
+      if (f->label != PROTOBUF_C_LABEL_REQUIRED)
+        continue;
+      n_required--;
+      if (s->seen[i / 64] & ((uint64_t) 1 << (i % 64)))
+        continue;
+      const void *member = (const char *) s->plan->default_image + f->offset;
+      switch (f->type)
+        {
+        case PROTOBUF_C_TYPE_STRING:
+          {
+            const char *str = * (const char * const *) member;
+            if (str == NULL)
+              str = "";
+            emit_length_delimited (t, f, strlen (str), str);
+            break;
+          }
+        case PROTOBUF_C_TYPE_BYTES:
+          {
+            const ProtobufCBinaryData *bd = member;
+            emit_length_delimited (t, f, bd->len, bd->data);
+            break;
+          }
+        case PROTOBUF_C_TYPE_MESSAGE:
+          // there is no default message
+          break;
+        default:
+          emit_scalar (t, f, false, member);
+          break;
+        }
+    }
+}
+
+/* --- JSON callbacks --- */
+static inline bool
+skip_value (Transcoder *t)
+{
+  if (t->skip_depth > 0)
+    {
+      if (t->skip_depth == 1)
+        t->skip_depth = 0;
+      return true;
+    }
+  return false;
+}
+
+static bool
+prepare_for_value (Transcoder *t, TranscoderStack *s)
+{
+  if (s->field_plan->field->label == PROTOBUF_C_LABEL_REPEATED
+   && !s->got_start_array)
+    {
+      maybe_set_error (t,
+                       "EXPECTED_LEFT_BRACKET",
+                       "got flat value (string, number, boolean etc) for repeated value");
+      return false;
+    }
+  return true;
+}
+
+static inline void
+done_with_value (TranscoderStack *s)
+{
+  if (!s->got_start_array)
+    s->field_plan = NULL;
+}
+
+static bool
+json__start_object   (void *callback_data)
+{
+  Transcoder *t = callback_data;
+  if (t->skip_depth > 0)
+    {
+      t->skip_depth += 1;
+      return true;
+    }
+  if (t->stack_depth == 0)
+    {
+      t->record_length = 0;
+      init_stack_node (t->stack, t->plan->root, 0);
+      t->stack_depth = 1;
+      return true;
+    }
+
+  TranscoderStack *s = t->stack + t->stack_depth - 1;
+  const ProtobufCFieldDescriptor *f = s->field_plan->field;
+  if (f->type != PROTOBUF_C_TYPE_MESSAGE)
+    {
+      maybe_set_error (t,
+                       "OBJECT_NOT_ALLOWED_FOR_FIELD",
+                       "Only Message Fields may be stored as objects");
+      return false;
+    }
+  if (f->label == PROTOBUF_C_LABEL_REPEATED && !s->got_start_array)
+    {
+      maybe_set_error (t,
+                       "EXPECTED_LEFT_BRACKET",
+                       "got object instead of array for repeated value");
+      return false;
+    }
+  record_append_tag (t, f, PBCREP_WIRE_TYPE_LENGTH_PREFIXED);
+  init_stack_node (s + 1, s->field_plan->message_plan, record_begin_length (t));
+  done_with_value (s);
+  t->stack_depth += 1;
+  return true;
+}
+
+static bool
+json__end_object     (void *callback_data)
+{
+  Transcoder *t = callback_data;
+  if (t->skip_depth > 0)
+    {
+      t->skip_depth -= 1;
+      if (t->skip_depth == 1)
+        t->skip_depth = 0;
+      return true;
+    }
+  TranscoderStack *s = t->stack + t->stack_depth - 1;
+  if (t->n_required[s->plan->index] > 0)
+    emit_missing_required (t, s);
+  --(t->stack_depth);
+  if (t->stack_depth > 0)
+    {
+      record_end_length (t, s->start);
+      return true;
+    }
+
+  if (t->record_length > t->max_length)
+    {
+      if (t->error == NULL)
+        t->error = pbcrep_error_new_printf ("MESSAGE_TOO_LONG",
+                                            "message of %zu bytes does not fit in the length prefix",
+                                            t->record_length);
+      return false;
+    }
+  uint8_t prefix[PBCREP_LENGTH_PREFIX_MAX_SIZE];
+  unsigned prefix_len = pbcrep_length_prefix_encode (t->lp_format, t->record_length, prefix);
+  pbcrep_buffer_append_small (t->output, prefix_len, prefix);
+  pbcrep_buffer_append (t->output, t->record_length, t->record);
+  t->n_records++;
+  return true;
+}
+
+static bool
+json__start_array    (void *callback_data)
+{
+  Transcoder *t = callback_data;
+  if (t->skip_depth > 0)
+    {
+      t->skip_depth++;
+      return true;
+    }
+  if (t->stack_depth == 0)
+    {
+      maybe_set_error (t,
+                       "ARRAY_NOT_ALLOWED_AT_TOPLEVEL",
+                       "Toplevel JSON object must not be array");
+      return false;
+    }
+  TranscoderStack *s = t->stack + t->stack_depth - 1;
+  if (s->got_start_array)
+    {
+      maybe_set_error (t,
+                       "NESTED_ARRAY",
+                       "Arrays erroreously nested");
+      return false;
+    }
+  const ProtobufCFieldDescriptor *f = s->field_plan->field;
+  if (f->label != PROTOBUF_C_LABEL_REPEATED)
+    {
+      maybe_set_error (t,
+                       "NOT_A_REPEATED_FIELD",
+                       "Arrays are only allowed for repeated fields");
+      return false;
+    }
+  s->got_start_array = true;
+  if (f->flags & PROTOBUF_C_FIELD_FLAG_PACKED)
+    {
+      s->packed = true;
+      s->array_tag_start = t->record_length;
+      record_append_tag (t, f, PBCREP_WIRE_TYPE_LENGTH_PREFIXED);
+      s->array_start = record_begin_length (t);
+    }
+  return true;
+}
+
+static bool
+json__end_array      (void *callback_data)
+{
+  Transcoder *t = callback_data;
+  if (t->skip_depth > 0)
+    {
+      t->skip_depth -= 1;
+      if (t->skip_depth == 1)
+        t->skip_depth = 0;
+      return true;
+    }
+  TranscoderStack *s = t->stack + t->stack_depth - 1;
+  assert (s->got_start_array);
+  if (s->packed)
+    {
+      // empty arrays are not packed at all
+      if (t->record_length == s->array_start)
+        t->record_length = s->array_tag_start;
+      else
+        record_end_length (t, s->array_start);
+      s->packed = false;
+    }
+  s->got_start_array = false;
+  s->field_plan = NULL;
+  return true;
+}
+
+static bool
+json__object_key     (unsigned key_length,
+                      const char *key,
+                      void *callback_data)
+{
+  Transcoder *t = callback_data;
+  if (t->skip_depth > 0)
+    {
+      assert (t->skip_depth != 1);
+      return true;
+    }
+  TranscoderStack *s = t->stack + t->stack_depth - 1;
+  assert (s->field_plan == NULL);
+  s->field_plan = pbcrep_message_plan_find_field (s->plan, key_length, key);
+  if (s->field_plan == NULL)
+    {
+      t->skip_depth = 1;
+      return true;
+    }
+  unsigned i = s->field_plan - s->plan->fields;
+  uint64_t bit = (uint64_t) 1 << (i % 64);
+  if (s->field_plan->field->flags & PROTOBUF_C_FIELD_FLAG_ONEOF)
+    forget_oneof (t, s, s->field_plan->field);
+  else if (PBCREP_UNLIKELY (s->seen[i / 64] & bit))
+    remove_field (t, s, s->field_plan->field->id);
+  s->seen[i / 64] |= bit;
+  return true;
+}
+
+// A number (or a string) for a numeric or boolean field.
+static bool
+parse_scalar (Transcoder                     *t,
+              const ProtobufCFieldDescriptor *f,
+              const char                     *text,
+              ScalarValue                    *value_out)
+{
+  char *end;
+  switch (f->type)
+    {
+    case PROTOBUF_C_TYPE_INT32:
+    case PROTOBUF_C_TYPE_SINT32:
+    case PROTOBUF_C_TYPE_SFIXED32:
+      value_out->v_int32 = strtol (text, &end, 0);
+      break;
+    case PROTOBUF_C_TYPE_UINT32:
+    case PROTOBUF_C_TYPE_FIXED32:
+      value_out->v_uint32 = strtoul (text, &end, 0);
+      break;
+    case PROTOBUF_C_TYPE_FLOAT:
+      value_out->v_float = strtod (text, &end);
+      break;
+    case PROTOBUF_C_TYPE_INT64:
+    case PROTOBUF_C_TYPE_SINT64:
+    case PROTOBUF_C_TYPE_SFIXED64:
+      value_out->v_int64 = strtoll (text, &end, 0);
+      break;
+    case PROTOBUF_C_TYPE_UINT64:
+    case PROTOBUF_C_TYPE_FIXED64:
+      value_out->v_uint64 = strtoull (text, &end, 0);
+      break;
+    case PROTOBUF_C_TYPE_DOUBLE:
+      value_out->v_double = strtod (text, &end);
+      break;
+    case PROTOBUF_C_TYPE_BOOL:
+      value_out->v_boolean = strtoul (text, NULL, 0) ? 1 : 0;
+      return true;
+    default:
+      assert (0);
+      return false;
+    }
+  if (end == text)
+    {
+      maybe_set_error (t,
+                       "BAD_NUMBER",
+                       "Numeric value doesn't match Protobuf type");
+      return false;
+    }
+  return true;
+}
+
+static bool
+json__number_value   (unsigned number_length,
+                      const char *number,
+                      void *callback_data)
+{
+  Transcoder *t = callback_data;
+  if (skip_value (t))
+    return true;
+  TranscoderStack *s = t->stack + t->stack_depth - 1;
+  const ProtobufCFieldDescriptor *f = s->field_plan->field;
+  if (!prepare_for_value (t, s))
+    return false;
+
+  ScalarValue value;
+  switch (f->type)
+    {
+    case PROTOBUF_C_TYPE_ENUM:
+      {
+        unsigned long v = strtoul (number, NULL, 0);
+        if (protobuf_c_enum_descriptor_get_value (f->descriptor, v) == NULL)
+          {
+            maybe_set_error (t,
+                             "BAD_ENUM_NUMERIC_VALUE",
+                             "Unknown enum value given as number");
+            return false;
+          }
+        value.v_int32 = v;
+        emit_scalar (t, f, s->packed, &value);
+        break;
+      }
+
+    case PROTOBUF_C_TYPE_STRING:
+      emit_length_delimited (t, f, number_length, number);
+      break;
+
+    case PROTOBUF_C_TYPE_BYTES:
+      maybe_set_error (t,
+                       "BAD_VALUE_FOR_BYTES",
+                       "Bytes field cannot be initialized with a number");
+      return false;
+
+    case PROTOBUF_C_TYPE_MESSAGE:
+      maybe_set_error (t,
+                       "BAD_VALUE_FOR_MESSAGE",
+                       "Message field cannot be initialized with a number");
+      return false;
+
+    default:
+      if (!parse_scalar (t, f, number, &value))
+        return false;
+      emit_scalar (t, f, s->packed, &value);
+      break;
+    }
+  done_with_value (s);
+  return true;
+}
+
+static inline int
+hexdigit_value (char c)
+{
+  if ('0' <= c && c <= '9')
+    return c - '0';
+  if ('a' <= c && c <= 'f')
+    return c - 'a' + 10;
+  if ('A' <= c && c <= 'F')
+    return c - 'A' + 10;
+  return -1;
+}
+
+// Bytes are given as hex, possibly with whitespace.
+static bool
+emit_hex_bytes (Transcoder                     *t,
+                const ProtobufCFieldDescriptor *f,
+                size_t                          string_length,
+                const char                     *string)
+{
+  size_t tag_start = t->record_length;
+  record_append_tag (t, f, PBCREP_WIRE_TYPE_LENGTH_PREFIXED);
+  size_t start = record_begin_length (t);
+  uint8_t *out = record_reserve (t, string_length / 2);
+  const char *end = string + string_length;
+  const char *at = string;
+  while (at < end)
+    {
+      int h = hexdigit_value (at[0]);
+      if (h < 0)
+        {
+          if (*at == ' ' || *at == '\n')
+            {
+              at++;
+              continue;
+            }
+          maybe_set_error (t, "BAD_HEX", "only hex-digits and whitespace allowed");
+          return false;
+        }
+      int h2 = hexdigit_value (at[1]);
+      if (h2 < 0)
+        {
+          maybe_set_error (t, "BAD_HEX", "bad hex digit");
+          return false;
+        }
+      *out++ = (h << 4) | h2;
+      at += 2;
+    }
+  t->record_length = out - t->record;
+  if (t->record_length == start && field_omits_zero (f))
+    t->record_length = tag_start;
+  else
+    record_end_length (t, start);
+  return true;
+}
+
+static bool
+json__string_value   (unsigned string_length,
+                      const char *string,
+                      void *callback_data)
+{
+  Transcoder *t = callback_data;
+  if (skip_value (t))
+    return true;
+  TranscoderStack *s = t->stack + t->stack_depth - 1;
+  const ProtobufCFieldDescriptor *f = s->field_plan->field;
+  if (!prepare_for_value (t, s))
+    return false;
+
+  ScalarValue value;
+  switch (f->type)
+    {
+    case PROTOBUF_C_TYPE_ENUM:
+      {
+        const ProtobufCEnumValue *ev = pbcrep_enum_plan_find_by_name (s->field_plan->enum_plan,
+                                                                      string_length, string);
+        if (ev == NULL)
+          {
+            maybe_set_error (t,
+                             "BAD_ENUM_STRING_VALUE",
+                             "Unknown enum value given as string");
+            return false;
+          }
+        value.v_int32 = ev->value;
+        emit_scalar (t, f, s->packed, &value);
+        break;
+      }
+
+    case PROTOBUF_C_TYPE_STRING:
+      emit_length_delimited (t, f, string_length, string);
+      break;
+
+    case PROTOBUF_C_TYPE_BYTES:
+      if (!emit_hex_bytes (t, f, string_length, string))
+        return false;
+      break;
+
+    case PROTOBUF_C_TYPE_MESSAGE:
+      maybe_set_error (t,
+                       "BAD_VALUE_FOR_MESSAGE",
+                       "Message field cannot be initialized with a string");
+      return false;
+
+    default:
+      if (!parse_scalar (t, f, string, &value))
+        return false;
+      emit_scalar (t, f, s->packed, &value);
+      break;
+    }
+  done_with_value (s);
+  return true;
+}
+
+static bool
+json__boolean_value  (int boolean_value,
+                      void *callback_data)
+{
+  Transcoder *t = callback_data;
+  if (skip_value (t))
+    return true;
+  TranscoderStack *s = t->stack + t->stack_depth - 1;
+  const ProtobufCFieldDescriptor *f = s->field_plan->field;
+  if (!prepare_for_value (t, s))
+    return false;
+
+  ScalarValue value;
+  switch (f->type)
+    {
+    case PROTOBUF_C_TYPE_INT32:
+    case PROTOBUF_C_TYPE_SINT32:
+    case PROTOBUF_C_TYPE_SFIXED32:
+    case PROTOBUF_C_TYPE_UINT32:
+    case PROTOBUF_C_TYPE_FIXED32:
+      value.v_int32 = boolean_value;
+      break;
+    case PROTOBUF_C_TYPE_FLOAT:
+      value.v_float = boolean_value;
+      break;
+    case PROTOBUF_C_TYPE_INT64:
+    case PROTOBUF_C_TYPE_SINT64:
+    case PROTOBUF_C_TYPE_SFIXED64:
+    case PROTOBUF_C_TYPE_UINT64:
+    case PROTOBUF_C_TYPE_FIXED64:
+      value.v_int64 = boolean_value;
+      break;
+    case PROTOBUF_C_TYPE_DOUBLE:
+      value.v_double = boolean_value;
+      break;
+    case PROTOBUF_C_TYPE_BOOL:
+      value.v_boolean = boolean_value;
+      break;
+
+    case PROTOBUF_C_TYPE_ENUM:
+      maybe_set_error (t,
+                       "BAD_ENUM",
+                       "Enum may not be given as boolean");
+      return false;
+
+    case PROTOBUF_C_TYPE_STRING:
+      {
+        const char *str = boolean_value ? "true" : "false";
+        emit_length_delimited (t, f, strlen (str), str);
+        done_with_value (s);
+        return true;
+      }
+
+    case PROTOBUF_C_TYPE_BYTES:
+      maybe_set_error (t,
+                       "BAD_VALUE_FOR_BYTES",
+                       "Bytes field cannot be initialized with a boolean");
+      return false;
+
+    case PROTOBUF_C_TYPE_MESSAGE:
+      maybe_set_error (t,
+                       "BAD_VALUE_FOR_MESSAGE",
+                       "Message field cannot be initialized with a boolean");
+      return false;
+    }
+  emit_scalar (t, f, s->packed, &value);
+  done_with_value (s);
+  return true;
+}
+
+static bool
+json__null_value     (void *callback_data)
+{
+  Transcoder *t = callback_data;
+  if (skip_value (t))
+    return true;
+  TranscoderStack *s = t->stack + t->stack_depth - 1;
+  if (s->field_plan->field->label == PROTOBUF_C_LABEL_REQUIRED)
+    {
+      maybe_set_error (t,
+                       "NULL_NOT_ALLOWED",
+                       "null not allowed for required field");
+      return false;
+    }
+  done_with_value (s);
+  return true;
+}
+
+static void
+json__error          (const JSON_CallbackParser_ErrorInfo *error,
+                      void *callback_data)
+{
+  Transcoder *t = callback_data;
+  maybe_set_error (t, error->code_str, error->message);
+}
+
+#define json__partial_string_value NULL
+#define json__destroy NULL
+
+static JSON_Callbacks json_callbacks = JSON_CALLBACKS_DEF(json__, );
+
+/* --- public API --- */
+PBCREP_JSON_Transcoder *
+pbcrep_json_transcoder_new (PBCREP_Plan                     *plan,
+                            const PBCREP_Parser_JSONOptions *json_options,
+                            PBCREP_LengthPrefixed_Format     lp_format)
+{
+  JSON_CallbackParser_Options cb_parser_options;
+  switch (json_options->json_dialect)
+    {
+      case PBCREP_JSON_DIALECT_JSON:
+        cb_parser_options = JSON_CALLBACK_PARSER_OPTIONS_INIT;
+        break;
+      case PBCREP_JSON_DIALECT_JSON5:
+        cb_parser_options = JSON_CALLBACK_PARSER_OPTIONS_INIT_JSON5;
+        break;
+      default:
+        return NULL;
+    }
+  // Objects never nest deeper than the JSON, so this bounds our stack.
+  cb_parser_options.max_stack_depth = json_options->max_stack_depth;
+
+  Transcoder *t = pbcrep_malloc (sizeof (Transcoder));
+  t->plan = pbcrep_plan_ref (plan);
+  t->lp_format = lp_format;
+  t->max_length = pbcrep_length_prefix_max_length (lp_format);
+  t->json_parser = json_callback_parser_new (&json_callbacks, t, &cb_parser_options);
+  t->error = NULL;
+  t->output = NULL;
+  t->skip_depth = 0;
+  t->stack_depth = 0;
+  t->max_stack_depth = json_options->max_stack_depth;
+  t->stack = pbcrep_malloc (sizeof (TranscoderStack) * t->max_stack_depth);
+
+  unsigned seen_words = 1;
+  t->n_required = pbcrep_malloc (sizeof (unsigned) * plan->n_messages);
+  for (unsigned i = 0; i < plan->n_messages; i++)
+    {
+      const PBCREP_MessagePlan *mplan = plan->messages + i;
+      unsigned n = 0;
+      for (unsigned j = 0; j < mplan->n_fields; j++)
+        if (mplan->fields[j].field->label == PROTOBUF_C_LABEL_REQUIRED)
+          n++;
+      t->n_required[i] = n;
+      if ((mplan->n_fields + 63) / 64 > seen_words)
+        seen_words = (mplan->n_fields + 63) / 64;
+    }
+  t->seen_bits = pbcrep_malloc (sizeof (uint64_t) * seen_words * t->max_stack_depth);
+  for (unsigned i = 0; i < t->max_stack_depth; i++)
+    t->stack[i].seen = t->seen_bits + seen_words * i;
+
+  t->record_alloced = INITIAL_RECORD_ALLOCED;
+  t->record = pbcrep_malloc (t->record_alloced);
+  t->record_length = 0;
+  t->n_records = 0;
+  return t;
+}
+
+bool
+pbcrep_json_transcoder_feed     (PBCREP_JSON_Transcoder *transcoder,
+                                 size_t                  data_length,
+                                 const uint8_t          *data,
+                                 PBCREP_Buffer          *output,
+                                 PBCREP_Error          **error)
+{
+  transcoder->output = output;
+  bool ok = json_callback_parser_feed (transcoder->json_parser, data_length, data);
+  transcoder->output = NULL;
+  if (ok)
+    {
+      assert (transcoder->error == NULL);
+      return true;
+    }
+  assert (transcoder->error != NULL);
+  *error = transcoder->error;
+  transcoder->error = NULL;
+  return false;
+}
+
+bool
+pbcrep_json_transcoder_end_feed (PBCREP_JSON_Transcoder *transcoder,
+                                 PBCREP_Buffer          *output,
+                                 PBCREP_Error          **error)
+{
+  transcoder->output = output;
+  bool ok = json_callback_parser_end_feed (transcoder->json_parser);
+  transcoder->output = NULL;
+  if (ok)
+    {
+      assert (transcoder->error == NULL);
+      return true;
+    }
+  assert (transcoder->error != NULL);
+  *error = transcoder->error;
+  transcoder->error = NULL;
+  return false;
+}
+
+uint64_t
+pbcrep_json_transcoder_get_n_records (PBCREP_JSON_Transcoder *transcoder)
+{
+  return transcoder->n_records;
+}
+
+void
+pbcrep_json_transcoder_destroy  (PBCREP_JSON_Transcoder *transcoder)
+{
+  json_callback_parser_destroy (transcoder->json_parser);
+  if (transcoder->error != NULL)
+    pbcrep_error_destroy (transcoder->error);
+  pbcrep_plan_unref (transcoder->plan);
+  pbcrep_free (transcoder->stack);
+  pbcrep_free (transcoder->n_required);
+  pbcrep_free (transcoder->seen_bits);
+  pbcrep_free (transcoder->record);
+  pbcrep_free (transcoder);
+}
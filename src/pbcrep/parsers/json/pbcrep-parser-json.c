@@ -39,20 +39,27 @@
  * Hopefully we're not "the root of all evil", at least.
  *
  * Each message we return to the user is embedded in a MessageContainer.
- * The point of this structure is to provide a "high-water mark" for memory
- * allocation.  So, whenever a message requires more memory than any prior
- * message using the container, we allocate it on a "trash stack",
- * keeping track of how much memory we needed to avoid allocation.
+ * Everything the message points to is carved out of the container's
+ * reusable slab; whatever doesn't fit goes on a "trash stack"
+ * of individual allocations (extra_list) that is freed when the
+ * container is recycled.
  *
- * When a message is finished, we look to see if it required the trash-stack,
- * and if so, we delete all the recyclable MessageContainers, since they
- * are no longer the right size.
+ * The slab size is not a high-water mark: one giant record would
+ * otherwise bloat every container forever.  Instead, when a message
+ * is finished, its size is noted in a small log-linear histogram,
+ * and the slab is sized to cover a percentile (95th by default)
+ * of recent messages.  Growing happens as soon as the estimate
+ * says so; shrinking only after several consecutive windows of
+ * smaller messages.  The histogram is halved at the end of each window,
+ * so old outliers fade away.
  *
- * This gets stored in the Parser, and when a MessageContainer is
- * recycled and it is smaller than the value in the parser,
- * the slab will be resized (via free and malloc) ----
- * 
- *     * ...
+ * The slab size gets stored in the Parser, and when a MessageContainer is
+ * recycled and its slab is a different size than the value in the parser,
+ * the slab will be resized (via free and malloc).
+ *
+ * Alongside that, we keep per-descriptor, per-field statistics
+ * (occurrences, string bytes, repeated counts), which are cheap
+ * to maintain and are exposed via pbcrep_parser_json_peek_field_stats().
  *
  * We use an overly complex scheme for handling repeated fields;
  * perhaps a simply power-of-two resizing array would be easier.
@@ -81,6 +88,24 @@
 
 #define MESSAGE_ALIGN   8
 
+/* Slab sizes are rounded up to this. */
+#define SLAB_SIZE_GRANULARITY       64
+#define MIN_REUSABLE_SLAB_SIZE      64
+
+/* Messages per estimation window.  During warm-up, we also
+ * re-estimate at every power-of-two message count. */
+#define SLAB_ESTIMATE_WINDOW        128
+
+/* Number of consecutive windows that must suggest a slab
+ * half the current size (or smaller) before we shrink. */
+#define SLAB_SHRINK_WINDOWS         4
+
+/* Histogram buckets: 4 per power-of-two, enough for 32-bit sizes. */
+#define SLAB_HISTOGRAM_SUB_BITS     2
+#define SLAB_HISTOGRAM_N_BUCKETS    128
+
+#define MAX_RECYCLED_CONTAINERS     8
+
 static inline size_t
 sizeof_field_from_type (ProtobufCType type)
 {
@@ -115,9 +140,28 @@ struct RepeatedValueArrayList {
   RepeatedValueArrayList *next;
 };
 
+/* Per-descriptor statistics, indexed by PBCREP_MessagePlan.index. */
+typedef struct DescriptorStats DescriptorStats;
+struct DescriptorStats {
+  uint64_t n_messages;
+  PBCREP_Parser_JSONFieldStats fields[];        // desc->n_fields
+};
+
+typedef struct SlabEstimator {
+  uint32_t histogram[SLAB_HISTOGRAM_N_BUCKETS];
+  unsigned n_in_window;
+  uint64_t n_total;
+  unsigned n_small_windows;
+  unsigned percentile;
+  size_t max_slab_size;
+} SlabEstimator;
+
 typedef struct PBCREP_Parser_JSON_Stack {
   const ProtobufCFieldDescriptor *field_desc;
+  const PBCREP_FieldPlan *field_plan;   // for field_desc
   ProtobufCMessage *message;  // contains field corresponding to field_desc
+  const PBCREP_MessagePlan *plan;       // for message->descriptor
+  DescriptorStats *stats;     // for message->descriptor
   RepeatedValueArrayList *rep_list_backward;
   size_t n_repeated_values;
   bool got_start_array;
@@ -128,6 +172,8 @@ typedef struct PBCREP_Parser_JSON_Stack {
 typedef struct PBCREP_Parser_JSON PBCREP_Parser_JSON;
 struct PBCREP_Parser_JSON {
   PBCREP_Parser base;
+  PBCREP_Plan *plan;
+  PBCREP_Parser_JSONOptions options;
 
   JSON_CallbackParser *json_parser;
   PBCREP_Error *error;
@@ -148,8 +194,12 @@ struct PBCREP_Parser_JSON {
   MessageContainer *last_message;
 
   MessageContainer *message_container_recycling_list;
+  unsigned n_recycled_message_containers;
 
   size_t reusable_slab_size;
+  SlabEstimator slab_estimator;
+
+  DescriptorStats **stats_table;        // plan->n_messages, lazily filled
 
   RepeatedValueArrayList *recycled_repeated_nodes;
 };
@@ -227,6 +277,151 @@ parser_alloc (MessageContainer   *mc,
   return rv;
 }
 
+/* --- Per-descriptor statistics --- */
+static inline DescriptorStats *
+get_descriptor_stats (PBCREP_Parser_JSON *p,
+                      const PBCREP_MessagePlan *mplan)
+{
+  DescriptorStats *at = p->stats_table[mplan->index];
+  if (PBCREP_LIKELY (at != NULL))
+    return at;
+
+  size_t size = sizeof (DescriptorStats)
+              + sizeof (PBCREP_Parser_JSONFieldStats) * mplan->n_fields;
+  at = pbcrep_malloc (size);
+  memset (at, 0, size);
+  p->stats_table[mplan->index] = at;
+  return at;
+}
+
+static inline PBCREP_Parser_JSONFieldStats *
+field_stats (PBCREP_Parser_JSON_Stack *s)
+{
+  return s->stats->fields + (s->field_plan - s->plan->fields);
+}
+
+/* --- Slab size estimation --- */
+
+/* Log-linear bucketing: values 0..3 are exact,
+ * after that there are 4 buckets per power-of-two. */
+static inline unsigned
+histogram_bucket (size_t size)
+{
+  if (size > UINT32_MAX)
+    size = UINT32_MAX;
+  if (size < (1 << SLAB_HISTOGRAM_SUB_BITS))
+    return size;
+  unsigned msb = 31 - __builtin_clz ((uint32_t) size);
+  unsigned sub = (size >> (msb - SLAB_HISTOGRAM_SUB_BITS))
+               & ((1 << SLAB_HISTOGRAM_SUB_BITS) - 1);
+  return ((msb - SLAB_HISTOGRAM_SUB_BITS + 1) << SLAB_HISTOGRAM_SUB_BITS) + sub;
+}
+
+/* largest size that falls in the bucket */
+static inline size_t
+histogram_bucket_max (unsigned bucket)
+{
+  if (bucket < (1 << SLAB_HISTOGRAM_SUB_BITS))
+    return bucket;
+  unsigned msb = (bucket >> SLAB_HISTOGRAM_SUB_BITS) + SLAB_HISTOGRAM_SUB_BITS - 1;
+  size_t sub = bucket & ((1 << SLAB_HISTOGRAM_SUB_BITS) - 1);
+  size_t shift = msb - SLAB_HISTOGRAM_SUB_BITS;
+  return ((((size_t) 1 << SLAB_HISTOGRAM_SUB_BITS) + sub + 1) << shift) - 1;
+}
+
+static size_t
+slab_estimator_percentile (const SlabEstimator *e)
+{
+  uint64_t total = 0;
+  for (unsigned i = 0; i < SLAB_HISTOGRAM_N_BUCKETS; i++)
+    total += e->histogram[i];
+  if (total == 0)
+    return 0;
+  uint64_t threshold = (total * e->percentile + 99) / 100;
+  uint64_t cumulative = 0;
+  for (unsigned i = 0; i < SLAB_HISTOGRAM_N_BUCKETS; i++)
+    {
+      cumulative += e->histogram[i];
+      if (cumulative >= threshold)
+        return histogram_bucket_max (i);
+    }
+  return histogram_bucket_max (SLAB_HISTOGRAM_N_BUCKETS - 1);
+}
+
+/* Called when a toplevel message is finished, with the number
+ * of slab bytes it needed (including any overflow to the trash-stack). */
+static void
+note_message_size (PBCREP_Parser_JSON *p, size_t used)
+{
+  SlabEstimator *e = &p->slab_estimator;
+  if (e->percentile == 0)
+    return;
+
+  e->histogram[histogram_bucket (used)] += 1;
+  e->n_in_window += 1;
+  e->n_total += 1;
+
+  bool window_done = e->n_in_window >= SLAB_ESTIMATE_WINDOW;
+  bool warming_up = e->n_total < SLAB_ESTIMATE_WINDOW
+                 && (e->n_total & (e->n_total - 1)) == 0;
+  if (!window_done && !warming_up)
+    return;
+
+  size_t target = slab_estimator_percentile (e);
+  target = (target + SLAB_SIZE_GRANULARITY - 1) & ~(size_t)(SLAB_SIZE_GRANULARITY - 1);
+  if (target < MIN_REUSABLE_SLAB_SIZE)
+    target = MIN_REUSABLE_SLAB_SIZE;
+  if (target > e->max_slab_size)
+    target = e->max_slab_size;
+
+  if (target > p->reusable_slab_size)
+    {
+      DEBUG("growing reusable slab %u => %u\n", (unsigned) p->reusable_slab_size, (unsigned) target);
+      p->reusable_slab_size = target;
+      e->n_small_windows = 0;
+    }
+  else if (window_done && target * 2 <= p->reusable_slab_size)
+    {
+      if (++e->n_small_windows >= SLAB_SHRINK_WINDOWS)
+        {
+          DEBUG("shrinking reusable slab %u => %u\n", (unsigned) p->reusable_slab_size, (unsigned) target);
+          p->reusable_slab_size = target;
+          e->n_small_windows = 0;
+        }
+    }
+  else if (window_done)
+    e->n_small_windows = 0;
+
+  if (window_done)
+    {
+      // decay, so that old outliers are forgotten.
+      for (unsigned i = 0; i < SLAB_HISTOGRAM_N_BUCKETS; i++)
+        e->histogram[i] >>= 1;
+      e->n_in_window = 0;
+    }
+}
+
+static void
+recycle_message_container (PBCREP_Parser_JSON *p, MessageContainer *mc)
+{
+  if (p->n_recycled_message_containers >= MAX_RECYCLED_CONTAINERS)
+    {
+      free_message_container (mc);
+      return;
+    }
+  ExtraAllocationListNode *extra = mc->extra_list;
+  while (extra != NULL)
+    {
+      ExtraAllocationListNode *next = extra->next;
+      pbcrep_free (extra);
+      extra = next;
+    }
+  mc->extra_list = NULL;
+  mc->queue_next = p->message_container_recycling_list;
+  p->message_container_recycling_list = mc;
+  p->n_recycled_message_containers++;
+}
+
 static inline RepeatedValueArrayList *
 parser_allocate_repeated_value_array_list_node (PBCREP_Parser_JSON *parser)
 {
@@ -363,6 +558,7 @@ json__start_object   (void *callback_data)
       else
         {
           p->message_container_recycling_list = mc->queue_next;
+          p->n_recycled_message_containers--;
           if (PBCREP_UNLIKELY(mc->reusable_slab_size != p->reusable_slab_size))
             {
               pbcrep_free (mc->reusable_slab);
@@ -376,9 +572,13 @@ json__start_object   (void *callback_data)
       p->in_progress = mc;
 
       p->stack[0].message = &mc->message;
-      protobuf_c_message_init (p->base.message_desc, p->stack[0].message);
+      pbcrep_message_plan_init_message (p->plan->root, p->stack[0].message);
       DEBUG("ALLOCATED MESSAGE %p at stack depth 0 named %s\n", p->stack[0].message, p->base.message_desc->name);
       p->stack[0].field_desc = NULL;
+      p->stack[0].field_plan = NULL;
+      p->stack[0].plan = p->plan->root;
+      p->stack[0].stats = get_descriptor_stats (p, p->plan->root);
+      p->stack[0].stats->n_messages++;
       p->stack[0].rep_list_backward = NULL;
       p->stack[0].n_repeated_values = 0;
       p->stack[0].got_start_array = false;
@@ -404,11 +604,16 @@ json__start_object   (void *callback_data)
               return false;
             }
         }
-      const ProtobufCMessageDescriptor *md = s->field_desc->descriptor;
+      const PBCREP_MessagePlan *mplan = s->field_plan->message_plan;
+      const ProtobufCMessageDescriptor *md = mplan->descriptor;
       s[1].message = parser_alloc (p->in_progress, md->sizeof_message, MESSAGE_ALIGN);
       DEBUG("ALLOCATED MESSAGE %p at stack depth %u (%s)\n", s[1].message, p->stack_depth, md->name);
-      protobuf_c_message_init (md, s[1].message);
+      pbcrep_message_plan_init_message (mplan, s[1].message);
       s[1].field_desc = NULL;
+      s[1].field_plan = NULL;
+      s[1].plan = mplan;
+      s[1].stats = get_descriptor_stats (p, mplan);
+      s[1].stats->n_messages++;
       s[1].n_repeated_values = 0;
       s[1].rep_list_backward = NULL;
       s[1].got_start_array = false;
@@ -439,6 +644,7 @@ json__end_object     (void *callback_data)
     {
       MessageContainer *mc = p->in_progress;
       p->in_progress = NULL;
+      note_message_size (p, mc->used);
       if (p->last_message == NULL)
         p->first_message = mc;
       else
@@ -566,6 +772,11 @@ json__end_array      (void *callback_data)
       memcpy (contig_at, partial + 1, n_partial_elts * sizeof_elt);
       parser_free_repeated_value_array_list_node (p, partial);
     }
+  PBCREP_Parser_JSONFieldStats *fs = field_stats (s);
+  fs->n_repeated_values += s->n_repeated_values;
+  if (s->n_repeated_values > fs->max_repeated_values)
+    fs->max_repeated_values = s->n_repeated_values;
+
   s->field_desc = NULL;
   s->n_repeated_values = 0;
 
@@ -578,7 +789,6 @@ json__object_key     (unsigned key_length,
                       void *callback_data)
 {
   PBCREP_Parser_JSON *p = callback_data;
-  (void) key_length;
   DEBUG("json: object_key=%s\n", key);
   if (p->skip_depth > 0)
     {
@@ -596,13 +806,16 @@ json__object_key     (unsigned key_length,
   DEBUG("looking for field %s in message %p desc %p\n", key, message, msg_desc);
   assert(msg_desc->magic == PROTOBUF_C__MESSAGE_DESCRIPTOR_MAGIC);
   assert (s->field_desc == NULL);
-  const ProtobufCFieldDescriptor *field_desc = protobuf_c_message_descriptor_get_field_by_name (msg_desc, key);
-  if (field_desc == NULL)
+  const PBCREP_FieldPlan *field_plan = pbcrep_message_plan_find_field (s->plan, key_length, key);
+  if (field_plan == NULL)
     {
       p->skip_depth = 1;
       return true;
     }
+  const ProtobufCFieldDescriptor *field_desc = field_plan->field;
   s->field_desc = field_desc;
+  s->field_plan = field_plan;
+  field_stats (s)->n_occurrences++;
   DEBUG("field_desc: name=%s offset=%u qoffset=%u type=%u label=%u\n",field_desc->name, field_desc->offset, field_desc->quantifier_offset, field_desc->type, field_desc->label);
   return true;
 }
@@ -791,9 +1004,10 @@ static bool
 parse_string_to_value (PBCREP_Parser_JSON *p,
                        size_t string_length,
                        const char *string,
-                       const ProtobufCFieldDescriptor *f,
+                       const PBCREP_FieldPlan *fp,
                        void *value_out)
 {
+  const ProtobufCFieldDescriptor *f = fp->field;
   char *end;
   switch (f->type)
     {
@@ -867,8 +1081,7 @@ parse_string_to_value (PBCREP_Parser_JSON *p,
 
     case PROTOBUF_C_TYPE_ENUM:
       {
-        const ProtobufCEnumDescriptor *ed = f->descriptor;
-        const ProtobufCEnumValue *ev = protobuf_c_enum_descriptor_get_value_by_name (ed, string);
+        const ProtobufCEnumValue *ev = pbcrep_enum_plan_find_by_name (fp->enum_plan, string_length, string);
         if (ev == NULL)
           {
             maybe_set_error (p,
@@ -960,8 +1173,10 @@ json__string_value   (unsigned string_length,
   if (value == NULL)
     return false;
 
-  if (!parse_string_to_value (p, string_length, string, f, value))
+  if (!parse_string_to_value (p, string_length, string, s->field_plan, value))
     return false;
+  if (f->type == PROTOBUF_C_TYPE_STRING || f->type == PROTOBUF_C_TYPE_BYTES)
+    field_stats (s)->string_bytes += string_length;
   if (!done_with_value (p, s))
     return false;
   return true;
@@ -1151,6 +1366,42 @@ pbc_parser_json_end_feed (PBCREP_Parser      *parser,
 
 }
 
+static inline MessageContainer *
+container_from_message (ProtobufCMessage *message)
+{
+  return (MessageContainer *) ((char *) message - offsetof (MessageContainer, message));
+}
+
+static bool
+pbc_parser_json_advance (PBCREP_Parser      *parser,
+                         PBCREP_Error      **error)
+{
+  PBCREP_Parser_JSON *p = (PBCREP_Parser_JSON *) parser;
+  (void) error;
+  if (parser->current_message != NULL)
+    {
+      recycle_message_container (p, container_from_message (parser->current_message));
+      parser->current_message = NULL;
+    }
+  if (p->first_message != NULL)
+    {
+      MessageContainer *mc = p->first_message;
+      p->first_message = mc->queue_next;
+      if (p->first_message == NULL)
+        p->last_message = NULL;
+      mc->queue_next = NULL;
+      parser->current_message = &mc->message;
+    }
+  return true;
+}
+
+// Taken messages aren't recycled:  they may be freed on another thread.
+static void
+pbc_parser_json_free_message (ProtobufCMessage *message)
+{
+  free_message_container (container_from_message (message));
+}
+
 static void
 pbc_parser_json_destruct (PBCREP_Parser      *parser)
 {
@@ -1176,6 +1427,19 @@ pbc_parser_json_destruct (PBCREP_Parser      *parser)
       free_message_container (p->first_message);
       p->first_message = mc;
     }
+  if (parser->current_message != NULL)
+    free_message_container (container_from_message (parser->current_message));
+  while (p->message_container_recycling_list != NULL)
+    {
+      MessageContainer *mc = p->message_container_recycling_list->queue_next;
+      free_message_container (p->message_container_recycling_list);
+      p->message_container_recycling_list = mc;
+    }
+
+  for (unsigned i = 0; i < p->plan->n_messages; i++)
+    pbcrep_free (p->stats_table[i]);
+  pbcrep_free (p->stats_table);
+  pbcrep_plan_unref (p->plan);
 
   while (p->recycled_repeated_nodes != NULL)
     {
@@ -1193,9 +1457,19 @@ PBCREP_Parser *
 pbcrep_parser_new_json  (const ProtobufCMessageDescriptor  *message_desc,
                          const PBCREP_Parser_JSONOptions   *json_options)
 {
+  PBCREP_Plan *plan = pbcrep_plan_new (message_desc);
+  PBCREP_Parser *rv = pbcrep_parser_new_json_from_plan (plan, json_options);
+  pbcrep_plan_unref (plan);
+  return rv;
+}
+
+PBCREP_Parser *
+pbcrep_parser_new_json_from_plan (PBCREP_Plan                     *plan,
+                                  const PBCREP_Parser_JSONOptions *json_options)
+{
+  const ProtobufCMessageDescriptor *message_desc = plan->root->descriptor;
   size_t size = sizeof (PBCREP_Parser_JSON)
-              + sizeof (PBCREP_Parser_JSON_Stack) * json_options->max_stack_depth
-              + json_options->estimated_message_size;
+              + sizeof (PBCREP_Parser_JSON_Stack) * json_options->max_stack_depth;
 
   JSON_CallbackParser_Options cb_parser_options;
   switch (json_options->json_dialect)
@@ -1212,13 +1486,17 @@ pbcrep_parser_new_json  (const ProtobufCMessageDescriptor  *message_desc,
 
   PBCREP_Parser *parser = pbcrep_parser_create_protected (message_desc, size);
   PBCREP_Parser_JSON *p = (PBCREP_Parser_JSON *) parser;
+  p->plan = pbcrep_plan_ref (plan);
+  p->options = *json_options;
   p->json_parser = json_callback_parser_new (&json_callbacks,
                                              parser,
                                              &cb_parser_options);
 
   parser->feed = pbc_parser_json_feed;
   parser->end_feed = pbc_parser_json_end_feed;
+  parser->advance = pbc_parser_json_advance;
   parser->destruct = pbc_parser_json_destruct;
+  parser->free_message = pbc_parser_json_free_message;
 
   p->error = NULL;
   p->in_progress = p->first_message = p->last_message = NULL;
@@ -1233,8 +1511,25 @@ pbcrep_parser_new_json  (const ProtobufCMessageDescriptor  *message_desc,
   p->stack = (PBCREP_Parser_JSON_Stack *) (p + 1);
 
   p->recycled_repeated_nodes = NULL;
-  p->reusable_slab_size = INITIAL_REUSABLE_SLAB_SIZE;
+  p->reusable_slab_size = json_options->estimated_message_size > 0
+                        ? json_options->estimated_message_size
+                        : plan->root->estimated_slab_size > 0
+                        ? (plan->root->estimated_slab_size + SLAB_SIZE_GRANULARITY - 1)
+                          & ~(size_t) (SLAB_SIZE_GRANULARITY - 1)
+                        : INITIAL_REUSABLE_SLAB_SIZE;
   p->message_container_recycling_list = NULL;
+  p->n_recycled_message_containers = 0;
+
+  memset (&p->slab_estimator, 0, sizeof (SlabEstimator));
+  p->slab_estimator.percentile = json_options->slab_size_percentile > 100
+                               ? 100
+                               : json_options->slab_size_percentile;
+  p->slab_estimator.max_slab_size = json_options->max_reusable_slab_size;
+  if (p->slab_estimator.max_slab_size < p->reusable_slab_size)
+    p->slab_estimator.max_slab_size = p->reusable_slab_size;
+
+  p->stats_table = pbcrep_malloc (sizeof (DescriptorStats *) * plan->n_messages);
+  memset (p->stats_table, 0, sizeof (DescriptorStats *) * plan->n_messages);
 
   return parser;
 } 
@@ -1244,3 +1539,41 @@ pbcrep_parser_is_json (PBCREP_Parser *parser)
 {
   return parser->feed == pbc_parser_json_feed;
 }
+
+PBCREP_Plan *
+pbcrep_parser_json_peek_plan (PBCREP_Parser             *parser,
+                              PBCREP_Parser_JSONOptions *options_out)
+{
+  assert (pbcrep_parser_is_json (parser));
+  PBCREP_Parser_JSON *p = (PBCREP_Parser_JSON *) parser;
+  if (options_out != NULL)
+    *options_out = p->options;
+  return p->plan;
+}
+
+const PBCREP_Parser_JSONFieldStats *
+pbcrep_parser_json_peek_field_stats (PBCREP_Parser                    *parser,
+                                     const ProtobufCMessageDescriptor *desc,
+                                     uint64_t                 *n_messages_out)
+{
+  assert (pbcrep_parser_is_json (parser));
+  PBCREP_Parser_JSON *p = (PBCREP_Parser_JSON *) parser;
+  const PBCREP_MessagePlan *mplan = pbcrep_plan_get_message_plan (p->plan, desc);
+  DescriptorStats *at = mplan != NULL ? p->stats_table[mplan->index] : NULL;
+  if (at != NULL)
+    {
+      if (n_messages_out != NULL)
+        *n_messages_out = at->n_messages;
+      return at->fields;
+    }
+  if (n_messages_out != NULL)
+    *n_messages_out = 0;
+  return NULL;
+}
+
+size_t
+pbcrep_parser_json_get_slab_size (PBCREP_Parser *parser)
+{
+  assert (pbcrep_parser_is_json (parser));
+  return ((PBCREP_Parser_JSON *) parser)->reusable_slab_size;
+}
@@ -20,3 +20,27 @@ PBCREP_Parser *pbcrep_parser_new_length_prefixed
 void pbcrep_parser_length_prefixed_set_format
                                  (PBCREP_Parser *parser,
                                   PBCREP_LengthPrefixed_Format format);
+
+//
+// pbcrep_parser_is_length_prefixed()
+//
+// Whether 'parser' came from pbcrep_parser_new_length_prefixed()
+// (and is not in validate-only mode), and if so, its current format.
+//
+bool pbcrep_parser_is_length_prefixed
+                                 (PBCREP_Parser *parser,
+                                  PBCREP_LengthPrefixed_Format *format_out);
+
+//
+// pbcrep_parser_length_prefixed_set_validate_only()
+//
+// In validate-only mode, records are checked with pbcrep_validate_wire()
+// instead of being unpacked:  nothing is allocated per record and
+// no messages are produced.  Feeding fails at the first invalid record.
+// pbcrep_parser_length_prefixed_get_n_validated() counts the valid ones.
+//
+void pbcrep_parser_length_prefixed_set_validate_only
+                                 (PBCREP_Parser *parser,
+                                  bool           validate_only);
+uint64_t pbcrep_parser_length_prefixed_get_n_validated
+                                 (PBCREP_Parser *parser);
@@ -1,288 +1,200 @@
 #include "../../../pbcrep.h"
+#include "../../length-prefix.h"
 #include <string.h>
 #include <stdlib.h>
+#include <limits.h>
 
-#define LENBUF_SIZE 12
-
+/* Records are unpacked straight from the data they arrive in,
+ * when they lie in one piece in it (one fed array, or one fragment
+ * of a fed buffer).  Only a record that's split between feeds
+ * or fragments is copied:  its first part waits in 'pending'
+ * (which takes the fragments of fed buffers without copying them),
+ * and the whole record is gathered into 'buf' to unpack it.
+ */
 typedef struct PBCREP_Parser_LengthPrefixed PBCREP_Parser_LengthPrefixed;
 struct PBCREP_Parser_LengthPrefixed {
   PBCREP_Parser base;
-  uint8_t lenbuf[LENBUF_SIZE];
-  uint8_t lenbuf_len;
   PBCREP_LengthPrefixed_Format lp_format;
-  bool in_length_prefix;
+  PBCREP_Unpacker *unpacker;
+
+  // See pbcrep_parser_length_prefixed_set_validate_only().
+  bool validate_only;
+  uint64_t n_validated;
+
+  // An incomplete record, with its length-prefix.
+  PBCREP_Buffer pending;
 
-  size_t length_from_prefix;
-  size_t buf_alloced, buf_length;
+  size_t buf_alloced;
   uint8_t *buf;
+
+  // Unpacked messages not yet returned by advance():
+  // queue[queue_start..queue_length).
+  ProtobufCMessage **queue;
+  unsigned queue_start, queue_length, queue_alloced;
 };
 
-static void *
-PBCREP_LP_alloc (void *d, size_t s)
+// Messages are unpacked into arenas independent of the parser,
+// so taken messages can be freed anywhere.
+static void
+length_prefixed__free_message (ProtobufCMessage *message)
 {
-  (void) d;
-  return pbcrep_malloc (s);
+  pbcrep_unpacker_free_message (message);
 }
-static void
-PBCREP_LP_free (void *d, void *ptr)
+
+// Returns the size of the prefix, 0 if it is incomplete, or -1 on error.
+static int
+read_prefix (PBCREP_Parser_LengthPrefixed *lp,
+             size_t                        avail,
+             const uint8_t                *data,
+             size_t                       *length_out,
+             PBCREP_Error                **error)
 {
-  (void) d;
-  pbcrep_free (ptr);
+  int rv = pbcrep_length_prefix_decode (lp->lp_format, avail, data, length_out);
+  if (rv < 0)
+    {
+      *error = pbcrep_error_new (
+        "BAD_B128",
+        "overlong or bad B128-encoded length-prefix"
+      );
+      return -1;
+    }
+  if (rv > 0 && *length_out > UINT_MAX - PBCREP_LENGTH_PREFIX_MAX_SIZE)
+    {
+      *error = pbcrep_error_new_printf (
+        "RECORD_TOO_LONG",
+        "length-prefix gives a record of %llu bytes",
+        (unsigned long long) *length_out
+      );
+      return -1;
+    }
+  return rv;
 }
 
-/* TODO: optimize by providing different feed implementations for
- * each LengthPrefixFormat.
- */
 static bool
-length_prefixed__feed     (PBCREP_Parser      *parser,
-                           size_t              data_length,
-                           const uint8_t      *data,
-                           PBCREP_Error      **error)
+unpack_record (PBCREP_Parser_LengthPrefixed *lp,
+               size_t                        length,
+               const uint8_t                *data,
+               PBCREP_Error                **error)
 {
-  PBCREP_Parser_LengthPrefixed *lp = (PBCREP_Parser_LengthPrefixed*) parser;
-  if (lp->in_length_prefix)
-    goto in_length_prefix;
-  else
-    goto in_data;
-
-in_length_prefix:
-  switch (lp->lp_format)
+  if (lp->validate_only)
     {
-    case PBCREP_LENGTH_PREFIXED_UINT8:
-      if (data_length == 0)
-        {
-          lp->in_length_prefix = true;
-          return true;
-        }
-      lp->length_from_prefix = *data;
-      data++;
-      data_length--;
-      goto in_data;
-
-    case PBCREP_LENGTH_PREFIXED_UINT16_LE:
-      if (data_length + lp->lenbuf_len < 2)
-        {
-          memcpy (lp->lenbuf + lp->lenbuf_len, data, data_length);
-          lp->lenbuf_len += data_length;
-          lp->in_length_prefix = true;
-          return true;
-        }
-      else
-        {
-          unsigned copy = 2 - lp->lenbuf_len;
-          memcpy (lp->lenbuf + lp->lenbuf_len, data, copy);
-          lp->length_from_prefix = (uint16_t)lp->lenbuf[0]
-                                 | ((uint16_t)lp->lenbuf[1] << 8);
-          data += copy;
-          data_length -= copy;
-          goto in_data;
-        }
+      if (!pbcrep_validate_wire (lp->base.message_desc, length, data, error))
+        return false;
+      lp->n_validated++;
+      return true;
+    }
 
-    case PBCREP_LENGTH_PREFIXED_UINT24_LE:
-      if (data_length + lp->lenbuf_len < 3)
-        {
-          memcpy (lp->lenbuf + lp->lenbuf_len, data, data_length);
-          lp->lenbuf_len += data_length;
-          lp->in_length_prefix = true;
-          return true;
-        }
-      else
-        {
-          unsigned copy = 3 - lp->lenbuf_len;
-          memcpy (lp->lenbuf + lp->lenbuf_len, data, copy);
-          lp->length_from_prefix = (uint32_t)lp->lenbuf[0]
-                                 | ((uint32_t)lp->lenbuf[1] << 8)
-                                 | ((uint32_t)lp->lenbuf[2] << 16);
-          data += copy;
-          data_length -= copy;
-          goto in_data;
-        }
+  ProtobufCMessage *msg = pbcrep_unpacker_unpack (lp->unpacker, length, data, error);
+  if (msg == NULL)
+    return false;
+  if (lp->queue_length == lp->queue_alloced)
+    {
+      lp->queue_alloced = lp->queue_alloced ? lp->queue_alloced * 2 : 16;
+      lp->queue = pbcrep_realloc (lp->queue,
+                                  sizeof (ProtobufCMessage *) * lp->queue_alloced);
+    }
+  lp->queue[lp->queue_length++] = msg;
+  return true;
+}
 
-    case PBCREP_LENGTH_PREFIXED_UINT32_LE:
-      if (data_length + lp->lenbuf_len < 4)
-        {
-          memcpy (lp->lenbuf + lp->lenbuf_len, data, data_length);
-          lp->lenbuf_len += data_length;
-          lp->in_length_prefix = true;
-          return true;
-        }
-      else
-        {
-          unsigned copy = 4 - lp->lenbuf_len;
-          memcpy (lp->lenbuf + lp->lenbuf_len, data, copy);
-          lp->length_from_prefix = (uint32_t)lp->lenbuf[0]
-                                 | ((uint32_t)lp->lenbuf[1] << 8)
-                                 | ((uint32_t)lp->lenbuf[2] << 16)
-                                 | ((uint32_t)lp->lenbuf[3] << 24);
-          data += copy;
-          data_length -= copy;
-          goto in_data;
-        }
-    case PBCREP_LENGTH_PREFIXED_UINT16_BE:
-      if (data_length + lp->lenbuf_len < 2)
-        {
-          memcpy (lp->lenbuf + lp->lenbuf_len, data, data_length);
-          lp->lenbuf_len += data_length;
-          lp->in_length_prefix = true;
-          return true;
-        }
-      else
-        {
-          unsigned copy = 2 - lp->lenbuf_len;
-          memcpy (lp->lenbuf + lp->lenbuf_len, data, copy);
-          lp->length_from_prefix = (uint16_t)lp->lenbuf[1]
-                                 | ((uint16_t)lp->lenbuf[0] << 8);
-          data += copy;
-          data_length -= copy;
-          goto in_data;
-        }
+// Unpack every complete record in lp->pending.
+static bool
+process_pending (PBCREP_Parser_LengthPrefixed *lp,
+                 PBCREP_Error                **error)
+{
+  for (;;)
+    {
+      uint8_t prefix[PBCREP_LENGTH_PREFIX_MAX_SIZE];
+      unsigned avail = pbcrep_buffer_peek (&lp->pending, sizeof (prefix), prefix);
+      size_t length;
+      int prefix_len = read_prefix (lp, avail, prefix, &length, error);
+      if (prefix_len < 0)
+        return false;
+      if (prefix_len == 0 || lp->pending.size - prefix_len < length)
+        return true;
 
-    case PBCREP_LENGTH_PREFIXED_UINT24_BE:
-      if (data_length + lp->lenbuf_len < 3)
+      PBCREP_BufferFragment *frag = lp->pending.first_frag;
+      bool ok;
+      if (frag->buf_length >= prefix_len + length)
         {
-          memcpy (lp->lenbuf + lp->lenbuf_len, data, data_length);
-          lp->lenbuf_len += data_length;
-          lp->in_length_prefix = true;
-          return true;
+          ok = unpack_record (lp, length,
+                              frag->buf + frag->buf_start + prefix_len,
+                              error);
+          pbcrep_buffer_discard (&lp->pending, prefix_len + length);
         }
       else
         {
-          unsigned copy = 3 - lp->lenbuf_len;
-          memcpy (lp->lenbuf + lp->lenbuf_len, data, copy);
-          lp->length_from_prefix = (uint32_t)lp->lenbuf[2]
-                                 | ((uint32_t)lp->lenbuf[1] << 8)
-                                 | ((uint32_t)lp->lenbuf[0] << 16);
-          data += copy;
-          data_length -= copy;
-          goto in_data;
-        }
-    case PBCREP_LENGTH_PREFIXED_UINT32_BE:
-      if (data_length + lp->lenbuf_len < 4)
-        {
-          memcpy (lp->lenbuf + lp->lenbuf_len, data, data_length);
-          lp->lenbuf_len += data_length;
-          lp->in_length_prefix = true;
-          return true;
-        }
-      else
-        {
-          unsigned copy = 4 - lp->lenbuf_len;
-          memcpy (lp->lenbuf + lp->lenbuf_len, data, copy);
-          lp->length_from_prefix = (uint32_t)lp->lenbuf[3]
-                                 | ((uint32_t)lp->lenbuf[2] << 8)
-                                 | ((uint32_t)lp->lenbuf[1] << 16)
-                                 | ((uint32_t)lp->lenbuf[0] << 24);
-          data += copy;
-          data_length -= copy;
-          goto in_data;
-        }
-
-    case PBCREP_LENGTH_PREFIXED_B128:
-      while (lp->lenbuf_len < LENBUF_SIZE && data_length > 0)
-        {
-          bool last = (*data & 0x80) == 0;
-          lp->lenbuf[lp->lenbuf_len++] = *data++;
-          data_length--;
-          if (last)
-            goto done_b128_le;
-        }
-      if (lp->lenbuf_len == LENBUF_SIZE)
-        {
-          *error = pbcrep_error_new (
-            "BAD_B128",
-            "overlong or bad B128-encoded length-prefix"
-          );
-          return false;
-        }
-      lp->in_length_prefix = true;
-      return true;
-      
-      done_b128_le:
-        {
-          /* compute payload length */
-          size_t v = 0;
-          size_t shift = 0;
-          for (unsigned i = 0; i < lp->lenbuf_len; i++)
-            {
-              v |= ((lp->lenbuf[i] & 0x7f) << shift);
-              shift += 7;
-            }
-          lp->length_from_prefix = v;
-        }
-        goto in_data;
-      
-    case PBCREP_LENGTH_PREFIXED_B128_BE:
-      while (lp->lenbuf_len < LENBUF_SIZE && data_length > 0)
-        {
-          bool last = (*data & 0x80) == 0;
-          lp->lenbuf[lp->lenbuf_len++] = *data++;
-          data_length--;
-          if (last)
-            goto done_b128_be;
-        }
-      if (lp->lenbuf_len == LENBUF_SIZE)
-        {
-          *error = pbcrep_error_new (
-            "BAD_B128",
-            "overlong or bad B128-encoded big-endian length-prefix"
-          );
-          return false;
-        }
-      lp->in_length_prefix = true;
-      return true;
-      
-      done_b128_be:
-        {
-          /* compute payload length */
-          size_t v = 0;
-          for (unsigned i = 0; i < lp->lenbuf_len; i++)
+          if (length > lp->buf_alloced)
             {
-              v <<= 7;
-              v |= (lp->lenbuf[i] & 0x7f);
+              lp->buf_alloced = length;
+              lp->buf = pbcrep_realloc (lp->buf, lp->buf_alloced);
             }
-          lp->length_from_prefix = v;
+          pbcrep_buffer_discard (&lp->pending, prefix_len);
+          pbcrep_buffer_read (&lp->pending, length, lp->buf);
+          ok = unpack_record (lp, length, lp->buf, error);
         }
-        goto in_data;
+      if (!ok)
+        return false;
     }
+}
 
-in_data:
-  if (lp->length_from_prefix > lp->buf_alloced)
-    {
-      lp->buf_alloced = lp->length_from_prefix;
-      lp->buf = pbcrep_realloc (lp->buf, lp->buf_alloced);
-    }
-  if (lp->buf_length + data_length >= lp->length_from_prefix)
+static bool
+length_prefixed__feed     (PBCREP_Parser      *parser,
+                           size_t              data_length,
+                           const uint8_t      *data,
+                           PBCREP_Error      **error)
+{
+  PBCREP_Parser_LengthPrefixed *lp = (PBCREP_Parser_LengthPrefixed*) parser;
+  size_t length;
+  int prefix_len;
+
+  // Finish the pending record, taking no more data than it needs.
+  while (lp->pending.size > 0 && data_length > 0)
     {
-      size_t copy = lp->length_from_prefix - lp->buf_length;
-      memcpy (lp->buf + lp->buf_length, data, copy);
+      uint8_t prefix[PBCREP_LENGTH_PREFIX_MAX_SIZE];
+      unsigned avail = pbcrep_buffer_peek (&lp->pending, sizeof (prefix), prefix);
+      prefix_len = read_prefix (lp, avail, prefix, &length, error);
+      if (prefix_len < 0)
+        return false;
+      size_t copy = prefix_len == 0 ? 1 : prefix_len + length - lp->pending.size;
+      if (copy > data_length)
+        copy = data_length;
+      pbcrep_buffer_append (&lp->pending, copy, data);
       data += copy;
       data_length -= copy;
-
-      ProtobufCAllocator allocator = {
-        PBCREP_LP_alloc,
-        PBCREP_LP_free,
-        lp
-      };
-      ProtobufCMessage *msg = protobuf_c_message_unpack(lp->base.message_desc, &allocator, lp->buf_length, lp->buf);
-      if (msg == NULL)
-        {
-          *error = pbcrep_error_new (
-            "PROTOBUF_MALFORMED",
-            "Error unpacking Protocol Buffers message"
-          );
-          return false;
-        }
-
-      lp->buf_length = 0;
-      lp->lenbuf_len = 0;
-      goto in_length_prefix;
+      // (The byte that completes a prefix may also complete
+      // its record, if that is empty.)
+      if (!process_pending (lp, error))
+        return false;
     }
-  else
+
+  // Unpack whole records in place.
+  while (data_length > 0)
     {
-      memcpy (lp->buf + lp->buf_length, data, data_length);
-      lp->buf_length += data_length;
-      return true;
+      prefix_len = read_prefix (lp, data_length, data, &length, error);
+      if (prefix_len < 0)
+        return false;
+      if (prefix_len == 0 || data_length - prefix_len < length)
+        break;
+      if (!unpack_record (lp, length, data + prefix_len, error))
+        return false;
+      data += prefix_len + length;
+      data_length -= prefix_len + length;
     }
+
+  if (data_length > 0)
+    pbcrep_buffer_append (&lp->pending, data_length, data);
+  return true;
+}
+
+static bool
+length_prefixed__feed_buffer (PBCREP_Parser      *parser,
+                              PBCREP_Buffer      *buffer,
+                              PBCREP_Error      **error)
+{
+  PBCREP_Parser_LengthPrefixed *lp = (PBCREP_Parser_LengthPrefixed*) parser;
+  pbcrep_buffer_drain (&lp->pending, buffer);
+  return process_pending (lp, error);
 }
 
 static bool
@@ -290,10 +202,14 @@ length_prefixed__end_feed (PBCREP_Parser      *parser,
                            PBCREP_Error      **error)
 {
   PBCREP_Parser_LengthPrefixed *lp = (PBCREP_Parser_LengthPrefixed*) parser;
-  if (lp->in_length_prefix)
+  if (lp->pending.size == 0)
+    return true;
+
+  uint8_t prefix[PBCREP_LENGTH_PREFIX_MAX_SIZE];
+  unsigned avail = pbcrep_buffer_peek (&lp->pending, sizeof (prefix), prefix);
+  size_t length;
+  if (pbcrep_length_prefix_decode (lp->lp_format, avail, prefix, &length) == 0)
     {
-      if (lp->lenbuf_len == 0)
-        return true;
       *error = pbcrep_error_new (
         "PARTIAL_RECORD",
         "terminated in length-prefix itself"
@@ -310,12 +226,40 @@ length_prefixed__end_feed (PBCREP_Parser      *parser,
     }
 }
 
+static bool
+length_prefixed__advance  (PBCREP_Parser      *parser,
+                           PBCREP_Error      **error)
+{
+  PBCREP_Parser_LengthPrefixed *lp = (PBCREP_Parser_LengthPrefixed*) parser;
+  (void) error;
+  if (parser->current_message != NULL)
+    {
+      pbcrep_unpacker_free_message (parser->current_message);
+      parser->current_message = NULL;
+    }
+  if (lp->queue_start < lp->queue_length)
+    {
+      parser->current_message = lp->queue[lp->queue_start++];
+      if (lp->queue_start == lp->queue_length)
+        lp->queue_start = lp->queue_length = 0;
+    }
+  return true;
+}
+
 static void
 length_prefixed__destruct (PBCREP_Parser      *parser)
 {
   PBCREP_Parser_LengthPrefixed *lp = (PBCREP_Parser_LengthPrefixed*) parser;
+  if (parser->current_message != NULL)
+    pbcrep_unpacker_free_message (parser->current_message);
+  for (unsigned i = lp->queue_start; i < lp->queue_length; i++)
+    pbcrep_unpacker_free_message (lp->queue[i]);
+  if (lp->queue != NULL)
+    pbcrep_free (lp->queue);
+  pbcrep_buffer_clear (&lp->pending);
   if (lp->buf != NULL)
     pbcrep_free (lp->buf);
+  pbcrep_unpacker_destroy (lp->unpacker);
 }
 
 PBCREP_Parser *
@@ -328,14 +272,22 @@ pbcrep_parser_new_length_prefixed (PBCREP_LengthPrefixed_Format lp_format,
   lp = (PBCREP_Parser_LengthPrefixed *) p;
 
   lp->lp_format = lp_format;
-  lp->lenbuf_len = 0;
-  lp->length_from_prefix = 0;
+  PBCREP_Plan *plan = pbcrep_plan_new (desc);
+  lp->unpacker = pbcrep_unpacker_new (plan);
+  pbcrep_plan_unref (plan);
+  pbcrep_buffer_init (&lp->pending);
   lp->buf_alloced = 0;
-  lp->buf_length = 0;
   lp->buf = NULL;
+  lp->queue = NULL;
+  lp->queue_start = lp->queue_length = lp->queue_alloced = 0;
+  lp->validate_only = false;
+  lp->n_validated = 0;
   lp->base.destruct = length_prefixed__destruct;
   lp->base.feed = length_prefixed__feed;
+  lp->base.feed_buffer = length_prefixed__feed_buffer;
   lp->base.end_feed = length_prefixed__end_feed;
+  lp->base.advance = length_prefixed__advance;
+  lp->base.free_message = length_prefixed__free_message;
   return p;
 }
 
@@ -348,3 +300,29 @@ pbcrep_parser_length_prefixed_set_format (PBCREP_Parser *parser,
   // TODO: assert that this is only called from message-handler.
   ((PBCREP_Parser_LengthPrefixed *) parser)->lp_format = format;
 }
+
+bool
+pbcrep_parser_is_length_prefixed (PBCREP_Parser *parser,
+                                  PBCREP_LengthPrefixed_Format *format_out)
+{
+  if (parser->feed != length_prefixed__feed
+   || ((PBCREP_Parser_LengthPrefixed *) parser)->validate_only)
+    return false;
+  *format_out = ((PBCREP_Parser_LengthPrefixed *) parser)->lp_format;
+  return true;
+}
+
+void
+pbcrep_parser_length_prefixed_set_validate_only (PBCREP_Parser *parser,
+                                                 bool           validate_only)
+{
+  assert (parser->feed == length_prefixed__feed);
+  ((PBCREP_Parser_LengthPrefixed *) parser)->validate_only = validate_only;
+}
+
+uint64_t
+pbcrep_parser_length_prefixed_get_n_validated (PBCREP_Parser *parser)
+{
+  assert (parser->feed == length_prefixed__feed);
+  return ((PBCREP_Parser_LengthPrefixed *) parser)->n_validated;
+}
@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include "../pbcrep.h"
 #include <stdlib.h>
 #include <stdarg.h>
@@ -21,7 +22,7 @@ pbcrep_error_new_printf  (const char *code,
   va_list args;
   char *msg;
   va_start (args, message);
-  asprintf (&msg, message, args);
+  vasprintf (&msg, message, args);
   va_end (args);
 
   PBCREP_Error *e = pbcrep_malloc (sizeof (PBCREP_Error));
@@ -0,0 +1,671 @@
+/*
+ * Pipelined message transfer.
+ *
+ * The reader thread cuts the input into chunks (at record boundaries,
+ * when there is more than one parser), and deals chunk n to parser
+ * n % n_parsers.  Each parser turns its chunks into batches of messages,
+ * dealing batch n to printer n % n_printers, which prints it into
+ * the batch's output buffer.  The calling thread writes the batches out
+ * in order, taking batch n from printer n % n_printers.
+ *
+ * Every pair of adjacent threads has its own ring, so each ring has
+ * one producer and one consumer;  dealing round-robin keeps the order
+ * without any reassembly queue.  After its last item, every thread
+ * pushes NULL onto each of its output rings.
+ *
+ * After a failure, the first error is kept, and the threads
+ * pass on the batches they get without working on them
+ * so that everyone reaches the end.
+ */
+#include <pthread.h>
+#include <time.h>
+#include <stdlib.h>
+#include "../pbcrep.h"
+
+#define DEFAULT_CHUNK_SIZE      (1024*1024)
+#define DEFAULT_RING_SIZE       4
+
+// Times to look at a ring before sleeping on it.
+#define RING_SPIN_COUNT         256
+
+#if defined(__x86_64__) || defined(__i386__)
+#define CPU_RELAX()             __builtin_ia32_pause ()
+#else
+#define CPU_RELAX()             do {} while (0)
+#endif
+
+static uint64_t
+now_ns (void)
+{
+  struct timespec ts;
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* --- rings --- */
+
+// head and tail only increase (wrapping);  the slot is the counter
+// masked.  A side that finds nothing to do spins a little,
+// then sets its 'waiting' flag and sleeps on 'cond';  the other side
+// checks the flags after moving its counter.
+// (Both are sequentially-consistent, so one side or the other
+// sees the change.)
+#define WAITING_PRODUCER        1
+#define WAITING_CONSUMER        2
+
+typedef struct {
+  unsigned mask;
+  void **slots;
+  unsigned waiting;
+  pthread_mutex_t mutex;
+  pthread_cond_t cond;
+
+  // Keep the consumer's and producer's counters apart.
+  char pad0[64];
+  unsigned head;                        // written by the consumer
+  char pad1[64];
+  unsigned tail;                        // written by the producer
+  char pad2[64];
+} Ring;
+
+static void
+ring_init (Ring *ring, unsigned size)
+{
+  unsigned n = 1;
+  while (n < size)
+    n *= 2;
+  ring->mask = n - 1;
+  ring->slots = pbcrep_malloc (sizeof (void *) * n);
+  ring->waiting = 0;
+  pthread_mutex_init (&ring->mutex, NULL);
+  pthread_cond_init (&ring->cond, NULL);
+  ring->head = ring->tail = 0;
+}
+
+static void
+ring_clear (Ring *ring)
+{
+  pbcrep_free (ring->slots);
+  pthread_mutex_destroy (&ring->mutex);
+  pthread_cond_destroy (&ring->cond);
+}
+
+// Wait until *counter != value;  returns the time spent waiting.
+static uint64_t
+ring_wait (Ring *ring, unsigned flag, unsigned *counter, unsigned value)
+{
+  if (__atomic_load_n (counter, __ATOMIC_ACQUIRE) != value)
+    return 0;
+  uint64_t start = now_ns ();
+  for (unsigned i = 0; i < RING_SPIN_COUNT; i++)
+    {
+      CPU_RELAX ();
+      if (__atomic_load_n (counter, __ATOMIC_ACQUIRE) != value)
+        return now_ns () - start;
+    }
+  pthread_mutex_lock (&ring->mutex);
+  __atomic_or_fetch (&ring->waiting, flag, __ATOMIC_SEQ_CST);
+  while (__atomic_load_n (counter, __ATOMIC_SEQ_CST) == value)
+    pthread_cond_wait (&ring->cond, &ring->mutex);
+  __atomic_and_fetch (&ring->waiting, ~flag, __ATOMIC_SEQ_CST);
+  pthread_mutex_unlock (&ring->mutex);
+  return now_ns () - start;
+}
+
+static void
+ring_wake (Ring *ring, unsigned flag)
+{
+  if (__atomic_load_n (&ring->waiting, __ATOMIC_SEQ_CST) & flag)
+    {
+      pthread_mutex_lock (&ring->mutex);
+      pthread_cond_broadcast (&ring->cond);
+      pthread_mutex_unlock (&ring->mutex);
+    }
+}
+
+static uint64_t
+ring_push (Ring *ring, void *item)
+{
+  unsigned tail = ring->tail;
+  uint64_t waited = ring_wait (ring, WAITING_PRODUCER, &ring->head, tail - ring->mask - 1);
+  ring->slots[tail & ring->mask] = item;
+  __atomic_store_n (&ring->tail, tail + 1, __ATOMIC_SEQ_CST);
+  ring_wake (ring, WAITING_CONSUMER);
+  return waited;
+}
+
+static void *
+ring_pop (Ring *ring, uint64_t *waited)
+{
+  unsigned head = ring->head;
+  *waited += ring_wait (ring, WAITING_CONSUMER, &ring->tail, head);
+  void *item = ring->slots[head & ring->mask];
+  __atomic_store_n (&ring->head, head + 1, __ATOMIC_SEQ_CST);
+  ring_wake (ring, WAITING_PRODUCER);
+  return item;
+}
+
+/* --- chunks and batches --- */
+
+typedef struct {
+  size_t length;
+  uint8_t *data;
+  bool is_last;
+} Chunk;
+
+typedef struct {
+  ProtobufCMessage **messages;
+  unsigned n_messages, messages_alloced;
+  void (*free_message) (ProtobufCMessage *message);
+  PBCREP_Buffer output;
+  bool is_last;
+} Batch;
+
+static void
+chunk_free (Chunk *chunk)
+{
+  pbcrep_free (chunk->data);
+  pbcrep_free (chunk);
+}
+
+static Batch *
+batch_new (PBCREP_Parser *parser, bool is_last)
+{
+  Batch *batch = pbcrep_malloc (sizeof (Batch));
+  batch->messages = NULL;
+  batch->n_messages = batch->messages_alloced = 0;
+  batch->free_message = parser->free_message;
+  pbcrep_buffer_init (&batch->output);
+  batch->is_last = is_last;
+  return batch;
+}
+
+static void
+batch_take_messages (Batch *batch, PBCREP_Parser *parser)
+{
+  for (;;)
+    {
+      pbcrep_parser_advance (parser);
+      ProtobufCMessage *message = pbcrep_parser_take_message (parser);
+      if (message == NULL)
+        return;
+      if (batch->n_messages == batch->messages_alloced)
+        {
+          batch->messages_alloced = batch->messages_alloced ? batch->messages_alloced * 2 : 64;
+          batch->messages = pbcrep_realloc (batch->messages,
+                                            sizeof (ProtobufCMessage *) * batch->messages_alloced);
+        }
+      batch->messages[batch->n_messages++] = message;
+    }
+}
+
+// The count is kept for the writer.
+static void
+batch_free_messages (Batch *batch)
+{
+  if (batch->messages == NULL)
+    return;
+  for (unsigned i = 0; i < batch->n_messages; i++)
+    batch->free_message (batch->messages[i]);
+  pbcrep_free (batch->messages);
+  batch->messages = NULL;
+}
+
+static void
+batch_free (Batch *batch)
+{
+  batch_free_messages (batch);
+  pbcrep_buffer_clear (&batch->output);
+  pbcrep_free (batch);
+}
+
+/* --- the pipeline --- */
+
+typedef struct {
+  PBCREP_BinaryDataReader *input;
+  PBCREP_ParserFactory *parser_factory;
+  PBCREP_BinaryDataWriter *output;
+  unsigned n_parsers, n_printers;
+  size_t chunk_size;
+
+  PBCREP_Parser **parsers;
+  PBCREP_Printer **printers;
+  Ring *chunk_rings;                    // [n_parsers]:  read -> parse
+  Ring *batch_rings;                    // [n_parsers * n_printers]:  parse -> print
+  Ring *output_rings;                   // [n_printers]:  print -> write
+
+  bool failed;
+  pthread_mutex_t failure_mutex;
+  PBCREP_TransferResultCode code;
+  PBCREP_Error *error;
+
+  // Only written by the reader and writer threads, respectively.
+  uint64_t bytes_read;
+  uint64_t bytes_written, n_messages;
+
+  PBCREP_PipelineStageStats stages[PBCREP_PIPELINE_N_STAGES];
+} Pipeline;
+
+typedef struct {
+  Pipeline *pipeline;
+  unsigned index;
+} Worker;
+
+typedef struct {
+  uint64_t start;
+  uint64_t n_batches;
+  uint64_t input_wait_ns;
+  uint64_t output_wait_ns;
+} ThreadTimes;
+
+static void
+thread_times_init (ThreadTimes *t)
+{
+  t->start = now_ns ();
+  t->n_batches = 0;
+  t->input_wait_ns = t->output_wait_ns = 0;
+}
+
+static void
+thread_times_done (Pipeline *p, PBCREP_PipelineStage stage, const ThreadTimes *t)
+{
+  PBCREP_PipelineStageStats *s = &p->stages[stage];
+  uint64_t waited = t->input_wait_ns + t->output_wait_ns;
+  uint64_t elapsed = now_ns () - t->start;
+  __atomic_add_fetch (&s->n_batches, t->n_batches, __ATOMIC_RELAXED);
+  __atomic_add_fetch (&s->busy_ns, elapsed > waited ? elapsed - waited : 0, __ATOMIC_RELAXED);
+  __atomic_add_fetch (&s->input_wait_ns, t->input_wait_ns, __ATOMIC_RELAXED);
+  __atomic_add_fetch (&s->output_wait_ns, t->output_wait_ns, __ATOMIC_RELAXED);
+}
+
+static bool
+pipeline_failed (Pipeline *p)
+{
+  return __atomic_load_n (&p->failed, __ATOMIC_RELAXED);
+}
+
+// Takes ownership of 'error' (which may be NULL).
+static void
+pipeline_fail (Pipeline *p, PBCREP_TransferResultCode code, PBCREP_Error *error)
+{
+  pthread_mutex_lock (&p->failure_mutex);
+  if (!p->failed)
+    {
+      p->code = code;
+      p->error = error != NULL ? error
+               : pbcrep_error_new ("TRANSFER_FAILED", "pipelined transfer failed");
+      __atomic_store_n (&p->failed, true, __ATOMIC_RELAXED);
+    }
+  else if (error != NULL)
+    pbcrep_error_destroy (error);
+  pthread_mutex_unlock (&p->failure_mutex);
+}
+
+// Fill the chunk, up to 'alloced' bytes.  Returns false on error.
+static bool
+read_chunk (Pipeline *p, Chunk *chunk, size_t alloced)
+{
+  while (chunk->length < alloced)
+    {
+      size_t amt;
+      PBCREP_Error *error = NULL;
+      switch (pbcrep_binary_data_reader_read (p->input, alloced - chunk->length,
+                                              chunk->data + chunk->length,
+                                              &amt, &error))
+        {
+        case PBCREP_READ_RESULT_OK:
+          chunk->length += amt;
+          p->bytes_read += amt;
+          break;
+        case PBCREP_READ_RESULT_EOF:
+          chunk->is_last = true;
+          return true;
+        case PBCREP_READ_RESULT_BLOCKED:
+          pipeline_fail (p, PBCREP_TRANSFER_RESULT_READ_FAILED,
+                         pbcrep_error_new ("READ_BLOCKED",
+                                           "transfer from a nonblocking reader"));
+          return false;
+        case PBCREP_READ_RESULT_ERROR:
+          pipeline_fail (p, PBCREP_TRANSFER_RESULT_READ_FAILED, error);
+          return false;
+        }
+    }
+  return true;
+}
+
+static void *
+read_thread (void *data)
+{
+  Pipeline *p = data;
+  ThreadTimes t;
+  thread_times_init (&t);
+
+  // The incomplete record at the end of the last chunk.
+  uint8_t *carry = NULL;
+  size_t carry_len = 0;
+
+  bool done = false;
+  for (uint64_t seq = 0; !done && !pipeline_failed (p); seq++)
+    {
+      size_t alloced = p->chunk_size;
+      while (alloced <= carry_len)
+        alloced *= 2;
+      Chunk *chunk = pbcrep_malloc (sizeof (Chunk));
+      chunk->data = pbcrep_malloc (alloced);
+      chunk->length = carry_len;
+      chunk->is_last = false;
+      if (carry != NULL)
+        {
+          memcpy (chunk->data, carry, carry_len);
+          pbcrep_free (carry);
+          carry = NULL;
+          carry_len = 0;
+        }
+
+      bool ok;
+      while ((ok = read_chunk (p, chunk, alloced))
+          && !chunk->is_last
+          && p->n_parsers > 1)
+        {
+          size_t whole = p->parser_factory->split (p->parser_factory,
+                                                   chunk->length, chunk->data);
+          if (whole > 0)
+            {
+              carry_len = chunk->length - whole;
+              if (carry_len > 0)
+                {
+                  carry = pbcrep_malloc (carry_len);
+                  memcpy (carry, chunk->data + whole, carry_len);
+                }
+              chunk->length = whole;
+              break;
+            }
+
+          // Not even one record:  read more.
+          alloced *= 2;
+          chunk->data = pbcrep_realloc (chunk->data, alloced);
+        }
+      if (!ok)
+        {
+          chunk_free (chunk);
+          break;
+        }
+      done = chunk->is_last;
+      t.output_wait_ns += ring_push (&p->chunk_rings[seq % p->n_parsers], chunk);
+      t.n_batches++;
+    }
+  if (carry != NULL)
+    pbcrep_free (carry);
+
+  for (unsigned i = 0; i < p->n_parsers; i++)
+    t.output_wait_ns += ring_push (&p->chunk_rings[i], NULL);
+  thread_times_done (p, PBCREP_PIPELINE_STAGE_READ, &t);
+  return NULL;
+}
+
+static void *
+parse_thread (void *data)
+{
+  Worker *w = data;
+  Pipeline *p = w->pipeline;
+  PBCREP_Parser *parser = p->parsers[w->index];
+  Ring *rings = p->batch_rings + w->index * p->n_printers;
+  ThreadTimes t;
+  thread_times_init (&t);
+
+  for (uint64_t seq = w->index; ; seq += p->n_parsers)
+    {
+      Chunk *chunk = ring_pop (&p->chunk_rings[w->index], &t.input_wait_ns);
+      if (chunk == NULL)
+        break;
+      Batch *batch = batch_new (parser, chunk->is_last);
+      if (!pipeline_failed (p))
+        {
+          PBCREP_Error *error = NULL;
+          bool ok = pbcrep_parser_feed (parser, chunk->length, chunk->data, &error)
+                 && (!chunk->is_last || pbcrep_parser_end_feed (parser, &error));
+          batch_take_messages (batch, parser);
+          if (!ok)
+            pipeline_fail (p, PBCREP_TRANSFER_RESULT_READ_FAILED, error);
+        }
+      chunk_free (chunk);
+      t.output_wait_ns += ring_push (&rings[seq % p->n_printers], batch);
+      t.n_batches++;
+    }
+
+  for (unsigned i = 0; i < p->n_printers; i++)
+    t.output_wait_ns += ring_push (&rings[i], NULL);
+  thread_times_done (p, PBCREP_PIPELINE_STAGE_PARSE, &t);
+  return NULL;
+}
+
+static void *
+print_thread (void *data)
+{
+  Worker *w = data;
+  Pipeline *p = w->pipeline;
+  PBCREP_Printer *printer = p->printers[w->index];
+  ThreadTimes t;
+  thread_times_init (&t);
+
+  for (uint64_t seq = w->index; ; seq += p->n_printers)
+    {
+      Ring *ring = &p->batch_rings[(seq % p->n_parsers) * p->n_printers + w->index];
+      Batch *batch = ring_pop (ring, &t.input_wait_ns);
+      if (batch == NULL)
+        break;
+      if (!pipeline_failed (p))
+        {
+          PBCREP_Error *error = NULL;
+          bool ok = true;
+          for (unsigned i = 0; ok && i < batch->n_messages; i++)
+            ok = pbcrep_printer_print (printer, batch->messages[i], &error);
+          if (ok && batch->is_last)
+            ok = pbcrep_printer_end (printer, &error);
+          if (!ok)
+            pipeline_fail (p, PBCREP_TRANSFER_RESULT_WRITE_FAILED, error);
+          pbcrep_buffer_drain (&batch->output, &printer->output_data);
+        }
+      batch_free_messages (batch);
+      t.output_wait_ns += ring_push (&p->output_rings[w->index], batch);
+      t.n_batches++;
+    }
+
+  t.output_wait_ns += ring_push (&p->output_rings[w->index], NULL);
+  thread_times_done (p, PBCREP_PIPELINE_STAGE_PRINT, &t);
+  return NULL;
+}
+
+static bool
+write_batch (Pipeline *p, Batch *batch, int fd, PBCREP_Error **error)
+{
+  if (fd >= 0)
+    return pbcrep_buffer_write_all_to_fd (&batch->output, fd, error);
+  bool ok = true;
+  for (PBCREP_BufferFragment *frag = batch->output.first_frag;
+       frag != NULL && ok;
+       frag = frag->next)
+    ok = pbcrep_binary_data_writer_write (p->output, frag->buf_length,
+                                          frag->buf + frag->buf_start, error);
+  return ok;
+}
+
+// Run on the calling thread.
+static void
+write_stage (Pipeline *p)
+{
+  ThreadTimes t;
+  thread_times_init (&t);
+
+  PBCREP_Error *error = NULL;
+  int fd = -1;
+  if (p->output->get_fd != NULL)
+    {
+      if (pbcrep_binary_data_writer_flush (p->output, &error))
+        fd = p->output->get_fd (p->output);
+      else
+        pipeline_fail (p, PBCREP_TRANSFER_RESULT_WRITE_FAILED, error);
+    }
+
+  for (uint64_t seq = 0; ; seq++)
+    {
+      Batch *batch = ring_pop (&p->output_rings[seq % p->n_printers], &t.input_wait_ns);
+      if (batch == NULL)
+        break;
+      if (!pipeline_failed (p))
+        {
+          size_t size = batch->output.size;
+          if (write_batch (p, batch, fd, &error))
+            {
+              p->bytes_written += size;
+              p->n_messages += batch->n_messages;
+            }
+          else
+            pipeline_fail (p, PBCREP_TRANSFER_RESULT_WRITE_FAILED, error);
+        }
+      batch_free (batch);
+      t.n_batches++;
+    }
+
+  if (!pipeline_failed (p) && !pbcrep_binary_data_writer_flush (p->output, &error))
+    pipeline_fail (p, PBCREP_TRANSFER_RESULT_WRITE_FAILED, error);
+  thread_times_done (p, PBCREP_PIPELINE_STAGE_WRITE, &t);
+}
+
+static void
+start_thread (pthread_t *thread, void *(*func) (void *), void *arg)
+{
+  int rv = pthread_create (thread, NULL, func, arg);
+  if (rv != 0)
+    {
+      fprintf (stderr, "pbcrep_transfer_messages_pipelined: pthread_create: %s\n",
+               strerror (rv));
+      abort ();
+    }
+}
+
+PBCREP_TransferResult
+pbcrep_transfer_messages_pipelined (PBCREP_BinaryDataReader      *input,
+                                    PBCREP_ParserFactory         *parser_factory,
+                                    PBCREP_PrinterFactory        *printer_factory,
+                                    PBCREP_BinaryDataWriter      *output,
+                                    const PBCREP_PipelineOptions *options,
+                                    PBCREP_PipelineStats         *stats_out)
+{
+  static const PBCREP_PipelineOptions default_options = PBCREP_PIPELINE_OPTIONS_INIT;
+  PBCREP_TransferResult res = { PBCREP_TRANSFER_RESULT_SUCCESS, NULL, 0 };
+  uint64_t start = now_ns ();
+  if (options == NULL)
+    options = &default_options;
+
+  Pipeline p;
+  memset (&p, 0, sizeof (p));
+  p.input = input;
+  p.parser_factory = parser_factory;
+  p.output = output;
+  p.n_parsers = options->n_parse_threads ? options->n_parse_threads : 1;
+  if (parser_factory->split == NULL)
+    p.n_parsers = 1;
+  p.n_printers = options->n_print_threads ? options->n_print_threads : 1;
+  p.chunk_size = options->chunk_size ? options->chunk_size : DEFAULT_CHUNK_SIZE;
+  unsigned ring_size = options->ring_size ? options->ring_size : DEFAULT_RING_SIZE;
+
+  p.parsers = pbcrep_malloc (sizeof (PBCREP_Parser *) * p.n_parsers);
+  for (unsigned i = 0; i < p.n_parsers; i++)
+    p.parsers[i] = pbcrep_parser_factory_create_parser (parser_factory);
+  if (p.parsers[0]->free_message == NULL)
+    {
+      for (unsigned i = 0; i < p.n_parsers; i++)
+        pbcrep_parser_destroy (p.parsers[i]);
+      pbcrep_free (p.parsers);
+      res.code = PBCREP_TRANSFER_RESULT_READ_FAILED;
+      res.error = pbcrep_error_new ("NOT_SUPPORTED",
+                                    "parser cannot hand over its messages");
+      return res;
+    }
+  p.printers = pbcrep_malloc (sizeof (PBCREP_Printer *) * p.n_printers);
+  for (unsigned i = 0; i < p.n_printers; i++)
+    p.printers[i] = pbcrep_printer_factory_create_printer (printer_factory);
+
+  p.chunk_rings = pbcrep_malloc (sizeof (Ring) * p.n_parsers);
+  for (unsigned i = 0; i < p.n_parsers; i++)
+    ring_init (&p.chunk_rings[i], ring_size);
+  p.batch_rings = pbcrep_malloc (sizeof (Ring) * p.n_parsers * p.n_printers);
+  for (unsigned i = 0; i < p.n_parsers * p.n_printers; i++)
+    ring_init (&p.batch_rings[i], ring_size);
+  p.output_rings = pbcrep_malloc (sizeof (Ring) * p.n_printers);
+  for (unsigned i = 0; i < p.n_printers; i++)
+    ring_init (&p.output_rings[i], ring_size);
+  pthread_mutex_init (&p.failure_mutex, NULL);
+
+  unsigned n_threads = 1 + p.n_parsers + p.n_printers;
+  pthread_t *threads = pbcrep_malloc (sizeof (pthread_t) * n_threads);
+  Worker *workers = pbcrep_malloc (sizeof (Worker) * (p.n_parsers + p.n_printers));
+  start_thread (&threads[0], read_thread, &p);
+  for (unsigned i = 0; i < p.n_parsers; i++)
+    {
+      workers[i].pipeline = &p;
+      workers[i].index = i;
+      start_thread (&threads[1 + i], parse_thread, &workers[i]);
+    }
+  for (unsigned i = 0; i < p.n_printers; i++)
+    {
+      Worker *w = &workers[p.n_parsers + i];
+      w->pipeline = &p;
+      w->index = i;
+      start_thread (&threads[1 + p.n_parsers + i], print_thread, w);
+    }
+  write_stage (&p);
+  for (unsigned i = 0; i < n_threads; i++)
+    pthread_join (threads[i], NULL);
+  pbcrep_free (threads);
+  pbcrep_free (workers);
+
+  if (p.failed)
+    {
+      res.code = p.code;
+      res.error = p.error;
+    }
+  res.n_transferred = p.n_messages;
+  if (stats_out != NULL)
+    {
+      stats_out->elapsed_ns = now_ns () - start;
+      stats_out->bytes_read = p.bytes_read;
+      stats_out->bytes_written = p.bytes_written;
+      memcpy (stats_out->stages, p.stages, sizeof (p.stages));
+      stats_out->stages[PBCREP_PIPELINE_STAGE_READ].n_threads = 1;
+      stats_out->stages[PBCREP_PIPELINE_STAGE_PARSE].n_threads = p.n_parsers;
+      stats_out->stages[PBCREP_PIPELINE_STAGE_PRINT].n_threads = p.n_printers;
+      stats_out->stages[PBCREP_PIPELINE_STAGE_WRITE].n_threads = 1;
+    }
+
+  for (unsigned i = 0; i < p.n_parsers; i++)
+    {
+      pbcrep_parser_destroy (p.parsers[i]);
+      ring_clear (&p.chunk_rings[i]);
+    }
+  for (unsigned i = 0; i < p.n_parsers * p.n_printers; i++)
+    ring_clear (&p.batch_rings[i]);
+  for (unsigned i = 0; i < p.n_printers; i++)
+    {
+      pbcrep_printer_destroy (p.printers[i]);
+      ring_clear (&p.output_rings[i]);
+    }
+  pbcrep_free (p.parsers);
+  pbcrep_free (p.printers);
+  pbcrep_free (p.chunk_rings);
+  pbcrep_free (p.batch_rings);
+  pbcrep_free (p.output_rings);
+  pthread_mutex_destroy (&p.failure_mutex);
+  return res;
+}
+
+double
+pbcrep_pipeline_stats_utilization (const PBCREP_PipelineStats *stats,
+                                   PBCREP_PipelineStage        stage)
+{
+  const PBCREP_PipelineStageStats *s = &stats->stages[stage];
+  if (stats->elapsed_ns == 0 || s->n_threads == 0)
+    return 0;
+  return (double) s->busy_ns / ((double) stats->elapsed_ns * s->n_threads);
+}
@@ -0,0 +1,63 @@
+/*
+ * Pipelined message transfer.
+ *
+ * Reading, parsing, printing and writing each get their own threads,
+ * handing chunks of input and batches of messages along
+ * single-producer/single-consumer rings.  Output comes out
+ * in input order.
+ *
+ * Parsing is spread over several threads only if the parser factory
+ * can split its input (see PBCREP_ParserFactory.split), and the parsers
+ * must implement free_message (see pbcrep_parser_take_message()).
+ * Printing may be spread over several threads for formats whose printers
+ * print each message independently, which the built-in ones do;
+ * only the printer that gets the last batch is ended.
+ */
+
+typedef struct {
+  unsigned n_parse_threads;             // 0 means 1
+  unsigned n_print_threads;             // 0 means 1
+  size_t chunk_size;                    // bytes of input per batch;  0 means 1M
+  unsigned ring_size;                   // batches in flight between two threads;  0 means 4
+} PBCREP_PipelineOptions;
+#define PBCREP_PIPELINE_OPTIONS_INIT { 0, 0, 0, 0 }
+
+typedef enum {
+  PBCREP_PIPELINE_STAGE_READ,
+  PBCREP_PIPELINE_STAGE_PARSE,
+  PBCREP_PIPELINE_STAGE_PRINT,
+  PBCREP_PIPELINE_STAGE_WRITE
+} PBCREP_PipelineStage;
+#define PBCREP_PIPELINE_N_STAGES 4
+
+// Times are summed over the stage's threads.
+typedef struct {
+  unsigned n_threads;
+  uint64_t n_batches;
+  uint64_t busy_ns;
+  uint64_t input_wait_ns;               // waiting for the previous stage
+  uint64_t output_wait_ns;              // waiting for the next stage
+} PBCREP_PipelineStageStats;
+
+typedef struct {
+  uint64_t elapsed_ns;
+  uint64_t bytes_read;
+  uint64_t bytes_written;
+  PBCREP_PipelineStageStats stages[PBCREP_PIPELINE_N_STAGES];
+} PBCREP_PipelineStats;
+
+// Fraction of the stage's threads' time that was spent working:
+// the bottleneck is the stage nearest 1.
+double pbcrep_pipeline_stats_utilization (const PBCREP_PipelineStats *stats,
+                                          PBCREP_PipelineStage        stage);
+
+// Like pbcrep_transfer_messages(), but pipelined.
+// n_transferred counts messages.  'options' and 'stats_out' may be NULL.
+// The input and output are not destroyed.
+PBCREP_TransferResult
+pbcrep_transfer_messages_pipelined (PBCREP_BinaryDataReader      *input,
+                                    PBCREP_ParserFactory         *parser_factory,
+                                    PBCREP_PrinterFactory        *printer_factory,
+                                    PBCREP_BinaryDataWriter      *output,
+                                    const PBCREP_PipelineOptions *options,
+                                    PBCREP_PipelineStats         *stats_out);
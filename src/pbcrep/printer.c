@@ -0,0 +1,61 @@
+#include <assert.h>
+#include <stdlib.h>
+#include "../pbcrep.h"
+
+
+bool
+pbcrep_printer_print    (PBCREP_Printer *printer,
+                         const ProtobufCMessage *message,
+                         PBCREP_Error **error)
+{
+  assert (printer->magic == PBCREP_PRINTER_MAGIC_VALUE);
+  assert (!printer->ended);
+  return printer->print (printer, message, error);
+}
+
+bool
+pbcrep_printer_end      (PBCREP_Printer *printer,
+                         PBCREP_Error **error)
+{
+  assert (printer->magic == PBCREP_PRINTER_MAGIC_VALUE);
+  assert (!printer->ended);
+  printer->ended = true;
+  if (printer->end_print != NULL)
+    return printer->end_print (printer, error);
+  return true;
+}
+
+bool
+pbcrep_printer_is_ended (PBCREP_Printer *printer)
+{
+  return printer->ended;
+}
+
+void
+pbcrep_printer_destroy  (PBCREP_Printer *printer)
+{
+  assert (printer->magic == PBCREP_PRINTER_MAGIC_VALUE);
+
+  if (printer->destroy != NULL)
+    printer->destroy (printer);
+
+  // Now, undo any work done by
+  // pbcrep_printer_new_protected().
+  pbcrep_buffer_clear (&printer->output_data);
+  pbcrep_free (printer);
+}
+
+PBCREP_Printer *
+pbcrep_printer_new_protected (size_t sizeof_printer)
+{
+  assert (sizeof_printer >= sizeof (PBCREP_Printer));
+  PBCREP_Printer *rv = pbcrep_malloc (sizeof_printer);
+  assert (rv != NULL);
+  rv->magic = PBCREP_PRINTER_MAGIC_VALUE;
+  rv->print = NULL;
+  rv->end_print = NULL;
+  rv->destroy = NULL;
+  pbcrep_buffer_init (&rv->output_data);
+  rv->ended = false;
+  return rv;
+}
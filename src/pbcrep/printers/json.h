@@ -1,15 +1,43 @@
-
 typedef struct PBCREP_JSON_PrinterOptions PBCREP_JSON_PrinterOptions;
 struct PBCREP_JSON_PrinterOptions
 {
   unsigned quoteless_keys : 1;
   unsigned formatted : 1;
 
-  // if formatted
+  // if formatted; 0 means 2.
   unsigned indent_size;
 };
 
-PBCREP_Printer *pbcrep_printer_new_json (ProtobufCMessageDescriptor *desc,
-                                         PBCREP_JSON_PrinterOptions *options);
+//
+// Each message is printed as a JSON object followed by a newline.
+//
+// Enums are printed by name, bytes as hex strings,
+// and non-finite floats as the strings "NaN", "Infinity" and "-Infinity";
+// all of these are understood by pbcrep_parser_new_json().
+//
+// options may be NULL, for compact output with quoted keys.
+//
+PBCREP_Printer *pbcrep_printer_new_json (const ProtobufCMessageDescriptor *desc,
+                                         const PBCREP_JSON_PrinterOptions *options);
+
+// Like pbcrep_printer_new_json(), but shares a precomputed plan
+// (the printer takes a reference).
+PBCREP_Printer *pbcrep_printer_new_json_from_plan
+                                        (PBCREP_Plan                      *plan,
+                                         const PBCREP_JSON_PrinterOptions *options);
 
+// Whether 'printer' is from pbcrep_printer_new_json*();
+// if so, *desc_out (if non-NULL) is set to the type it prints.
+bool pbcrep_printer_is_json (PBCREP_Printer                    *printer,
+                             const ProtobufCMessageDescriptor **desc_out);
 
+// Print a packed message of the printer's type, as print() would
+// print it after unpacking, but without unpacking it:  the fields
+// are read straight from the wire format.
+//
+// If protobuf_c_message_unpack() would reject the message,
+// nothing is printed.
+bool pbcrep_printer_json_print_packed (PBCREP_Printer  *printer,
+                                       size_t           length,
+                                       const uint8_t   *data,
+                                       PBCREP_Error   **error);
@@ -0,0 +1,1002 @@
+/*
+ * JSON Printer.
+ *
+ * Everything that depends only on the message type--
+ * the key fragments ("\"name\":"), nested message plans,
+ * and enum names--comes from a PBCREP_Plan,
+ * so printing a message is just a walk over its fields.
+ *
+ * Output is written straight into the free space at the end of
+ * the output buffer (pbcrep_buffer_reserve).  An "Out" is a cursor
+ * into that space;  we only commit when a fragment fills up,
+ * or when the message is finished.
+ *
+ * Numbers:
+ *   - integers are formatted two digits at a time from a table.
+ *   - doubles that are exact integers take the integer path;
+ *     otherwise we use the shortest of %.15g, %.16g, %.17g
+ *     that reads back (via strtod) to the same value.
+ *     (floats likewise, with %.6g through %.9g)
+ *     Both are done in the "C" locale, whatever LC_NUMERIC the
+ *     program has set, so the decimal point is always '.'.
+ *
+ * Strings:
+ *   runs of bytes that need no escaping are found 16 bytes
+ *   at a time (SSE2) or 8 bytes at a time (portable SWAR),
+ *   and copied in bulk.
+ */
+#include "../../../pbcrep.h"
+#include "../../wire-format.h"
+#include <assert.h>
+#include <locale.h>
+#include <math.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+// Enough for any number we print, including quotes around "-Infinity".
+#define MAX_SCALAR_SIZE    32
+
+// Strings are copied in pieces no larger than this,
+// so that a piece always fits in an empty fragment.
+#define MAX_COPY_CHUNK     1024
+
+typedef struct PBCREP_Printer_JSON PBCREP_Printer_JSON;
+struct PBCREP_Printer_JSON
+{
+  PBCREP_Printer base;
+  PBCREP_Plan *plan;
+  bool quoteless_keys;
+  bool formatted;
+  unsigned indent_size;
+
+  // for pbcrep_printer_json_print_packed()
+  struct WireFieldIndex *wire_index;
+  size_t wire_index_alloced;
+};
+
+/* --- Writing into the tail of the output buffer --- */
+typedef struct {
+  PBCREP_Buffer *buffer;
+  uint8_t *start;               // from pbcrep_buffer_reserve()
+  uint8_t *at;
+  uint8_t *end;
+} Out;
+
+static void
+out_start (Out *o, PBCREP_Buffer *buffer)
+{
+  unsigned avail;
+  o->buffer = buffer;
+  pbcrep_buffer_reserve (buffer, 1, &o->start, &avail);
+  o->at = o->start;
+  o->end = o->start + avail;
+}
+
+static inline void
+out_commit (Out *o)
+{
+  pbcrep_buffer_commit (o->buffer, o->at - o->start);
+}
+
+static void
+out_grow (Out *o, size_t min_size)
+{
+  unsigned avail;
+  out_commit (o);
+  pbcrep_buffer_reserve (o->buffer, min_size, &o->start, &avail);
+  o->at = o->start;
+  o->end = o->start + avail;
+}
+
+static inline uint8_t *
+out_reserve (Out *o, size_t min_size)
+{
+  if (PBCREP_UNLIKELY ((size_t) (o->end - o->at) < min_size))
+    out_grow (o, min_size);
+  return o->at;
+}
+
+static inline void
+out_byte (Out *o, uint8_t b)
+{
+  out_reserve (o, 1);
+  *(o->at)++ = b;
+}
+
+static void
+out_bytes (Out *o, size_t length, const void *data)
+{
+  const uint8_t *d = data;
+  while (length > 0)
+    {
+      size_t avail = o->end - o->at;
+      if (avail == 0)
+        {
+          out_grow (o, 1);
+          avail = o->end - o->at;
+        }
+      size_t n = length < avail ? length : avail;
+      memcpy (o->at, d, n);
+      o->at += n;
+      d += n;
+      length -= n;
+    }
+}
+
+static inline void
+out_newline_indent (Out *o, unsigned n_spaces)
+{
+  uint8_t *w = out_reserve (o, n_spaces + 1);
+  *w++ = '\n';
+  memset (w, ' ', n_spaces);
+  o->at = w + n_spaces;
+}
+
+/* --- Numbers --- */
+static const char digit_pairs[201] =
+  "00010203040506070809101112131415161718192021222324252627282930313233343536373839"
+  "40414243444546474849505152535455565758596061626364656667686970717273747576777879"
+  "8081828384858687888990919293949596979899";
+
+static inline unsigned
+format_uint64 (uint64_t v, char *out)
+{
+  char tmp[20];
+  char *p = tmp + sizeof (tmp);
+  while (v >= 100)
+    {
+      unsigned r = v % 100;
+      v /= 100;
+      p -= 2;
+      memcpy (p, digit_pairs + 2 * r, 2);
+    }
+  if (v >= 10)
+    {
+      p -= 2;
+      memcpy (p, digit_pairs + 2 * v, 2);
+    }
+  else
+    *--p = '0' + v;
+  unsigned len = tmp + sizeof (tmp) - p;
+  memcpy (out, p, len);
+  return len;
+}
+
+static inline unsigned
+format_int64 (int64_t v, char *out)
+{
+  if (v < 0)
+    {
+      *out = '-';
+      return 1 + format_uint64 (-(uint64_t) v, out + 1);
+    }
+  return format_uint64 (v, out);
+}
+
+static unsigned
+format_nonfinite (double v, char *out)
+{
+  const char *str = isnan (v) ? "\"NaN\"" : v < 0 ? "\"-Infinity\"" : "\"Infinity\"";
+  unsigned len = strlen (str);
+  memcpy (out, str, len);
+  return len;
+}
+
+// snprintf() and strtod() follow LC_NUMERIC, which would give "1,5"
+// in many locales;  formatting is done with this locale in effect.
+static locale_t c_numeric_locale;
+static pthread_once_t c_numeric_locale_once = PTHREAD_ONCE_INIT;
+
+static void
+init_c_numeric_locale (void)
+{
+  c_numeric_locale = newlocale (LC_NUMERIC_MASK, "C", (locale_t) 0);
+}
+
+static inline locale_t
+use_c_numeric_locale (void)
+{
+  pthread_once (&c_numeric_locale_once, init_c_numeric_locale);
+  return uselocale (c_numeric_locale != (locale_t) 0 ? c_numeric_locale : LC_GLOBAL_LOCALE);
+}
+
+static unsigned
+format_double (double v, char *out)
+{
+  if (!isfinite (v))
+    return format_nonfinite (v, out);
+
+  // Integral values in the exactly-representable range.
+  if (v >= -9007199254740992.0 && v <= 9007199254740992.0
+   && v == (double) (int64_t) v
+   && !(v == 0 && signbit (v)))
+    return format_int64 ((int64_t) v, out);
+
+  locale_t old_locale = use_c_numeric_locale ();
+  unsigned len = 0;
+  for (int precision = 15; precision <= 17; precision++)
+    {
+      len = snprintf (out, MAX_SCALAR_SIZE, "%.*g", precision, v);
+      if (strtod (out, NULL) == v)
+        break;
+    }
+  uselocale (old_locale);
+  return len;
+}
+
+static unsigned
+format_float (float v, char *out)
+{
+  if (!isfinite (v))
+    return format_nonfinite (v, out);
+
+  if (v >= -16777216.0f && v <= 16777216.0f
+   && v == (float) (int32_t) v
+   && !(v == 0 && signbit (v)))
+    return format_int64 ((int32_t) v, out);
+
+  locale_t old_locale = use_c_numeric_locale ();
+  unsigned len = 0;
+  for (int precision = 6; precision <= 9; precision++)
+    {
+      len = snprintf (out, MAX_SCALAR_SIZE, "%.*g", precision, (double) v);
+      if (strtof (out, NULL) == v)
+        break;
+    }
+  uselocale (old_locale);
+  return len;
+}
+
+/* --- Strings --- */
+static inline bool
+byte_needs_escape (uint8_t c)
+{
+  return c < 0x20 || c == '"' || c == '\\';
+}
+
+// Length of the initial run of str that can be copied verbatim.
+static inline size_t
+clean_prefix_length (size_t length, const uint8_t *str)
+{
+  size_t i = 0;
+#if defined(__SSE2__)
+  const __m128i quote = _mm_set1_epi8 ('"');
+  const __m128i backslash = _mm_set1_epi8 ('\\');
+  const __m128i max_control = _mm_set1_epi8 (0x1f);
+  for (; i + 16 <= length; i += 16)
+    {
+      __m128i v = _mm_loadu_si128 ((const __m128i *) (str + i));
+      // unsigned v <= 0x1f  <=>  min(v, 0x1f) == v
+      __m128i control = _mm_cmpeq_epi8 (_mm_min_epu8 (v, max_control), v);
+      __m128i special = _mm_or_si128 (_mm_cmpeq_epi8 (v, quote),
+                                      _mm_cmpeq_epi8 (v, backslash));
+      int mask = _mm_movemask_epi8 (_mm_or_si128 (control, special));
+      if (mask != 0)
+        return i + __builtin_ctz (mask);
+    }
+#else
+# define ONES  0x0101010101010101ULL
+# define HIGHS 0x8080808080808080ULL
+  for (; i + 8 <= length; i += 8)
+    {
+      uint64_t w;
+      memcpy (&w, str + i, 8);
+      uint64_t q = w ^ (ONES * '"');
+      uint64_t b = w ^ (ONES * '\\');
+      uint64_t hits = ((w - ONES * 0x20) & ~w)
+                    | ((q - ONES) & ~q)
+                    | ((b - ONES) & ~b);
+      if ((hits & HIGHS) != 0)
+        break;                  // find the exact byte below
+    }
+# undef ONES
+# undef HIGHS
+#endif
+  while (i < length && !byte_needs_escape (str[i]))
+    i++;
+  return i;
+}
+
+static void
+print_string (Out *o, size_t length, const uint8_t *str)
+{
+  static const char hex[] = "0123456789abcdef";
+  out_byte (o, '"');
+  while (length > 0)
+    {
+      size_t clean = clean_prefix_length (length, str);
+      out_bytes (o, clean, str);
+      str += clean;
+      length -= clean;
+      if (length == 0)
+        break;
+
+      uint8_t c = *str++;
+      length--;
+      uint8_t *w = out_reserve (o, 6);
+      w[0] = '\\';
+      switch (c)
+        {
+        case '"':  w[1] = '"';  o->at += 2; break;
+        case '\\': w[1] = '\\'; o->at += 2; break;
+        case '\n': w[1] = 'n';  o->at += 2; break;
+        case '\r': w[1] = 'r';  o->at += 2; break;
+        case '\t': w[1] = 't';  o->at += 2; break;
+        case '\b': w[1] = 'b';  o->at += 2; break;
+        case '\f': w[1] = 'f';  o->at += 2; break;
+        default:
+          w[1] = 'u';
+          w[2] = '0';
+          w[3] = '0';
+          w[4] = hex[c >> 4];
+          w[5] = hex[c & 15];
+          o->at += 6;
+          break;
+        }
+    }
+  out_byte (o, '"');
+}
+
+static void
+print_bytes (Out *o, const ProtobufCBinaryData *bd)
+{
+  static const char hex[] = "0123456789abcdef";
+  const uint8_t *at = bd->data;
+  size_t rem = bd->len;
+  out_byte (o, '"');
+  while (rem > 0)
+    {
+      size_t n = rem < MAX_COPY_CHUNK ? rem : MAX_COPY_CHUNK;
+      uint8_t *w = out_reserve (o, 2 * n);
+      for (size_t i = 0; i < n; i++)
+        {
+          *w++ = hex[at[i] >> 4];
+          *w++ = hex[at[i] & 15];
+        }
+      o->at = w;
+      at += n;
+      rem -= n;
+    }
+  out_byte (o, '"');
+}
+
+/* --- Messages --- */
+static bool
+value_is_zero (const ProtobufCFieldDescriptor *f, const void *member)
+{
+  switch (f->type)
+    {
+    case PROTOBUF_C_TYPE_STRING:
+      {
+        const char *str = * (const char * const *) member;
+        return str == NULL || str[0] == '\0';
+      }
+    case PROTOBUF_C_TYPE_MESSAGE:
+      return * (const void * const *) member == NULL;
+    case PROTOBUF_C_TYPE_BYTES:
+      return ((const ProtobufCBinaryData *) member)->len == 0;
+    case PROTOBUF_C_TYPE_FLOAT:
+      return * (const float *) member == 0;
+    case PROTOBUF_C_TYPE_DOUBLE:
+      return * (const double *) member == 0;
+    default:
+      {
+        size_t size = pbcrep_wire_member_size (f->type);
+        return size == 4 ? * (const uint32_t *) member == 0
+                         : * (const uint64_t *) member == 0;
+      }
+    }
+}
+
+// Follows the same rules as protobuf_c_message_pack(), which writes
+// a NULL required string or message as an empty one.
+static bool
+field_is_present (const ProtobufCMessage *message,
+                  const ProtobufCFieldDescriptor *f)
+{
+  const char *m = (const char *) message;
+  const void *member = m + f->offset;
+  if (f->label == PROTOBUF_C_LABEL_REPEATED)
+    return * (const size_t *) (m + f->quantifier_offset) > 0;
+  if (f->flags & PROTOBUF_C_FIELD_FLAG_ONEOF)
+    return * (const uint32_t *) (m + f->quantifier_offset) == f->id;
+  if (f->type == PROTOBUF_C_TYPE_STRING || f->type == PROTOBUF_C_TYPE_MESSAGE)
+    {
+      const void *ptr = * (const void * const *) member;
+      if (ptr == NULL)
+        return f->label == PROTOBUF_C_LABEL_REQUIRED;
+      if (f->label == PROTOBUF_C_LABEL_OPTIONAL)
+        return ptr != f->default_value;
+    }
+  switch (f->label)
+    {
+    case PROTOBUF_C_LABEL_REQUIRED:
+      return true;
+    case PROTOBUF_C_LABEL_OPTIONAL:
+      if (f->type == PROTOBUF_C_TYPE_STRING || f->type == PROTOBUF_C_TYPE_MESSAGE)
+        return true;
+      return * (const protobuf_c_boolean *) (m + f->quantifier_offset);
+    default:            // proto3: no presence, skip zero values
+      return !value_is_zero (f, member);
+    }
+}
+
+static void print_message (PBCREP_Printer_JSON       *p,
+                           Out                       *o,
+                           const PBCREP_MessagePlan  *mplan,
+                           const ProtobufCMessage    *message,
+                           unsigned                   depth);
+
+static void
+print_value (PBCREP_Printer_JSON    *p,
+             Out                    *o,
+             const PBCREP_FieldPlan *fp,
+             const void             *value,
+             unsigned                depth)
+{
+  uint8_t *w;
+  switch (fp->field->type)
+    {
+    case PROTOBUF_C_TYPE_INT32:
+    case PROTOBUF_C_TYPE_SINT32:
+    case PROTOBUF_C_TYPE_SFIXED32:
+      w = out_reserve (o, MAX_SCALAR_SIZE);
+      o->at = w + format_int64 (* (const int32_t *) value, (char *) w);
+      break;
+    case PROTOBUF_C_TYPE_UINT32:
+    case PROTOBUF_C_TYPE_FIXED32:
+      w = out_reserve (o, MAX_SCALAR_SIZE);
+      o->at = w + format_uint64 (* (const uint32_t *) value, (char *) w);
+      break;
+    case PROTOBUF_C_TYPE_INT64:
+    case PROTOBUF_C_TYPE_SINT64:
+    case PROTOBUF_C_TYPE_SFIXED64:
+      w = out_reserve (o, MAX_SCALAR_SIZE);
+      o->at = w + format_int64 (* (const int64_t *) value, (char *) w);
+      break;
+    case PROTOBUF_C_TYPE_UINT64:
+    case PROTOBUF_C_TYPE_FIXED64:
+      w = out_reserve (o, MAX_SCALAR_SIZE);
+      o->at = w + format_uint64 (* (const uint64_t *) value, (char *) w);
+      break;
+    case PROTOBUF_C_TYPE_FLOAT:
+      w = out_reserve (o, MAX_SCALAR_SIZE);
+      o->at = w + format_float (* (const float *) value, (char *) w);
+      break;
+    case PROTOBUF_C_TYPE_DOUBLE:
+      w = out_reserve (o, MAX_SCALAR_SIZE);
+      o->at = w + format_double (* (const double *) value, (char *) w);
+      break;
+    case PROTOBUF_C_TYPE_BOOL:
+      if (* (const protobuf_c_boolean *) value)
+        out_bytes (o, 4, "true");
+      else
+        out_bytes (o, 5, "false");
+      break;
+    case PROTOBUF_C_TYPE_ENUM:
+      {
+        int v = * (const int32_t *) value;
+        const char *name = pbcrep_enum_plan_get_name (fp->enum_plan, v);
+        if (name == NULL)
+          {
+            w = out_reserve (o, MAX_SCALAR_SIZE);
+            o->at = w + format_int64 (v, (char *) w);
+          }
+        else
+          {
+            out_byte (o, '"');
+            out_bytes (o, strlen (name), name);
+            out_byte (o, '"');
+          }
+        break;
+      }
+    case PROTOBUF_C_TYPE_STRING:
+      {
+        // packed, NULL is an empty string
+        const char *str = * (const char * const *) value;
+        if (str == NULL)
+          out_bytes (o, 2, "\"\"");
+        else
+          print_string (o, strlen (str), (const uint8_t *) str);
+        break;
+      }
+    case PROTOBUF_C_TYPE_BYTES:
+      print_bytes (o, value);
+      break;
+    case PROTOBUF_C_TYPE_MESSAGE:
+      {
+        // and an empty message
+        const ProtobufCMessage *sub = * (const ProtobufCMessage * const *) value;
+        if (sub == NULL)
+          out_bytes (o, 2, "{}");
+        else
+          print_message (p, o, fp->message_plan, sub, depth);
+        break;
+      }
+    }
+}
+
+// The separator (unless this is the first field), and the key.
+static inline void
+print_key (PBCREP_Printer_JSON    *p,
+           Out                    *o,
+           const PBCREP_FieldPlan *fp,
+           unsigned                depth,
+           bool                   *first_inout)
+{
+  if (!*first_inout)
+    out_byte (o, ',');
+  *first_inout = false;
+  if (p->formatted)
+    out_newline_indent (o, (depth + 1) * p->indent_size);
+  if (p->quoteless_keys)
+    out_bytes (o, fp->json_key_quoteless_length, fp->json_key_quoteless);
+  else
+    out_bytes (o, fp->json_key_length, fp->json_key);
+  if (p->formatted)
+    out_byte (o, ' ');
+}
+
+static void
+print_message (PBCREP_Printer_JSON       *p,
+               Out                       *o,
+               const PBCREP_MessagePlan  *mplan,
+               const ProtobufCMessage    *message,
+               unsigned                   depth)
+{
+  const char *m = (const char *) message;
+  bool first = true;
+  out_byte (o, '{');
+  for (unsigned i = 0; i < mplan->n_fields; i++)
+    {
+      const PBCREP_FieldPlan *fp = mplan->fields + i;
+      const ProtobufCFieldDescriptor *f = fp->field;
+      if (!field_is_present (message, f))
+        continue;
+      print_key (p, o, fp, depth, &first);
+
+      if (f->label == PROTOBUF_C_LABEL_REPEATED)
+        {
+          size_t n = * (const size_t *) (m + f->quantifier_offset);
+          const char *arr = * (const char * const *) (m + f->offset);
+          size_t elt_size = pbcrep_wire_member_size (f->type);
+          out_byte (o, '[');
+          for (size_t j = 0; j < n; j++)
+            {
+              if (j > 0)
+                out_byte (o, ',');
+              if (p->formatted)
+                out_newline_indent (o, (depth + 2) * p->indent_size);
+              print_value (p, o, fp, arr + elt_size * j, depth + 2);
+            }
+          if (p->formatted)
+            out_newline_indent (o, (depth + 1) * p->indent_size);
+          out_byte (o, ']');
+        }
+      else
+        print_value (p, o, fp, m + f->offset, depth + 1);
+    }
+  if (p->formatted && !first)
+    out_newline_indent (o, depth * p->indent_size);
+  out_byte (o, '}');
+}
+
+/* --- Printing straight from the wire format ---
+ *
+ * pbcrep_printer_json_print_packed() prints what print_message() would
+ * print for the unpacked message, without unpacking it.
+ *
+ * Each message is read twice.  The first pass checks the fields
+ * and indexes them by field-number:  the first and last occurrence of
+ * each, and how many there are.  The second pass prints the fields
+ * in the order of the descriptor.  A non-repeated field prints its last
+ * occurrence.  A repeated field is printed by scanning from its first
+ * occurrence to its last, so its elements are grouped into one array
+ * even if the encoder interleaved them.  Sub-messages are read the same
+ * way when they are printed.
+ *
+ * The indexes of the messages being printed are stacked in one array
+ * that grows as needed and is kept by the printer, so nothing is
+ * allocated per field.  The one exception is a non-repeated message
+ * given more than once:  unpacking merges the occurrences, which is
+ * the same as concatenating them, so they are concatenated into
+ * a temporary buffer.
+ *
+ * Like protobuf_c_message_unpack(), every occurrence of a message
+ * must be valid by itself:  the pieces of a merged message, and
+ * oneof members that a later one overrides, are checked with
+ * pbcrep_validate_wire_unpackable() although they are not printed
+ * on their own.
+ */
+typedef struct WireFieldIndex {
+  uint32_t first;               // offset of the first occurrence's tag
+  uint32_t last;                // offset of the last occurrence's tag
+  uint32_t count;
+} WireFieldIndex;
+
+typedef union {
+  int32_t v_int32;
+  uint32_t v_uint32;
+  int64_t v_int64;
+  uint64_t v_uint64;
+  float v_float;
+  double v_double;
+  protobuf_c_boolean v_boolean;
+} WireScalar;
+
+static bool print_wire_message (PBCREP_Printer_JSON      *p,
+                                Out                      *o,
+                                const PBCREP_MessagePlan *mplan,
+                                size_t                    len,
+                                const uint8_t            *data,
+                                size_t                    index_base,
+                                unsigned                  depth);
+
+// Print one (unpacked) value.
+static bool
+print_wire_value (PBCREP_Printer_JSON    *p,
+                  Out                    *o,
+                  const PBCREP_FieldPlan *fp,
+                  size_t                  len,
+                  const uint8_t          *data,
+                  size_t                  index_base,
+                  unsigned                depth)
+{
+  switch (fp->field->type)
+    {
+    case PROTOBUF_C_TYPE_MESSAGE:
+      return print_wire_message (p, o, fp->message_plan, len, data, index_base, depth);
+    case PROTOBUF_C_TYPE_STRING:
+      // unpacked, the string would end at a NUL
+      print_string (o, strnlen ((const char *) data, len), data);
+      return true;
+    case PROTOBUF_C_TYPE_BYTES:
+      {
+        ProtobufCBinaryData bd = { len, (uint8_t *) data };
+        print_bytes (o, &bd);
+        return true;
+      }
+    default:
+      {
+        WireScalar v;
+        pbcrep_wire_decode_scalar (fp->field->type, len, data, &v);
+        print_value (p, o, fp, &v, depth);
+        return true;
+      }
+    }
+}
+
+// Proto3 fields (outside oneofs) are only printed if non-zero.
+static bool
+wire_value_is_zero (const ProtobufCFieldDescriptor *f, size_t len, const uint8_t *data)
+{
+  switch (f->type)
+    {
+    case PROTOBUF_C_TYPE_MESSAGE:
+      return false;
+    case PROTOBUF_C_TYPE_STRING:
+      return len == 0 || data[0] == 0;
+    case PROTOBUF_C_TYPE_BYTES:
+      return len == 0;
+    default:
+      {
+        WireScalar v;
+        pbcrep_wire_decode_scalar (f->type, len, data, &v);
+        return value_is_zero (f, &v);
+      }
+    }
+}
+
+// Unpacking checks every occurrence of a message, even one that is
+// overridden by another oneof member, or merged with the others.
+static bool
+wire_messages_are_valid (const ProtobufCFieldDescriptor *f,
+                         size_t                          len,
+                         const uint8_t                  *data,
+                         const WireFieldIndex           *fi)
+{
+  PBCREP_WireField wf;
+  for (size_t at = fi->first; at <= fi->last; at = wf.end)
+    {
+      pbcrep_wire_decode_field (len, data, at, &wf);
+      if (wf.number == f->id
+       && !pbcrep_validate_wire_unpackable (f->descriptor, wf.value_length,
+                                            data + wf.value_start, NULL))
+        return false;
+    }
+  return true;
+}
+
+// Occurrences of a non-repeated message are merged.
+static bool
+print_wire_merged_message (PBCREP_Printer_JSON    *p,
+                           Out                    *o,
+                           const PBCREP_FieldPlan *fp,
+                           size_t                  len,
+                           const uint8_t          *data,
+                           const WireFieldIndex   *fi,
+                           size_t                  index_base,
+                           unsigned                depth)
+{
+  if (!wire_messages_are_valid (fp->field, len, data, fi))
+    return false;
+  size_t merged_len = 0;
+  uint8_t *merged = pbcrep_malloc (fi->last - fi->first + len - fi->last);
+  PBCREP_WireField wf;
+  for (size_t at = fi->first; at <= fi->last; at = wf.end)
+    {
+      pbcrep_wire_decode_field (len, data, at, &wf);
+      if (wf.number != fp->field->id)
+        continue;
+      memcpy (merged + merged_len, data + wf.value_start, wf.value_length);
+      merged_len += wf.value_length;
+    }
+  bool rv = print_wire_message (p, o, fp->message_plan, merged_len, merged, index_base, depth);
+  pbcrep_free (merged);
+  return rv;
+}
+
+// All occurrences, packed or not, go into one array.
+static bool
+print_wire_repeated (PBCREP_Printer_JSON    *p,
+                     Out                    *o,
+                     const PBCREP_FieldPlan *fp,
+                     size_t                  len,
+                     const uint8_t          *data,
+                     const WireFieldIndex   *fi,
+                     size_t                  index_base,
+                     unsigned                depth,
+                     bool                   *first_inout)
+{
+  const ProtobufCFieldDescriptor *f = fp->field;
+  size_t first = fi->first, last = fi->last;    // 'fi' moves if the index grows
+  bool opened = false;
+  PBCREP_WireField wf;
+  for (size_t at = first; at <= last; at = wf.end)
+    {
+      pbcrep_wire_decode_field (len, data, at, &wf);
+      if (wf.number != f->id)
+        continue;
+      const uint8_t *value = data + wf.value_start;
+      size_t rem = wf.value_length;
+      bool packed = wf.wire_type == PBCREP_WIRE_TYPE_LENGTH_PREFIXED
+                 && pbcrep_wire_type_is_packable (f->type);
+      if (packed && pbcrep_wire_fixed_size (f->type) > 0 && rem % pbcrep_wire_fixed_size (f->type) != 0)
+        return false;
+      do
+        {
+          // an empty packed array has no elements
+          if (packed && rem == 0)
+            break;
+          if (!opened)
+            {
+              print_key (p, o, fp, depth, first_inout);
+              out_byte (o, '[');
+              opened = true;
+            }
+          else
+            out_byte (o, ',');
+          if (p->formatted)
+            out_newline_indent (o, (depth + 2) * p->indent_size);
+          if (packed)
+            {
+              WireScalar v;
+              size_t used = pbcrep_wire_decode_scalar (f->type, rem, value, &v);
+              if (used == 0)
+                return false;
+              print_value (p, o, fp, &v, depth + 2);
+              value += used;
+              rem -= used;
+            }
+          else if (!print_wire_value (p, o, fp, rem, value, index_base, depth + 2))
+            return false;
+        }
+      while (packed && rem > 0);
+    }
+  if (opened)
+    {
+      if (p->formatted)
+        out_newline_indent (o, (depth + 1) * p->indent_size);
+      out_byte (o, ']');
+    }
+  return true;
+}
+
+static bool
+print_wire_message (PBCREP_Printer_JSON      *p,
+                    Out                      *o,
+                    const PBCREP_MessagePlan *mplan,
+                    size_t                    len,
+                    const uint8_t            *data,
+                    size_t                    index_base,
+                    unsigned                  depth)
+{
+  unsigned n_fields = mplan->n_fields;
+  if (index_base + n_fields > p->wire_index_alloced)
+    {
+      size_t new_alloced = p->wire_index_alloced > 0 ? p->wire_index_alloced * 2 : 32;
+      while (index_base + n_fields > new_alloced)
+        new_alloced *= 2;
+      p->wire_index = pbcrep_realloc (p->wire_index, new_alloced * sizeof (WireFieldIndex));
+      p->wire_index_alloced = new_alloced;
+    }
+  WireFieldIndex *index = p->wire_index + index_base;
+  memset (index, 0, n_fields * sizeof (WireFieldIndex));
+
+  // Pass 1:  check and index the fields.
+  unsigned guess = 0;
+  PBCREP_WireField wf;
+  for (size_t at = 0; at < len; at = wf.end)
+    {
+      if (!pbcrep_wire_decode_field (len, data, at, &wf))
+        return false;
+      int i = pbcrep_wire_find_field (mplan->descriptor, wf.number, &guess);
+      if (i < 0)
+        continue;               // unknown fields are not printed
+      if (!pbcrep_wire_type_matches (mplan->fields[i].field, wf.wire_type))
+        return false;
+      if (index[i].count++ == 0)
+        index[i].first = at;
+      index[i].last = at;
+    }
+  for (unsigned i = 0; i < n_fields; i++)
+    if (index[i].count == 0
+     && mplan->fields[i].field->label == PROTOBUF_C_LABEL_REQUIRED)
+      return false;
+
+  // Pass 2:  print them.
+  size_t sub_index_base = index_base + n_fields;
+  bool first = true;
+  out_byte (o, '{');
+  for (unsigned i = 0; i < n_fields; i++)
+    {
+      const PBCREP_FieldPlan *fp = mplan->fields + i;
+      const ProtobufCFieldDescriptor *f = fp->field;
+      index = p->wire_index + index_base;       // printing sub-messages may move it
+      if (index[i].count == 0)
+        continue;
+      if ((f->flags & PROTOBUF_C_FIELD_FLAG_ONEOF)
+       && !pbcrep_wire_oneof_member_is_last (mplan->descriptor, i,
+                                             &index[0].count, &index[0].last,
+                                             sizeof (WireFieldIndex)))
+        {
+          if (f->type == PROTOBUF_C_TYPE_MESSAGE
+           && !wire_messages_are_valid (f, len, data, index + i))
+            return false;
+          continue;
+        }
+      if (f->label == PROTOBUF_C_LABEL_REPEATED)
+        {
+          if (!print_wire_repeated (p, o, fp, len, data, index + i,
+                                    sub_index_base, depth, &first))
+            return false;
+          continue;
+        }
+
+      pbcrep_wire_decode_field (len, data, index[i].last, &wf);
+      const uint8_t *value = data + wf.value_start;
+      if (f->label == PROTOBUF_C_LABEL_NONE
+       && (f->flags & PROTOBUF_C_FIELD_FLAG_ONEOF) == 0
+       && wire_value_is_zero (f, wf.value_length, value))
+        continue;
+      print_key (p, o, fp, depth, &first);
+      if (f->type == PROTOBUF_C_TYPE_MESSAGE && index[i].count > 1)
+        {
+          WireFieldIndex fi = index[i];
+          if (!print_wire_merged_message (p, o, fp, len, data, &fi,
+                                          sub_index_base, depth + 1))
+            return false;
+        }
+      else if (!print_wire_value (p, o, fp, wf.value_length, value,
+                                  sub_index_base, depth + 1))
+        return false;
+    }
+  if (p->formatted && !first)
+    out_newline_indent (o, depth * p->indent_size);
+  out_byte (o, '}');
+  return true;
+}
+
+/* --- PBCREP_Printer methods --- */
+static bool
+pbcrep_printer_json_print (PBCREP_Printer *printer,
+                           const ProtobufCMessage *message,
+                           PBCREP_Error **error)
+{
+  PBCREP_Printer_JSON *p = (PBCREP_Printer_JSON *) printer;
+  if (message->descriptor != p->plan->root->descriptor)
+    {
+      if (error != NULL)
+        *error = pbcrep_error_new ("WRONG_MESSAGE_TYPE",
+                                   "message type does not match printer");
+      return false;
+    }
+  Out o;
+  out_start (&o, &printer->output_data);
+  print_message (p, &o, p->plan->root, message, 0);
+  out_byte (&o, '\n');
+  out_commit (&o);
+  return true;
+}
+
+static void
+pbcrep_printer_json_destroy (PBCREP_Printer *printer)
+{
+  PBCREP_Printer_JSON *p = (PBCREP_Printer_JSON *) printer;
+  pbcrep_plan_unref (p->plan);
+  pbcrep_free (p->wire_index);
+}
+
+bool
+pbcrep_printer_is_json (PBCREP_Printer                    *printer,
+                        const ProtobufCMessageDescriptor **desc_out)
+{
+  if (printer->print != pbcrep_printer_json_print)
+    return false;
+  PBCREP_Printer_JSON *p = (PBCREP_Printer_JSON *) printer;
+  if (desc_out != NULL)
+    *desc_out = p->plan->root->descriptor;
+  return true;
+}
+
+bool
+pbcrep_printer_json_print_packed (PBCREP_Printer  *printer,
+                                  size_t           length,
+                                  const uint8_t   *data,
+                                  PBCREP_Error   **error)
+{
+  PBCREP_Printer_JSON *p = (PBCREP_Printer_JSON *) printer;
+  assert (printer->print == pbcrep_printer_json_print);
+  size_t old_size = printer->output_data.size;
+  Out o;
+  out_start (&o, &printer->output_data);
+  // offsets are kept as uint32_t
+  bool ok = length <= UINT32_MAX
+         && print_wire_message (p, &o, p->plan->root, length, data, 0, 0);
+  if (ok)
+    out_byte (&o, '\n');
+  out_commit (&o);
+  if (!ok)
+    {
+      pbcrep_buffer_truncate (&printer->output_data, old_size);
+      if (error != NULL)
+        *error = pbcrep_error_new ("PROTOBUF_MALFORMED",
+                                   "Error unpacking Protocol Buffers message");
+      return false;
+    }
+  return true;
+}
+
+PBCREP_Printer *
+pbcrep_printer_new_json_from_plan (PBCREP_Plan                      *plan,
+                                   const PBCREP_JSON_PrinterOptions *options)
+{
+  PBCREP_Printer *printer = pbcrep_printer_new_protected (sizeof (PBCREP_Printer_JSON));
+  PBCREP_Printer_JSON *p = (PBCREP_Printer_JSON *) printer;
+  printer->print = pbcrep_printer_json_print;
+  printer->destroy = pbcrep_printer_json_destroy;
+  p->plan = pbcrep_plan_ref (plan);
+  p->quoteless_keys = options != NULL && options->quoteless_keys;
+  p->formatted = options != NULL && options->formatted;
+  p->indent_size = options != NULL && options->indent_size > 0
+                 ? options->indent_size
+                 : 2;
+  p->wire_index = NULL;
+  p->wire_index_alloced = 0;
+  return printer;
+}
+
+PBCREP_Printer *
+pbcrep_printer_new_json (const ProtobufCMessageDescriptor *desc,
+                         const PBCREP_JSON_PrinterOptions *options)
+{
+  PBCREP_Plan *plan = pbcrep_plan_new (desc);
+  PBCREP_Printer *rv = pbcrep_printer_new_json_from_plan (plan, options);
+  pbcrep_plan_unref (plan);
+  return rv;
+}
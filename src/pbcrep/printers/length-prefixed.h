@@ -3,3 +3,10 @@ PBCREP_Printer *pbcrep_printer_new_length_prefixed
                                  (PBCREP_LengthPrefixed_Format lp_format,
                                   const ProtobufCMessageDescriptor *desc);
 
+
+// Whether 'printer' came from pbcrep_printer_new_length_prefixed(),
+// and if so, its format and message type.
+bool pbcrep_printer_is_length_prefixed
+                                 (PBCREP_Printer *printer,
+                                  PBCREP_LengthPrefixed_Format *format_out,
+                                  const ProtobufCMessageDescriptor **desc_out);
@@ -0,0 +1,92 @@
+/*
+ * Length-prefixed printer.
+ *
+ * Messages are packed by a PBCREP_Packer straight into the printer's
+ * output buffer:  there is no temporary copy of the packed message.
+ *
+ * The packer measures the message first, so the length is known
+ * before anything is written:  the prefix goes first, and a message
+ * too long for a fixed-width prefix is rejected without writing it.
+ */
+#include "../../../pbcrep.h"
+#include "../../length-prefix.h"
+#include <string.h>
+
+typedef struct PBCREP_Printer_LengthPrefixed PBCREP_Printer_LengthPrefixed;
+struct PBCREP_Printer_LengthPrefixed
+{
+  PBCREP_Printer base;
+  const ProtobufCMessageDescriptor *descriptor;
+  PBCREP_LengthPrefixed_Format lp_format;
+  unsigned prefix_size;                 // 0 for the B128 formats
+  size_t max_length;
+  PBCREP_Packer *packer;
+};
+
+static bool
+pbcrep_printer_length_prefixed_print (PBCREP_Printer *printer,
+                                      const ProtobufCMessage *message,
+                                      PBCREP_Error **error)
+{
+  PBCREP_Printer_LengthPrefixed *lp = (PBCREP_Printer_LengthPrefixed *) printer;
+  PBCREP_Buffer *out = &printer->output_data;
+  uint8_t prefix[PBCREP_LENGTH_PREFIX_MAX_SIZE];
+
+  if (message->descriptor != lp->descriptor)
+    {
+      if (error != NULL)
+        *error = pbcrep_error_new ("WRONG_MESSAGE_TYPE",
+                                   "message type does not match printer");
+      return false;
+    }
+
+  size_t size = pbcrep_packer_measure (lp->packer, message);
+  if (size > lp->max_length)
+    {
+      if (error != NULL)
+        *error = pbcrep_error_new_printf ("MESSAGE_TOO_LONG",
+                                          "message of %zu bytes does not fit in a %u-byte length prefix",
+                                          size, lp->prefix_size);
+      return false;
+    }
+  unsigned prefix_len = pbcrep_length_prefix_encode (lp->lp_format, size, prefix);
+  pbcrep_buffer_append_small (out, prefix_len, prefix);
+  pbcrep_packer_pack_measured (lp->packer, message, out);
+  return true;
+}
+
+static void
+pbcrep_printer_length_prefixed_destroy (PBCREP_Printer *printer)
+{
+  PBCREP_Printer_LengthPrefixed *lp = (PBCREP_Printer_LengthPrefixed *) printer;
+  pbcrep_packer_destroy (lp->packer);
+}
+
+PBCREP_Printer *
+pbcrep_printer_new_length_prefixed (PBCREP_LengthPrefixed_Format lp_format,
+                                    const ProtobufCMessageDescriptor *desc)
+{
+  PBCREP_Printer *printer = pbcrep_printer_new_protected (sizeof (PBCREP_Printer_LengthPrefixed));
+  PBCREP_Printer_LengthPrefixed *lp = (PBCREP_Printer_LengthPrefixed *) printer;
+  printer->print = pbcrep_printer_length_prefixed_print;
+  printer->destroy = pbcrep_printer_length_prefixed_destroy;
+  lp->descriptor = desc;
+  lp->lp_format = lp_format;
+  lp->prefix_size = pbcrep_length_prefix_fixed_size (lp_format);
+  lp->max_length = pbcrep_length_prefix_max_length (lp_format);
+  lp->packer = pbcrep_packer_new ();
+  return printer;
+}
+
+bool
+pbcrep_printer_is_length_prefixed (PBCREP_Printer *printer,
+                                   PBCREP_LengthPrefixed_Format *format_out,
+                                   const ProtobufCMessageDescriptor **desc_out)
+{
+  if (printer->print != pbcrep_printer_length_prefixed_print)
+    return false;
+  PBCREP_Printer_LengthPrefixed *lp = (PBCREP_Printer_LengthPrefixed *) printer;
+  *format_out = lp->lp_format;
+  *desc_out = lp->descriptor;
+  return true;
+}
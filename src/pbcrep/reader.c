@@ -0,0 +1,101 @@
+#include "../pbcrep.h"
+
+PBCREP_ReadResult
+pbcrep_reader_advance    (PBCREP_Reader           *reader,
+                          PBCREP_Error           **error)
+{
+  return reader->advance (reader, error);
+}
+
+void
+pbcrep_reader_destroy    (PBCREP_Reader           *reader)
+{
+  reader->destroy (reader);
+}
+
+/* --- binary-data reader + parser --- */
+typedef struct {
+  PBCREP_Reader base;
+  PBCREP_BinaryDataReader *input;
+  PBCREP_Parser *parser;
+  PBCREP_Buffer buffer;
+  bool started;                         // advance() has been called
+  bool ended;                           // end_feed() has been called
+} ParserReader;
+
+static PBCREP_ReadResult
+parser_reader_advance (PBCREP_Reader *reader,
+                       PBCREP_Error **error)
+{
+  ParserReader *r = (ParserReader *) reader;
+  r->started = true;
+  for (;;)
+    {
+      pbcrep_parser_advance (r->parser);
+      reader->message = r->parser->current_message;
+      if (reader->message != NULL)
+        return PBCREP_READ_RESULT_OK;
+      if (r->ended)
+        return PBCREP_READ_RESULT_EOF;
+
+      size_t amt;
+      PBCREP_ReadResult rv = pbcrep_binary_data_reader_read_buffer (r->input, &r->buffer,
+                                                                   &amt, error);
+      switch (rv)
+        {
+        case PBCREP_READ_RESULT_OK:
+          if (!pbcrep_parser_feed_buffer (r->parser, &r->buffer, error))
+            return PBCREP_READ_RESULT_ERROR;
+          break;
+        case PBCREP_READ_RESULT_EOF:
+          r->ended = true;
+          if (!pbcrep_parser_end_feed (r->parser, error))
+            return PBCREP_READ_RESULT_ERROR;
+          break;
+        default:
+          return rv;
+        }
+    }
+}
+
+static void
+parser_reader_destroy (PBCREP_Reader *reader)
+{
+  ParserReader *r = (ParserReader *) reader;
+  pbcrep_parser_destroy (r->parser);
+  pbcrep_binary_data_reader_destroy (r->input);
+  pbcrep_buffer_clear (&r->buffer);
+  pbcrep_free (r);
+}
+
+PBCREP_Reader *
+pbcrep_reader_new_parser (PBCREP_BinaryDataReader *reader,
+                          PBCREP_Parser           *parser)
+{
+  ParserReader *r = pbcrep_malloc (sizeof (ParserReader));
+  r->base.descriptor = parser->message_desc;
+  r->base.message = NULL;
+  r->base.advance = parser_reader_advance;
+  r->base.destroy = parser_reader_destroy;
+  r->input = reader;
+  r->parser = parser;
+  pbcrep_buffer_init (&r->buffer);
+  r->started = false;
+  r->ended = false;
+  return &r->base;
+}
+
+bool
+pbcrep_reader_peek_parser(PBCREP_Reader           *reader,
+                          PBCREP_BinaryDataReader **input_out,
+                          PBCREP_Parser          **parser_out)
+{
+  if (reader->advance != parser_reader_advance)
+    return false;
+  ParserReader *r = (ParserReader *) reader;
+  if (r->started)
+    return false;
+  *input_out = r->input;
+  *parser_out = r->parser;
+  return true;
+}
@@ -17,3 +17,10 @@ PBCREP_ReadResult pbcrep_reader_advance    (PBCREP_Reader           *reader,
                                             PBCREP_Error           **error);
 void              pbcrep_reader_destroy    (PBCREP_Reader           *reader);
 
+
+// For readers from pbcrep_reader_new_parser() that have not been
+// advanced yet:  their binary-data reader and parser, so the caller
+// can consume the input some other way.  Returns false otherwise.
+bool              pbcrep_reader_peek_parser(PBCREP_Reader           *reader,
+                                            PBCREP_BinaryDataReader **input_out,
+                                            PBCREP_Parser          **parser_out);
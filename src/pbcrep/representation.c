@@ -0,0 +1,450 @@
+/*
+ * Representation strings, and the global factory cache.
+ *
+ * The built-in representations are static objects;
+ * pbcrep_representation_from_string() just finds one by name.
+ *
+ * The cache maps (repstr, desc) to a (lazily created) parser-factory
+ * and printer-factory.  It is a chained hash-table guarded by
+ * a single mutex:  lookups are short and happen once per
+ * parser/printer, so contention is not a concern.
+ * Factories are built with the mutex released.
+ */
+#include "../pbcrep.h"
+#include <assert.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define CACHE_INITIAL_SIZE  16
+
+typedef enum
+{
+  BUILTIN_JSON,
+  BUILTIN_LENGTH_PREFIXED
+} BuiltinKind;
+
+typedef struct BuiltinRepresentation BuiltinRepresentation;
+struct BuiltinRepresentation
+{
+  PBCREP_Representation base;
+  const char *name;
+  BuiltinKind kind;
+  PBCREP_JSON_Dialect json_dialect;                     // BUILTIN_JSON
+  PBCREP_LengthPrefixed_Format lp_format;               // BUILTIN_LENGTH_PREFIXED
+};
+
+static PBCREP_ParserFactory *
+builtin_create_parser_factory (PBCREP_Representation *rep,
+                               const ProtobufCMessageDescriptor *desc)
+{
+  BuiltinRepresentation *b = (BuiltinRepresentation *) rep;
+  switch (b->kind)
+    {
+    case BUILTIN_JSON:
+      {
+        PBCREP_Parser_JSONOptions options = PBCREP_PARSER_JSON_OPTIONS_INIT;
+        options.json_dialect = b->json_dialect;
+        return pbcrep_parser_factory_new_json (desc, &options);
+      }
+    case BUILTIN_LENGTH_PREFIXED:
+      return pbcrep_parser_factory_new_length_prefixed (b->lp_format, desc);
+    }
+  return NULL;
+}
+
+static PBCREP_PrinterFactory *
+builtin_create_printer_factory (PBCREP_Representation *rep,
+                                const ProtobufCMessageDescriptor *desc)
+{
+  BuiltinRepresentation *b = (BuiltinRepresentation *) rep;
+  switch (b->kind)
+    {
+    case BUILTIN_JSON:
+      {
+        PBCREP_JSON_PrinterOptions options;
+        memset (&options, 0, sizeof (options));
+        options.quoteless_keys = b->json_dialect == PBCREP_JSON_DIALECT_JSON5;
+        return pbcrep_printer_factory_new_json (desc, &options);
+      }
+    case BUILTIN_LENGTH_PREFIXED:
+      return pbcrep_printer_factory_new_length_prefixed (b->lp_format, desc);
+    }
+  return NULL;
+}
+
+static PBCREP_Parser *
+builtin_create_parser (PBCREP_Representation *rep,
+                       const ProtobufCMessageDescriptor *desc)
+{
+  BuiltinRepresentation *b = (BuiltinRepresentation *) rep;
+  switch (b->kind)
+    {
+    case BUILTIN_JSON:
+      {
+        PBCREP_Parser_JSONOptions options = PBCREP_PARSER_JSON_OPTIONS_INIT;
+        options.json_dialect = b->json_dialect;
+        return pbcrep_parser_new_json (desc, &options);
+      }
+    case BUILTIN_LENGTH_PREFIXED:
+      return pbcrep_parser_new_length_prefixed (b->lp_format, desc);
+    }
+  return NULL;
+}
+
+static PBCREP_Printer *
+builtin_create_printer (PBCREP_Representation *rep,
+                        const ProtobufCMessageDescriptor *desc)
+{
+  BuiltinRepresentation *b = (BuiltinRepresentation *) rep;
+  switch (b->kind)
+    {
+    case BUILTIN_JSON:
+      {
+        PBCREP_JSON_PrinterOptions options;
+        memset (&options, 0, sizeof (options));
+        options.quoteless_keys = b->json_dialect == PBCREP_JSON_DIALECT_JSON5;
+        return pbcrep_printer_new_json (desc, &options);
+      }
+    case BUILTIN_LENGTH_PREFIXED:
+      return pbcrep_printer_new_length_prefixed (b->lp_format, desc);
+    }
+  return NULL;
+}
+
+#define BUILTIN_REP_METHODS                                     \
+  {                                                             \
+    builtin_create_parser_factory,                              \
+    builtin_create_printer_factory,                             \
+    builtin_create_parser,                                      \
+    builtin_create_printer,                                     \
+    NULL, NULL                                                  \
+  }
+#define BUILTIN_JSON_REP(name, dialect)                         \
+  { BUILTIN_REP_METHODS, name, BUILTIN_JSON, dialect, 0 }
+#define BUILTIN_LP_REP(name, format)                            \
+  { BUILTIN_REP_METHODS, name, BUILTIN_LENGTH_PREFIXED,         \
+    PBCREP_JSON_DIALECT_JSON, format }
+
+static BuiltinRepresentation builtin_representations[] = {
+  BUILTIN_JSON_REP ("json", PBCREP_JSON_DIALECT_JSON),
+  BUILTIN_JSON_REP ("json5", PBCREP_JSON_DIALECT_JSON5),
+  BUILTIN_LP_REP ("length_prefixed_u8", PBCREP_LENGTH_PREFIXED_UINT8),
+  BUILTIN_LP_REP ("length_prefixed_u16_le", PBCREP_LENGTH_PREFIXED_UINT16_LE),
+  BUILTIN_LP_REP ("length_prefixed_u24_le", PBCREP_LENGTH_PREFIXED_UINT24_LE),
+  BUILTIN_LP_REP ("length_prefixed_u32_le", PBCREP_LENGTH_PREFIXED_UINT32_LE),
+  BUILTIN_LP_REP ("length_prefixed_u16_be", PBCREP_LENGTH_PREFIXED_UINT16_BE),
+  BUILTIN_LP_REP ("length_prefixed_u24_be", PBCREP_LENGTH_PREFIXED_UINT24_BE),
+  BUILTIN_LP_REP ("length_prefixed_u32_be", PBCREP_LENGTH_PREFIXED_UINT32_BE),
+  BUILTIN_LP_REP ("length_prefixed_b128", PBCREP_LENGTH_PREFIXED_B128),
+  BUILTIN_LP_REP ("length_prefixed_b128_be", PBCREP_LENGTH_PREFIXED_B128_BE),
+};
+#define N_BUILTIN_REPRESENTATIONS \
+  (sizeof (builtin_representations) / sizeof (builtin_representations[0]))
+
+PBCREP_Representation *
+pbcrep_representation_from_string (const char *repstr,
+                                   PBCREP_Error **error)
+{
+  for (unsigned i = 0; i < N_BUILTIN_REPRESENTATIONS; i++)
+    if (strcmp (builtin_representations[i].name, repstr) == 0)
+      return &builtin_representations[i].base;
+  if (error != NULL)
+    *error = pbcrep_error_new_printf ("UNKNOWN_REPRESENTATION",
+                                      "unknown representation '%s'",
+                                      repstr);
+  return NULL;
+}
+
+bool
+pbcrep_representation_is_length_prefixed (PBCREP_Representation        *rep,
+                                          PBCREP_LengthPrefixed_Format *format_out)
+{
+  for (unsigned i = 0; i < N_BUILTIN_REPRESENTATIONS; i++)
+    if (rep == &builtin_representations[i].base)
+      {
+        if (builtin_representations[i].kind != BUILTIN_LENGTH_PREFIXED)
+          return false;
+        if (format_out != NULL)
+          *format_out = builtin_representations[i].lp_format;
+        return true;
+      }
+  return false;
+}
+
+PBCREP_Representation *
+pbcrep_representation_ref (PBCREP_Representation *rep)
+{
+  if (rep->ref != NULL)
+    rep->ref (rep);
+  return rep;
+}
+
+void
+pbcrep_representation_unref (PBCREP_Representation *rep)
+{
+  if (rep->unref != NULL)
+    rep->unref (rep);
+}
+
+PBCREP_ParserFactory *
+pbcrep_representation_create_parser_factory (PBCREP_Representation *rep,
+                                             const ProtobufCMessageDescriptor *desc)
+{
+  return rep->create_parser_factory (rep, desc);
+}
+
+PBCREP_PrinterFactory *
+pbcrep_representation_create_printer_factory(PBCREP_Representation *rep,
+                                             const ProtobufCMessageDescriptor *desc)
+{
+  return rep->create_printer_factory (rep, desc);
+}
+
+/* --- the cache --- */
+typedef struct CacheEntry CacheEntry;
+struct CacheEntry
+{
+  uint32_t hash;
+  const ProtobufCMessageDescriptor *desc;
+  PBCREP_Representation *rep;
+  PBCREP_ParserFactory *parser_factory;         // lazily created
+  PBCREP_PrinterFactory *printer_factory;       // lazily created
+  CacheEntry *next;
+  char repstr[];
+};
+
+static pthread_mutex_t cache_mutex = PTHREAD_MUTEX_INITIALIZER;
+static unsigned cache_table_size;               // power-of-two, or 0
+static unsigned cache_n_entries;
+static CacheEntry **cache_table;
+
+static inline uint32_t
+cache_hash (const char *repstr, const ProtobufCMessageDescriptor *desc)
+{
+  uint64_t h = (uintptr_t) desc;
+  h *= 0x9e3779b97f4a7c15ULL;
+  return pbcrep_plan_hash_name (strlen (repstr), repstr) ^ (uint32_t) (h >> 32);
+}
+
+static void
+cache_resize (unsigned new_size)
+{
+  CacheEntry **new_table = pbcrep_malloc (sizeof (CacheEntry *) * new_size);
+  memset (new_table, 0, sizeof (CacheEntry *) * new_size);
+  for (unsigned i = 0; i < cache_table_size; i++)
+    while (cache_table[i] != NULL)
+      {
+        CacheEntry *move = cache_table[i];
+        cache_table[i] = move->next;
+        unsigned b = move->hash & (new_size - 1);
+        move->next = new_table[b];
+        new_table[b] = move;
+      }
+  pbcrep_free (cache_table);
+  cache_table = new_table;
+  cache_table_size = new_size;
+}
+
+// Must be called with cache_mutex held.
+static CacheEntry *
+cache_lookup_locked (const char *repstr,
+                     const ProtobufCMessageDescriptor *desc,
+                     PBCREP_Error **error)
+{
+  uint32_t hash = cache_hash (repstr, desc);
+  if (cache_table_size > 0)
+    {
+      CacheEntry *at;
+      for (at = cache_table[hash & (cache_table_size - 1)]; at != NULL; at = at->next)
+        if (at->hash == hash && at->desc == desc && strcmp (at->repstr, repstr) == 0)
+          return at;
+    }
+
+  PBCREP_Representation *rep = pbcrep_representation_from_string (repstr, error);
+  if (rep == NULL)
+    return NULL;
+
+  if (cache_table_size == 0)
+    cache_resize (CACHE_INITIAL_SIZE);
+  else if (cache_n_entries * 2 >= cache_table_size)
+    cache_resize (cache_table_size * 2);
+
+  size_t repstr_len = strlen (repstr);
+  CacheEntry *entry = pbcrep_malloc (sizeof (CacheEntry) + repstr_len + 1);
+  entry->hash = hash;
+  entry->desc = desc;
+  entry->rep = rep;
+  entry->parser_factory = NULL;
+  entry->printer_factory = NULL;
+  memcpy (entry->repstr, repstr, repstr_len + 1);
+  unsigned b = hash & (cache_table_size - 1);
+  entry->next = cache_table[b];
+  cache_table[b] = entry;
+  cache_n_entries++;
+  return entry;
+}
+
+// The factory is built outside cache_mutex, since that analyzes the
+// whole descriptor.  If another thread published one meanwhile,
+// ours is dropped and theirs is returned.
+PBCREP_ParserFactory *
+pbcrep_try_get_parser_factory  (const char                       *repstr,
+                                const ProtobufCMessageDescriptor *desc,
+                                PBCREP_Error                    **error)
+{
+  PBCREP_ParserFactory *rv = NULL;
+  pthread_mutex_lock (&cache_mutex);
+  CacheEntry *entry = cache_lookup_locked (repstr, desc, error);
+  if (entry != NULL && entry->parser_factory != NULL)
+    rv = pbcrep_parser_factory_ref (entry->parser_factory);
+  PBCREP_Representation *rep = entry != NULL ? entry->rep : NULL;
+  pthread_mutex_unlock (&cache_mutex);
+  if (rv != NULL || rep == NULL)
+    return rv;
+
+  PBCREP_ParserFactory *created = pbcrep_representation_create_parser_factory (rep, desc);
+  if (created == NULL)
+    {
+      if (error != NULL)
+        *error = pbcrep_error_new_printf ("PARSER_NOT_SUPPORTED",
+                                          "representation '%s' cannot parse %s",
+                                          repstr, desc->name);
+      return NULL;
+    }
+
+  // Re-check:  the entry may have been filled in, or the cache cleared.
+  pthread_mutex_lock (&cache_mutex);
+  entry = cache_lookup_locked (repstr, desc, NULL);
+  assert (entry != NULL);
+  if (entry->parser_factory == NULL)
+    {
+      entry->parser_factory = created;
+      created = NULL;
+    }
+  rv = pbcrep_parser_factory_ref (entry->parser_factory);
+  pthread_mutex_unlock (&cache_mutex);
+  if (created != NULL)
+    pbcrep_parser_factory_unref (created);
+  return rv;
+}
+
+PBCREP_PrinterFactory *
+pbcrep_try_get_printer_factory (const char                       *repstr,
+                                const ProtobufCMessageDescriptor *desc,
+                                PBCREP_Error                    **error)
+{
+  PBCREP_PrinterFactory *rv = NULL;
+  pthread_mutex_lock (&cache_mutex);
+  CacheEntry *entry = cache_lookup_locked (repstr, desc, error);
+  if (entry != NULL && entry->printer_factory != NULL)
+    rv = pbcrep_printer_factory_ref (entry->printer_factory);
+  PBCREP_Representation *rep = entry != NULL ? entry->rep : NULL;
+  pthread_mutex_unlock (&cache_mutex);
+  if (rv != NULL || rep == NULL)
+    return rv;
+
+  PBCREP_PrinterFactory *created = pbcrep_representation_create_printer_factory (rep, desc);
+  if (created == NULL)
+    {
+      if (error != NULL)
+        *error = pbcrep_error_new_printf ("PRINTER_NOT_SUPPORTED",
+                                          "representation '%s' cannot print %s",
+                                          repstr, desc->name);
+      return NULL;
+    }
+
+  // Re-check:  the entry may have been filled in, or the cache cleared.
+  pthread_mutex_lock (&cache_mutex);
+  entry = cache_lookup_locked (repstr, desc, NULL);
+  assert (entry != NULL);
+  if (entry->printer_factory == NULL)
+    {
+      entry->printer_factory = created;
+      created = NULL;
+    }
+  rv = pbcrep_printer_factory_ref (entry->printer_factory);
+  pthread_mutex_unlock (&cache_mutex);
+  if (created != NULL)
+    pbcrep_printer_factory_unref (created);
+  return rv;
+}
+
+void
+pbcrep_representation_cache_clear (void)
+{
+  pthread_mutex_lock (&cache_mutex);
+  for (unsigned i = 0; i < cache_table_size; i++)
+    while (cache_table[i] != NULL)
+      {
+        CacheEntry *kill = cache_table[i];
+        cache_table[i] = kill->next;
+        if (kill->parser_factory != NULL)
+          pbcrep_parser_factory_unref (kill->parser_factory);
+        if (kill->printer_factory != NULL)
+          pbcrep_printer_factory_unref (kill->printer_factory);
+        pbcrep_representation_unref (kill->rep);
+        pbcrep_free (kill);
+      }
+  pbcrep_free (cache_table);
+  cache_table = NULL;
+  cache_table_size = 0;
+  cache_n_entries = 0;
+  pthread_mutex_unlock (&cache_mutex);
+}
+
+/* --- pbcrep.h convenience functions --- */
+PBCREP_Parser *
+pbcrep_try_make_parser  (const char                       *rep_str_spec,
+                         const ProtobufCMessageDescriptor *desc,
+                         PBCREP_Error                    **error)
+{
+  PBCREP_ParserFactory *factory = pbcrep_try_get_parser_factory (rep_str_spec, desc, error);
+  if (factory == NULL)
+    return NULL;
+  PBCREP_Parser *rv = pbcrep_parser_factory_create_parser (factory);
+  pbcrep_parser_factory_unref (factory);
+  return rv;
+}
+
+PBCREP_Parser *
+pbcrep_make_parser      (const char                       *rep_str_spec,
+                         const ProtobufCMessageDescriptor *desc)
+{
+  PBCREP_Error *error = NULL;
+  PBCREP_Parser *rv = pbcrep_try_make_parser (rep_str_spec, desc, &error);
+  if (rv == NULL)
+    {
+      fprintf (stderr, "pbcrep_make_parser: %s\n", error->error_message);
+      abort ();
+    }
+  return rv;
+}
+
+PBCREP_Printer *
+pbcrep_try_make_printer (const char                       *rep_str_spec,
+                         const ProtobufCMessageDescriptor *desc,
+                         PBCREP_Error                    **error)
+{
+  PBCREP_PrinterFactory *factory = pbcrep_try_get_printer_factory (rep_str_spec, desc, error);
+  if (factory == NULL)
+    return NULL;
+  PBCREP_Printer *rv = pbcrep_printer_factory_create_printer (factory);
+  pbcrep_printer_factory_unref (factory);
+  return rv;
+}
+
+PBCREP_Printer *
+pbcrep_make_printer     (const char                       *rep_str_spec,
+                         const ProtobufCMessageDescriptor *desc)
+{
+  PBCREP_Error *error = NULL;
+  PBCREP_Printer *rv = pbcrep_try_make_printer (rep_str_spec, desc, &error);
+  if (rv == NULL)
+    {
+      fprintf (stderr, "pbcrep_make_printer: %s\n", error->error_message);
+      abort ();
+    }
+  return rv;
+}
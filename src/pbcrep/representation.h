@@ -22,6 +22,81 @@ typedef struct PBCREP_ParserFactory PBCREP_ParserFactory;
 typedef struct PBCREP_PrinterFactory PBCREP_PrinterFactory;
 typedef struct PBCREP_Representation PBCREP_Representation;
 
+/*
+ * Factories are fixed to a single message type.
+ *
+ * They are immutable and refcounted, so one factory
+ * may be used from many threads at once.
+ * The work of analyzing the descriptor is done
+ * when the factory is built (see PBCREP_Plan),
+ * so creating a parser or printer is cheap.
+ */
+struct PBCREP_ParserFactory
+{
+  unsigned ref_count;
+  const ProtobufCMessageDescriptor *descriptor;
+
+  PBCREP_Parser *(*create_parser) (PBCREP_ParserFactory *factory);
+  void           (*destroy)       (PBCREP_ParserFactory *factory);
+
+  // Optional, for formats whose records can be found without
+  // parsing them:  the length of the whole records at the start
+  // of 'data'.  Separate parsers may be fed the pieces of input
+  // cut there.  If the data is malformed, return 'length',
+  // so that a parser will report the error.
+  size_t         (*split)         (PBCREP_ParserFactory *factory,
+                                   size_t                length,
+                                   const uint8_t        *data);
+};
+
+struct PBCREP_PrinterFactory
+{
+  unsigned ref_count;
+  const ProtobufCMessageDescriptor *descriptor;
+
+  PBCREP_Printer *(*create_printer) (PBCREP_PrinterFactory *factory);
+  void            (*destroy)        (PBCREP_PrinterFactory *factory);
+};
+
+PBCREP_Parser *
+pbcrep_parser_factory_create_parser (PBCREP_ParserFactory *factory);
+PBCREP_ParserFactory *
+pbcrep_parser_factory_ref           (PBCREP_ParserFactory *factory);
+void
+pbcrep_parser_factory_unref         (PBCREP_ParserFactory *factory);
+
+PBCREP_Printer *
+pbcrep_printer_factory_create_printer (PBCREP_PrinterFactory *factory);
+PBCREP_PrinterFactory *
+pbcrep_printer_factory_ref          (PBCREP_PrinterFactory *factory);
+void
+pbcrep_printer_factory_unref        (PBCREP_PrinterFactory *factory);
+
+// Concrete factories.  The options are copied.
+PBCREP_ParserFactory *
+pbcrep_parser_factory_new_json      (const ProtobufCMessageDescriptor *desc,
+                                     const PBCREP_Parser_JSONOptions  *options);
+PBCREP_ParserFactory *
+pbcrep_parser_factory_new_length_prefixed
+                                    (PBCREP_LengthPrefixed_Format      lp_format,
+                                     const ProtobufCMessageDescriptor *desc);
+PBCREP_PrinterFactory *
+pbcrep_printer_factory_new_json     (const ProtobufCMessageDescriptor *desc,
+                                     const PBCREP_JSON_PrinterOptions *options);
+PBCREP_PrinterFactory *
+pbcrep_printer_factory_new_length_prefixed
+                                    (PBCREP_LengthPrefixed_Format      lp_format,
+                                     const ProtobufCMessageDescriptor *desc);
+
+// For factory implementations:  allocate a factory
+// with ref_count==1 and the given descriptor.
+PBCREP_ParserFactory *
+pbcrep_parser_factory_new_protected (const ProtobufCMessageDescriptor *desc,
+                                     size_t                    sizeof_factory);
+PBCREP_PrinterFactory *
+pbcrep_printer_factory_new_protected(const ProtobufCMessageDescriptor *desc,
+                                     size_t                    sizeof_factory);
+
 struct PBCREP_Representation
 {
   PBCREP_ParserFactory *
@@ -42,11 +117,65 @@ struct PBCREP_Representation
   void (*unref)                (PBCREP_Representation *rep);
 };
 
+//
+// pbcrep_representation_from_string()
+//
+// Understood representations:
+//    json, json5
+//    length_prefixed_u8
+//    length_prefixed_u16_le, length_prefixed_u24_le, length_prefixed_u32_le
+//    length_prefixed_u16_be, length_prefixed_u24_be, length_prefixed_u32_be
+//    length_prefixed_b128, length_prefixed_b128_be
+//
+// The built-in representations are static,
+// so ref/unref are no-ops on them.
+//
 PBCREP_Representation *
 pbcrep_representation_from_string (const char *repstr,
-                                   PBCREP_Error *error);
+                                   PBCREP_Error **error);
+
+//
+// pbcrep_representation_is_length_prefixed()
+//
+// Whether 'rep' is one of the built-in length_prefixed_* representations,
+// and if so, its format.
+//
+bool
+pbcrep_representation_is_length_prefixed (PBCREP_Representation        *rep,
+                                          PBCREP_LengthPrefixed_Format *format_out);
 
 PBCREP_Representation *
 pbcrep_representation_ref (PBCREP_Representation *rep);
 void
 pbcrep_representation_unref (PBCREP_Representation *rep);
+
+PBCREP_ParserFactory *
+pbcrep_representation_create_parser_factory (PBCREP_Representation *rep,
+                                             const ProtobufCMessageDescriptor *desc);
+PBCREP_PrinterFactory *
+pbcrep_representation_create_printer_factory(PBCREP_Representation *rep,
+                                             const ProtobufCMessageDescriptor *desc);
+
+//
+// Cached factories.
+//
+// These are keyed by (repstr, desc) in a global, thread-safe cache,
+// so after the first call for a given pair, neither the repstr
+// nor the descriptor is re-analyzed.
+//
+// The returned factory has been ref'd; call
+// pbcrep_{parser,printer}_factory_unref() when done with it.
+//
+// pbcrep_try_make_parser() and pbcrep_try_make_printer() use this cache.
+//
+PBCREP_ParserFactory *
+pbcrep_try_get_parser_factory  (const char                       *repstr,
+                                const ProtobufCMessageDescriptor *desc,
+                                PBCREP_Error                    **error);
+PBCREP_PrinterFactory *
+pbcrep_try_get_printer_factory (const char                       *repstr,
+                                const ProtobufCMessageDescriptor *desc,
+                                PBCREP_Error                    **error);
+
+// Drop every cached entry.  Factories still held by callers stay valid.
+void pbcrep_representation_cache_clear (void);
@@ -0,0 +1,682 @@
+#include <limits.h>
+#include "../pbcrep.h"
+#include "length-prefix.h"
+#include "wire-format.h"
+
+/* Output is written once this much has been re-framed. */
+#define REFRAME_WRITE_SIZE      (64*1024)
+
+static bool
+reframe_write_out (PBCREP_Buffer           *buffer,
+                   PBCREP_BinaryDataWriter *output,
+                   int                      fd,
+                   PBCREP_Error           **error)
+{
+  if (fd >= 0)
+    return pbcrep_buffer_write_all_to_fd (buffer, fd, error);
+  bool ok = true;
+  for (PBCREP_BufferFragment *frag = buffer->first_frag;
+       frag != NULL && ok;
+       frag = frag->next)
+    ok = pbcrep_binary_data_writer_write (output, frag->buf_length,
+                                          frag->buf + frag->buf_start, error);
+  pbcrep_buffer_discard (buffer, buffer->size);
+  return ok;
+}
+
+/* Peek at the next record in 'in'.  Returns the size of its length-prefix
+ * (which the caller discards) if the whole record is there,
+ * 0 if more data is needed, or -1 (with res filled in) if it is bad.
+ */
+static int
+peek_record (PBCREP_Buffer                *in,
+             PBCREP_LengthPrefixed_Format  format,
+             size_t                       *length_out,
+             PBCREP_TransferResult        *res)
+{
+  uint8_t prefix[PBCREP_LENGTH_PREFIX_MAX_SIZE];
+  unsigned avail = pbcrep_buffer_peek (in, sizeof (prefix), prefix);
+  int prefix_len = pbcrep_length_prefix_decode (format, avail, prefix, length_out);
+  if (prefix_len < 0)
+    {
+      res->code = PBCREP_TRANSFER_RESULT_READ_FAILED;
+      res->error = pbcrep_error_new ("BAD_B128",
+                                     "overlong or bad B128-encoded length-prefix");
+      return -1;
+    }
+  if (prefix_len > 0 && *length_out > UINT_MAX - PBCREP_LENGTH_PREFIX_MAX_SIZE)
+    {
+      res->code = PBCREP_TRANSFER_RESULT_READ_FAILED;
+      res->error = pbcrep_error_new_printf ("RECORD_TOO_LONG",
+                                            "length-prefix gives a record of %llu bytes",
+                                            (unsigned long long) *length_out);
+      return -1;
+    }
+  if (prefix_len == 0 || in->size - prefix_len < *length_out)
+    return 0;
+  return prefix_len;
+}
+
+/* The first 'length' bytes of 'in', contiguous:  in place
+ * if they are in one fragment, else copied into the scratch space.
+ */
+static const uint8_t *
+peek_payload (PBCREP_Buffer  *in,
+              size_t          length,
+              uint8_t       **scratch_inout,
+              size_t         *scratch_alloced_inout)
+{
+  if (in->first_frag != NULL && in->first_frag->buf_length >= length)
+    return in->first_frag->buf + in->first_frag->buf_start;
+  if (length > *scratch_alloced_inout)
+    {
+      *scratch_alloced_inout = length;
+      *scratch_inout = pbcrep_realloc (*scratch_inout, length);
+    }
+  pbcrep_buffer_peek (in, length, *scratch_inout);
+  return *scratch_inout;
+}
+
+/* If 'desc' is given, each payload must be a valid 'desc' message
+ * (see pbcrep_validate_wire_unpackable());  otherwise, with 'check_wire',
+ * it must be a well-formed sequence of fields. */
+static PBCREP_TransferResult
+transfer_reframed (PBCREP_BinaryDataReader          *input,
+                   PBCREP_LengthPrefixed_Format      input_format,
+                   PBCREP_BinaryDataWriter          *output,
+                   PBCREP_LengthPrefixed_Format      output_format,
+                   bool                              check_wire,
+                   const ProtobufCMessageDescriptor *desc)
+{
+  PBCREP_TransferResult res = { PBCREP_TRANSFER_RESULT_SUCCESS, NULL, 0 };
+  PBCREP_Buffer in = PBCREP_BUFFER_INIT;
+  PBCREP_Buffer out = PBCREP_BUFFER_INIT;
+  uint8_t *scratch = NULL;              // for checking records split between fragments
+  size_t scratch_alloced = 0;
+  size_t max_length = pbcrep_length_prefix_max_length (output_format);
+
+  int fd = -1;
+  if (output != NULL && output->get_fd != NULL)
+    {
+      if (!pbcrep_binary_data_writer_flush (output, &res.error))
+        {
+          res.code = PBCREP_TRANSFER_RESULT_WRITE_FAILED;
+          return res;
+        }
+      fd = output->get_fd (output);
+    }
+
+  for (;;)
+    {
+      // Re-frame every complete record.
+      for (;;)
+        {
+          size_t length;
+          int prefix_len = peek_record (&in, input_format, &length, &res);
+          if (prefix_len < 0)
+            goto done;
+          if (prefix_len == 0)
+            break;
+          if (length > max_length)
+            {
+              res.code = PBCREP_TRANSFER_RESULT_WRITE_FAILED;
+              res.error = pbcrep_error_new_printf ("MESSAGE_TOO_LONG",
+                                                   "record of %zu bytes does not fit in the output's length prefix",
+                                                   length);
+              goto done;
+            }
+          pbcrep_buffer_discard (&in, prefix_len);
+
+          if (desc != NULL)
+            {
+              const uint8_t *payload = peek_payload (&in, length, &scratch, &scratch_alloced);
+              if (!pbcrep_validate_wire_unpackable (desc, length, payload, &res.error))
+                {
+                  res.code = PBCREP_TRANSFER_RESULT_READ_FAILED;
+                  goto done;
+                }
+            }
+          else if (check_wire && length > 0)
+            {
+              const uint8_t *payload = peek_payload (&in, length, &scratch, &scratch_alloced);
+              size_t bad = pbcrep_wire_check_fields (length, payload);
+              if (bad < length)
+                {
+                  res.code = PBCREP_TRANSFER_RESULT_READ_FAILED;
+                  res.error = pbcrep_error_new_printf ("PROTOBUF_MALFORMED",
+                                                       "record %llu: bad field at offset %zu",
+                                                       (unsigned long long) res.n_transferred,
+                                                       bad);
+                  goto done;
+                }
+            }
+
+          if (output != NULL)
+            {
+              uint8_t out_prefix[PBCREP_LENGTH_PREFIX_MAX_SIZE];
+              unsigned out_prefix_len = pbcrep_length_prefix_encode (output_format, length, out_prefix);
+              pbcrep_buffer_append_small (&out, out_prefix_len, out_prefix);
+              pbcrep_buffer_transfer (&out, &in, length);
+            }
+          else
+            pbcrep_buffer_discard (&in, length);
+          res.n_transferred++;
+        }
+
+      if (out.size >= REFRAME_WRITE_SIZE
+       && !reframe_write_out (&out, output, fd, &res.error))
+        {
+          res.code = PBCREP_TRANSFER_RESULT_WRITE_FAILED;
+          goto done;
+        }
+
+      size_t amt;
+      PBCREP_ReadResult rv = pbcrep_binary_data_reader_read_buffer (input, &in, &amt, &res.error);
+      if (rv == PBCREP_READ_RESULT_EOF)
+        {
+          if (in.size > 0)
+            {
+              res.code = PBCREP_TRANSFER_RESULT_READ_FAILED;
+              res.error = pbcrep_error_new ("PARTIAL_RECORD",
+                                            "input ends within a record");
+              goto done;
+            }
+          break;
+        }
+      if (rv == PBCREP_READ_RESULT_BLOCKED)
+        {
+          res.code = PBCREP_TRANSFER_RESULT_READ_FAILED;
+          res.error = pbcrep_error_new ("READ_BLOCKED",
+                                        "transfer from a nonblocking reader");
+          goto done;
+        }
+      if (rv == PBCREP_READ_RESULT_ERROR)
+        {
+          res.code = PBCREP_TRANSFER_RESULT_READ_FAILED;
+          goto done;
+        }
+    }
+
+  if (output != NULL
+   && (!reframe_write_out (&out, output, fd, &res.error)
+    || !pbcrep_binary_data_writer_flush (output, &res.error)))
+    res.code = PBCREP_TRANSFER_RESULT_WRITE_FAILED;
+
+done:
+  pbcrep_buffer_clear (&in);
+  pbcrep_buffer_clear (&out);
+  if (scratch != NULL)
+    pbcrep_free (scratch);
+  return res;
+}
+
+PBCREP_TransferResult
+pbcrep_transfer_reframed (PBCREP_BinaryDataReader     *input,
+                          PBCREP_LengthPrefixed_Format input_format,
+                          PBCREP_BinaryDataWriter     *output,
+                          PBCREP_LengthPrefixed_Format output_format,
+                          bool                         check_wire)
+{
+  return transfer_reframed (input, input_format, output, output_format,
+                            check_wire, NULL);
+}
+
+PBCREP_TransferResult
+pbcrep_transfer_sharded (PBCREP_BinaryDataReader     *input,
+                         PBCREP_LengthPrefixed_Format input_format,
+                         const PBCREP_FieldPath      *key,
+                         unsigned                     n_outputs,
+                         PBCREP_BinaryDataWriter    **outputs,
+                         PBCREP_LengthPrefixed_Format output_format)
+{
+  PBCREP_TransferResult res = { PBCREP_TRANSFER_RESULT_SUCCESS, NULL, 0 };
+  if (n_outputs == 0)
+    {
+      res.code = PBCREP_TRANSFER_RESULT_WRITE_FAILED;
+      res.error = pbcrep_error_new ("NO_OUTPUTS", "sharded transfer without outputs");
+      return res;
+    }
+  PBCREP_Buffer in = PBCREP_BUFFER_INIT;
+  PBCREP_Buffer *out = pbcrep_malloc (sizeof (PBCREP_Buffer) * n_outputs);
+  int *fds = pbcrep_malloc (sizeof (int) * n_outputs);
+  uint8_t *scratch = NULL;              // for records split between fragments
+  size_t scratch_alloced = 0;
+  size_t max_length = pbcrep_length_prefix_max_length (output_format);
+  size_t out_size = 0;                  // total in out[]
+
+  for (unsigned i = 0; i < n_outputs; i++)
+    pbcrep_buffer_init (out + i);
+  for (unsigned i = 0; i < n_outputs; i++)
+    {
+      fds[i] = -1;
+      if (outputs[i]->get_fd != NULL)
+        {
+          if (!pbcrep_binary_data_writer_flush (outputs[i], &res.error))
+            {
+              res.code = PBCREP_TRANSFER_RESULT_WRITE_FAILED;
+              goto done;
+            }
+          fds[i] = outputs[i]->get_fd (outputs[i]);
+        }
+    }
+
+  for (;;)
+    {
+      // Route every complete record.
+      for (;;)
+        {
+          size_t length;
+          int prefix_len = peek_record (&in, input_format, &length, &res);
+          if (prefix_len < 0)
+            goto done;
+          if (prefix_len == 0)
+            break;
+          if (length > max_length)
+            {
+              res.code = PBCREP_TRANSFER_RESULT_WRITE_FAILED;
+              res.error = pbcrep_error_new_printf ("MESSAGE_TOO_LONG",
+                                                   "record of %zu bytes does not fit in the output's length prefix",
+                                                   length);
+              goto done;
+            }
+          pbcrep_buffer_discard (&in, prefix_len);
+
+          const uint8_t *payload = peek_payload (&in, length, &scratch, &scratch_alloced);
+          uint64_t hash;
+          if (!pbcrep_field_path_hash (key, length, payload, &hash, &res.error))
+            {
+              res.code = PBCREP_TRANSFER_RESULT_READ_FAILED;
+              goto done;
+            }
+          PBCREP_Buffer *o = out + hash % n_outputs;
+          uint8_t out_prefix[PBCREP_LENGTH_PREFIX_MAX_SIZE];
+          unsigned out_prefix_len = pbcrep_length_prefix_encode (output_format, length, out_prefix);
+          pbcrep_buffer_append_small (o, out_prefix_len, out_prefix);
+          pbcrep_buffer_transfer (o, &in, length);
+          out_size += out_prefix_len + length;
+          res.n_transferred++;
+        }
+
+      // Write out the larger buffers once there is enough in all of them.
+      if (out_size >= REFRAME_WRITE_SIZE)
+        {
+          for (unsigned i = 0; i < n_outputs; i++)
+            if (out[i].size >= REFRAME_WRITE_SIZE / n_outputs)
+              {
+                out_size -= out[i].size;
+                if (!reframe_write_out (out + i, outputs[i], fds[i], &res.error))
+                  {
+                    res.code = PBCREP_TRANSFER_RESULT_WRITE_FAILED;
+                    goto done;
+                  }
+              }
+        }
+
+      size_t amt;
+      PBCREP_ReadResult rv = pbcrep_binary_data_reader_read_buffer (input, &in, &amt, &res.error);
+      if (rv == PBCREP_READ_RESULT_EOF)
+        {
+          if (in.size > 0)
+            {
+              res.code = PBCREP_TRANSFER_RESULT_READ_FAILED;
+              res.error = pbcrep_error_new ("PARTIAL_RECORD",
+                                            "input ends within a record");
+              goto done;
+            }
+          break;
+        }
+      if (rv == PBCREP_READ_RESULT_BLOCKED)
+        {
+          res.code = PBCREP_TRANSFER_RESULT_READ_FAILED;
+          res.error = pbcrep_error_new ("READ_BLOCKED",
+                                        "transfer from a nonblocking reader");
+          goto done;
+        }
+      if (rv == PBCREP_READ_RESULT_ERROR)
+        {
+          res.code = PBCREP_TRANSFER_RESULT_READ_FAILED;
+          goto done;
+        }
+    }
+
+  for (unsigned i = 0; i < n_outputs; i++)
+    if (!reframe_write_out (out + i, outputs[i], fds[i], &res.error)
+     || !pbcrep_binary_data_writer_flush (outputs[i], &res.error))
+      {
+        res.code = PBCREP_TRANSFER_RESULT_WRITE_FAILED;
+        break;
+      }
+
+done:
+  pbcrep_buffer_clear (&in);
+  for (unsigned i = 0; i < n_outputs; i++)
+    pbcrep_buffer_clear (out + i);
+  pbcrep_free (out);
+  pbcrep_free (fds);
+  if (scratch != NULL)
+    pbcrep_free (scratch);
+  return res;
+}
+
+// Between length-prefixed formats, only the framing changes:
+// the payloads can be copied as they are.
+static bool
+try_transfer_reframed (PBCREP_Reader *input,
+                       PBCREP_Writer *output,
+                       PBCREP_TransferResult *res)
+{
+  PBCREP_BinaryDataReader *bin_input;
+  PBCREP_Parser *parser;
+  PBCREP_BinaryDataWriter *bin_output;
+  PBCREP_Printer *printer;
+  PBCREP_LengthPrefixed_Format input_format, output_format;
+  const ProtobufCMessageDescriptor *output_desc;
+  if (!pbcrep_reader_peek_parser (input, &bin_input, &parser)
+   || !pbcrep_parser_is_length_prefixed (parser, &input_format)
+   || !pbcrep_writer_peek_printer (output, &bin_output, &printer)
+   || !pbcrep_printer_is_length_prefixed (printer, &output_format, &output_desc)
+   || output_desc != parser->message_desc
+   || printer->output_data.size > 0
+   || printer->ended)
+    return false;
+
+  // Validate the payloads against the descriptor, so that
+  // records the parser would reject still are.
+  *res = transfer_reframed (bin_input, input_format,
+                            bin_output, output_format,
+                            true, parser->message_desc);
+  if (res->code == PBCREP_TRANSFER_RESULT_SUCCESS
+   && !pbcrep_writer_end_write (output, &res->error))
+    res->code = PBCREP_TRANSFER_RESULT_WRITE_FAILED;
+  return true;
+}
+
+// A record too long for the output's length-prefix is the
+// output's failure, as in the re-framing and sharding paths.
+static PBCREP_TransferResultCode
+transcoder_failure_code (const PBCREP_Error *error)
+{
+  if (error != NULL && strcmp (error->error_code_str, "MESSAGE_TOO_LONG") == 0)
+    return PBCREP_TRANSFER_RESULT_WRITE_FAILED;
+  return PBCREP_TRANSFER_RESULT_READ_FAILED;
+}
+
+static PBCREP_TransferResult
+transfer_transcoded (PBCREP_BinaryDataReader *input,
+                     PBCREP_JSON_Transcoder  *transcoder,
+                     PBCREP_BinaryDataWriter *output)
+{
+  PBCREP_TransferResult res = { PBCREP_TRANSFER_RESULT_SUCCESS, NULL, 0 };
+  PBCREP_Buffer in = PBCREP_BUFFER_INIT;
+  PBCREP_Buffer out = PBCREP_BUFFER_INIT;
+
+  int fd = -1;
+  if (output->get_fd != NULL)
+    {
+      if (!pbcrep_binary_data_writer_flush (output, &res.error))
+        {
+          res.code = PBCREP_TRANSFER_RESULT_WRITE_FAILED;
+          return res;
+        }
+      fd = output->get_fd (output);
+    }
+
+  for (;;)
+    {
+      size_t amt;
+      PBCREP_ReadResult rv = pbcrep_binary_data_reader_read_buffer (input, &in, &amt, &res.error);
+      if (rv == PBCREP_READ_RESULT_EOF)
+        {
+          if (!pbcrep_json_transcoder_end_feed (transcoder, &out, &res.error))
+            {
+              res.code = transcoder_failure_code (res.error);
+              goto done;
+            }
+          break;
+        }
+      if (rv == PBCREP_READ_RESULT_BLOCKED)
+        {
+          res.code = PBCREP_TRANSFER_RESULT_READ_FAILED;
+          res.error = pbcrep_error_new ("READ_BLOCKED",
+                                        "transfer from a nonblocking reader");
+          goto done;
+        }
+      if (rv == PBCREP_READ_RESULT_ERROR)
+        {
+          res.code = PBCREP_TRANSFER_RESULT_READ_FAILED;
+          goto done;
+        }
+
+      for (PBCREP_BufferFragment *frag = in.first_frag; frag != NULL; frag = frag->next)
+        if (!pbcrep_json_transcoder_feed (transcoder, frag->buf_length,
+                                          frag->buf + frag->buf_start,
+                                          &out, &res.error))
+          {
+            res.code = transcoder_failure_code (res.error);
+            goto done;
+          }
+      pbcrep_buffer_discard (&in, in.size);
+
+      if (out.size >= REFRAME_WRITE_SIZE
+       && !reframe_write_out (&out, output, fd, &res.error))
+        {
+          res.code = PBCREP_TRANSFER_RESULT_WRITE_FAILED;
+          goto done;
+        }
+    }
+
+  if (!reframe_write_out (&out, output, fd, &res.error)
+   || !pbcrep_binary_data_writer_flush (output, &res.error))
+    res.code = PBCREP_TRANSFER_RESULT_WRITE_FAILED;
+
+done:
+  res.n_transferred = pbcrep_json_transcoder_get_n_records (transcoder);
+  pbcrep_buffer_clear (&in);
+  pbcrep_buffer_clear (&out);
+  return res;
+}
+
+// From JSON to a length-prefixed format, the records can be
+// encoded as the JSON is parsed, without building messages.
+static bool
+try_transfer_transcoded (PBCREP_Reader *input,
+                         PBCREP_Writer *output,
+                         PBCREP_TransferResult *res)
+{
+  PBCREP_BinaryDataReader *bin_input;
+  PBCREP_Parser *parser;
+  PBCREP_BinaryDataWriter *bin_output;
+  PBCREP_Printer *printer;
+  PBCREP_LengthPrefixed_Format output_format;
+  const ProtobufCMessageDescriptor *output_desc;
+  if (!pbcrep_reader_peek_parser (input, &bin_input, &parser)
+   || !pbcrep_parser_is_json (parser)
+   || !pbcrep_writer_peek_printer (output, &bin_output, &printer)
+   || !pbcrep_printer_is_length_prefixed (printer, &output_format, &output_desc)
+   || output_desc != parser->message_desc
+   || printer->output_data.size > 0
+   || printer->ended)
+    return false;
+
+  PBCREP_Parser_JSONOptions json_options;
+  PBCREP_Plan *plan = pbcrep_parser_json_peek_plan (parser, &json_options);
+  PBCREP_JSON_Transcoder *transcoder = pbcrep_json_transcoder_new (plan, &json_options,
+                                                                   output_format);
+  if (transcoder == NULL)
+    return false;
+  *res = transfer_transcoded (bin_input, transcoder, bin_output);
+  pbcrep_json_transcoder_destroy (transcoder);
+  if (res->code == PBCREP_TRANSFER_RESULT_SUCCESS
+   && !pbcrep_writer_end_write (output, &res->error))
+    res->code = PBCREP_TRANSFER_RESULT_WRITE_FAILED;
+  return true;
+}
+
+static PBCREP_TransferResult
+transfer_wire_to_json (PBCREP_BinaryDataReader     *input,
+                       PBCREP_LengthPrefixed_Format input_format,
+                       PBCREP_Printer              *printer,
+                       PBCREP_BinaryDataWriter     *output)
+{
+  PBCREP_TransferResult res = { PBCREP_TRANSFER_RESULT_SUCCESS, NULL, 0 };
+  PBCREP_Buffer in = PBCREP_BUFFER_INIT;
+  PBCREP_Buffer *out = &printer->output_data;
+  uint8_t *scratch = NULL;              // for records split between fragments
+  size_t scratch_alloced = 0;
+
+  int fd = -1;
+  if (output->get_fd != NULL)
+    {
+      if (!pbcrep_binary_data_writer_flush (output, &res.error))
+        {
+          res.code = PBCREP_TRANSFER_RESULT_WRITE_FAILED;
+          return res;
+        }
+      fd = output->get_fd (output);
+    }
+
+  for (;;)
+    {
+      for (;;)
+        {
+          size_t length;
+          int prefix_len = peek_record (&in, input_format, &length, &res);
+          if (prefix_len < 0)
+            goto done;
+          if (prefix_len == 0)
+            break;
+          pbcrep_buffer_discard (&in, prefix_len);
+          const uint8_t *payload = peek_payload (&in, length, &scratch, &scratch_alloced);
+          if (!pbcrep_printer_json_print_packed (printer, length, payload, &res.error))
+            {
+              res.code = PBCREP_TRANSFER_RESULT_READ_FAILED;
+              goto done;
+            }
+          pbcrep_buffer_discard (&in, length);
+          res.n_transferred++;
+        }
+
+      if (out->size >= REFRAME_WRITE_SIZE
+       && !reframe_write_out (out, output, fd, &res.error))
+        {
+          res.code = PBCREP_TRANSFER_RESULT_WRITE_FAILED;
+          goto done;
+        }
+
+      size_t amt;
+      PBCREP_ReadResult rv = pbcrep_binary_data_reader_read_buffer (input, &in, &amt, &res.error);
+      if (rv == PBCREP_READ_RESULT_EOF)
+        {
+          if (in.size > 0)
+            {
+              res.code = PBCREP_TRANSFER_RESULT_READ_FAILED;
+              res.error = pbcrep_error_new ("PARTIAL_RECORD",
+                                            "input ends within a record");
+              goto done;
+            }
+          break;
+        }
+      if (rv == PBCREP_READ_RESULT_BLOCKED)
+        {
+          res.code = PBCREP_TRANSFER_RESULT_READ_FAILED;
+          res.error = pbcrep_error_new ("READ_BLOCKED",
+                                        "transfer from a nonblocking reader");
+          goto done;
+        }
+      if (rv == PBCREP_READ_RESULT_ERROR)
+        {
+          res.code = PBCREP_TRANSFER_RESULT_READ_FAILED;
+          goto done;
+        }
+    }
+
+  if (!reframe_write_out (out, output, fd, &res.error)
+   || !pbcrep_binary_data_writer_flush (output, &res.error))
+    res.code = PBCREP_TRANSFER_RESULT_WRITE_FAILED;
+
+done:
+  pbcrep_buffer_clear (&in);
+  if (scratch != NULL)
+    pbcrep_free (scratch);
+  return res;
+}
+
+// From a length-prefixed format to JSON, the JSON can be
+// printed straight from the payloads, without unpacking them.
+static bool
+try_transfer_wire_to_json (PBCREP_Reader *input,
+                           PBCREP_Writer *output,
+                           PBCREP_TransferResult *res)
+{
+  PBCREP_BinaryDataReader *bin_input;
+  PBCREP_Parser *parser;
+  PBCREP_BinaryDataWriter *bin_output;
+  PBCREP_Printer *printer;
+  PBCREP_LengthPrefixed_Format input_format;
+  const ProtobufCMessageDescriptor *output_desc;
+  if (!pbcrep_reader_peek_parser (input, &bin_input, &parser)
+   || !pbcrep_parser_is_length_prefixed (parser, &input_format)
+   || !pbcrep_writer_peek_printer (output, &bin_output, &printer)
+   || !pbcrep_printer_is_json (printer, &output_desc)
+   || output_desc != parser->message_desc
+   || printer->output_data.size > 0
+   || printer->ended)
+    return false;
+
+  *res = transfer_wire_to_json (bin_input, input_format, printer, bin_output);
+  if (res->code == PBCREP_TRANSFER_RESULT_SUCCESS
+   && !pbcrep_writer_end_write (output, &res->error))
+    res->code = PBCREP_TRANSFER_RESULT_WRITE_FAILED;
+  return true;
+}
+
+PBCREP_TransferResult
+pbcrep_transfer_messages (PBCREP_Reader *input,
+                          PBCREP_Writer *output)
+{
+  PBCREP_TransferResult res = { PBCREP_TRANSFER_RESULT_SUCCESS, NULL, 0 };
+  if (try_transfer_reframed (input, output, &res)
+   || try_transfer_transcoded (input, output, &res)
+   || try_transfer_wire_to_json (input, output, &res))
+    return res;
+  for (;;)
+    {
+      switch (pbcrep_reader_advance (input, &res.error))
+        {
+        case PBCREP_READ_RESULT_OK:
+          if (!pbcrep_writer_write (output, input->message, &res.error))
+            {
+              res.code = PBCREP_TRANSFER_RESULT_WRITE_FAILED;
+              return res;
+            }
+          res.n_transferred++;
+          break;
+        case PBCREP_READ_RESULT_EOF:
+          if (!pbcrep_writer_end_write (output, &res.error))
+            res.code = PBCREP_TRANSFER_RESULT_WRITE_FAILED;
+          return res;
+        case PBCREP_READ_RESULT_BLOCKED:
+          res.code = PBCREP_TRANSFER_RESULT_READ_FAILED;
+          res.error = pbcrep_error_new ("READ_BLOCKED",
+                                        "transfer from a nonblocking reader");
+          return res;
+        case PBCREP_READ_RESULT_ERROR:
+          res.code = PBCREP_TRANSFER_RESULT_READ_FAILED;
+          return res;
+        }
+    }
+}
+
+PBCREP_TransferResult
+pbcrep_try_transfer_messages (PBCREP_Reader *input,
+                              PBCREP_Writer *output,
+                              PBCREP_Error **error)
+{
+  PBCREP_TransferResult res = pbcrep_transfer_messages (input, output);
+  if (res.error != NULL && error != NULL)
+    {
+      *error = res.error;
+      res.error = NULL;
+    }
+  return res;
+}
@@ -0,0 +1,707 @@
+#include "../pbcrep.h"
+#include "wire-format.h"
+#include <string.h>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+/* Arena allocations are aligned to this. */
+#define ARENA_ALIGN             8
+
+/* Blocks added to an arena that outgrows its first are at least this big. */
+#define ARENA_MIN_EXTRA_BLOCK   4096
+
+/* The estimate for the first block is trusted up to this size;
+ * past it, the arena grows by blocks as it is used. */
+#define ARENA_MAX_FIRST_BLOCK   (256 * 1024)
+
+#define ARENA_ALIGN_UP(size)    (((size) + ARENA_ALIGN - 1) & ~(size_t) (ARENA_ALIGN - 1))
+
+/* An arena is a chain of blocks.  The first block holds the root
+ * message right after its header, so that the message finds its arena;
+ * the other blocks are chained from the first.
+ */
+typedef struct ArenaBlock ArenaBlock;
+struct ArenaBlock
+{
+  ArenaBlock *next;
+};
+#define ARENA_HEADER_SIZE       ARENA_ALIGN_UP (sizeof (ArenaBlock))
+
+/* What the first pass learns about each field of a message. */
+typedef struct {
+  uint32_t n_occurrences;
+  uint32_t n_seen;              // occurrences decoded so far, in the second pass
+  uint32_t last_ordinal;        // of the last occurrence, among the known fields
+  bool skip;                    // a oneof member overridden by a later one (only checked)
+  size_t n_values;              // repeated fields only
+} FieldScan;
+
+/* A message's data is usually one piece, but a non-repeated
+ * sub-message given more than once is merged from several.
+ */
+typedef struct {
+  size_t length;
+  const uint8_t *data;
+} Segment;
+
+struct PBCREP_Unpacker
+{
+  PBCREP_Plan *plan;
+
+  // Stacks, with a frame for each message being unpacked.
+  FieldScan *scans;
+  size_t scans_alloced;
+  Segment *segments;
+  size_t segments_alloced;
+
+  // The arena of the message being unpacked.
+  ArenaBlock *arena;
+  uint8_t *arena_at;
+  uint8_t *arena_end;
+  size_t arena_used;
+
+  // Arena bytes needed per byte of packed message, times 16:
+  // this sizes the first block, up to ARENA_MAX_FIRST_BLOCK.
+  size_t expansion_x16;
+};
+
+PBCREP_Unpacker *
+pbcrep_unpacker_new (PBCREP_Plan *plan)
+{
+  PBCREP_Unpacker *u = pbcrep_malloc (sizeof (PBCREP_Unpacker));
+  u->plan = pbcrep_plan_ref (plan);
+  u->scans_alloced = 64;
+  u->scans = pbcrep_malloc (sizeof (FieldScan) * u->scans_alloced);
+  u->segments_alloced = 16;
+  u->segments = pbcrep_malloc (sizeof (Segment) * u->segments_alloced);
+  u->arena = NULL;
+  u->arena_at = u->arena_end = NULL;
+  u->arena_used = 0;
+  u->expansion_x16 = 32;
+  return u;
+}
+
+void
+pbcrep_unpacker_destroy (PBCREP_Unpacker *unpacker)
+{
+  pbcrep_plan_unref (unpacker->plan);
+  pbcrep_free (unpacker->scans);
+  pbcrep_free (unpacker->segments);
+  pbcrep_free (unpacker);
+}
+
+static void
+arena_free (ArenaBlock *arena)
+{
+  ArenaBlock *block = arena->next;
+  while (block != NULL)
+    {
+      ArenaBlock *next = block->next;
+      pbcrep_free (block);
+      block = next;
+    }
+  pbcrep_free (arena);
+}
+
+void
+pbcrep_unpacker_free_message (ProtobufCMessage *message)
+{
+  arena_free ((ArenaBlock *) ((uint8_t *) message - ARENA_HEADER_SIZE));
+}
+
+/* --- Arena allocation --- */
+static void
+arena_start (PBCREP_Unpacker *u, size_t size)
+{
+  size = ARENA_HEADER_SIZE + ARENA_ALIGN_UP (size);
+  u->arena = pbcrep_malloc (size);
+  u->arena->next = NULL;
+  u->arena_at = (uint8_t *) u->arena + ARENA_HEADER_SIZE;
+  u->arena_end = (uint8_t *) u->arena + size;
+  u->arena_used = 0;
+}
+
+static void *
+arena_alloc_block (PBCREP_Unpacker *u, size_t size)
+{
+  size_t data_size = size > ARENA_MIN_EXTRA_BLOCK ? size : ARENA_MIN_EXTRA_BLOCK;
+  if (data_size < u->arena_used / 2)
+    data_size = ARENA_ALIGN_UP (u->arena_used / 2);
+  ArenaBlock *block = pbcrep_malloc (ARENA_HEADER_SIZE + data_size);
+  block->next = u->arena->next;
+  u->arena->next = block;
+  uint8_t *rv = (uint8_t *) block + ARENA_HEADER_SIZE;
+  u->arena_at = rv + size;
+  u->arena_end = rv + data_size;
+  return rv;
+}
+
+static inline void *
+arena_alloc (PBCREP_Unpacker *u, size_t size)
+{
+  size = ARENA_ALIGN_UP (size);
+  u->arena_used += size;
+  if (PBCREP_UNLIKELY ((size_t) (u->arena_end - u->arena_at) < size))
+    return arena_alloc_block (u, size);
+  void *rv = u->arena_at;
+  u->arena_at += size;
+  return rv;
+}
+
+/* --- Scratch stacks --- */
+static inline void
+ensure_scans (PBCREP_Unpacker *u, size_t n)
+{
+  if (PBCREP_UNLIKELY (n > u->scans_alloced))
+    {
+      while (n > u->scans_alloced)
+        u->scans_alloced *= 2;
+      u->scans = pbcrep_realloc (u->scans, sizeof (FieldScan) * u->scans_alloced);
+    }
+}
+
+static inline void
+push_segment (PBCREP_Unpacker *u, size_t index, size_t length, const uint8_t *data)
+{
+  if (PBCREP_UNLIKELY (index >= u->segments_alloced))
+    {
+      u->segments_alloced *= 2;
+      u->segments = pbcrep_realloc (u->segments, sizeof (Segment) * u->segments_alloced);
+    }
+  u->segments[index].length = length;
+  u->segments[index].data = data;
+}
+
+/* --- Values --- */
+// The number of varints in a packed field:  the number of bytes
+// without the continuation bit, if the last byte has none.
+static bool
+count_packed_varints (size_t length, const uint8_t *data, size_t *count_out)
+{
+  if (length > 0 && data[length - 1] >= 0x80)
+    return false;
+  size_t count = 0, at = 0;
+#if defined(__SSE2__)
+  for (; at + 16 <= length; at += 16)
+    {
+      __m128i v = _mm_loadu_si128 ((const __m128i *) (data + at));
+      count += 16 - __builtin_popcount (_mm_movemask_epi8 (v));
+    }
+#endif
+  for (; at < length; at++)
+    count += data[at] < 0x80;
+  *count_out = count;
+  return true;
+}
+
+// Whether the next 'n' bytes are single-byte varints.
+#if defined(__SSE2__)
+# define BULK_VARINTS  16
+# define ALL_SMALL(p)  (_mm_movemask_epi8 (_mm_loadu_si128 ((const __m128i *) (p))) == 0)
+#else
+# define BULK_VARINTS  8
+static inline bool
+all_small_8 (const uint8_t *p)
+{
+  uint64_t w;
+  memcpy (&w, p, 8);
+  return (w & 0x8080808080808080ULL) == 0;
+}
+# define ALL_SMALL(p)  all_small_8 (p)
+#endif
+
+// Decode packed varints into out[0..), converting each with CONVERT.
+// Runs of single-byte varints, the common case for small numbers,
+// are recognized a block at a time.
+#define DECODE_PACKED_VARINTS(ctype, CONVERT)                           \
+  do {                                                                  \
+    ctype *o = out;                                                     \
+    while (at < length)                                                 \
+      {                                                                 \
+        while (length - at >= BULK_VARINTS && ALL_SMALL (data + at))    \
+          {                                                             \
+            for (unsigned i = 0; i < BULK_VARINTS; i++)                 \
+              {                                                         \
+                uint64_t v = data[at + i];                              \
+                o[i] = CONVERT;                                         \
+              }                                                         \
+            o += BULK_VARINTS;                                          \
+            at += BULK_VARINTS;                                         \
+          }                                                             \
+        if (at == length)                                               \
+          break;                                                        \
+        uint64_t v;                                                     \
+        unsigned used = pbcrep_wire_decode_varint (length - at,         \
+                                                   data + at, &v);      \
+        if (used == 0)                                                  \
+          return false;                                                 \
+        *o++ = CONVERT;                                                 \
+        at += used;                                                     \
+      }                                                                 \
+  } while (0)
+
+static bool
+decode_packed_varints (ProtobufCType  type,
+                       size_t         length,
+                       const uint8_t *data,
+                       void          *out)
+{
+  size_t at = 0;
+  switch (type)
+    {
+    case PROTOBUF_C_TYPE_INT32:
+    case PROTOBUF_C_TYPE_UINT32:
+    case PROTOBUF_C_TYPE_ENUM:
+      DECODE_PACKED_VARINTS (uint32_t, (uint32_t) v);
+      break;
+    case PROTOBUF_C_TYPE_SINT32:
+      DECODE_PACKED_VARINTS (int32_t, (int32_t) (((uint32_t) v >> 1) ^ -((uint32_t) v & 1)));
+      break;
+    case PROTOBUF_C_TYPE_SINT64:
+      DECODE_PACKED_VARINTS (int64_t, (int64_t) ((v >> 1) ^ -(v & 1)));
+      break;
+    case PROTOBUF_C_TYPE_BOOL:
+      DECODE_PACKED_VARINTS (protobuf_c_boolean, v != 0);
+      break;
+    default:
+      DECODE_PACKED_VARINTS (uint64_t, v);
+      break;
+    }
+  return true;
+}
+
+static void
+decode_packed_fixed (ProtobufCType  type,
+                     size_t         length,
+                     const uint8_t *data,
+                     void          *out)
+{
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+  (void) type;
+  memcpy (out, data, length);
+#else
+  unsigned size = pbcrep_wire_fixed_size (type);
+  for (size_t at = 0; at < length; at += size)
+    pbcrep_wire_decode_scalar (type, size, data + at, (uint8_t *) out + at);
+#endif
+}
+
+/* --- Unpacking --- */
+static bool
+malformed (const PBCREP_MessagePlan  *mplan,
+           const char                *what,
+           const ProtobufCFieldDescriptor *f,
+           PBCREP_Error             **error)
+{
+  if (error != NULL)
+    *error = pbcrep_error_new_printf ("PROTOBUF_MALFORMED",
+                                      "%s: %s%s%s",
+                                      mplan->descriptor->name, what,
+                                      f != NULL ? " " : "",
+                                      f != NULL ? f->name : "");
+  return false;
+}
+
+// Find a field, trying first the last one found and the one after it,
+// as repeated fields repeat and fields usually come in order.
+static inline int
+lookup_field (const PBCREP_MessagePlan *mplan, uint32_t id, int *prev_inout)
+{
+  const ProtobufCFieldDescriptor *fields = mplan->descriptor->fields;
+  int prev = *prev_inout;
+  if (prev >= 0 && fields[prev].id == id)
+    return prev;
+  int idx = prev + 1;
+  if (idx >= (int) mplan->n_fields || fields[idx].id != id)
+    idx = pbcrep_message_plan_find_field_by_id (mplan, id);
+  if (idx >= 0)
+    *prev_inout = idx;
+  return idx;
+}
+
+// The first pass:  check the message, find its fields
+// and count the values of the repeated ones.
+static bool
+scan_message (PBCREP_Unpacker          *u,
+              const PBCREP_MessagePlan *mplan,
+              size_t                    seg_base,
+              size_t                    n_segs,
+              size_t                    scan_base,
+              size_t                   *n_unknown_out,
+              PBCREP_Error            **error)
+{
+  unsigned n_fields = mplan->n_fields;
+  const ProtobufCFieldDescriptor *fields = mplan->descriptor->fields;
+  ensure_scans (u, scan_base + n_fields);
+  FieldScan *scans = u->scans + scan_base;
+  memset (scans, 0, sizeof (FieldScan) * n_fields);
+  size_t n_unknown = 0;
+  uint32_t ordinal = 0;
+  int prev = -1;
+  bool has_oneofs = false;
+  for (size_t s = 0; s < n_segs; s++)
+    {
+      size_t length = u->segments[seg_base + s].length;
+      const uint8_t *data = u->segments[seg_base + s].data;
+      PBCREP_WireField wf;
+      for (size_t at = 0; at < length; at = wf.end)
+        {
+          if (!pbcrep_wire_decode_field (length, data, at, &wf))
+            return malformed (mplan, "bad field", NULL, error);
+          int idx = lookup_field (mplan, wf.number, &prev);
+          if (idx < 0)
+            {
+              n_unknown++;
+              continue;
+            }
+          const ProtobufCFieldDescriptor *f = fields + idx;
+          if (!pbcrep_wire_type_matches (f, wf.wire_type))
+            return malformed (mplan, "wrong wire type for field", f, error);
+          FieldScan *fs = scans + idx;
+          fs->n_occurrences++;
+          fs->last_ordinal = ordinal++;
+          if (f->flags & PROTOBUF_C_FIELD_FLAG_ONEOF)
+            has_oneofs = true;
+          if (f->label != PROTOBUF_C_LABEL_REPEATED)
+            continue;
+          if (wf.wire_type != PBCREP_WIRE_TYPE_LENGTH_PREFIXED
+           || !pbcrep_wire_type_is_packable (f->type))
+            {
+              fs->n_values++;
+              continue;
+            }
+          unsigned fixed_size = pbcrep_wire_fixed_size (f->type);
+          if (fixed_size > 0)
+            {
+              if (wf.value_length % fixed_size != 0)
+                return malformed (mplan, "bad packed field", f, error);
+              fs->n_values += wf.value_length / fixed_size;
+            }
+          else
+            {
+              size_t count;
+              if (!count_packed_varints (wf.value_length, data + wf.value_start, &count))
+                return malformed (mplan, "bad packed field", f, error);
+              fs->n_values += count;
+            }
+        }
+    }
+
+  for (unsigned i = 0; i < n_fields; i++)
+    if (scans[i].n_occurrences == 0
+     && fields[i].label == PROTOBUF_C_LABEL_REQUIRED)
+      return malformed (mplan, "missing required field", fields + i, error);
+
+  // Skip the oneof members that a later one overrides.
+  if (has_oneofs)
+    for (unsigned i = 0; i < n_fields; i++)
+      if (scans[i].n_occurrences > 0
+       && (fields[i].flags & PROTOBUF_C_FIELD_FLAG_ONEOF) != 0
+       && !pbcrep_wire_oneof_member_is_last (mplan->descriptor, i,
+                                             &scans[0].n_occurrences, &scans[0].last_ordinal,
+                                             sizeof (FieldScan)))
+        scans[i].skip = true;
+
+  *n_unknown_out = n_unknown;
+  return true;
+}
+
+// Gather the occurrences of a non-repeated message field,
+// to be merged, onto the segment stack at sub_seg_base.
+// Occurrences before another member of its oneof don't count.
+static size_t
+gather_segments (PBCREP_Unpacker          *u,
+                 const PBCREP_MessagePlan *mplan,
+                 size_t                    seg_base,
+                 size_t                    n_segs,
+                 unsigned                  field_index,
+                 size_t                    sub_seg_base)
+{
+  const ProtobufCFieldDescriptor *fields = mplan->descriptor->fields;
+  const ProtobufCFieldDescriptor *target = fields + field_index;
+  size_t n = 0;
+  int prev = -1;
+  for (size_t s = 0; s < n_segs; s++)
+    {
+      size_t length = u->segments[seg_base + s].length;
+      const uint8_t *data = u->segments[seg_base + s].data;
+      PBCREP_WireField wf;
+      for (size_t at = 0; at < length; at = wf.end)
+        {
+          pbcrep_wire_decode_field (length, data, at, &wf);
+          if (wf.number == target->id)
+            {
+              push_segment (u, sub_seg_base + n, wf.value_length, data + wf.value_start);
+              n++;
+            }
+          else if (target->flags & PROTOBUF_C_FIELD_FLAG_ONEOF)
+            {
+              int idx = lookup_field (mplan, wf.number, &prev);
+              if (idx >= 0 && pbcrep_wire_fields_share_oneof (target, fields + idx))
+                n = 0;
+            }
+        }
+    }
+  return n;
+}
+
+static bool
+unpack_message (PBCREP_Unpacker          *u,
+                const PBCREP_MessagePlan *mplan,
+                size_t                    seg_base,
+                size_t                    n_segs,
+                size_t                    scan_base,
+                ProtobufCMessage        **message_out,
+                PBCREP_Error            **error);
+
+static inline bool
+unpack_submessage (PBCREP_Unpacker          *u,
+                   const PBCREP_FieldPlan   *fp,
+                   size_t                    length,
+                   const uint8_t            *data,
+                   size_t                    sub_seg_base,
+                   size_t                    sub_scan_base,
+                   ProtobufCMessage        **message_out,
+                   PBCREP_Error            **error)
+{
+  push_segment (u, sub_seg_base, length, data);
+  return unpack_message (u, fp->message_plan, sub_seg_base, 1,
+                         sub_scan_base, message_out, error);
+}
+
+// Copy a string or bytes value into the arena.
+static inline void
+copy_value (PBCREP_Unpacker *u,
+            ProtobufCType    type,
+            size_t           length,
+            const uint8_t   *data,
+            void            *member)
+{
+  if (type == PROTOBUF_C_TYPE_STRING)
+    {
+      char *str = arena_alloc (u, length + 1);
+      memcpy (str, data, length);
+      str[length] = 0;
+      * (char **) member = str;
+    }
+  else
+    {
+      ProtobufCBinaryData *bd = member;
+      bd->len = length;
+      bd->data = NULL;
+      if (length > 0)
+        {
+          bd->data = arena_alloc (u, length);
+          memcpy (bd->data, data, length);
+        }
+    }
+}
+
+// The second pass:  decode the fields into a message in the arena.
+static bool
+unpack_message (PBCREP_Unpacker          *u,
+                const PBCREP_MessagePlan *mplan,
+                size_t                    seg_base,
+                size_t                    n_segs,
+                size_t                    scan_base,
+                ProtobufCMessage        **message_out,
+                PBCREP_Error            **error)
+{
+  size_t n_unknown;
+  if (!scan_message (u, mplan, seg_base, n_segs, scan_base, &n_unknown, error))
+    return false;
+
+  const ProtobufCMessageDescriptor *desc = mplan->descriptor;
+  const ProtobufCFieldDescriptor *fields = desc->fields;
+  unsigned n_fields = mplan->n_fields;
+  size_t sub_seg_base = seg_base + n_segs;
+  size_t sub_scan_base = scan_base + n_fields;
+
+  char *m = arena_alloc (u, desc->sizeof_message);
+  pbcrep_message_plan_init_message (mplan, m);
+  ProtobufCMessage *message = (ProtobufCMessage *) m;
+  FieldScan *scans = u->scans + scan_base;
+  for (unsigned i = 0; i < n_fields; i++)
+    if (fields[i].label == PROTOBUF_C_LABEL_REPEATED && scans[i].n_values > 0)
+      * (void **) (m + fields[i].offset) = arena_alloc (u, pbcrep_wire_member_size (fields[i].type) * scans[i].n_values);
+  if (n_unknown > 0)
+    message->unknown_fields = arena_alloc (u, sizeof (ProtobufCMessageUnknownField) * n_unknown);
+
+  int prev = -1;
+  for (size_t s = 0; s < n_segs; s++)
+    {
+      size_t length = u->segments[seg_base + s].length;
+      const uint8_t *data = u->segments[seg_base + s].data;
+      PBCREP_WireField wf;
+      for (size_t at = 0; at < length; at = wf.end)
+        {
+          pbcrep_wire_decode_field (length, data, at, &wf);
+          int idx = lookup_field (mplan, wf.number, &prev);
+          if (idx < 0)
+            {
+              // kept as protobuf-c does:  the value, with any length-prefix
+              uint32_t number;
+              PBCREP_WireType wire_type;
+              unsigned tag_len = pbcrep_wire_decode_tag (length - at, data + at, &number, &wire_type);
+              ProtobufCMessageUnknownField *uf = message->unknown_fields + message->n_unknown_fields++;
+              uf->tag = number;
+              uf->wire_type = (ProtobufCWireType) wire_type;
+              uf->len = wf.end - at - tag_len;
+              uf->data = arena_alloc (u, uf->len);
+              memcpy (uf->data, data + at + tag_len, uf->len);
+              continue;
+            }
+
+          const ProtobufCFieldDescriptor *f = fields + idx;
+          const PBCREP_FieldPlan *fp = mplan->fields + idx;
+          FieldScan *fs = u->scans + scan_base + idx;   // the stack moves as sub-messages are unpacked
+
+          // protobuf-c unpacks each occurrence of a message by itself,
+          // even one merged with others or overridden by another
+          // oneof member, so each must be valid by itself.
+          if (f->type == PROTOBUF_C_TYPE_MESSAGE
+           && f->label != PROTOBUF_C_LABEL_REPEATED
+           && (fs->skip || fs->n_occurrences > 1)
+           && !pbcrep_validate_wire_unpackable (f->descriptor, wf.value_length,
+                                                data + wf.value_start, error))
+            return false;
+          if (fs->skip)
+            continue;
+          const uint8_t *value = data + wf.value_start;
+          void *member = m + f->offset;
+
+          if (f->label == PROTOBUF_C_LABEL_REPEATED)
+            {
+              size_t *n_ptr = (size_t *) (m + f->quantifier_offset);
+              size_t elt_size = pbcrep_wire_member_size (f->type);
+              uint8_t *elt = * (uint8_t **) member + elt_size * *n_ptr;
+              if (wf.wire_type == PBCREP_WIRE_TYPE_LENGTH_PREFIXED
+               && pbcrep_wire_type_is_packable (f->type))
+                {
+                  unsigned fixed_size = pbcrep_wire_fixed_size (f->type);
+                  if (fixed_size > 0)
+                    {
+                      decode_packed_fixed (f->type, wf.value_length, value, elt);
+                      *n_ptr += wf.value_length / fixed_size;
+                    }
+                  else
+                    {
+                      // counted in the first pass, so only overlong varints fail
+                      size_t count;
+                      count_packed_varints (wf.value_length, value, &count);
+                      if (!decode_packed_varints (f->type, wf.value_length, value, elt))
+                        return malformed (mplan, "bad packed field", f, error);
+                      *n_ptr += count;
+                    }
+                }
+              else if (f->type == PROTOBUF_C_TYPE_MESSAGE)
+                {
+                  if (!unpack_submessage (u, fp, wf.value_length, value,
+                                          sub_seg_base, sub_scan_base,
+                                          (ProtobufCMessage **) elt, error))
+                    return false;
+                  *n_ptr += 1;
+                }
+              else if (f->type == PROTOBUF_C_TYPE_STRING || f->type == PROTOBUF_C_TYPE_BYTES)
+                {
+                  copy_value (u, f->type, wf.value_length, value, elt);
+                  *n_ptr += 1;
+                }
+              else
+                {
+                  if (pbcrep_wire_decode_scalar (f->type, wf.value_length, value, elt) == 0)
+                    return malformed (mplan, "bad value for field", f, error);
+                  *n_ptr += 1;
+                }
+              continue;
+            }
+
+          // Non-repeated:  the last occurrence wins.
+          bool last = ++fs->n_seen == fs->n_occurrences;
+          switch (f->type)
+            {
+            case PROTOBUF_C_TYPE_MESSAGE:
+              if (!last)
+                continue;
+              if (fs->n_occurrences == 1)
+                {
+                  if (!unpack_submessage (u, fp, wf.value_length, value,
+                                          sub_seg_base, sub_scan_base,
+                                          member, error))
+                    return false;
+                }
+              else
+                {
+                  size_t n = gather_segments (u, mplan, seg_base, n_segs, idx, sub_seg_base);
+                  if (!unpack_message (u, fp->message_plan, sub_seg_base, n,
+                                       sub_scan_base, member, error))
+                    return false;
+                }
+              break;
+            case PROTOBUF_C_TYPE_STRING:
+            case PROTOBUF_C_TYPE_BYTES:
+              if (!last)
+                continue;
+              copy_value (u, f->type, wf.value_length, value, member);
+              break;
+            default:
+              pbcrep_wire_decode_scalar (f->type, wf.value_length, value, member);
+              break;
+            }
+          if (f->flags & PROTOBUF_C_FIELD_FLAG_ONEOF)
+            * (uint32_t *) (m + f->quantifier_offset) = f->id;
+          else if (f->label == PROTOBUF_C_LABEL_OPTIONAL
+                && f->type != PROTOBUF_C_TYPE_STRING
+                && f->type != PROTOBUF_C_TYPE_MESSAGE)
+            * (protobuf_c_boolean *) (m + f->quantifier_offset) = 1;
+        }
+    }
+
+  *message_out = message;
+  return true;
+}
+
+ProtobufCMessage *
+pbcrep_unpacker_unpack (PBCREP_Unpacker   *unpacker,
+                        size_t             length,
+                        const uint8_t     *data,
+                        PBCREP_Error     **error)
+{
+  PBCREP_Unpacker *u = unpacker;
+  const PBCREP_MessagePlan *root = u->plan->root;
+  if (length > UINT32_MAX)
+    {
+      if (error != NULL)
+        *error = pbcrep_error_new_printf ("RECORD_TOO_LONG",
+                                          "%s: message of %zu bytes is too long to unpack",
+                                          root->descriptor->name, length);
+      return NULL;
+    }
+
+  // The root message comes first in the arena.
+  size_t root_size = ARENA_ALIGN_UP (root->descriptor->sizeof_message);
+  size_t estimate = length * u->expansion_x16 / 16;
+  if (estimate > ARENA_MAX_FIRST_BLOCK)
+    estimate = ARENA_MAX_FIRST_BLOCK;
+  arena_start (u, root_size + estimate);
+
+  ProtobufCMessage *message;
+  push_segment (u, 0, length, data);
+  if (!unpack_message (u, root, 0, 1, 0, &message, error))
+    {
+      arena_free (u->arena);
+      u->arena = NULL;
+      return NULL;
+    }
+
+  // Size the next first block by this message, leaning towards
+  // the larger messages, so that most fit in one block.
+  size_t expansion = (u->arena_used - root_size) * 16 / (length > 0 ? length : 1) + 1;
+  if (expansion > u->expansion_x16)
+    u->expansion_x16 = expansion;
+  else
+    u->expansion_x16 -= (u->expansion_x16 - expansion) / 16;
+  u->arena = NULL;
+  return message;
+}
@@ -0,0 +1,34 @@
+/*
+ * PBCREP_Unpacker: unpacks messages as protobuf_c_message_unpack() does,
+ * giving the same ProtobufCMessage structures, but faster.
+ *
+ * It works from the plan's tables:  fields are found by number with a
+ * direct index, after first trying the field following the last one.
+ * Each message is read twice:  once to count the values of its repeated
+ * fields (and check it), and once to decode it into arrays of the
+ * right size.  Packed varints are decoded in bulk.
+ *
+ * Everything a message points to is allocated with it, in one arena,
+ * so it is freed at once by pbcrep_unpacker_free_message();
+ * it must not be freed with protobuf_c_message_free_unpacked().
+ */
+
+typedef struct PBCREP_Unpacker PBCREP_Unpacker;
+
+// The unpacker takes a reference to the plan;  it unpacks
+// the plan's root type.
+PBCREP_Unpacker  *pbcrep_unpacker_new          (PBCREP_Plan       *plan);
+
+// Returns NULL (setting *error) if the message is malformed.
+// Unpackers aren't thread-safe, but their messages may be used
+// and freed in any thread.
+ProtobufCMessage *pbcrep_unpacker_unpack       (PBCREP_Unpacker   *unpacker,
+                                                size_t             length,
+                                                const uint8_t     *data,
+                                                PBCREP_Error     **error);
+
+// Frees a message from pbcrep_unpacker_unpack(), whether or not
+// its unpacker still exists.
+void              pbcrep_unpacker_free_message (ProtobufCMessage  *message);
+
+void              pbcrep_unpacker_destroy      (PBCREP_Unpacker   *unpacker);
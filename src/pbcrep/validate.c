@@ -0,0 +1,225 @@
+#include "../pbcrep.h"
+#include "wire-format.h"
+#include <string.h>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+/* --- UTF-8 --- */
+// Skip ASCII 16 bytes at a time (SSE2) or 8 bytes at a time (SWAR).
+static inline size_t
+skip_ascii (size_t length, const uint8_t *data, size_t at)
+{
+#if defined(__SSE2__)
+  while (length - at >= 16)
+    {
+      int mask = _mm_movemask_epi8 (_mm_loadu_si128 ((const __m128i *) (data + at)));
+      if (mask != 0)
+        return at + __builtin_ctz (mask);
+      at += 16;
+    }
+#else
+  while (length - at >= 8)
+    {
+      uint64_t w;
+      memcpy (&w, data + at, 8);
+      if ((w & 0x8080808080808080ULL) != 0)
+        break;
+      at += 8;
+    }
+#endif
+  while (at < length && data[at] < 0x80)
+    at++;
+  return at;
+}
+
+// Rejects overlong forms, surrogates and code points past U+10FFFF.
+static bool
+utf8_is_valid (size_t length, const uint8_t *data)
+{
+  size_t at = 0;
+  for (;;)
+    {
+      at = skip_ascii (length, data, at);
+      if (at == length)
+        return true;
+      uint8_t c = data[at];
+      unsigned n;
+      uint8_t min2 = 0x80, max2 = 0xbf;     // bounds for the second byte
+      if (c >= 0xc2 && c <= 0xdf)
+        n = 1;
+      else if (c >= 0xe0 && c <= 0xef)
+        {
+          n = 2;
+          if (c == 0xe0)
+            min2 = 0xa0;
+          else if (c == 0xed)
+            max2 = 0x9f;
+        }
+      else if (c >= 0xf0 && c <= 0xf4)
+        {
+          n = 3;
+          if (c == 0xf0)
+            min2 = 0x90;
+          else if (c == 0xf4)
+            max2 = 0x8f;
+        }
+      else
+        return false;
+      if (length - at <= n)
+        return false;
+      if (data[at + 1] < min2 || data[at + 1] > max2)
+        return false;
+      for (unsigned i = 2; i <= n; i++)
+        if ((data[at + i] & 0xc0) != 0x80)
+          return false;
+      at += n + 1;
+    }
+}
+
+/* --- Messages --- */
+// Each varint in a packed field must end within the field,
+// and take at most PBCREP_WIRE_MAX_VARINT_SIZE bytes.
+static bool
+packed_varints_are_valid (size_t length, const uint8_t *data)
+{
+  if (length > 0 && data[length - 1] >= 0x80)
+    return false;
+  unsigned run = 0;
+  for (size_t at = 0; at < length; at++)
+    {
+      if (data[at] < 0x80)
+        run = 0;
+      else if (++run == PBCREP_WIRE_MAX_VARINT_SIZE)
+        return false;
+    }
+  return true;
+}
+
+static bool
+invalid (const ProtobufCMessageDescriptor *desc,
+         const char                       *code,
+         const char                       *what,
+         const ProtobufCFieldDescriptor   *f,
+         size_t                            at,
+         PBCREP_Error                    **error)
+{
+  if (error != NULL)
+    *error = pbcrep_error_new_printf (code, "%s: %s%s%s at offset %zu",
+                                      desc->name, what,
+                                      f != NULL ? " " : "",
+                                      f != NULL ? f->name : "",
+                                      at);
+  return false;
+}
+
+static bool
+field_is_present (size_t length, const uint8_t *data, uint32_t id)
+{
+  PBCREP_WireField wf;
+  for (size_t at = 0; at < length; at = wf.end)
+    {
+      pbcrep_wire_decode_field (length, data, at, &wf);
+      if (wf.number == id)
+        return true;
+    }
+  return false;
+}
+
+static bool
+validate_message (const ProtobufCMessageDescriptor *desc,
+                  size_t                            length,
+                  const uint8_t                    *data,
+                  bool                              check_utf8,
+                  unsigned                          depth,
+                  PBCREP_Error                    **error)
+{
+  if (depth > PBCREP_VALIDATE_MAX_DEPTH)
+    {
+      if (error != NULL)
+        *error = pbcrep_error_new_printf ("PROTOBUF_MALFORMED",
+                                          "%s: nested too deeply", desc->name);
+      return false;
+    }
+
+  // The fields seen, for the first 64.
+  uint64_t seen = 0;
+
+  unsigned guess = 0;
+  PBCREP_WireField wf;
+  for (size_t at = 0; at < length; at = wf.end)
+    {
+      if (!pbcrep_wire_decode_field (length, data, at, &wf))
+        return invalid (desc, "PROTOBUF_MALFORMED", "bad field", NULL, at, error);
+      int i = pbcrep_wire_find_field (desc, wf.number, &guess);
+      if (i < 0)
+        continue;               // unknown fields are skipped
+      const ProtobufCFieldDescriptor *f = desc->fields + i;
+      if (!pbcrep_wire_type_matches (f, wf.wire_type))
+        return invalid (desc, "PROTOBUF_MALFORMED", "wrong wire type for field", f, at, error);
+      if (i < 64)
+        seen |= (uint64_t) 1 << i;
+      if (wf.wire_type != PBCREP_WIRE_TYPE_LENGTH_PREFIXED)
+        continue;
+
+      const uint8_t *value = data + wf.value_start;
+      switch (f->type)
+        {
+        case PROTOBUF_C_TYPE_BYTES:
+          break;
+        case PROTOBUF_C_TYPE_STRING:
+          if (check_utf8 && !utf8_is_valid (wf.value_length, value))
+            return invalid (desc, "BAD_UTF8", "bad UTF-8 in field", f, at, error);
+          break;
+        case PROTOBUF_C_TYPE_MESSAGE:
+          if (!validate_message (f->descriptor, wf.value_length, value,
+                                 check_utf8, depth + 1, error))
+            return false;
+          break;
+        default:
+          {
+            // a packed repeated field
+            unsigned fixed_size = pbcrep_wire_fixed_size (f->type);
+            if (fixed_size > 0 ? wf.value_length % fixed_size != 0
+                               : !packed_varints_are_valid (wf.value_length, value))
+              return invalid (desc, "PROTOBUF_MALFORMED", "bad packed field", f, at, error);
+            break;
+          }
+        }
+    }
+
+  for (unsigned i = 0; i < desc->n_fields; i++)
+    {
+      const ProtobufCFieldDescriptor *f = desc->fields + i;
+      if (f->label != PROTOBUF_C_LABEL_REQUIRED)
+        continue;
+      if (i < 64 ? (seen & ((uint64_t) 1 << i)) == 0
+                 : !field_is_present (length, data, f->id))
+        {
+          if (error != NULL)
+            *error = pbcrep_error_new_printf ("PROTOBUF_MALFORMED",
+                                              "%s: missing required field %s",
+                                              desc->name, f->name);
+          return false;
+        }
+    }
+  return true;
+}
+
+bool
+pbcrep_validate_wire (const ProtobufCMessageDescriptor *desc,
+                      size_t                            length,
+                      const uint8_t                    *data,
+                      PBCREP_Error                    **error)
+{
+  return validate_message (desc, length, data, true, 0, error);
+}
+
+bool
+pbcrep_validate_wire_unpackable (const ProtobufCMessageDescriptor *desc,
+                                 size_t                            length,
+                                 const uint8_t                    *data,
+                                 PBCREP_Error                    **error)
+{
+  return validate_message (desc, length, data, false, 0, error);
+}
@@ -0,0 +1,29 @@
+/*
+ * pbcrep_validate_wire(): check a packed message against its
+ * descriptor without unpacking it or allocating anything.
+ *
+ * A message is valid if protobuf_c_message_unpack() would accept it:
+ * valid tags, wire types that suit the fields, lengths within the data,
+ * well-formed packed fields and required fields present, all the way
+ * down through its sub-messages.  In addition, strings must be UTF-8,
+ * which protobuf-c does not check.
+ *
+ * Unknown fields are only checked for framing.  A non-repeated
+ * sub-message given more than once must have its required fields
+ * in each piece, where unpacking would merge the pieces first.
+ */
+
+// Sub-messages nested deeper than this are rejected.
+#define PBCREP_VALIDATE_MAX_DEPTH       100
+
+bool pbcrep_validate_wire (const ProtobufCMessageDescriptor *desc,
+                           size_t                            length,
+                           const uint8_t                    *data,
+                           PBCREP_Error                    **error);
+
+// The same, but without the UTF-8 check,
+// which protobuf_c_message_unpack() doesn't make.
+bool pbcrep_validate_wire_unpackable (const ProtobufCMessageDescriptor *desc,
+                                      size_t                            length,
+                                      const uint8_t                    *data,
+                                      PBCREP_Error                    **error);
@@ -0,0 +1,373 @@
+/* Reading and writing the protobuf wire format:  varints, tags and values,
+ * without packing or unpacking any messages.
+ *
+ * Private to the library;  include after pbcrep.h.
+ */
+
+#ifndef __PBCREP_WIRE_FORMAT_H_
+#define __PBCREP_WIRE_FORMAT_H_
+
+#define PBCREP_WIRE_MAX_VARINT_SIZE     10
+#define PBCREP_WIRE_MAX_FIELD_NUMBER    ((1U << 29) - 1)
+
+typedef enum
+{
+  PBCREP_WIRE_TYPE_VARINT = 0,
+  PBCREP_WIRE_TYPE_64BIT = 1,
+  PBCREP_WIRE_TYPE_LENGTH_PREFIXED = 2,
+  PBCREP_WIRE_TYPE_START_GROUP = 3,             // not supported by protobuf-c
+  PBCREP_WIRE_TYPE_END_GROUP = 4,               // not supported by protobuf-c
+  PBCREP_WIRE_TYPE_32BIT = 5
+} PBCREP_WireType;
+
+// Decode the varint at the start of data[0..avail).  Returns its size,
+// or 0 if it is truncated or longer than PBCREP_WIRE_MAX_VARINT_SIZE.
+static inline unsigned
+pbcrep_wire_decode_varint (size_t          avail,
+                           const uint8_t  *data,
+                           uint64_t       *value_out)
+{
+  if (avail > 0 && data[0] < 0x80)
+    {
+      *value_out = data[0];
+      return 1;
+    }
+  unsigned max = avail < PBCREP_WIRE_MAX_VARINT_SIZE ? avail : PBCREP_WIRE_MAX_VARINT_SIZE;
+  uint64_t value = 0;
+  for (unsigned i = 0; i < max; i++)
+    {
+      value |= (uint64_t) (data[i] & 0x7f) << (7 * i);
+      if (data[i] < 0x80)
+        {
+          *value_out = value;
+          return i + 1;
+        }
+    }
+  return 0;
+}
+
+// Decode a tag.  Returns its size, or 0 if it is truncated
+// or the field number is out of range.
+static inline unsigned
+pbcrep_wire_decode_tag    (size_t          avail,
+                           const uint8_t  *data,
+                           uint32_t       *field_number_out,
+                           PBCREP_WireType *wire_type_out)
+{
+  uint64_t tag;
+  unsigned rv = pbcrep_wire_decode_varint (avail, data, &tag);
+  if (rv == 0 || rv > 5)
+    return 0;
+  uint64_t field_number = tag >> 3;
+  if (field_number == 0 || field_number > PBCREP_WIRE_MAX_FIELD_NUMBER)
+    return 0;
+  *field_number_out = field_number;
+  *wire_type_out = (PBCREP_WireType) (tag & 7);
+  return rv;
+}
+
+// The size of the value of the given wire type at the start of
+// data[0..avail), or 0 if it is malformed or runs past the end.
+// (No value is empty, and groups are rejected, as protobuf-c does.)
+static inline size_t
+pbcrep_wire_value_size    (PBCREP_WireType wire_type,
+                           size_t          avail,
+                           const uint8_t  *data)
+{
+  uint64_t length;
+  unsigned prefix_len;
+  switch (wire_type)
+    {
+    case PBCREP_WIRE_TYPE_VARINT:
+      return pbcrep_wire_decode_varint (avail, data, &length);
+    case PBCREP_WIRE_TYPE_64BIT:
+      return avail >= 8 ? 8 : 0;
+    case PBCREP_WIRE_TYPE_32BIT:
+      return avail >= 4 ? 4 : 0;
+    case PBCREP_WIRE_TYPE_LENGTH_PREFIXED:
+      prefix_len = pbcrep_wire_decode_varint (avail, data, &length);
+      if (prefix_len == 0 || length > avail - prefix_len)
+        return 0;
+      return prefix_len + length;
+    default:
+      return 0;
+    }
+}
+
+// Check that data[0..len) is a sequence of well-formed fields:
+// valid tags and wire types, and values within the data.
+// Length-prefixed values are not looked into.
+// Returns the offset of the first bad field, or 'len'.
+static inline size_t
+pbcrep_wire_check_fields  (size_t          len,
+                           const uint8_t  *data)
+{
+  size_t at = 0;
+  while (at < len)
+    {
+      uint32_t field_number;
+      PBCREP_WireType wire_type;
+      unsigned tag_len = pbcrep_wire_decode_tag (len - at, data + at,
+                                                 &field_number, &wire_type);
+      if (tag_len == 0)
+        return at;
+      size_t value_len = pbcrep_wire_value_size (wire_type, len - at - tag_len,
+                                                 data + at + tag_len);
+      if (value_len == 0)
+        return at;
+      at += tag_len + value_len;
+    }
+  return len;
+}
+
+// A field located within a message:  see pbcrep_wire_decode_field().
+typedef struct
+{
+  uint32_t number;
+  PBCREP_WireType wire_type;
+  size_t value_start;           // for length-prefixed:  of the payload
+  size_t value_length;          // for length-prefixed:  of the payload
+  size_t end;
+} PBCREP_WireField;
+
+// Locate the field whose tag is at data[at], in the message data[0..len).
+// False if it is malformed.
+static inline bool
+pbcrep_wire_decode_field  (size_t          len,
+                           const uint8_t  *data,
+                           size_t          at,
+                           PBCREP_WireField *out)
+{
+  unsigned tag_len = pbcrep_wire_decode_tag (len - at, data + at,
+                                             &out->number, &out->wire_type);
+  if (tag_len == 0)
+    return false;
+  at += tag_len;
+  size_t value_size = pbcrep_wire_value_size (out->wire_type, len - at, data + at);
+  if (value_size == 0)
+    return false;
+  out->end = at + value_size;
+  if (out->wire_type == PBCREP_WIRE_TYPE_LENGTH_PREFIXED)
+    {
+      uint64_t length;
+      at += pbcrep_wire_decode_varint (len - at, data + at, &length);
+    }
+  out->value_start = at;
+  out->value_length = out->end - at;
+  return true;
+}
+
+// 4 or 8 for the fixed-size types, 0 for varints and the rest.
+static inline unsigned
+pbcrep_wire_fixed_size    (ProtobufCType   type)
+{
+  switch (type)
+    {
+    case PROTOBUF_C_TYPE_SFIXED32:
+    case PROTOBUF_C_TYPE_FIXED32:
+    case PROTOBUF_C_TYPE_FLOAT:
+      return 4;
+    case PROTOBUF_C_TYPE_SFIXED64:
+    case PROTOBUF_C_TYPE_FIXED64:
+    case PROTOBUF_C_TYPE_DOUBLE:
+      return 8;
+    default:
+      return 0;
+    }
+}
+
+// The size of a value of the type as a message member,
+// or as an element of a repeated field's array.
+static inline size_t
+pbcrep_wire_member_size   (ProtobufCType   type)
+{
+  switch (type)
+    {
+    case PROTOBUF_C_TYPE_INT64:
+    case PROTOBUF_C_TYPE_SINT64:
+    case PROTOBUF_C_TYPE_SFIXED64:
+    case PROTOBUF_C_TYPE_UINT64:
+    case PROTOBUF_C_TYPE_FIXED64:
+    case PROTOBUF_C_TYPE_DOUBLE:
+      return 8;
+    case PROTOBUF_C_TYPE_BOOL:
+      return sizeof (protobuf_c_boolean);
+    case PROTOBUF_C_TYPE_STRING:
+      return sizeof (char *);
+    case PROTOBUF_C_TYPE_BYTES:
+      return sizeof (ProtobufCBinaryData);
+    case PROTOBUF_C_TYPE_MESSAGE:
+      return sizeof (ProtobufCMessage *);
+    default:
+      return 4;
+    }
+}
+
+static inline bool
+pbcrep_wire_type_is_packable (ProtobufCType type)
+{
+  return type != PROTOBUF_C_TYPE_STRING
+      && type != PROTOBUF_C_TYPE_BYTES
+      && type != PROTOBUF_C_TYPE_MESSAGE;
+}
+
+// Whether a value of the field may have the wire type, as protobuf-c
+// accepts:  repeated scalars may come packed or not.
+static inline bool
+pbcrep_wire_type_matches  (const ProtobufCFieldDescriptor *field,
+                           PBCREP_WireType wire_type)
+{
+  if (!pbcrep_wire_type_is_packable (field->type))
+    return wire_type == PBCREP_WIRE_TYPE_LENGTH_PREFIXED;
+  if (wire_type == PBCREP_WIRE_TYPE_LENGTH_PREFIXED)
+    return field->label == PROTOBUF_C_LABEL_REPEATED;
+  switch (pbcrep_wire_fixed_size (field->type))
+    {
+    case 4:  return wire_type == PBCREP_WIRE_TYPE_32BIT;
+    case 8:  return wire_type == PBCREP_WIRE_TYPE_64BIT;
+    default: return wire_type == PBCREP_WIRE_TYPE_VARINT;
+    }
+}
+
+// Find the field numbered 'number', or return -1.  Fields usually
+// come in order, so the one after the last found ('*guess_inout',
+// which starts at 0) is tried first.
+static inline int
+pbcrep_wire_find_field    (const ProtobufCMessageDescriptor *desc,
+                           uint32_t        number,
+                           unsigned       *guess_inout)
+{
+  unsigned i = *guess_inout;
+  if (i >= desc->n_fields || desc->fields[i].id != number)
+    {
+      const ProtobufCFieldDescriptor *f = protobuf_c_message_descriptor_get_field (desc, number);
+      if (f == NULL)
+        return -1;
+      i = f - desc->fields;
+    }
+  *guess_inout = i + 1;
+  return i;
+}
+
+static inline bool
+pbcrep_wire_fields_share_oneof (const ProtobufCFieldDescriptor *f,
+                                const ProtobufCFieldDescriptor *g)
+{
+  return (f->flags & PROTOBUF_C_FIELD_FLAG_ONEOF)
+      && (g->flags & PROTOBUF_C_FIELD_FLAG_ONEOF)
+      && f->quantifier_offset == g->quantifier_offset;
+}
+
+// Of a oneof's members, only the last one given is set.  Whether
+// member 'i' (which was given) is that one:  'count' and 'last' point
+// at field 0's number of occurrences and the position of its last
+// (anything that grows through the message), and the other fields'
+// follow every 'stride' bytes, as in an array of structs.
+static inline bool
+pbcrep_wire_oneof_member_is_last (const ProtobufCMessageDescriptor *desc,
+                                  unsigned        i,
+                                  const uint32_t *count,
+                                  const uint32_t *last,
+                                  size_t          stride)
+{
+#define PBCREP_WIRE_STRIDED(ptr, j) \
+  (* (const uint32_t *) ((const char *) (ptr) + (size_t) (j) * stride))
+  for (unsigned j = 0; j < desc->n_fields; j++)
+    if (PBCREP_WIRE_STRIDED (count, j) > 0
+     && PBCREP_WIRE_STRIDED (last, j) > PBCREP_WIRE_STRIDED (last, i)
+     && pbcrep_wire_fields_share_oneof (desc->fields + i, desc->fields + j))
+      return false;
+  return true;
+#undef PBCREP_WIRE_STRIDED
+}
+
+// Decode a scalar (not a string, bytes or message) into 'member_out',
+// laid out as the message member would be.
+// Returns the number of bytes used, or 0 if they run out.
+static inline size_t
+pbcrep_wire_decode_scalar (ProtobufCType   type,
+                           size_t          avail,
+                           const uint8_t  *data,
+                           void           *member_out)
+{
+  uint64_t v = 0;
+  unsigned fixed_size = pbcrep_wire_fixed_size (type);
+  if (fixed_size > 0)
+    {
+      if (avail < fixed_size)
+        return 0;
+      for (unsigned i = 0; i < fixed_size; i++)
+        v |= (uint64_t) data[i] << (8 * i);
+      if (fixed_size == 4)
+        * (uint32_t *) member_out = v;
+      else
+        * (uint64_t *) member_out = v;
+      return fixed_size;
+    }
+
+  unsigned n = pbcrep_wire_decode_varint (avail, data, &v);
+  switch (type)
+    {
+    case PROTOBUF_C_TYPE_INT32:
+    case PROTOBUF_C_TYPE_ENUM:
+    case PROTOBUF_C_TYPE_UINT32:
+      * (uint32_t *) member_out = v;
+      break;
+    case PROTOBUF_C_TYPE_SINT32:
+      * (int32_t *) member_out = (int32_t) (((uint32_t) v >> 1) ^ -((uint32_t) v & 1));
+      break;
+    case PROTOBUF_C_TYPE_SINT64:
+      * (int64_t *) member_out = (int64_t) ((v >> 1) ^ -(v & 1));
+      break;
+    case PROTOBUF_C_TYPE_BOOL:
+      * (protobuf_c_boolean *) member_out = v != 0;
+      break;
+    default:
+      * (uint64_t *) member_out = v;
+      break;
+    }
+  return n;
+}
+
+// The number of bytes in the varint encoding of 'value'.
+static inline unsigned
+pbcrep_wire_varint_size   (uint64_t        value)
+{
+  unsigned rv = 1;
+  while (value >= 0x80)
+    {
+      value >>= 7;
+      rv++;
+    }
+  return rv;
+}
+
+// Encode 'value' as a varint;  'out' must have room for
+// PBCREP_WIRE_MAX_VARINT_SIZE bytes.  Returns the size.
+static inline unsigned
+pbcrep_wire_encode_varint (uint64_t        value,
+                           uint8_t        *out)
+{
+  unsigned rv = 0;
+  while (value >= 0x80)
+    {
+      out[rv++] = value | 0x80;
+      value >>= 7;
+    }
+  out[rv++] = value;
+  return rv;
+}
+
+static inline uint32_t
+pbcrep_wire_zigzag32      (int32_t         value)
+{
+  return ((uint32_t) value << 1) ^ (uint32_t) (value >> 31);
+}
+
+static inline uint64_t
+pbcrep_wire_zigzag64      (int64_t         value)
+{
+  return ((uint64_t) value << 1) ^ (uint64_t) (value >> 63);
+}
+
+#endif
@@ -0,0 +1,133 @@
+#include <assert.h>
+#include "../pbcrep.h"
+
+bool
+pbcrep_writer_write       (PBCREP_Writer *writer,
+                           const ProtobufCMessage *message,
+                           PBCREP_Error **error)
+{
+  return writer->write (writer, message, error);
+}
+
+bool
+pbcrep_writer_end_write   (PBCREP_Writer *writer,
+                           PBCREP_Error **error)
+{
+  return writer->end_write (writer, error);
+}
+
+void
+pbcrep_writer_destroy     (PBCREP_Writer *writer)
+{
+  writer->destroy (writer);
+}
+
+void
+pbcrep_writer_set_flush_threshold (PBCREP_Writer *writer,
+                                   size_t         threshold)
+{
+  writer->flush_threshold = threshold;
+}
+
+/* --- printer + binary-data writer --- */
+typedef struct {
+  PBCREP_Writer base;
+  PBCREP_BinaryDataWriter *output;
+  PBCREP_Printer *printer;
+} PrinterWriter;
+
+// Write out everything the printer has produced:  with writev
+// where the output is a file descriptor, since the printers'
+// output tends to be many small fragments.
+static bool
+printer_writer_write_output (PrinterWriter *w, PBCREP_Error **error)
+{
+  PBCREP_Buffer *data = &w->printer->output_data;
+  int fd = -1;
+  if (w->output->get_fd != NULL)
+    {
+      if (!pbcrep_binary_data_writer_flush (w->output, error))
+        return false;
+      fd = w->output->get_fd (w->output);
+    }
+  if (fd >= 0)
+    return pbcrep_buffer_write_all_to_fd (data, fd, error);
+
+  // Only what was written is discarded.
+  size_t written = 0;
+  bool ok = true;
+  for (PBCREP_BufferFragment *frag = data->first_frag;
+       frag != NULL && ok;
+       frag = frag->next)
+    {
+      ok = pbcrep_binary_data_writer_write (w->output, frag->buf_length,
+                                            frag->buf + frag->buf_start, error);
+      if (ok)
+        written += frag->buf_length;
+    }
+  pbcrep_buffer_discard (data, written);
+  return ok;
+}
+
+static bool
+printer_writer_write (PBCREP_Writer *writer,
+                      const ProtobufCMessage *message,
+                      PBCREP_Error **error)
+{
+  PrinterWriter *w = (PrinterWriter *) writer;
+  if (writer->descriptor == NULL)
+    writer->descriptor = message->descriptor;
+  assert (message->descriptor == writer->descriptor);
+  if (!pbcrep_printer_print (w->printer, message, error))
+    return false;
+  if (w->printer->output_data.size >= writer->flush_threshold)
+    return printer_writer_write_output (w, error);
+  return true;
+}
+
+static bool
+printer_writer_end_write (PBCREP_Writer *writer,
+                          PBCREP_Error **error)
+{
+  PrinterWriter *w = (PrinterWriter *) writer;
+  return pbcrep_printer_end (w->printer, error)
+      && printer_writer_write_output (w, error)
+      && pbcrep_binary_data_writer_flush (w->output, error);
+}
+
+static void
+printer_writer_destroy (PBCREP_Writer *writer)
+{
+  PrinterWriter *w = (PrinterWriter *) writer;
+  pbcrep_printer_destroy (w->printer);
+  pbcrep_binary_data_writer_destroy (w->output);
+  pbcrep_free (w);
+}
+
+PBCREP_Writer *
+pbcrep_writer_new_printer (PBCREP_BinaryDataWriter *writer,
+                           PBCREP_Printer *printer)
+{
+  PrinterWriter *w = pbcrep_malloc (sizeof (PrinterWriter));
+  w->base.write = printer_writer_write;
+  w->base.end_write = printer_writer_end_write;
+  w->base.destroy = printer_writer_destroy;
+  w->base.descriptor = NULL;            // set by the first message
+  w->base.flush_threshold = PBCREP_WRITER_DEFAULT_FLUSH_THRESHOLD;
+  w->output = writer;
+  w->printer = printer;
+  return &w->base;
+}
+
+bool
+pbcrep_writer_peek_printer (PBCREP_Writer *writer,
+                            PBCREP_BinaryDataWriter **output_out,
+                            PBCREP_Printer **printer_out)
+{
+  if (writer->write != printer_writer_write)
+    return false;
+  PrinterWriter *w = (PrinterWriter *) writer;
+  *output_out = w->output;
+  *printer_out = w->printer;
+  return true;
+}
@@ -11,8 +11,15 @@ struct PBCREP_Writer
                                     PBCREP_Error **error);
   void (*destroy)                  (PBCREP_Writer *writer);
   const ProtobufCMessageDescriptor *descriptor;
+
+  // Output is collected until this many bytes are ready
+  // (or end_write), then written in one batch.
+  size_t flush_threshold;
 };
 
+#define PBCREP_WRITER_DEFAULT_FLUSH_THRESHOLD   (64*1024)
+
+// Takes ownership of 'writer' and 'printer'.
 PBCREP_Writer    *pbcrep_writer_new_printer (PBCREP_BinaryDataWriter *writer,
                                              PBCREP_Printer *printer);
 bool              pbcrep_writer_write       (PBCREP_Writer *reader,
@@ -22,3 +29,14 @@ bool              pbcrep_writer_end_write   (PBCREP_Writer *writer,
                                              PBCREP_Error **error);
 void              pbcrep_writer_destroy     (PBCREP_Writer *reader);
 
+// 0 writes after every message.
+void              pbcrep_writer_set_flush_threshold
+                                            (PBCREP_Writer *writer,
+                                             size_t         threshold);
+
+
+// For writers from pbcrep_writer_new_printer():  their binary-data
+// writer and printer.  Returns false for other writers.
+bool              pbcrep_writer_peek_printer(PBCREP_Writer *writer,
+                                             PBCREP_BinaryDataWriter **output_out,
+                                             PBCREP_Printer **printer_out);
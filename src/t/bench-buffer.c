@@ -0,0 +1,113 @@
+/*
+ * Microbenchmark:  appending many short records to a PBCREP_Buffer.
+ *
+ * Each record is a decimal integer and a comma, which is
+ * roughly what a printer does for a repeated int field.
+ *
+ * Not a test:  it is built but not run by "make check".
+ */
+#include "../pbcrep.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define N_VALUES        (1 << 22)
+
+static double
+now (void)
+{
+  struct timespec ts;
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static unsigned
+format_record (uint32_t v, char *out)
+{
+  char tmp[16];
+  char *p = tmp + sizeof (tmp);
+  *--p = ',';
+  do
+    {
+      *--p = '0' + v % 10;
+      v /= 10;
+    }
+  while (v != 0);
+  unsigned len = tmp + sizeof (tmp) - p;
+  memcpy (out, p, len);
+  return len;
+}
+
+static void
+bench_append (PBCREP_Buffer *buffer, const uint32_t *values)
+{
+  char tmp[16];
+  for (unsigned i = 0; i < N_VALUES; i++)
+    pbcrep_buffer_append (buffer, format_record (values[i], tmp), tmp);
+}
+
+static void
+bench_append_small (PBCREP_Buffer *buffer, const uint32_t *values)
+{
+  char tmp[16];
+  for (unsigned i = 0; i < N_VALUES; i++)
+    pbcrep_buffer_append_small (buffer, format_record (values[i], tmp), tmp);
+}
+
+static void
+bench_reserve_commit (PBCREP_Buffer *buffer, const uint32_t *values)
+{
+  uint8_t *start, *at, *end;
+  unsigned avail;
+  pbcrep_buffer_reserve (buffer, 16, &start, &avail);
+  at = start;
+  end = start + avail;
+  for (unsigned i = 0; i < N_VALUES; i++)
+    {
+      if ((size_t) (end - at) < 16)
+        {
+          pbcrep_buffer_commit (buffer, at - start);
+          pbcrep_buffer_reserve (buffer, 16, &start, &avail);
+          at = start;
+          end = start + avail;
+        }
+      at += format_record (values[i], (char *) at);
+    }
+  pbcrep_buffer_commit (buffer, at - start);
+}
+
+static void
+run (const char *name,
+     void (*func) (PBCREP_Buffer *, const uint32_t *),
+     const uint32_t *values)
+{
+  PBCREP_Buffer buffer = PBCREP_BUFFER_INIT;
+  double start = now ();
+  func (&buffer, values);
+  double elapsed = now () - start;
+  printf ("%-16s %8.2f ns/record  %7.1f MB/s\n",
+          name,
+          elapsed * 1e9 / N_VALUES,
+          buffer.size / elapsed / 1e6);
+  pbcrep_buffer_clear (&buffer);
+}
+
+int main (void)
+{
+  uint32_t *values = malloc (sizeof (uint32_t) * N_VALUES);
+  uint32_t x = 1;
+  for (unsigned i = 0; i < N_VALUES; i++)
+    {
+      x = x * 1103515245 + 12345;
+      values[i] = x >> (x & 31);
+    }
+  for (unsigned pass = 0; pass < 2; pass++)
+    {
+      run ("append", bench_append, values);
+      run ("append_small", bench_append_small, values);
+      run ("reserve/commit", bench_reserve_commit, values);
+    }
+  free (values);
+  return 0;
+}
@@ -0,0 +1,410 @@
+/*
+ * Round-trip data through the binary-data writers and readers:
+ * the plain file-descriptor ones, the mmap reader, and the io_uring
+ * ones (which are the plain ones if io_uring is unavailable).
+ * Then pbcrep_binary_data_transfer() between assorted ends,
+ * re-framing length-prefixed records, and the printer writer's
+ * batching of output.
+ */
+#include "../pbcrep.h"
+#include <assert.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#define DATA_SIZE       (3*1000*1000 + 17)
+
+static uint8_t *data;
+
+typedef struct {
+  const char *name;
+  PBCREP_BinaryDataWriter *(*make_writer) (int fd, const PBCREP_IOUringOptions *options);
+  PBCREP_BinaryDataReader *(*make_reader) (int fd, const PBCREP_IOUringOptions *options);
+  PBCREP_IOUringOptions options;
+} Mode;
+
+static PBCREP_BinaryDataWriter *
+plain_writer (int fd, const PBCREP_IOUringOptions *options)
+{
+  (void) options;
+  return pbcrep_binary_data_writer_to_fileno (fd, true);
+}
+static PBCREP_BinaryDataReader *
+plain_reader (int fd, const PBCREP_IOUringOptions *options)
+{
+  (void) options;
+  return pbcrep_binary_data_reader_from_fileno (fd, true);
+}
+static PBCREP_BinaryDataReader *
+mmap_reader (int fd, const PBCREP_IOUringOptions *options)
+{
+  (void) options;
+  return pbcrep_binary_data_reader_from_fileno_mmap (fd, true);
+}
+static PBCREP_BinaryDataWriter *
+io_uring_writer (int fd, const PBCREP_IOUringOptions *options)
+{
+  return pbcrep_binary_data_writer_to_fileno_io_uring (fd, true, options);
+}
+static PBCREP_BinaryDataReader *
+io_uring_reader (int fd, const PBCREP_IOUringOptions *options)
+{
+  return pbcrep_binary_data_reader_from_fileno_io_uring (fd, true, options);
+}
+
+static void
+test_round_trip (const Mode *mode)
+{
+  char filename[] = "/tmp/pbcrep-test-XXXXXX";
+  int fd = mkstemp (filename);
+  assert (fd >= 0);
+
+  // Write in pieces of assorted sizes.
+  PBCREP_BinaryDataWriter *writer = mode->make_writer (fd, &mode->options);
+  size_t at = 0;
+  unsigned piece = 1;
+  while (at < DATA_SIZE)
+    {
+      size_t n = piece < DATA_SIZE - at ? piece : DATA_SIZE - at;
+      assert (pbcrep_binary_data_writer_write (writer, n, data + at, NULL));
+      at += n;
+      piece = piece * 7 % 100003 + 1;
+    }
+  assert (pbcrep_binary_data_writer_flush (writer, NULL));
+  pbcrep_binary_data_writer_destroy (writer);
+
+  fd = open (filename, O_RDONLY);
+  assert (fd >= 0);
+  unlink (filename);
+  PBCREP_BinaryDataReader *reader = mode->make_reader (fd, &mode->options);
+  PBCREP_Buffer buffer = PBCREP_BUFFER_INIT;
+  PBCREP_ReadResult result;
+  size_t amt;
+  while ((result = pbcrep_binary_data_reader_read_buffer (reader, &buffer, &amt, NULL))
+         != PBCREP_READ_RESULT_EOF)
+    assert (result != PBCREP_READ_RESULT_ERROR);
+  pbcrep_binary_data_reader_destroy (reader);
+
+  assert (buffer.size == DATA_SIZE);
+  uint8_t *got = malloc (DATA_SIZE);
+  pbcrep_buffer_read (&buffer, DATA_SIZE, got);
+  assert (memcmp (got, data, DATA_SIZE) == 0);
+  free (got);
+  fprintf (stderr, "  %s: ok\n", mode->name);
+}
+
+static int
+make_temp_file (void)
+{
+  char filename[] = "/tmp/pbcrep-test-XXXXXX";
+  int fd = mkstemp (filename);
+  assert (fd >= 0);
+  unlink (filename);
+  return fd;
+}
+
+static int
+make_data_file (void)
+{
+  int fd = make_temp_file ();
+  assert (write (fd, data, DATA_SIZE) == DATA_SIZE);
+  lseek (fd, 0, SEEK_SET);
+  return fd;
+}
+
+// Check that fd holds data[skip..DATA_SIZE).
+static void
+check_file (int fd, size_t skip)
+{
+  size_t length = DATA_SIZE - skip;
+  uint8_t *got = malloc (length + 1);
+  lseek (fd, 0, SEEK_SET);
+  assert ((size_t) read (fd, got, length + 1) == length);
+  assert (memcmp (got, data + skip, length) == 0);
+  free (got);
+  close (fd);
+}
+
+static void
+transfer_and_check (PBCREP_BinaryDataReader *reader, size_t skip, const char *name)
+{
+  int out_fd = make_temp_file ();
+  PBCREP_BinaryDataWriter *writer = pbcrep_binary_data_writer_to_fileno (out_fd, false);
+  PBCREP_TransferResult res = pbcrep_binary_data_transfer (reader, writer);
+  assert (res.code == PBCREP_TRANSFER_RESULT_SUCCESS);
+  assert (res.n_transferred == DATA_SIZE - skip);
+  pbcrep_binary_data_reader_destroy (reader);
+  pbcrep_binary_data_writer_destroy (writer);
+  check_file (out_fd, skip);
+  fprintf (stderr, "  transfer %s: ok\n", name);
+}
+
+static void
+test_transfers (void)
+{
+  // file to file
+  transfer_and_check (pbcrep_binary_data_reader_from_fileno (make_data_file (), true),
+                      0, "file");
+
+  // from memory, through a buffer
+  transfer_and_check (pbcrep_binary_data_reader_from_data (DATA_SIZE, data),
+                      0, "data");
+
+  // The mmap reader must hand over its position.
+  PBCREP_BinaryDataReader *reader
+    = pbcrep_binary_data_reader_from_fileno_mmap (make_data_file (), true);
+  uint8_t start[1000];
+  size_t amt;
+  assert (pbcrep_binary_data_reader_read (reader, sizeof (start), start, &amt, NULL)
+          == PBCREP_READ_RESULT_OK);
+  assert (amt == sizeof (start));
+  transfer_and_check (reader, sizeof (start), "mmap");
+
+  // from a pipe
+  int pipe_fds[2];
+  assert (pipe (pipe_fds) == 0);
+  pid_t pid = fork ();
+  assert (pid >= 0);
+  if (pid == 0)
+    {
+      close (pipe_fds[0]);
+      for (size_t at = 0; at < DATA_SIZE; )
+        {
+          ssize_t rv = write (pipe_fds[1], data + at, DATA_SIZE - at);
+          assert (rv > 0);
+          at += rv;
+        }
+      _exit (0);
+    }
+  close (pipe_fds[1]);
+  transfer_and_check (pbcrep_binary_data_reader_from_fileno (pipe_fds[0], true),
+                      0, "pipe");
+  int status;
+  assert (waitpid (pid, &status, 0) == pid && status == 0);
+}
+
+// A record of field 1, a varint, and field 2, that many bytes.
+static size_t
+make_record (unsigned id, uint8_t *out)
+{
+  size_t at = 0;
+  out[at++] = 0x08;
+  out[at++] = id & 0x3f;
+  out[at++] = 0x12;
+  out[at++] = id & 0x3f;
+  memset (out + at, 'a', id & 0x3f);
+  return at + (id & 0x3f);
+}
+
+static void
+test_reframe (void)
+{
+  // 1000 records, with u32-le prefixes.
+  uint8_t *in = malloc (1000 * 140);
+  uint8_t *expect = malloc (1000 * 140);
+  size_t in_len = 0, expect_len = 0;
+  for (unsigned i = 0; i < 1000; i++)
+    {
+      uint8_t record[140];
+      size_t len = make_record (i, record);
+      in[in_len++] = len;
+      in[in_len++] = len >> 8;
+      in[in_len++] = 0;
+      in[in_len++] = 0;
+      memcpy (in + in_len, record, len);
+      in_len += len;
+      expect[expect_len++] = len;               // less than 128:  one byte of b128
+      memcpy (expect + expect_len, record, len);
+      expect_len += len;
+    }
+
+  int out_fd = make_temp_file ();
+  PBCREP_BinaryDataReader *reader = pbcrep_binary_data_reader_from_data (in_len, in);
+  PBCREP_BinaryDataWriter *writer = pbcrep_binary_data_writer_to_fileno (out_fd, false);
+  PBCREP_TransferResult res = pbcrep_transfer_reframed (reader, PBCREP_LENGTH_PREFIXED_UINT32_LE,
+                                                        writer, PBCREP_LENGTH_PREFIXED_B128,
+                                                        true);
+  assert (res.code == PBCREP_TRANSFER_RESULT_SUCCESS);
+  assert (res.n_transferred == 1000);
+  pbcrep_binary_data_reader_destroy (reader);
+  pbcrep_binary_data_writer_destroy (writer);
+  uint8_t *got = malloc (expect_len + 1);
+  lseek (out_fd, 0, SEEK_SET);
+  assert ((size_t) read (out_fd, got, expect_len + 1) == expect_len);
+  assert (memcmp (got, expect, expect_len) == 0);
+  close (out_fd);
+  free (got);
+
+  // Check only:  make the last record's bytes field overrun the record.
+  in[in_len - (999 & 0x3f) - 1]++;
+  reader = pbcrep_binary_data_reader_from_data (in_len, in);
+  res = pbcrep_transfer_reframed (reader, PBCREP_LENGTH_PREFIXED_UINT32_LE,
+                                  NULL, PBCREP_LENGTH_PREFIXED_B128,
+                                  true);
+  assert (res.code == PBCREP_TRANSFER_RESULT_READ_FAILED);
+  assert (res.n_transferred == 999);
+  assert (strcmp (res.error->error_code_str, "PROTOBUF_MALFORMED") == 0);
+  pbcrep_error_destroy (res.error);
+  pbcrep_binary_data_reader_destroy (reader);
+  free (in);
+  free (expect);
+  fprintf (stderr, "  reframe: ok\n");
+}
+
+/* A printer of 'record_size' bytes of data per message, in order. */
+typedef struct {
+  PBCREP_Printer base;
+  size_t record_size;
+  size_t at;
+} DataPrinter;
+
+static bool
+data_printer_print (PBCREP_Printer *printer,
+                    const ProtobufCMessage *message,
+                    PBCREP_Error **error)
+{
+  DataPrinter *p = (DataPrinter *) printer;
+  (void) message;
+  (void) error;
+  pbcrep_buffer_append (&printer->output_data, p->record_size, data + p->at);
+  p->at += p->record_size;
+  return true;
+}
+
+static PBCREP_Printer *
+data_printer_new (size_t record_size)
+{
+  PBCREP_Printer *printer = pbcrep_printer_new_protected (sizeof (DataPrinter));
+  printer->print = data_printer_print;
+  ((DataPrinter *) printer)->record_size = record_size;
+  ((DataPrinter *) printer)->at = 0;
+  return printer;
+}
+
+/* What the writer passes on, and a write that fails. */
+typedef struct {
+  PBCREP_Buffer got;
+  unsigned n_writes;
+  unsigned fail_at;             // 0 never fails
+} Collected;
+
+static bool
+collect (size_t length, uint8_t *bytes, void *callback_data)
+{
+  Collected *c = callback_data;
+  if (++c->n_writes == c->fail_at)
+    return false;
+  pbcrep_buffer_append (&c->got, length, bytes);
+  return true;
+}
+
+static bool
+collected_is_data (Collected *c, size_t length)
+{
+  if (c->got.size != length)
+    return false;
+  uint8_t *got = malloc (length + 1);
+  pbcrep_buffer_peek (&c->got, length, got);
+  bool rv = memcmp (got, data, length) == 0;
+  free (got);
+  return rv;
+}
+
+static const ProtobufCMessageDescriptor dummy_descriptor;
+
+static void
+test_printer_writer (void)
+{
+  ProtobufCMessage message = { .descriptor = &dummy_descriptor };
+
+  // Nothing is written until the threshold is reached.
+  Collected c = { PBCREP_BUFFER_INIT, 0, 0 };
+  PBCREP_Writer *writer = pbcrep_writer_new_printer (pbcrep_binary_data_writer_to_buffer_cb (collect, &c),
+                                                     data_printer_new (100));
+  pbcrep_writer_set_flush_threshold (writer, 1000);
+  for (unsigned i = 0; i < 9; i++)
+    assert (pbcrep_writer_write (writer, &message, NULL));
+  assert (c.got.size == 0);
+  assert (pbcrep_writer_write (writer, &message, NULL));
+  assert (collected_is_data (&c, 1000));
+  for (unsigned i = 0; i < 5; i++)
+    assert (pbcrep_writer_write (writer, &message, NULL));
+  assert (c.got.size == 1000);
+  assert (pbcrep_writer_end_write (writer, NULL));
+  assert (collected_is_data (&c, 1500));
+  pbcrep_writer_destroy (writer);
+  pbcrep_buffer_clear (&c.got);
+
+  // A threshold of 0 writes every message.
+  c = (Collected) { PBCREP_BUFFER_INIT, 0, 0 };
+  writer = pbcrep_writer_new_printer (pbcrep_binary_data_writer_to_buffer_cb (collect, &c),
+                                      data_printer_new (100));
+  pbcrep_writer_set_flush_threshold (writer, 0);
+  for (unsigned i = 1; i <= 3; i++)
+    {
+      assert (pbcrep_writer_write (writer, &message, NULL));
+      assert (collected_is_data (&c, 100 * i));
+    }
+  pbcrep_writer_destroy (writer);
+  pbcrep_buffer_clear (&c.got);
+
+  // A failed write keeps what wasn't written.
+  c = (Collected) { PBCREP_BUFFER_INIT, 0, 3 };
+  writer = pbcrep_writer_new_printer (pbcrep_binary_data_writer_to_buffer_cb (collect, &c),
+                                      data_printer_new (1000));
+  pbcrep_writer_set_flush_threshold (writer, 200000);
+  PBCREP_Error *error = NULL;
+  unsigned n = 0;
+  while (c.n_writes == 0)
+    {
+      bool ok = pbcrep_writer_write (writer, &message, &error);
+      n++;
+      assert (ok == (c.n_writes < c.fail_at));
+    }
+  assert (n == 200);
+  assert (strcmp (error->error_code_str, "CALLBACK_FAILED") == 0);
+  pbcrep_error_destroy (error);
+  PBCREP_BinaryDataWriter *output;
+  PBCREP_Printer *printer;
+  assert (pbcrep_writer_peek_printer (writer, &output, &printer));
+  assert (c.got.size > 0);
+  assert (collected_is_data (&c, c.got.size));
+  assert (printer->output_data.size == 200000 - c.got.size);
+  uint8_t *rest = malloc (printer->output_data.size);
+  pbcrep_buffer_peek (&printer->output_data, printer->output_data.size, rest);
+  assert (memcmp (rest, data + c.got.size, printer->output_data.size) == 0);
+  free (rest);
+  pbcrep_writer_destroy (writer);
+  pbcrep_buffer_clear (&c.got);
+  fprintf (stderr, "  printer writer: ok\n");
+}
+
+static Mode modes[] = {
+  { "plain", plain_writer, plain_reader, PBCREP_IO_URING_OPTIONS_INIT },
+  { "mmap", plain_writer, mmap_reader, PBCREP_IO_URING_OPTIONS_INIT },
+  { "io_uring", io_uring_writer, io_uring_reader, PBCREP_IO_URING_OPTIONS_INIT },
+  { "io_uring, small blocks", io_uring_writer, io_uring_reader, { 4, 5000, false } },
+  { "io_uring, nonblocking", io_uring_writer, io_uring_reader, { 32, 65536, true } },
+};
+
+int main(void)
+{
+  data = malloc (DATA_SIZE);
+  for (size_t i = 0; i < DATA_SIZE; i++)
+    data[i] = (uint8_t) ((i * 2654435761u) >> 13);
+
+  fprintf (stderr, "io_uring is %savailable\n",
+           pbcrep_io_uring_is_available () ? "" : "not ");
+  for (unsigned i = 0; i < sizeof (modes) / sizeof (modes[0]); i++)
+    test_round_trip (&modes[i]);
+  test_transfers ();
+  test_reframe ();
+  test_printer_writer ();
+  free (data);
+
+  fprintf(stderr, "Tests succeeded!\n");
+  return 0;
+}
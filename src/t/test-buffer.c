@@ -0,0 +1,724 @@
+/*
+ * Tests of PBCREP_Buffer internals that the other tests
+ * don't reach:  fragment size classes and huge pages,
+ * fragments shared between buffers, fragment recycling
+ * through the per-thread caches and the shared depot,
+ * searches for strings that span fragments, and writev
+ * batching and coalescing.
+ */
+#include "../pbcrep.h"
+#include <assert.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/uio.h>
+
+// The default sizing's fragments, header included.
+#define FRAGMENT_SIZE   32768
+#define HUGE_PAGE_SIZE  ((size_t) 1 << 21)
+
+// As buffer.c has them.
+#ifndef IOV_MAX
+# ifdef UIO_MAXIOV
+#  define IOV_MAX       UIO_MAXIOV
+# else
+#  define IOV_MAX       16
+# endif
+#endif
+#define WRITEV_COALESCE_SIZE    256
+#define WRITEV_STAGING_SIZE     16384
+
+static uint8_t *data;
+
+static void
+fill_buffer (PBCREP_Buffer *buffer, size_t length)
+{
+  pbcrep_buffer_init (buffer);
+  pbcrep_buffer_append (buffer, length, data);
+  assert (buffer->size == length);
+}
+
+static unsigned
+count_fragments (const PBCREP_Buffer *buffer)
+{
+  unsigned n = 0;
+  for (PBCREP_BufferFragment *at = buffer->first_frag; at != NULL; at = at->next)
+    n++;
+  return n;
+}
+
+// Size of a (never sealed) native fragment, header included.
+static size_t
+fragment_allocation (const PBCREP_BufferFragment *fragment)
+{
+  return sizeof (PBCREP_BufferFragment) + fragment->buf_max_size;
+}
+
+static bool
+buffer_has_data (const PBCREP_Buffer *buffer)
+{
+  size_t offset = 0;
+  for (PBCREP_BufferFragment *at = buffer->first_frag; at != NULL; at = at->next)
+    {
+      if (memcmp (at->buf + at->buf_start, data + offset, at->buf_length) != 0)
+        return false;
+      offset += at->buf_length;
+    }
+  return offset == buffer->size;
+}
+
+// Whether 'buffer' holds exactly 'length' bytes equal to 'expected'.
+static bool
+buffer_equals (const PBCREP_Buffer *buffer, size_t length, const uint8_t *expected)
+{
+  if (buffer->size != length)
+    return false;
+  uint8_t *contents = malloc (length + 1);
+  pbcrep_buffer_peek (buffer, length, contents);
+  bool rv = memcmp (contents, expected, length) == 0;
+  free (contents);
+  return rv;
+}
+
+static void *
+clear_buffer_thread (void *buffer)
+{
+  pbcrep_buffer_clear (buffer);
+  return NULL;
+}
+
+static void *
+fill_and_clear_thread (void *arg)
+{
+  PBCREP_Buffer buffer;
+  fill_buffer (&buffer, *(size_t *) arg);
+  pbcrep_buffer_clear (&buffer);
+  return NULL;
+}
+
+/* Fill a buffer with the given sizing and check that its
+ * fragments are first_size, then doubling up to max_size. */
+static void
+check_fragment_sizes (const PBCREP_BufferSizing *sizing,
+                      size_t                     length,
+                      size_t                     first_size,
+                      size_t                     max_size)
+{
+  PBCREP_Buffer buffer;
+  pbcrep_buffer_init_with_sizing (&buffer, sizing);
+  pbcrep_buffer_append (&buffer, length, data);
+  assert (buffer_has_data (&buffer));
+  size_t expected = first_size;
+  for (PBCREP_BufferFragment *at = buffer.first_frag; at != NULL; at = at->next)
+    {
+      assert (fragment_allocation (at) == expected);
+      if (expected < max_size)
+        expected *= 2;
+    }
+  assert (expected == max_size);
+  pbcrep_buffer_clear (&buffer);
+}
+
+static void
+test_size_classes (void)
+{
+  check_fragment_sizes (&pbcrep_buffer_sizing_small, 5 * 4096, 4096, 4096);
+  check_fragment_sizes (NULL, 5 * FRAGMENT_SIZE, FRAGMENT_SIZE, FRAGMENT_SIZE);
+
+  // Sizes round up to a power of two, from 4K to 2M.
+  PBCREP_BufferSizing tiny = { 100, 100, false };
+  check_fragment_sizes (&tiny, 3 * 4096, 4096, 4096);
+  PBCREP_BufferSizing odd = { 5000, 3000000, false };
+  check_fragment_sizes (&odd, 8 * HUGE_PAGE_SIZE, 8192, HUGE_PAGE_SIZE);
+  PBCREP_BufferSizing growing = { 4096, 40000, false };
+  check_fragment_sizes (&growing, 200000, 4096, 65536);
+
+  // The default sizing may be replaced.
+  pbcrep_buffer_set_default_sizing (&pbcrep_buffer_sizing_small);
+  check_fragment_sizes (NULL, 5 * 4096, 4096, 4096);
+  pbcrep_buffer_set_default_sizing (NULL);
+  check_fragment_sizes (NULL, 5 * FRAGMENT_SIZE, FRAGMENT_SIZE, FRAGMENT_SIZE);
+
+  // Reserving more than the next fragment's size
+  // takes the class that fits, or an exact unrecycled size past 2M.
+  PBCREP_Buffer buffer;
+  pbcrep_buffer_init_with_sizing (&buffer, &pbcrep_buffer_sizing_small);
+  uint8_t *ptr;
+  unsigned avail;
+  pbcrep_buffer_reserve (&buffer, 10000, &ptr, &avail);
+  assert (avail >= 10000);
+  assert (fragment_allocation (buffer.last_frag) == 16384);
+  memcpy (ptr, data, 10000);
+  pbcrep_buffer_commit (&buffer, 10000);
+
+  size_t big = 3 * HUGE_PAGE_SIZE;
+  pbcrep_buffer_reserve (&buffer, big, &ptr, &avail);
+  assert (avail == big);
+  memcpy (ptr, data + 10000, big);
+  pbcrep_buffer_commit (&buffer, big);
+  assert (buffer.size == 10000 + big);
+  assert (count_fragments (&buffer) == 2);
+  assert (buffer_has_data (&buffer));
+  pbcrep_buffer_clear (&buffer);
+  fprintf (stderr, "  size classes: ok\n");
+}
+
+/* The bulk sizing grows to 2M fragments mapped on a 2M boundary
+ * (to be backed by a huge page), which are recycled like the others. */
+static void
+test_huge_pages (void)
+{
+  PBCREP_BufferRecyclingStats s0, s1;
+  _pbcrep_buffer_cleanup_recycling_bin ();
+  check_fragment_sizes (&pbcrep_buffer_sizing_bulk, 6 * HUGE_PAGE_SIZE,
+                        65536, HUGE_PAGE_SIZE);
+
+  PBCREP_Buffer buffer;
+  pbcrep_buffer_init_with_sizing (&buffer, &pbcrep_buffer_sizing_bulk);
+  pbcrep_buffer_append (&buffer, 6 * HUGE_PAGE_SIZE, data);
+  unsigned n_huge = 0;
+  for (PBCREP_BufferFragment *at = buffer.first_frag; at != NULL; at = at->next)
+    if (fragment_allocation (at) == HUGE_PAGE_SIZE)
+      {
+        assert (((uintptr_t) at & (HUGE_PAGE_SIZE - 1)) == 0);
+        n_huge++;
+      }
+  assert (n_huge >= 3);
+  assert (buffer_has_data (&buffer));
+
+  pbcrep_buffer_get_recycling_stats (&s0);
+  pbcrep_buffer_clear (&buffer);
+  pbcrep_buffer_get_recycling_stats (&s1);
+  assert (s1.bytes_held >= s0.bytes_held + HUGE_PAGE_SIZE);
+  _pbcrep_buffer_cleanup_recycling_bin ();
+  fprintf (stderr, "  huge pages: ok\n");
+}
+
+/* --- shared fragments --- */
+static void
+test_append_slice (void)
+{
+  PBCREP_Buffer src, dst, dst2;
+  fill_buffer (&src, 3 * FRAGMENT_SIZE);
+  PBCREP_BufferFragment *first = src.first_frag;
+  assert (first->ref_count == 1);
+
+  // Long pieces are shared, not copied.
+  pbcrep_buffer_init (&dst);
+  assert (pbcrep_buffer_append_slice (&dst, &src, 1000, 70000) == 70000);
+  assert (buffer_equals (&dst, 70000, data + 1000));
+  assert (dst.first_frag->is_foreign);
+  assert (dst.first_frag->buf + dst.first_frag->buf_start == first->buf + first->buf_start + 1000);
+  assert (first->ref_count == 2);
+
+  // Short ones are copied.
+  unsigned end_of_first = first->buf_length;
+  pbcrep_buffer_append_slice (&dst, &src, end_of_first - 50, 50);
+  assert (!dst.last_frag->is_foreign);
+  assert (first->ref_count == 2);
+  assert (dst.size == 70050);
+
+  // A slice of a slice refers to the original fragment.
+  pbcrep_buffer_init (&dst2);
+  assert (pbcrep_buffer_append_slice (&dst2, &dst, 500, 1000) == 1000);
+  assert (buffer_equals (&dst2, 1000, data + 1500));
+  assert (first->ref_count == 3);
+
+  // Slices are clipped to the source.
+  assert (pbcrep_buffer_append_slice (&dst2, &src, src.size - 200, 1000) == 200);
+  assert (dst2.size == 1200);
+  pbcrep_buffer_truncate (&dst2, 1000);
+
+  // The slices outlive the source.
+  pbcrep_buffer_clear (&src);
+  assert (first->ref_count == 2);
+  pbcrep_buffer_clear (&dst);
+  assert (buffer_equals (&dst2, 1000, data + 1500));
+  pbcrep_buffer_clear (&dst2);
+  fprintf (stderr, "  append slice: ok\n");
+}
+
+static void
+test_clone (void)
+{
+  PBCREP_Buffer src, dst;
+  pbcrep_buffer_init_with_sizing (&src, &pbcrep_buffer_sizing_small);
+  pbcrep_buffer_append (&src, 5 * 4096, data);
+  pbcrep_buffer_clone (&dst, &src);
+  assert (dst.sizing == src.sizing);
+  assert (count_fragments (&dst) == count_fragments (&src));
+  assert (buffer_equals (&dst, 5 * 4096, data));
+
+  // Each may be consumed, or freed on another thread, independently.
+  pbcrep_buffer_discard (&src, 5000);
+  assert (buffer_equals (&dst, 5 * 4096, data));
+  pthread_t thread;
+  pthread_create (&thread, NULL, clear_buffer_thread, &dst);
+  pthread_join (thread, NULL);
+  assert (buffer_equals (&src, 5 * 4096 - 5000, data + 5000));
+  pbcrep_buffer_clear (&src);
+  fprintf (stderr, "  clone: ok\n");
+}
+
+/* Nothing written to a shared fragment may show through
+ * in the other buffers sharing it. */
+static void
+test_copy_on_write (void)
+{
+  uint8_t *other = malloc (1000);
+  for (unsigned i = 0; i < 1000; i++)
+    other[i] = ~data[i];
+
+  // Appending to the original goes past the shared bytes.
+  PBCREP_Buffer src, dst;
+  fill_buffer (&src, 1000);
+  pbcrep_buffer_clone (&dst, &src);
+  pbcrep_buffer_append (&src, 1000, other);
+  assert (src.first_frag == src.last_frag);
+  assert (buffer_equals (&dst, 1000, data));
+
+  // A shared fragment that is truncated is sealed, so appends
+  // can't overwrite the bytes cut off.
+  pbcrep_buffer_truncate (&src, 500);
+  pbcrep_buffer_append (&src, 1000, other);
+  assert (count_fragments (&src) == 2);
+  assert (buffer_equals (&dst, 1000, data));
+  pbcrep_buffer_clear (&src);
+  pbcrep_buffer_clear (&dst);
+
+  // An unshared fragment is simply reused.
+  fill_buffer (&src, 1000);
+  pbcrep_buffer_truncate (&src, 500);
+  pbcrep_buffer_append (&src, 1000, other);
+  assert (count_fragments (&src) == 1);
+  pbcrep_buffer_clear (&src);
+
+  // Placeholders in shared fragments are copied before being set.
+  PBCREP_BufferPlaceholder placeholder;
+  pbcrep_buffer_init (&src);
+  pbcrep_buffer_append (&src, 500, data);
+  pbcrep_buffer_append_placeholder (&src, 8, &placeholder);
+  pbcrep_buffer_append (&src, 492, data + 508);
+  pbcrep_buffer_placeholder_set (&placeholder, data + 500);
+  pbcrep_buffer_clone (&dst, &src);
+  PBCREP_BufferFragment *shared = src.first_frag;
+  assert (shared->ref_count == 2);
+  pbcrep_buffer_placeholder_set (&placeholder, other);
+  assert (src.first_frag != shared);
+  assert (shared->ref_count == 1);
+  assert (buffer_equals (&dst, 1000, data));
+  uint8_t *expected = malloc (1000);
+  memcpy (expected, data, 1000);
+  memcpy (expected + 500, other, 8);
+  assert (buffer_equals (&src, 1000, expected));
+
+  // Once unshared, it is written in place.
+  PBCREP_BufferFragment *copy = src.first_frag;
+  pbcrep_buffer_placeholder_set (&placeholder, data + 500);
+  assert (src.first_frag == copy);
+  assert (buffer_equals (&src, 1000, data));
+  pbcrep_buffer_clear (&src);
+  pbcrep_buffer_clear (&dst);
+  free (expected);
+  free (other);
+  fprintf (stderr, "  copy on write: ok\n");
+}
+
+static void
+test_recycling_stats (void)
+{
+  PBCREP_BufferRecyclingStats s0, s1, s2;
+  _pbcrep_buffer_cleanup_recycling_bin ();
+  pbcrep_buffer_get_recycling_stats (&s0);
+
+  PBCREP_Buffer buffer;
+  fill_buffer (&buffer, 100);
+  pbcrep_buffer_clear (&buffer);
+  pbcrep_buffer_get_recycling_stats (&s1);
+  assert (s1.n_misses == s0.n_misses + 1);
+  assert (s1.n_hits == s0.n_hits);
+  assert (s1.bytes_held == s0.bytes_held + FRAGMENT_SIZE);
+
+  fill_buffer (&buffer, 100);
+  pbcrep_buffer_get_recycling_stats (&s2);
+  assert (s2.n_misses == s1.n_misses);
+  assert (s2.n_hits == s1.n_hits + 1);
+  assert (s2.bytes_held == s0.bytes_held);
+  pbcrep_buffer_clear (&buffer);
+  _pbcrep_buffer_cleanup_recycling_bin ();
+  fprintf (stderr, "  recycling stats: ok\n");
+}
+
+/* Fragments allocated here are freed by another thread, which
+ * spills them to the depot (it keeps only a few) and hands over
+ * the rest when it exits;  allocating them again must take them
+ * all back from the depot. */
+static void
+test_cross_thread_free (void)
+{
+  PBCREP_BufferRecyclingStats s0, s1, s2;
+  pbcrep_buffer_set_recycling_limits (4, 32);
+  _pbcrep_buffer_cleanup_recycling_bin ();
+  pbcrep_buffer_get_recycling_stats (&s0);
+
+  size_t length = 20 * FRAGMENT_SIZE;
+  PBCREP_Buffer buffer;
+  fill_buffer (&buffer, length);
+  unsigned n = count_fragments (&buffer);
+  assert (n > 20);
+  pbcrep_buffer_get_recycling_stats (&s1);
+  assert (s1.n_misses == s0.n_misses + n);
+
+  pthread_t thread;
+  pthread_create (&thread, NULL, clear_buffer_thread, &buffer);
+  pthread_join (thread, NULL);
+  pbcrep_buffer_get_recycling_stats (&s1);
+  assert (s1.bytes_held == s0.bytes_held + (size_t) n * FRAGMENT_SIZE);
+
+  fill_buffer (&buffer, length);
+  pbcrep_buffer_get_recycling_stats (&s2);
+  assert (s2.n_hits == s1.n_hits + n);
+  assert (s2.n_misses == s1.n_misses);
+  assert (s2.bytes_held == s0.bytes_held);
+  assert (memcmp (buffer.first_frag->buf + buffer.first_frag->buf_start, data, 100) == 0);
+  pbcrep_buffer_clear (&buffer);
+
+  // ... and the other way:  from this thread's cache
+  // (via the depot) to a new thread.
+  _pbcrep_buffer_cleanup_recycling_bin ();
+  fill_buffer (&buffer, length);
+  pbcrep_buffer_clear (&buffer);
+  pbcrep_buffer_get_recycling_stats (&s1);
+  pthread_create (&thread, NULL, fill_and_clear_thread, &length);
+  pthread_join (thread, NULL);
+  pbcrep_buffer_get_recycling_stats (&s2);
+  assert (s2.n_hits + s2.n_misses == s1.n_hits + s1.n_misses + n);
+  assert (s2.n_hits >= s1.n_hits + n - 4);
+  assert (s2.bytes_held == s1.bytes_held + (s2.n_misses - s1.n_misses) * FRAGMENT_SIZE);
+
+  _pbcrep_buffer_cleanup_recycling_bin ();
+  pbcrep_buffer_set_recycling_limits (16, 32);
+  fprintf (stderr, "  cross-thread free: ok\n");
+}
+
+// With no room in the depot, spilled fragments are freed.
+static void
+test_depot_full (void)
+{
+  PBCREP_BufferRecyclingStats s0, s1;
+  pbcrep_buffer_set_recycling_limits (4, 0);
+  _pbcrep_buffer_cleanup_recycling_bin ();
+  pbcrep_buffer_get_recycling_stats (&s0);
+
+  PBCREP_Buffer buffer;
+  fill_buffer (&buffer, 20 * FRAGMENT_SIZE);
+  pbcrep_buffer_clear (&buffer);
+  pbcrep_buffer_get_recycling_stats (&s1);
+  assert (s1.bytes_held > s0.bytes_held);
+  assert (s1.bytes_held <= s0.bytes_held + 4 * FRAGMENT_SIZE);
+
+  _pbcrep_buffer_cleanup_recycling_bin ();
+  pbcrep_buffer_set_recycling_limits (16, 32);
+  fprintf (stderr, "  depot full: ok\n");
+}
+
+/* Many threads allocating and freeing at once,
+ * with stats read all the while. */
+#define N_THREADS       8
+
+static void *
+churn_thread (void *arg)
+{
+  (void) arg;
+  for (unsigned i = 0; i < 200; i++)
+    {
+      PBCREP_Buffer buffer;
+      fill_buffer (&buffer, (i % 7 + 1) * FRAGMENT_SIZE);
+      pbcrep_buffer_clear (&buffer);
+    }
+  return NULL;
+}
+
+static void
+test_threads (void)
+{
+  pbcrep_buffer_set_recycling_limits (4, 8);
+  pthread_t threads[N_THREADS];
+  for (unsigned i = 0; i < N_THREADS; i++)
+    pthread_create (&threads[i], NULL, churn_thread, NULL);
+  for (unsigned i = 0; i < 100; i++)
+    {
+      PBCREP_BufferRecyclingStats stats;
+      pbcrep_buffer_get_recycling_stats (&stats);
+    }
+  for (unsigned i = 0; i < N_THREADS; i++)
+    pthread_join (threads[i], NULL);
+  PBCREP_BufferRecyclingStats stats;
+  pbcrep_buffer_get_recycling_stats (&stats);
+  assert (stats.n_hits > 0);
+  _pbcrep_buffer_cleanup_recycling_bin ();
+  pbcrep_buffer_set_recycling_limits (16, 32);
+  fprintf (stderr, "  threads: ok\n");
+}
+
+/* --- searching --- */
+#define HAY_SIZE        120
+
+static char hay[HAY_SIZE + 1];
+
+// The first index in hay where any of 'strings' starts, or -1.
+static int
+naive_polystr_index_of (char **strings)
+{
+  for (unsigned i = 0; i < HAY_SIZE; i++)
+    for (char **s = strings; *s != NULL; s++)
+      if (strncmp (hay + i, *s, strlen (*s)) == 0)
+        return i;
+  return -1;
+}
+
+// hay, in up to three fragments:  [0, a), [a, b) and [b, HAY_SIZE).
+static void
+split_hay (PBCREP_Buffer *buffer, unsigned a, unsigned b)
+{
+  pbcrep_buffer_init (buffer);
+  if (a > 0)
+    pbcrep_buffer_append_foreign (buffer, a, hay, NULL, NULL);
+  if (b > a)
+    pbcrep_buffer_append_foreign (buffer, b - a, hay + a, NULL, NULL);
+  if (HAY_SIZE > b)
+    pbcrep_buffer_append_foreign (buffer, HAY_SIZE - b, hay + b, NULL, NULL);
+}
+
+static char *
+hay_substring (unsigned offset, unsigned length)
+{
+  char *rv = malloc (length + 1);
+  memcpy (rv, hay + offset, length);
+  rv[length] = 0;
+  return rv;
+}
+
+/* Every needle, and every set of needles, is looked for in hay
+ * split at every pair of offsets, so each match (and near-miss)
+ * lies within one fragment, or spans two or three of them.
+ * Needles of 17 bytes or more need fragments of 32 or more to
+ * take the vectorized path. */
+static void
+test_str_index_of (void)
+{
+  // Few letters, so there are plenty of partial matches.
+  uint32_t r = 12345;
+  for (unsigned i = 0; i < HAY_SIZE; i++)
+    {
+      r = r * 1103515245 + 12345;
+      hay[i] = "abn"[(r >> 16) % 3];
+    }
+
+  char *absent = hay_substring (50, 20);
+  absent[19] = 'z';
+  char *needles[] = {
+    "ab", "ba", "bnb", "zz", absent,
+    hay_substring (10, 4),
+    hay_substring (30, 17),
+    hay_substring (50, 20),
+    hay_substring (5, 40),
+    hay_substring (HAY_SIZE - 18, 18),
+  };
+  unsigned n_needles = sizeof (needles) / sizeof (needles[0]);
+  char *sets[][4] = {
+    { "zz", needles[7], NULL },
+    { needles[9], needles[7], "bbbb", NULL },
+    { "ab", "ba", NULL },
+    { absent, needles[6], NULL },
+    { absent, "zz", needles[8], NULL },
+    { "bnb", needles[5], "nnn", NULL },
+  };
+  unsigned n_sets = sizeof (sets) / sizeof (sets[0]);
+
+  int expected_str[sizeof (needles) / sizeof (needles[0])];
+  for (unsigned i = 0; i < n_needles; i++)
+    {
+      char *one[2] = { needles[i], NULL };
+      expected_str[i] = naive_polystr_index_of (one);
+    }
+  assert (expected_str[3] == -1 && expected_str[4] == -1);
+  assert (expected_str[7] >= 0 && expected_str[9] >= 0);
+  int expected_poly[sizeof (sets) / sizeof (sets[0])];
+  for (unsigned i = 0; i < n_sets; i++)
+    expected_poly[i] = naive_polystr_index_of (sets[i]);
+
+  for (unsigned a = 0; a <= HAY_SIZE; a++)
+    for (unsigned b = a; b <= HAY_SIZE; b++)
+      {
+        PBCREP_Buffer buffer;
+        split_hay (&buffer, a, b);
+        for (unsigned i = 0; i < n_needles; i++)
+          if (pbcrep_buffer_str_index_of (&buffer, needles[i]) != expected_str[i])
+            {
+              fprintf (stderr, "str_index_of (%s) split at %u,%u\n", needles[i], a, b);
+              assert (0);
+            }
+        for (unsigned i = 0; i < n_sets; i++)
+          if (pbcrep_buffer_polystr_index_of (&buffer, sets[i]) != expected_poly[i])
+            {
+              fprintf (stderr, "polystr_index_of (set %u) split at %u,%u\n", i, a, b);
+              assert (0);
+            }
+        pbcrep_buffer_clear (&buffer);
+      }
+
+  for (unsigned i = 4; i < n_needles; i++)
+    free (needles[i]);
+  fprintf (stderr, "  str index of: ok\n");
+}
+
+// Append fragments of the given sizes (cycling), 'total' bytes
+// of 'data' in all, each a fragment of its own.
+static void
+append_fragments (PBCREP_Buffer *buffer, size_t total,
+                  unsigned n_sizes, const unsigned *sizes)
+{
+  pbcrep_buffer_init (buffer);
+  size_t at = 0;
+  for (unsigned i = 0; at < total; i++)
+    {
+      size_t n = sizes[i % n_sizes];
+      if (n > total - at)
+        n = total - at;
+      pbcrep_buffer_append_foreign (buffer, n, data + at, NULL, NULL);
+      at += n;
+    }
+}
+
+// Check that fd holds data[0..length), and empty it.
+static void
+check_fd_data (int fd, size_t length)
+{
+  uint8_t *got = malloc (length + 1);
+  assert (pread (fd, got, length + 1, 0) == (ssize_t) length);
+  assert (memcmp (got, data, length) == 0);
+  free (got);
+  assert (ftruncate (fd, 0) == 0);
+  lseek (fd, 0, SEEK_SET);
+}
+
+static void
+test_writev (void)
+{
+  char filename[] = "/tmp/pbcrep-test-XXXXXX";
+  int fd = mkstemp (filename);
+  assert (fd >= 0);
+  unlink (filename);
+
+  // Large fragments:  one writev takes IOV_MAX of them.
+  unsigned large[] = { 300 };
+  size_t total = (size_t) 300 * (3 * IOV_MAX + 5);
+  PBCREP_Buffer buffer;
+  append_fragments (&buffer, total, 1, large);
+  assert (pbcrep_buffer_writev (&buffer, fd) == 300 * IOV_MAX);
+  assert (buffer.size == total - 300 * IOV_MAX);
+  while (buffer.size > 0)
+    assert (pbcrep_buffer_writev (&buffer, fd) > 0);
+  check_fd_data (fd, total);
+
+  // Small fragments:  the first WRITEV_STAGING_SIZE bytes' worth
+  // are copied into one iovec, and the rest take an iovec each.
+  unsigned small[] = { 100 };
+  total = (size_t) 100 * 4 * IOV_MAX;
+  append_fragments (&buffer, total, 1, small);
+  unsigned n_staged = WRITEV_STAGING_SIZE / 100;
+  assert (pbcrep_buffer_writev (&buffer, fd) == 100 * (n_staged + IOV_MAX - 1));
+  assert (pbcrep_buffer_write_all_to_fd (&buffer, fd, NULL));
+  assert (buffer.size == 0);
+  check_fd_data (fd, total);
+
+  // Assorted sizes, on both sides of WRITEV_COALESCE_SIZE,
+  // with max_bytes ending inside fragments.
+  unsigned assorted[] = { 1, WRITEV_COALESCE_SIZE - 1, WRITEV_COALESCE_SIZE, 5000, 17, 40000, 3 };
+  total = 1000000;
+  append_fragments (&buffer, total, sizeof (assorted) / sizeof (assorted[0]), assorted);
+  size_t written = 0;
+  for (unsigned max_bytes = 1; buffer.size > 0; max_bytes = max_bytes * 3 + 1)
+    {
+      int rv = pbcrep_buffer_writev_len (&buffer, fd, max_bytes);
+      assert (rv > 0 && (unsigned) rv <= max_bytes);
+      written += rv;
+      assert (buffer.size == total - written);
+    }
+  check_fd_data (fd, total);
+  close (fd);
+  fprintf (stderr, "  writev: ok\n");
+}
+
+static void *
+slow_reader (void *arg)
+{
+  int fd = * (int *) arg;
+  size_t length = 4 * HUGE_PAGE_SIZE;
+  uint8_t *got = malloc (length + 1);
+  size_t at = 0;
+  for (;;)
+    {
+      usleep (at < 256 * 1024 ? 1000 : 0);
+      ssize_t rv = read (fd, got + at, 65536 < length + 1 - at ? 65536 : length + 1 - at);
+      assert (rv >= 0);
+      if (rv == 0)
+        break;
+      at += rv;
+    }
+  assert (at == length && memcmp (got, data, length) == 0);
+  free (got);
+  return NULL;
+}
+
+// A nonblocking pipe fills up;  write_all_to_fd() must wait for room.
+static void
+test_write_all_nonblocking (void)
+{
+  int fds[2];
+  assert (pipe (fds) == 0);
+  assert (fcntl (fds[1], F_SETFL, fcntl (fds[1], F_GETFL) | O_NONBLOCK) == 0);
+  pthread_t thread;
+  pthread_create (&thread, NULL, slow_reader, fds + 0);
+
+  PBCREP_Buffer buffer;
+  unsigned sizes[] = { 100, 70000, 1, 3000 };
+  append_fragments (&buffer, 4 * HUGE_PAGE_SIZE, 4, sizes);
+  assert (pbcrep_buffer_write_all_to_fd (&buffer, fds[1], NULL));
+  assert (buffer.size == 0);
+  close (fds[1]);
+  pthread_join (thread, NULL);
+  close (fds[0]);
+  fprintf (stderr, "  write all, nonblocking: ok\n");
+}
+
+int main(void)
+{
+  size_t data_size = 8 * HUGE_PAGE_SIZE;
+  data = malloc (data_size);
+  for (size_t i = 0; i < data_size; i++)
+    data[i] = (uint8_t) ((i * 2654435761u) >> 13);
+
+  test_size_classes ();
+  test_huge_pages ();
+  test_append_slice ();
+  test_clone ();
+  test_copy_on_write ();
+  test_str_index_of ();
+  test_writev ();
+  test_write_all_nonblocking ();
+  test_recycling_stats ();
+  test_cross_thread_free ();
+  test_depot_full ();
+  test_threads ();
+  free (data);
+
+  fprintf(stderr, "Tests succeeded!\n");
+  return 0;
+}
@@ -1,5 +1,9 @@
 #include "generated/test1.pb-c.h"
 #include "../pbcrep.h"
+#include "../pbcrep/length-prefix.h"
+#include "../pbcrep/wire-format.h"
+#include <locale.h>
+#include <pthread.h>
 #include <string.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -66,6 +70,20 @@ json_message_error_callback   (PBCREP_Parser      *parser,
 }
 #endif
 
+static void
+check_parsed_messages (PBCREP_Parser *parser, TestInfo *state)
+{
+  for (;;)
+    {
+      pbcrep_parser_advance (parser);
+      if (parser->current_message == NULL)
+        break;
+      assert (state->expect_index < state->test->n_messages);
+      state->test->message_checks[state->expect_index] (parser->current_message);
+      state->expect_index++;
+    }
+}
+
 static void
 test_stream_persons (Test *test, unsigned max_feed)
 {
@@ -89,6 +107,7 @@ test_stream_persons (Test *test, unsigned max_feed)
           return;
         }
       amt_fed += amt;
+      check_parsed_messages (parser, &state);
     }
   if (!pbcrep_parser_end_feed (parser, &error))
     {
@@ -98,6 +117,8 @@ test_stream_persons (Test *test, unsigned max_feed)
       test->check_error (error);
       return;
     }
+  check_parsed_messages (parser, &state);
+  assert (state.expect_index == test->n_messages);
   pbcrep_parser_destroy (parser);
   assert (test->check_error == NULL);
 }
@@ -321,6 +342,856 @@ static Test fuck__test = {
 };
 
 
+/* One outlier among many small records must not leave
+ * the parser with a huge slab. */
+static void
+test_slab_adaptation (void)
+{
+  PBCREP_Parser_JSONOptions json_options = PBCREP_PARSER_JSON_OPTIONS_INIT;
+  PBCREP_Parser *parser = pbcrep_parser_new_json (&foo__person__descriptor,
+                                                  &json_options);
+  PBCREP_Error *error = NULL;
+  static const char small[] = "{\"name\":\"a\",\"id\":1,\"test_ints\":[1,2]}";
+  for (unsigned i = 0; i < 2000; i++)
+    {
+      const char *json = (i == 100) ? long_int_array__str : small;
+      if (!pbcrep_parser_feed (parser, strlen (json), (const uint8_t *) json, &error))
+        assert(0);
+      pbcrep_parser_advance (parser);
+      assert (parser->current_message != NULL);
+    }
+  assert (pbcrep_parser_json_get_slab_size (parser) < sizeof (long_int_array__str));
+
+  uint64_t n_messages;
+  const PBCREP_Parser_JSONFieldStats *stats
+    = pbcrep_parser_json_peek_field_stats (parser, &foo__person__descriptor, &n_messages);
+  assert (stats != NULL);
+  assert (n_messages == 2000);
+  const ProtobufCFieldDescriptor *f
+    = protobuf_c_message_descriptor_get_field_by_name (&foo__person__descriptor, "test_ints");
+  const PBCREP_Parser_JSONFieldStats *fs = stats + (f - foo__person__descriptor.fields);
+  assert (fs->n_occurrences == 2000);
+  assert (fs->max_repeated_values == 1000);
+  pbcrep_parser_destroy (parser);
+}
+
+/* Printing a parsed message must give back the (compact) input. */
+static void
+test_print_round_trip (void)
+{
+  PBCREP_Parser *parser = pbcrep_make_parser ("json", &foo__person__descriptor);
+  PBCREP_Printer *printer = pbcrep_make_printer ("json", &foo__person__descriptor);
+  PBCREP_Error *error = NULL;
+  if (!pbcrep_parser_feed (parser, strlen (basic_json__str),
+                           (const uint8_t *) basic_json__str, &error)
+   || !pbcrep_parser_end_feed (parser, &error))
+    assert(0);
+  pbcrep_parser_advance (parser);
+  assert (parser->current_message != NULL);
+  if (!pbcrep_printer_print (printer, parser->current_message, &error))
+    assert(0);
+  char *str = pbcrep_buffer_empty_to_string (&printer->output_data);
+  assert (strlen (str) == strlen (basic_json__str) + 1);
+  assert (memcmp (str, basic_json__str, strlen (basic_json__str)) == 0);
+  assert (str[strlen (basic_json__str)] == '\n');
+  pbcrep_free (str);
+  pbcrep_printer_destroy (printer);
+  pbcrep_parser_destroy (parser);
+}
+
+/* Numbers print with a '.' whatever LC_NUMERIC the program has set. */
+static void
+test_print_locale (void)
+{
+  static const char *comma_locales[] = { "de_DE.UTF-8", "fr_FR.UTF-8", "ru_RU.UTF-8", "de_DE" };
+  char *old_locale = strdup (setlocale (LC_NUMERIC, NULL));
+  for (unsigned i = 0; i < N_ELEMENTS(comma_locales); i++)
+    if (setlocale (LC_NUMERIC, comma_locales[i]) != NULL)
+      break;
+
+  Foo__Mixed mixed = FOO__MIXED__INIT;
+  mixed.has_d = true;
+  mixed.d = 1.5;
+  mixed.has_f = true;
+  mixed.f = 0.25f;
+  PBCREP_Printer *printer = pbcrep_make_printer ("json", &foo__mixed__descriptor);
+  PBCREP_Error *error = NULL;
+  if (!pbcrep_printer_print (printer, &mixed.base, &error))
+    assert(0);
+  char *str = pbcrep_buffer_empty_to_string (&printer->output_data);
+  assert (strcmp (str, "{\"d\":1.5,\"f\":0.25}\n") == 0);
+  pbcrep_free (str);
+  pbcrep_printer_destroy (printer);
+
+  setlocale (LC_NUMERIC, old_locale);
+  free (old_locale);
+}
+
+/* protobuf_c_message_pack() writes a NULL required string as "",
+ * so the printer must too. */
+static void
+test_print_null_required (void)
+{
+  Foo__Person person = FOO__PERSON__INIT;
+  person.name = NULL;
+  person.id = 1;
+  PBCREP_Printer *printer = pbcrep_make_printer ("json", &foo__person__descriptor);
+  PBCREP_Error *error = NULL;
+  if (!pbcrep_printer_print (printer, &person.base, &error))
+    assert(0);
+  char *str = pbcrep_buffer_empty_to_string (&printer->output_data);
+  assert (strcmp (str, "{\"name\":\"\",\"id\":1}\n") == 0);
+  pbcrep_free (str);
+
+  uint8_t packed[16];
+  size_t len = foo__person__pack (&person, packed);
+  if (!pbcrep_printer_json_print_packed (printer, len, packed, &error))
+    assert(0);
+  str = pbcrep_buffer_empty_to_string (&printer->output_data);
+  assert (strcmp (str, "{\"name\":\"\",\"id\":1}\n") == 0);
+  pbcrep_free (str);
+  pbcrep_printer_destroy (printer);
+}
+
+/* The plan's lookup tables, for Mixed and the types reachable from it. */
+static void
+test_plan (void)
+{
+  PBCREP_Plan *plan = pbcrep_plan_new (&foo__mixed__descriptor);
+  const PBCREP_MessagePlan *mixed = plan->root;
+  assert (mixed->descriptor == &foo__mixed__descriptor);
+  assert (mixed == pbcrep_plan_get_message_plan (plan, &foo__mixed__descriptor));
+  const PBCREP_MessagePlan *person = pbcrep_plan_get_message_plan (plan, &foo__person__descriptor);
+  const PBCREP_MessagePlan *phone = pbcrep_plan_get_message_plan (plan, &foo__person__phone_number__descriptor);
+  assert (person != NULL && phone != NULL);
+  assert (pbcrep_plan_get_message_plan (plan, &foo__name__descriptor) == NULL);
+  assert (plan->n_messages == 3);
+  assert (plan->n_enums == 1);
+
+  // Lookup by name and by number finds every field.
+  assert (mixed->n_fields == foo__mixed__descriptor.n_fields);
+  assert (mixed->n_field_by_id == 18);
+  for (unsigned i = 0; i < mixed->n_fields; i++)
+    {
+      const PBCREP_FieldPlan *fp = mixed->fields + i;
+      const char *name = fp->field->name;
+      assert (fp->field == foo__mixed__descriptor.fields + i);
+      assert (pbcrep_message_plan_find_field (mixed, strlen (name), name) == fp);
+      assert (pbcrep_message_plan_find_field_by_id (mixed, fp->field->id) == (int) i);
+    }
+  assert (pbcrep_message_plan_find_field (mixed, 3, "i32x") != NULL);
+  assert (pbcrep_message_plan_find_field (mixed, 4, "i32x") == NULL);
+  assert (pbcrep_message_plan_find_field (mixed, 0, "") == NULL);
+  assert (pbcrep_message_plan_find_field_by_id (mixed, 0) == -1);
+  assert (pbcrep_message_plan_find_field_by_id (mixed, 18) == -1);
+  assert (pbcrep_message_plan_find_field_by_id (mixed, 100000) == -1);
+
+  // JSON keys.
+  const PBCREP_FieldPlan *fp = pbcrep_message_plan_find_field (person, 5, "email");
+  assert (fp != NULL);
+  assert (fp->json_key_length == 8 && strcmp (fp->json_key, "\"email\":") == 0);
+  assert (fp->json_key_quoteless_length == 6 && strcmp (fp->json_key_quoteless, "email:") == 0);
+  for (unsigned i = 0; i < person->n_fields; i++)
+    {
+      fp = person->fields + i;
+      assert (fp->json_key_length == fp->name_length + 3);
+      assert (memcmp (fp->json_key + 1, fp->field->name, fp->name_length) == 0);
+      assert (fp->json_key_quoteless_length == fp->name_length + 1);
+      assert (memcmp (fp->json_key_quoteless, fp->field->name, fp->name_length) == 0);
+    }
+
+  // Sub-plans.
+  fp = pbcrep_message_plan_find_field (mixed, 5, "child");
+  assert (fp->message_plan == mixed && fp->enum_plan == NULL);
+  fp = pbcrep_message_plan_find_field (mixed, 13, "choice_person");
+  assert (fp->message_plan == person);
+  fp = pbcrep_message_plan_find_field (person, 5, "phone");
+  assert (fp->message_plan == phone);
+  fp = pbcrep_message_plan_find_field (phone, 4, "type");
+  assert (fp->message_plan == NULL && fp->enum_plan == plan->enums);
+
+  // The default image is what the generated __init() gives.
+  Foo__Person__PhoneNumber expected, got;
+  foo__person__phone_number__init (&expected);
+  memset (&got, 0xff, sizeof (got));
+  pbcrep_message_plan_init_message (phone, &got);
+  assert (memcmp (&got, &expected, sizeof (got)) == 0);
+  assert (got.base.descriptor == &foo__person__phone_number__descriptor);
+  assert (!got.has_type && got.type == FOO__PERSON__PHONE_TYPE__HOME);
+  Foo__Mixed mixed_expected, mixed_got;
+  foo__mixed__init (&mixed_expected);
+  memset (&mixed_got, 0xff, sizeof (mixed_got));
+  pbcrep_message_plan_init_message (mixed, &mixed_got);
+  assert (memcmp (&mixed_got, &mixed_expected, sizeof (mixed_got)) == 0);
+
+  // Enum tables.
+  const PBCREP_EnumPlan *eplan = plan->enums;
+  assert (eplan->descriptor == &foo__person__phone_type__descriptor);
+  assert (eplan->dense_names != NULL);
+  assert (eplan->min_value == 0 && eplan->n_dense_names == 3);
+  assert (strcmp (pbcrep_enum_plan_get_name (eplan, 0), "MOBILE") == 0);
+  assert (strcmp (pbcrep_enum_plan_get_name (eplan, 1), "HOME") == 0);
+  assert (strcmp (pbcrep_enum_plan_get_name (eplan, 2), "WORK") == 0);
+  assert (pbcrep_enum_plan_get_name (eplan, 3) == NULL);
+  assert (pbcrep_enum_plan_get_name (eplan, -1) == NULL);
+  const ProtobufCEnumValue *ev = pbcrep_enum_plan_find_by_name (eplan, 4, "WORK");
+  assert (ev != NULL && ev->value == 2);
+  ev = pbcrep_enum_plan_find_by_name (eplan, 6, "MOBILE");
+  assert (ev != NULL && ev->value == 0);
+  assert (pbcrep_enum_plan_find_by_name (eplan, 3, "WORK") == NULL);
+  assert (pbcrep_enum_plan_find_by_name (eplan, 5, "WORKS") == NULL);
+
+  // Refcounting.
+  assert (plan->ref_count == 1);
+  assert (pbcrep_plan_ref (plan) == plan);
+  assert (plan->ref_count == 2);
+  pbcrep_plan_unref (plan);
+  assert (plan->ref_count == 1);
+  pbcrep_plan_unref (plan);
+}
+
+/* Factories are refcounted, and what they make outlives them. */
+static void
+test_factories (void)
+{
+  PBCREP_ParserFactory *pf = pbcrep_parser_factory_new_json (&foo__person__descriptor, NULL);
+  PBCREP_PrinterFactory *prf = pbcrep_printer_factory_new_json (&foo__person__descriptor, NULL);
+  assert (pf->ref_count == 1 && pf->descriptor == &foo__person__descriptor);
+  assert (prf->ref_count == 1 && prf->descriptor == &foo__person__descriptor);
+  assert (pf->split == NULL);
+  assert (pbcrep_parser_factory_ref (pf) == pf && pf->ref_count == 2);
+  assert (pbcrep_printer_factory_ref (prf) == prf && prf->ref_count == 2);
+  pbcrep_parser_factory_unref (pf);
+  pbcrep_printer_factory_unref (prf);
+  assert (pf->ref_count == 1 && prf->ref_count == 1);
+
+  // Parsers from one factory share its plan.
+  PBCREP_Parser *parser = pbcrep_parser_factory_create_parser (pf);
+  PBCREP_Parser *parser2 = pbcrep_parser_factory_create_parser (pf);
+  assert (pbcrep_parser_json_peek_plan (parser, NULL) == pbcrep_parser_json_peek_plan (parser2, NULL));
+  pbcrep_parser_destroy (parser2);
+  PBCREP_Printer *printer = pbcrep_printer_factory_create_printer (prf);
+
+  // Dropping the last reference leaves the parser and printer working.
+  pbcrep_parser_factory_unref (pf);
+  pbcrep_printer_factory_unref (prf);
+  PBCREP_Error *error = NULL;
+  if (!pbcrep_parser_feed (parser, strlen (basic_json__str),
+                           (const uint8_t *) basic_json__str, &error)
+   || !pbcrep_parser_end_feed (parser, &error))
+    assert(0);
+  pbcrep_parser_advance (parser);
+  assert (parser->current_message != NULL);
+  if (!pbcrep_printer_print (printer, parser->current_message, &error))
+    assert(0);
+  char *str = pbcrep_buffer_empty_to_string (&printer->output_data);
+  assert (memcmp (str, basic_json__str, strlen (basic_json__str)) == 0);
+  pbcrep_free (str);
+  pbcrep_printer_destroy (printer);
+  pbcrep_parser_destroy (parser);
+
+  // Length-prefixed records can be split without parsing.
+  pf = pbcrep_parser_factory_new_length_prefixed (PBCREP_LENGTH_PREFIXED_UINT8, &foo__mixed__descriptor);
+  assert (pf->ref_count == 1 && pf->descriptor == &foo__mixed__descriptor);
+  assert (pf->split != NULL);
+  static const uint8_t records[] = { 2, 0x48, 0x01, 0, 3, 0x48 };   // i32=1, {}, partial
+  assert (pf->split (pf, sizeof (records), records) == 4);
+  assert (pf->split (pf, 3, records) == 3);
+  assert (pf->split (pf, 2, records) == 0);
+  parser = pbcrep_parser_factory_create_parser (pf);
+  pbcrep_parser_factory_unref (pf);
+  if (!pbcrep_parser_feed (parser, 4, records, &error))
+    assert(0);
+  pbcrep_parser_advance (parser);
+  assert (parser->current_message != NULL);
+  pbcrep_parser_advance (parser);
+  assert (parser->current_message != NULL);
+  pbcrep_parser_destroy (parser);
+
+  prf = pbcrep_printer_factory_new_length_prefixed (PBCREP_LENGTH_PREFIXED_UINT8, &foo__mixed__descriptor);
+  assert (prf->ref_count == 1 && prf->descriptor == &foo__mixed__descriptor);
+  printer = pbcrep_printer_factory_create_printer (prf);
+  pbcrep_printer_factory_unref (prf);
+  Foo__Mixed mixed = FOO__MIXED__INIT;
+  if (!pbcrep_printer_print (printer, &mixed.base, &error))
+    assert(0);
+  assert (printer->output_data.size == 1);
+  pbcrep_printer_destroy (printer);
+}
+
+/* Parse basic_json__str with a parser from 'pf', and print it back. */
+static void
+check_cached_factories (PBCREP_ParserFactory *pf, PBCREP_PrinterFactory *prf)
+{
+  PBCREP_Parser *parser = pbcrep_parser_factory_create_parser (pf);
+  PBCREP_Printer *printer = pbcrep_printer_factory_create_printer (prf);
+  PBCREP_Error *error = NULL;
+  if (!pbcrep_parser_feed (parser, strlen (basic_json__str),
+                           (const uint8_t *) basic_json__str, &error)
+   || !pbcrep_parser_end_feed (parser, &error))
+    assert(0);
+  pbcrep_parser_advance (parser);
+  assert (parser->current_message != NULL);
+  if (!pbcrep_printer_print (printer, parser->current_message, &error))
+    assert(0);
+  char *str = pbcrep_buffer_empty_to_string (&printer->output_data);
+  assert (memcmp (str, basic_json__str, strlen (basic_json__str)) == 0);
+  pbcrep_free (str);
+  pbcrep_printer_destroy (printer);
+  pbcrep_parser_destroy (parser);
+}
+
+#define N_CACHE_THREADS 8
+static void *
+get_json_parser_factory (void *arg)
+{
+  return pbcrep_try_get_parser_factory ("json", &foo__person__descriptor, NULL);
+}
+
+static void
+test_factory_cache (void)
+{
+  PBCREP_Error *error = NULL;
+
+  // A repeated lookup finds the same factory.
+  PBCREP_ParserFactory *pf = pbcrep_try_get_parser_factory ("json", &foo__person__descriptor, &error);
+  PBCREP_PrinterFactory *prf = pbcrep_try_get_printer_factory ("json", &foo__person__descriptor, &error);
+  assert (pf != NULL && prf != NULL);
+  PBCREP_ParserFactory *pf2 = pbcrep_try_get_parser_factory ("json", &foo__person__descriptor, &error);
+  PBCREP_PrinterFactory *prf2 = pbcrep_try_get_printer_factory ("json", &foo__person__descriptor, &error);
+  assert (pf2 == pf && prf2 == prf);
+  pbcrep_parser_factory_unref (pf2);
+  pbcrep_printer_factory_unref (prf2);
+
+  // Other representations and descriptors get their own entries.
+  pf2 = pbcrep_try_get_parser_factory ("json5", &foo__person__descriptor, &error);
+  assert (pf2 != NULL && pf2 != pf);
+  pbcrep_parser_factory_unref (pf2);
+  pf2 = pbcrep_try_get_parser_factory ("json", &foo__mixed__descriptor, &error);
+  assert (pf2 != NULL && pf2 != pf);
+  assert (pf2->descriptor == &foo__mixed__descriptor);
+  pbcrep_parser_factory_unref (pf2);
+
+  // Clearing the cache leaves the factories we hold usable,
+  // and the next lookup builds new ones.
+  pbcrep_representation_cache_clear ();
+  check_cached_factories (pf, prf);
+  pf2 = pbcrep_try_get_parser_factory ("json", &foo__person__descriptor, &error);
+  prf2 = pbcrep_try_get_printer_factory ("json", &foo__person__descriptor, &error);
+  assert (pf2 != NULL && prf2 != NULL);
+  check_cached_factories (pf2, prf2);
+  pbcrep_parser_factory_unref (pf2);
+  pbcrep_printer_factory_unref (prf2);
+  pbcrep_parser_factory_unref (pf);
+  pbcrep_printer_factory_unref (prf);
+
+  // Threads racing to build a factory all end up with the published one.
+  pbcrep_representation_cache_clear ();
+  pthread_t threads[N_CACHE_THREADS];
+  for (unsigned i = 0; i < N_CACHE_THREADS; i++)
+    if (pthread_create (&threads[i], NULL, get_json_parser_factory, NULL) != 0)
+      assert(0);
+  PBCREP_ParserFactory *got[N_CACHE_THREADS];
+  for (unsigned i = 0; i < N_CACHE_THREADS; i++)
+    {
+      void *rv;
+      pthread_join (threads[i], &rv);
+      got[i] = rv;
+      assert (got[i] != NULL && got[i] == got[0]);
+    }
+  pf = pbcrep_try_get_parser_factory ("json", &foo__person__descriptor, &error);
+  assert (pf == got[0]);
+  pbcrep_parser_factory_unref (pf);
+  for (unsigned i = 0; i < N_CACHE_THREADS; i++)
+    pbcrep_parser_factory_unref (got[i]);
+
+  // An unknown representation is an error, and is not cached.
+  pf = pbcrep_try_get_parser_factory ("no-such-rep", &foo__person__descriptor, &error);
+  assert (pf == NULL);
+  assert (strcmp (error->error_code_str, "UNKNOWN_REPRESENTATION") == 0);
+  pbcrep_error_destroy (error);
+  error = NULL;
+  prf = pbcrep_try_get_printer_factory ("no-such-rep", &foo__person__descriptor, &error);
+  assert (prf == NULL);
+  assert (strcmp (error->error_code_str, "UNKNOWN_REPRESENTATION") == 0);
+  pbcrep_error_destroy (error);
+
+  pbcrep_representation_cache_clear ();
+}
+#undef N_CACHE_THREADS
+
+static const PBCREP_LengthPrefixed_Format all_lp_formats[] = {
+  PBCREP_LENGTH_PREFIXED_UINT8,
+  PBCREP_LENGTH_PREFIXED_UINT16_LE,
+  PBCREP_LENGTH_PREFIXED_UINT24_LE,
+  PBCREP_LENGTH_PREFIXED_UINT32_LE,
+  PBCREP_LENGTH_PREFIXED_UINT16_BE,
+  PBCREP_LENGTH_PREFIXED_UINT24_BE,
+  PBCREP_LENGTH_PREFIXED_UINT32_BE,
+  PBCREP_LENGTH_PREFIXED_B128,
+  PBCREP_LENGTH_PREFIXED_B128_BE,
+};
+
+/* Record i of the length-prefix tests:  every third one is empty
+ * (a zero-length record), the others set d, or d and f. */
+#define N_LP_RECORDS    10
+static void
+set_lp_record (Foo__Mixed *mixed, unsigned i)
+{
+  foo__mixed__init (mixed);
+  if (i % 3 != 0)
+    {
+      mixed->has_d = true;
+      mixed->d = i;
+    }
+  if (i % 3 == 2)
+    {
+      mixed->has_f = true;
+      mixed->f = i / 2.0f;
+    }
+}
+
+static void
+check_lp_records (PBCREP_Parser *parser, unsigned *n_inout)
+{
+  for (;;)
+    {
+      pbcrep_parser_advance (parser);
+      if (parser->current_message == NULL)
+        break;
+      assert (*n_inout < N_LP_RECORDS);
+      Foo__Mixed expected;
+      set_lp_record (&expected, *n_inout);
+      const Foo__Mixed *got = (const Foo__Mixed *) parser->current_message;
+      assert (got->has_d == expected.has_d && got->d == expected.d);
+      assert (got->has_f == expected.has_f && got->f == expected.f);
+      ++*n_inout;
+    }
+}
+
+/* Feed length-prefixed records in every format a byte at a time,
+ * and as buffers of small fragments, so that every prefix
+ * (including those of empty records) is split every way. */
+static void
+test_length_prefixed_feed (void)
+{
+  for (unsigned f = 0; f < N_ELEMENTS(all_lp_formats); f++)
+    {
+      PBCREP_LengthPrefixed_Format format = all_lp_formats[f];
+      PBCREP_Printer *printer = pbcrep_printer_new_length_prefixed (format, &foo__mixed__descriptor);
+      PBCREP_Error *error = NULL;
+      size_t last_nonempty_end = 0;
+      for (unsigned i = 0; i < N_LP_RECORDS; i++)
+        {
+          Foo__Mixed mixed;
+          set_lp_record (&mixed, i);
+          if (!pbcrep_printer_print (printer, &mixed.base, &error))
+            assert(0);
+          if (mixed.has_d)
+            last_nonempty_end = printer->output_data.size;
+        }
+      size_t len = printer->output_data.size;
+      uint8_t *stream = malloc (len);
+      pbcrep_buffer_read (&printer->output_data, len, stream);
+      pbcrep_printer_destroy (printer);
+
+      PBCREP_Parser *parser = pbcrep_parser_new_length_prefixed (format, &foo__mixed__descriptor);
+      unsigned n = 0;
+      for (size_t at = 0; at < len; at++)
+        {
+          if (!pbcrep_parser_feed (parser, 1, stream + at, &error))
+            assert(0);
+          check_lp_records (parser, &n);
+        }
+      if (!pbcrep_parser_end_feed (parser, &error))
+        assert(0);
+      check_lp_records (parser, &n);
+      assert (n == N_LP_RECORDS);
+      pbcrep_parser_destroy (parser);
+
+      // In one buffer, then in one buffer per fragment.
+      for (unsigned frag_size = 1; frag_size <= 7; frag_size++)
+        for (unsigned per_fragment = 0; per_fragment < 2; per_fragment++)
+          {
+            parser = pbcrep_parser_new_length_prefixed (format, &foo__mixed__descriptor);
+            PBCREP_Buffer buffer = PBCREP_BUFFER_INIT;
+            n = 0;
+            for (size_t at = 0; at < len; at += frag_size)
+              {
+                pbcrep_buffer_append_foreign (&buffer, MIN (frag_size, len - at),
+                                              stream + at, NULL, NULL);
+                if (per_fragment)
+                  {
+                    if (!pbcrep_parser_feed_buffer (parser, &buffer, &error))
+                      assert(0);
+                    assert (buffer.size == 0);
+                    check_lp_records (parser, &n);
+                  }
+              }
+            if (!pbcrep_parser_feed_buffer (parser, &buffer, &error)
+             || !pbcrep_parser_end_feed (parser, &error))
+              assert(0);
+            check_lp_records (parser, &n);
+            assert (n == N_LP_RECORDS);
+            pbcrep_parser_destroy (parser);
+          }
+
+      // Ending within a record is an error.
+      parser = pbcrep_parser_new_length_prefixed (format, &foo__mixed__descriptor);
+      if (!pbcrep_parser_feed (parser, last_nonempty_end - 1, stream, &error))
+        assert(0);
+      assert (!pbcrep_parser_end_feed (parser, &error));
+      assert (strcmp (error->error_code_str, "PARTIAL_RECORD") == 0);
+      pbcrep_error_destroy (error);
+      pbcrep_parser_destroy (parser);
+      free (stream);
+    }
+}
+
+/* pbcrep_transfer_messages() from data in one representation
+ * to 'out' in another. */
+static PBCREP_TransferResult
+transfer_to_file (const char *in_repstr, const char *out_repstr,
+                  const ProtobufCMessageDescriptor *desc,
+                  size_t len, const uint8_t *data, FILE *out)
+{
+  PBCREP_Reader *reader = pbcrep_reader_new_parser (pbcrep_binary_data_reader_from_data (len, data),
+                                                    pbcrep_make_parser (in_repstr, desc));
+  PBCREP_Writer *writer = pbcrep_writer_new_printer (pbcrep_binary_data_writer_to_fileno (fileno (out), false),
+                                                     pbcrep_make_printer (out_repstr, desc));
+  PBCREP_TransferResult res = pbcrep_transfer_messages (reader, writer);
+  pbcrep_reader_destroy (reader);
+  pbcrep_writer_destroy (writer);
+  rewind (out);
+  return res;
+}
+
+/* Between length-prefixed formats records are re-framed without being
+ * unpacked, but must still be rejected where unpacking would fail. */
+static void
+test_transfer_reframed (void)
+{
+  static const uint8_t good[] = { 9, 0x0a, 5, 'd', 'a', 'v', 'e', 'b', 0x10, 42 };
+  // protobuf-c doesn't check UTF-8.
+  static const uint8_t bad_utf8[] = { 6, 0x0a, 2, 0xc0, 0x80, 0x10, 1 };
+  static const uint8_t missing_id[] = { 3, 0x0a, 1, 'x' };
+  static const uint8_t wrong_wire_type[] = { 6, 0x0a, 1, 'x', 0x12, 1, 'y' };
+  static const uint8_t bad_phone[] = { 9, 0x0a, 1, 'x', 0x10, 1, 0x22, 2, 0x10, 1 };
+  static const struct {
+    const uint8_t *record;
+    size_t len;
+    bool ok;
+  } cases[] = {
+    { good, sizeof (good), true },
+    { bad_utf8, sizeof (bad_utf8), true },
+    { missing_id, sizeof (missing_id), false },
+    { wrong_wire_type, sizeof (wrong_wire_type), false },
+    { bad_phone, sizeof (bad_phone), false },
+  };
+  for (unsigned i = 0; i < N_ELEMENTS(cases); i++)
+    {
+      uint8_t in[32];
+      memcpy (in, good, sizeof (good));
+      memcpy (in + sizeof (good), cases[i].record, cases[i].len);
+      size_t in_len = sizeof (good) + cases[i].len;
+
+      // The parser agrees.
+      PBCREP_Parser *parser = pbcrep_make_parser ("length_prefixed_u8", &foo__person__descriptor);
+      PBCREP_Error *error = NULL;
+      bool parsed = pbcrep_parser_feed (parser, in_len, in, &error);
+      assert (parsed == cases[i].ok);
+      if (!parsed)
+        pbcrep_error_destroy (error);
+      pbcrep_parser_destroy (parser);
+
+      FILE *out = tmpfile ();
+      PBCREP_TransferResult res = transfer_to_file ("length_prefixed_u8", "length_prefixed_b128",
+                                                    &foo__person__descriptor, in_len, in, out);
+      if (cases[i].ok)
+        {
+          assert (res.code == PBCREP_TRANSFER_RESULT_SUCCESS);
+          assert (res.n_transferred == 2);
+          uint8_t got[33];
+          assert (fread (got, 1, sizeof (got), out) == in_len);
+          assert (memcmp (got, in, in_len) == 0);     // short:  the same prefixes
+        }
+      else
+        {
+          assert (res.code == PBCREP_TRANSFER_RESULT_READ_FAILED);
+          assert (res.n_transferred == 1);
+          assert (strcmp (res.error->error_code_str, "PROTOBUF_MALFORMED") == 0);
+          pbcrep_error_destroy (res.error);
+        }
+      fclose (out);
+    }
+}
+
+/* Parse 'len' bytes of 'repstr' and print the one message as JSON. */
+static char *
+reparse_to_json (const char *repstr, const ProtobufCMessageDescriptor *desc,
+                 size_t len, const uint8_t *data)
+{
+  PBCREP_Parser *parser = pbcrep_make_parser (repstr, desc);
+  PBCREP_Printer *printer = pbcrep_make_printer ("json", desc);
+  PBCREP_Error *error = NULL;
+  if (!pbcrep_parser_feed (parser, len, data, &error)
+   || !pbcrep_parser_end_feed (parser, &error))
+    assert(0);
+  pbcrep_parser_advance (parser);
+  assert (parser->current_message != NULL);
+  if (!pbcrep_printer_print (printer, parser->current_message, &error))
+    assert(0);
+  char *rv = pbcrep_buffer_empty_to_string (&printer->output_data);
+  pbcrep_printer_destroy (printer);
+  pbcrep_parser_destroy (parser);
+  return rv;
+}
+
+/* A key given twice, or given a value and then null, must come out of
+ * the transcoded transfer as it comes out of the parser:  the last wins. */
+static void
+test_transfer_transcoded (void)
+{
+  static const char *const jsons[] = {
+    "{\"name\":\"a\",\"id\":1,\"name\":\"b\",\"id\":2}",
+    "{\"name\":\"a\",\"id\":1,\"test_ints\":[1,2],\"test_ints\":[3]}",
+    "{\"name\":\"a\",\"id\":1,\"phone\":[{\"number\":\"1\"}],"
+     "\"phone\":[{\"number\":\"2\",\"type\":\"WORK\",\"number\":\"3\",\"type\":\"MOBILE\"}]}",
+    "{\"name\":\"a\",\"id\":1,\"email\":\"x\",\"email\":null}",
+    "{\"name\":\"a\",\"id\":1,\"test_ints\":[1,2],\"test_ints\":null}",
+    "{\"name\":\"a\",\"email\":\"x\",\"id\":1,\"phone\":[],\"email\":\"y\","
+     "\"test_ints\":[5],\"name\":\"c\",\"phone\":[{\"number\":\"4\"}],\"id\":7}",
+  };
+  for (unsigned i = 0; i < N_ELEMENTS(jsons); i++)
+    {
+      size_t json_len = strlen (jsons[i]);
+      char *expected = reparse_to_json ("json", &foo__person__descriptor,
+                                        json_len, (const uint8_t *) jsons[i]);
+      FILE *out = tmpfile ();
+      PBCREP_TransferResult res = transfer_to_file ("json", "length_prefixed_b128",
+                                                    &foo__person__descriptor,
+                                                    json_len, (const uint8_t *) jsons[i],
+                                                    out);
+      assert (res.code == PBCREP_TRANSFER_RESULT_SUCCESS);
+      assert (res.n_transferred == 1);
+      uint8_t lp[256];
+      size_t lp_len = fread (lp, 1, sizeof (lp), out);
+      assert (lp_len > 0 && lp_len < sizeof (lp));
+      char *got = reparse_to_json ("length_prefixed_b128", &foo__person__descriptor,
+                                   lp_len, lp);
+      assert (strcmp (got, expected) == 0);
+      pbcrep_free (got);
+      pbcrep_free (expected);
+      fclose (out);
+    }
+
+  // The parser doesn't know oneofs, so check the unpacked message:
+  // one member replaces another, and null unsets the oneof.
+  static const struct {
+    const char *json;
+    Foo__Mixed__ChoiceCase choice_case;
+  } oneofs[] = {
+    { "{\"choice_int\":1,\"choice_str\":\"x\"}", FOO__MIXED__CHOICE_CHOICE_STR },
+    { "{\"choice_str\":\"x\",\"d\":1,\"choice_int\":2}", FOO__MIXED__CHOICE_CHOICE_INT },
+    { "{\"choice_str\":\"x\",\"choice_int\":null}", FOO__MIXED__CHOICE__NOT_SET },
+  };
+  for (unsigned i = 0; i < N_ELEMENTS(oneofs); i++)
+    {
+      FILE *out = tmpfile ();
+      PBCREP_TransferResult res = transfer_to_file ("json", "length_prefixed_u8",
+                                                    &foo__mixed__descriptor,
+                                                    strlen (oneofs[i].json),
+                                                    (const uint8_t *) oneofs[i].json,
+                                                    out);
+      assert (res.code == PBCREP_TRANSFER_RESULT_SUCCESS);
+      uint8_t lp[256];
+      size_t lp_len = fread (lp, 1, sizeof (lp), out);
+      assert (lp_len > 0 && lp[0] == lp_len - 1);
+      Foo__Mixed *mixed = foo__mixed__unpack (NULL, lp_len - 1, lp + 1);
+      assert (mixed != NULL);
+      assert (mixed->choice_case == oneofs[i].choice_case);
+      if (mixed->choice_case == FOO__MIXED__CHOICE_CHOICE_STR)
+        assert (strcmp (mixed->choice_str, "x") == 0);
+      if (mixed->choice_case == FOO__MIXED__CHOICE_CHOICE_INT)
+        assert (mixed->choice_int == 2);
+      foo__mixed__free_unpacked (mixed, NULL);
+      fclose (out);
+    }
+
+  // A record too long for the length-prefix is the writer's failure.
+  FILE *out = tmpfile ();
+  PBCREP_TransferResult res = transfer_to_file ("json", "length_prefixed_u8",
+                                                &foo__person__descriptor,
+                                                strlen (long_int_array__str),
+                                                (const uint8_t *) long_int_array__str,
+                                                out);
+  assert (res.code == PBCREP_TRANSFER_RESULT_WRITE_FAILED);
+  assert (strcmp (res.error->error_code_str, "MESSAGE_TOO_LONG") == 0);
+  pbcrep_error_destroy (res.error);
+  fclose (out);
+}
+
+/* Every record goes to the output its key hashes to, in order. */
+static void
+test_transfer_sharded (void)
+{
+#define N_SHARD_RECORDS 300
+#define N_SHARDS        4
+  PBCREP_Error *error = NULL;
+  PBCREP_FieldPath *key = pbcrep_field_path_new (&foo__person__descriptor, "id", &error);
+  assert (key != NULL);
+
+  // Persons whose ids repeat, so that equal keys meet.
+  uint8_t *in = malloc (N_SHARD_RECORDS * 32);
+  size_t in_len = 0;
+  size_t starts[N_SHARD_RECORDS], lengths[N_SHARD_RECORDS];
+  unsigned shards[N_SHARD_RECORDS];
+  int shard_of_id[37];
+  for (unsigned i = 0; i < N_ELEMENTS(shard_of_id); i++)
+    shard_of_id[i] = -1;
+  for (unsigned i = 0; i < N_SHARD_RECORDS; i++)
+    {
+      char name[16];
+      snprintf (name, sizeof (name), "n%u", i);
+      Foo__Person person = FOO__PERSON__INIT;
+      person.name = name;
+      person.id = (int) (i % 37) - 10;
+      size_t len = foo__person__get_packed_size (&person);
+      assert (len < 0x80);
+      in[in_len++] = len;
+      starts[i] = in_len;
+      lengths[i] = foo__person__pack (&person, in + in_len);
+      in_len += lengths[i];
+
+      uint64_t hash;
+      if (!pbcrep_field_path_hash (key, lengths[i], in + starts[i], &hash, &error))
+        assert(0);
+      shards[i] = hash % N_SHARDS;
+      if (shard_of_id[i % 37] < 0)
+        shard_of_id[i % 37] = shards[i];
+      assert (shard_of_id[i % 37] == (int) shards[i]);
+    }
+
+  FILE *files[N_SHARDS];
+  PBCREP_BinaryDataWriter *writers[N_SHARDS];
+  for (unsigned k = 0; k < N_SHARDS; k++)
+    {
+      files[k] = tmpfile ();
+      writers[k] = pbcrep_binary_data_writer_to_fileno (fileno (files[k]), false);
+    }
+  PBCREP_BinaryDataReader *reader = pbcrep_binary_data_reader_from_data (in_len, in);
+  PBCREP_TransferResult res = pbcrep_transfer_sharded (reader, PBCREP_LENGTH_PREFIXED_B128,
+                                                       key, N_SHARDS, writers,
+                                                       PBCREP_LENGTH_PREFIXED_UINT16_BE);
+  assert (res.code == PBCREP_TRANSFER_RESULT_SUCCESS);
+  assert (res.n_transferred == N_SHARD_RECORDS);
+  pbcrep_binary_data_reader_destroy (reader);
+
+  unsigned n_seen = 0;
+  for (unsigned k = 0; k < N_SHARDS; k++)
+    {
+      pbcrep_binary_data_writer_destroy (writers[k]);
+      rewind (files[k]);
+      uint8_t out[N_SHARD_RECORDS * 32];
+      size_t out_len = fread (out, 1, sizeof (out), files[k]);
+      fclose (files[k]);
+
+      // The records of this shard, in their input order.
+      size_t at = 0;
+      unsigned n_in_shard = 0;
+      for (unsigned i = 0; i < N_SHARD_RECORDS; i++)
+        {
+          if (shards[i] != k)
+            continue;
+          size_t length;
+          int prefix_len = pbcrep_length_prefix_decode (PBCREP_LENGTH_PREFIXED_UINT16_BE,
+                                                        out_len - at, out + at, &length);
+          assert (prefix_len == 2);
+          at += prefix_len;
+          assert (length == lengths[i] && at + length <= out_len);
+          assert (memcmp (out + at, in + starts[i], length) == 0);
+          at += length;
+          n_in_shard++;
+        }
+      assert (at == out_len);
+      assert (n_in_shard > 0);
+      n_seen += n_in_shard;
+    }
+  assert (n_seen == N_SHARD_RECORDS);
+
+  // No outputs:  nowhere to route to.
+  reader = pbcrep_binary_data_reader_from_data (in_len, in);
+  res = pbcrep_transfer_sharded (reader, PBCREP_LENGTH_PREFIXED_B128,
+                                 key, 0, NULL, PBCREP_LENGTH_PREFIXED_B128);
+  assert (res.code == PBCREP_TRANSFER_RESULT_WRITE_FAILED);
+  assert (strcmp (res.error->error_code_str, "NO_OUTPUTS") == 0);
+  pbcrep_error_destroy (res.error);
+  pbcrep_binary_data_reader_destroy (reader);
+
+  pbcrep_field_path_destroy (key);
+  free (in);
+#undef N_SHARD_RECORDS
+#undef N_SHARDS
+}
+
+static void
+pipeline_to_file (FILE *in, FILE *out,
+                  const char *in_repstr, const char *out_repstr,
+                  unsigned n_parse_threads, unsigned n_print_threads)
+{
+  PBCREP_Error *error = NULL;
+  PBCREP_ParserFactory *pf = pbcrep_try_get_parser_factory (in_repstr, &foo__person__descriptor, &error);
+  PBCREP_PrinterFactory *prf = pbcrep_try_get_printer_factory (out_repstr, &foo__person__descriptor, &error);
+  assert (pf != NULL && prf != NULL);
+  PBCREP_BinaryDataReader *reader = pbcrep_binary_data_reader_from_fileno (fileno (in), false);
+  PBCREP_BinaryDataWriter *writer = pbcrep_binary_data_writer_to_fileno (fileno (out), false);
+  PBCREP_PipelineOptions options = PBCREP_PIPELINE_OPTIONS_INIT;
+  options.n_parse_threads = n_parse_threads;
+  options.n_print_threads = n_print_threads;
+  options.chunk_size = 1000;
+  PBCREP_PipelineStats stats;
+  PBCREP_TransferResult res = pbcrep_transfer_messages_pipelined (reader, pf, prf, writer,
+                                                                  &options, &stats);
+  assert (res.code == PBCREP_TRANSFER_RESULT_SUCCESS);
+  assert (res.n_transferred == 500);
+  assert (stats.stages[PBCREP_PIPELINE_STAGE_PRINT].n_threads == n_print_threads);
+  pbcrep_binary_data_reader_destroy (reader);
+  pbcrep_binary_data_writer_destroy (writer);
+  pbcrep_parser_factory_unref (pf);
+  pbcrep_printer_factory_unref (prf);
+  rewind (out);
+}
+
+/* JSON -> length-prefixed -> JSON, through pipelines. */
+static void
+test_pipelined_transfer (void)
+{
+  FILE *json_in = tmpfile ();
+  FILE *lp = tmpfile ();
+  FILE *json_out = tmpfile ();
+  for (unsigned i = 0; i < 500; i++)
+    fprintf (json_in, "%s\n", basic_json__str);
+  fflush (json_in);
+  rewind (json_in);
+
+  pipeline_to_file (json_in, lp, "json", "length_prefixed_b128", 1, 3);
+  pipeline_to_file (lp, json_out, "length_prefixed_b128", "json", 4, 2);
+
+  size_t line_len = strlen (basic_json__str) + 1;
+  char *line = malloc (line_len + 1);
+  for (unsigned i = 0; i < 500; i++)
+    {
+      assert (fgets (line, line_len + 1, json_out) != NULL);
+      assert (memcmp (line, basic_json__str, line_len - 1) == 0);
+      assert (line[line_len - 1] == '\n');
+    }
+  assert (fgetc (json_out) == EOF);
+  free (line);
+  fclose (json_in);
+  fclose (lp);
+  fclose (json_out);
+}
+
 static Test *all_tests[] = {
   &basic_json__test,
   &long_int_array__test,
@@ -332,6 +1203,1416 @@ static unsigned test_sizes[] = {
  1,2,3,4,5,9,11,13,20,2000
 };
 
+/* Compare two unpacked messages field by field, unknown fields too. */
+static bool messages_equal (const ProtobufCMessage *a, const ProtobufCMessage *b);
+
+static bool
+values_equal (const ProtobufCFieldDescriptor *f, const void *a, const void *b)
+{
+  switch (f->type)
+    {
+    case PROTOBUF_C_TYPE_STRING:
+      {
+        const char *sa = * (const char * const *) a, *sb = * (const char * const *) b;
+        return (sa == NULL) == (sb == NULL) && (sa == NULL || strcmp (sa, sb) == 0);
+      }
+    case PROTOBUF_C_TYPE_BYTES:
+      {
+        const ProtobufCBinaryData *ba = a, *bb = b;
+        return ba->len == bb->len && (ba->len == 0 || memcmp (ba->data, bb->data, ba->len) == 0);
+      }
+    case PROTOBUF_C_TYPE_MESSAGE:
+      {
+        const ProtobufCMessage *ma = * (const ProtobufCMessage * const *) a;
+        const ProtobufCMessage *mb = * (const ProtobufCMessage * const *) b;
+        return (ma == NULL) == (mb == NULL) && (ma == NULL || messages_equal (ma, mb));
+      }
+    default:
+      return memcmp (a, b, pbcrep_wire_member_size (f->type)) == 0;
+    }
+}
+
+static bool
+messages_equal (const ProtobufCMessage *a, const ProtobufCMessage *b)
+{
+  const ProtobufCMessageDescriptor *desc = a->descriptor;
+  if (b->descriptor != desc)
+    return false;
+  const char *ma = (const char *) a, *mb = (const char *) b;
+  for (unsigned i = 0; i < desc->n_fields; i++)
+    {
+      const ProtobufCFieldDescriptor *f = desc->fields + i;
+      const void *qa = ma + f->quantifier_offset, *qb = mb + f->quantifier_offset;
+      if (f->label == PROTOBUF_C_LABEL_REPEATED)
+        {
+          size_t n = * (const size_t *) qa;
+          if (* (const size_t *) qb != n)
+            return false;
+          const char *va = * (const char * const *) (ma + f->offset);
+          const char *vb = * (const char * const *) (mb + f->offset);
+          size_t size = pbcrep_wire_member_size (f->type);
+          for (size_t j = 0; j < n; j++)
+            if (!values_equal (f, va + j * size, vb + j * size))
+              return false;
+          continue;
+        }
+      if (f->flags & PROTOBUF_C_FIELD_FLAG_ONEOF)
+        {
+          if (* (const uint32_t *) qa != * (const uint32_t *) qb)
+            return false;
+          if (* (const uint32_t *) qa != f->id)
+            continue;
+        }
+      else if (f->label == PROTOBUF_C_LABEL_OPTIONAL
+            && f->type != PROTOBUF_C_TYPE_STRING
+            && f->type != PROTOBUF_C_TYPE_MESSAGE)
+        {
+          if (* (const protobuf_c_boolean *) qa != * (const protobuf_c_boolean *) qb)
+            return false;
+          if (!* (const protobuf_c_boolean *) qa)
+            continue;
+        }
+      if (!values_equal (f, ma + f->offset, mb + f->offset))
+        return false;
+    }
+  if (a->n_unknown_fields != b->n_unknown_fields)
+    return false;
+  for (unsigned i = 0; i < a->n_unknown_fields; i++)
+    {
+      const ProtobufCMessageUnknownField *ua = a->unknown_fields + i;
+      const ProtobufCMessageUnknownField *ub = b->unknown_fields + i;
+      if (ua->tag != ub->tag || ua->wire_type != ub->wire_type || ua->len != ub->len
+       || memcmp (ua->data, ub->data, ua->len) != 0)
+        return false;
+    }
+  return true;
+}
+
+/* Records of Mixed, built by appending to a growing buffer. */
+typedef struct {
+  uint8_t *data;
+  size_t len;
+  size_t alloced;
+} Record;
+
+static void
+record_append (Record *rec, size_t len, const void *data)
+{
+  if (rec->len + len > rec->alloced)
+    {
+      rec->alloced = (rec->len + len) * 2;
+      rec->data = realloc (rec->data, rec->alloced);
+    }
+  memcpy (rec->data + rec->len, data, len);
+  rec->len += len;
+}
+
+static void
+record_append_varint (Record *rec, uint64_t value)
+{
+  uint8_t buf[PBCREP_WIRE_MAX_VARINT_SIZE];
+  record_append (rec, pbcrep_wire_encode_varint (value, buf), buf);
+}
+
+static void
+record_append_tag (Record *rec, uint32_t number, PBCREP_WireType wire_type)
+{
+  record_append_varint (rec, (uint64_t) number << 3 | wire_type);
+}
+
+// Appending messages merges them, as protobuf_c_message_unpack() does.
+static void
+record_append_mixed (Record *rec, const Foo__Mixed *mixed)
+{
+  uint8_t *buf = malloc (foo__mixed__get_packed_size (mixed) + 1);
+  record_append (rec, foo__mixed__pack (mixed, buf), buf);
+  free (buf);
+}
+
+#define N_MIXED_RECORDS 8
+
+/* Mixed records with every kind of field:  packed and not (as declared
+ * and not), oneofs, unknown fields, sub-messages merged from several
+ * occurrences, and a large record with long repeated fields. */
+static void
+make_mixed_records (Record *records)
+{
+  memset (records, 0, sizeof (Record) * N_MIXED_RECORDS);
+  Record *rec = records;
+
+  // Everything, as protobuf-c packs it.
+  static int32_t ints[] = { 0, 1, -1, 300, INT32_MAX, INT32_MIN };
+  static int64_t sints[] = { 0, -1, 1, INT64_MIN, INT64_MAX, -300 };
+  static uint32_t fixed[] = { 0, 1, 0xdeadbeef };
+  static double doubles[] = { 0.5, -2.25, 1e300 };
+  static protobuf_c_boolean bools[] = { 1, 0, 1, 1 };
+  Foo__Person person = FOO__PERSON__INIT;
+  person.name = "p";
+  person.id = 5;
+  Foo__Mixed child = FOO__MIXED__INIT;
+  child.n_packed_ints = 2;
+  child.packed_ints = ints;
+  child.choice_case = FOO__MIXED__CHOICE_CHOICE_PERSON;
+  child.choice_person = &person;
+  Foo__Mixed grandchild = FOO__MIXED__INIT;
+  grandchild.str = "g";
+  Foo__Mixed *children[] = { &grandchild, &child };
+  Foo__Mixed all = FOO__MIXED__INIT;
+  all.has_d = true;
+  all.d = -1.5;
+  all.has_f = true;
+  all.f = 0.25f;
+  all.n_packed_ints = N_ELEMENTS(ints);
+  all.packed_ints = ints;
+  all.n_ints = N_ELEMENTS(ints);
+  all.ints = ints;
+  all.n_packed_sints = N_ELEMENTS(sints);
+  all.packed_sints = sints;
+  all.n_packed_fixed = N_ELEMENTS(fixed);
+  all.packed_fixed = fixed;
+  all.n_packed_doubles = N_ELEMENTS(doubles);
+  all.packed_doubles = doubles;
+  all.n_packed_bools = N_ELEMENTS(bools);
+  all.packed_bools = bools;
+  all.has_i32 = true;
+  all.i32 = -7;
+  all.has_s32 = true;
+  all.s32 = -7;
+  all.choice_case = FOO__MIXED__CHOICE_CHOICE_STR;
+  all.choice_str = "choice";
+  all.child = &child;
+  all.n_children = N_ELEMENTS(children);
+  all.children = children;
+  all.has_blob = true;
+  all.blob.len = 3;
+  all.blob.data = (uint8_t *) "\0\1\2";
+  all.str = "str";
+  record_append_mixed (rec++, &all);
+
+  // Packed fields given unpacked and in several runs, and
+  // unpacked fields given packed.
+  record_append_tag (rec, 3, PBCREP_WIRE_TYPE_VARINT);
+  record_append_varint (rec, 17);
+  record_append_tag (rec, 3, PBCREP_WIRE_TYPE_LENGTH_PREFIXED);
+  record_append_varint (rec, 2);
+  record_append_varint (rec, 1);
+  record_append_varint (rec, 2);
+  record_append_tag (rec, 3, PBCREP_WIRE_TYPE_VARINT);
+  record_append_varint (rec, (uint64_t) (int64_t) -3);
+  record_append_tag (rec, 4, PBCREP_WIRE_TYPE_LENGTH_PREFIXED);
+  record_append_varint (rec, 3);
+  record_append_varint (rec, 4);
+  record_append_varint (rec, 300);
+  record_append_tag (rec, 4, PBCREP_WIRE_TYPE_VARINT);
+  record_append_varint (rec, 6);
+  record_append_tag (rec, 8, PBCREP_WIRE_TYPE_VARINT);
+  record_append_varint (rec, 1);
+  rec++;
+
+  // Oneof members replacing each other;  the last wins.
+  Foo__Mixed m = FOO__MIXED__INIT;
+  m.choice_case = FOO__MIXED__CHOICE_CHOICE_INT;
+  m.choice_int = 7;
+  record_append_mixed (rec, &m);
+  m.choice_case = FOO__MIXED__CHOICE_CHOICE_STR;
+  m.choice_str = "s";
+  record_append_mixed (rec, &m);
+  m.choice_case = FOO__MIXED__CHOICE_CHOICE_PERSON;
+  m.choice_person = &person;
+  record_append_mixed (rec++, &m);
+  record_append_mixed (rec, &m);
+  m.choice_case = FOO__MIXED__CHOICE_CHOICE_INT;
+  m.choice_int = -8;
+  record_append_mixed (rec++, &m);
+
+  // Unknown fields of each wire type, among known ones.
+  foo__mixed__init (&m);
+  m.has_i32 = true;
+  m.i32 = 1;
+  record_append_mixed (rec, &m);
+  record_append_tag (rec, 100, PBCREP_WIRE_TYPE_VARINT);
+  record_append_varint (rec, 12345);
+  record_append_tag (rec, 101, PBCREP_WIRE_TYPE_64BIT);
+  record_append (rec, 8, "abcdefgh");
+  m.i32 = 2;
+  record_append_mixed (rec, &m);
+  record_append_tag (rec, 102, PBCREP_WIRE_TYPE_LENGTH_PREFIXED);
+  record_append_varint (rec, 3);
+  record_append (rec, 3, "xyz");
+  record_append_tag (rec, 103, PBCREP_WIRE_TYPE_32BIT);
+  record_append (rec, 4, "abcd");
+  rec++;
+
+  // A non-repeated sub-message, and a oneof member that is a message,
+  // each given twice:  they are merged.
+  Foo__Mixed c1 = FOO__MIXED__INIT, c2 = FOO__MIXED__INIT;
+  c1.has_i32 = true;
+  c1.i32 = 1;
+  c1.n_packed_ints = 2;
+  c1.packed_ints = ints;
+  c1.str = "first";
+  c2.has_s32 = true;
+  c2.s32 = 2;
+  c2.n_packed_ints = 3;
+  c2.packed_ints = ints + 3;
+  c2.str = "second";
+  Foo__Person p1 = FOO__PERSON__INIT, p2 = FOO__PERSON__INIT;
+  p1.name = "one";
+  p1.id = 1;
+  p1.email = "one@example.com";
+  p2.name = "two";
+  p2.id = 2;
+  foo__mixed__init (&m);
+  m.child = &c1;
+  m.choice_case = FOO__MIXED__CHOICE_CHOICE_PERSON;
+  m.choice_person = &p1;
+  record_append_mixed (rec, &m);
+  m.child = &c2;
+  m.choice_person = &p2;
+  m.has_d = true;
+  m.d = 2;
+  record_append_mixed (rec++, &m);
+
+  // Nothing at all.
+  rec->data = malloc (1);
+  rec++;
+
+  // Large:  long packed and repeated fields, and a long blob.
+  enum { N_LARGE = 20000 };
+  int32_t *large_ints = malloc (sizeof (int32_t) * N_LARGE);
+  double *large_doubles = malloc (sizeof (double) * N_LARGE);
+  Foo__Mixed *large_children = malloc (sizeof (Foo__Mixed) * 200);
+  Foo__Mixed **large_child_ptrs = malloc (sizeof (Foo__Mixed *) * 200);
+  for (unsigned i = 0; i < N_LARGE; i++)
+    {
+      large_ints[i] = (int32_t) (i * 2654435761u);
+      large_doubles[i] = i / 3.0;
+    }
+  for (unsigned i = 0; i < 200; i++)
+    {
+      foo__mixed__init (large_children + i);
+      large_children[i].has_i32 = true;
+      large_children[i].i32 = i;
+      large_child_ptrs[i] = large_children + i;
+    }
+  uint8_t *blob = malloc (70000);
+  for (unsigned i = 0; i < 70000; i++)
+    blob[i] = i * 7;
+  foo__mixed__init (&m);
+  m.n_packed_ints = N_LARGE;
+  m.packed_ints = large_ints;
+  m.n_ints = N_LARGE / 4;
+  m.ints = large_ints;
+  m.n_packed_doubles = N_LARGE;
+  m.packed_doubles = large_doubles;
+  m.n_children = 200;
+  m.children = large_child_ptrs;
+  m.has_blob = true;
+  m.blob.len = 70000;
+  m.blob.data = blob;
+  record_append_mixed (rec++, &m);
+  free (large_ints);
+  free (large_doubles);
+  free (large_children);
+  free (large_child_ptrs);
+  free (blob);
+
+  assert (rec == records + N_MIXED_RECORDS);
+}
+
+static void
+free_mixed_records (Record *records)
+{
+  for (unsigned i = 0; i < N_MIXED_RECORDS; i++)
+    free (records[i].data);
+}
+
+#define N_HIDDEN_BAD_RECORDS 2
+
+/* Mixed records that protobuf_c_message_unpack() rejects for a message
+ * that is not kept as it is:  a oneof member overridden by a later one,
+ * and a piece of a merged message. */
+static void
+make_hidden_bad_records (Record *records)
+{
+  memset (records, 0, sizeof (Record) * N_HIDDEN_BAD_RECORDS);
+  Foo__Mixed mixed = FOO__MIXED__INIT;
+  mixed.choice_case = FOO__MIXED__CHOICE_CHOICE_INT;
+  mixed.choice_int = 1;
+  record_append_tag (records + 0, 13, PBCREP_WIRE_TYPE_LENGTH_PREFIXED);
+  record_append_varint (records + 0, 3);
+  record_append (records + 0, 3, "\12\1x");         // a Person without its id
+  record_append_mixed (records + 0, &mixed);
+
+  Foo__Person person = FOO__PERSON__INIT;
+  person.name = "x";
+  person.id = 1;
+  foo__mixed__init (&mixed);
+  mixed.choice_case = FOO__MIXED__CHOICE_CHOICE_PERSON;
+  mixed.choice_person = &person;
+  record_append_tag (records + 1, 13, PBCREP_WIRE_TYPE_LENGTH_PREFIXED);
+  record_append_varint (records + 1, 2);
+  record_append (records + 1, 2, "\20\2");          // only an id
+  record_append_mixed (records + 1, &mixed);
+
+  for (unsigned i = 0; i < N_HIDDEN_BAD_RECORDS; i++)
+    assert (foo__mixed__unpack (NULL, records[i].len, records[i].data) == NULL);
+}
+
+/* Transcoding must give what parsing and then printing gives. */
+static uint8_t *
+transcode (const char *json, unsigned max_feed, size_t *len_out)
+{
+  PBCREP_Plan *plan = pbcrep_plan_new (&foo__person__descriptor);
+  PBCREP_Parser_JSONOptions options = PBCREP_PARSER_JSON_OPTIONS_INIT;
+  PBCREP_JSON_Transcoder *transcoder = pbcrep_json_transcoder_new (plan, &options,
+                                                                   PBCREP_LENGTH_PREFIXED_B128);
+  pbcrep_plan_unref (plan);
+  PBCREP_Buffer out = PBCREP_BUFFER_INIT;
+  PBCREP_Error *error = NULL;
+  size_t len = strlen (json);
+  for (size_t at = 0; at < len; at += max_feed)
+    if (!pbcrep_json_transcoder_feed (transcoder, MIN (max_feed, len - at),
+                                      (const uint8_t *) json + at, &out, &error))
+      assert(0);
+  if (!pbcrep_json_transcoder_end_feed (transcoder, &out, &error))
+    assert(0);
+  assert (pbcrep_json_transcoder_get_n_records (transcoder) == 1);
+  pbcrep_json_transcoder_destroy (transcoder);
+  *len_out = out.size;
+  uint8_t *rv = malloc (out.size);
+  pbcrep_buffer_read (&out, out.size, rv);
+  return rv;
+}
+
+static void
+test_transcode (void)
+{
+  PBCREP_Parser *parser = pbcrep_make_parser ("json", &foo__person__descriptor);
+  PBCREP_Printer *printer = pbcrep_make_printer ("length_prefixed_b128", &foo__person__descriptor);
+  PBCREP_Error *error = NULL;
+  if (!pbcrep_parser_feed (parser, strlen (basic_json__str),
+                           (const uint8_t *) basic_json__str, &error)
+   || !pbcrep_parser_end_feed (parser, &error))
+    assert(0);
+  pbcrep_parser_advance (parser);
+  assert (parser->current_message != NULL);
+  if (!pbcrep_printer_print (printer, parser->current_message, &error))
+    assert(0);
+  size_t expected_len = printer->output_data.size;
+  uint8_t *expected = malloc (expected_len);
+  pbcrep_buffer_read (&printer->output_data, expected_len, expected);
+  pbcrep_printer_destroy (printer);
+  pbcrep_parser_destroy (parser);
+
+  for (unsigned size_i = 0; size_i < N_ELEMENTS(test_sizes); size_i++)
+    {
+      size_t len;
+      uint8_t *got = transcode (basic_json__str, test_sizes[size_i], &len);
+      assert (len == expected_len);
+      assert (memcmp (got, expected, len) == 0);
+      free (got);
+    }
+  free (expected);
+
+  // Missing required fields come last, so just check the contents.
+  size_t len;
+  uint8_t *got = transcode (long_int_array__str, 13, &len);
+  assert (len > 2 && got[0] >= 0x80 && got[1] < 0x80);
+  assert ((size_t) ((got[0] & 0x7f) | (got[1] << 7)) == len - 2);
+  Foo__Person *person = foo__person__unpack (NULL, len - 2, got + 2);
+  assert (person != NULL);
+  assert (strcmp (person->name, "") == 0);
+  assert (person->id == 0);
+  assert (person->n_test_ints == 1000);
+  assert (person->test_ints[0] == 1);
+  assert (person->test_ints[1] == 33);
+  foo__person__free_unpacked (person, NULL);
+  free (got);
+}
+
+// Printing straight from the wire format must match
+// printing the unpacked message.
+static void
+test_print_packed (void)
+{
+  const char *jsons[] = { basic_json__str, long_int_array__str, empty_object__str };
+  for (unsigned i = 0; i < N_ELEMENTS(jsons); i++)
+    {
+      PBCREP_Printer *printer = pbcrep_make_printer ("json", &foo__person__descriptor);
+      PBCREP_Error *error = NULL;
+      size_t len;
+      uint8_t *packed = transcode (jsons[i], 4096, &len);
+      unsigned prefix_len = 1;
+      while (packed[prefix_len - 1] >= 0x80)
+        prefix_len++;
+      Foo__Person *person = foo__person__unpack (NULL, len - prefix_len, packed + prefix_len);
+      assert (person != NULL);
+      if (!pbcrep_printer_print (printer, &person->base, &error))
+        assert(0);
+      char *expected = pbcrep_buffer_empty_to_string (&printer->output_data);
+      foo__person__free_unpacked (person, NULL);
+
+      assert (pbcrep_printer_is_json (printer, NULL));
+      if (!pbcrep_printer_json_print_packed (printer, len - prefix_len,
+                                             packed + prefix_len, &error))
+        assert(0);
+      char *got = pbcrep_buffer_empty_to_string (&printer->output_data);
+      assert (strcmp (got, expected) == 0);
+
+      // Truncated:  an error, and nothing printed.
+      assert (len > prefix_len);
+      assert (!pbcrep_printer_json_print_packed (printer, len - prefix_len - 1,
+                                                 packed + prefix_len, &error));
+      assert (strcmp (error->error_code_str, "PROTOBUF_MALFORMED") == 0);
+      pbcrep_error_destroy (error);
+      assert (printer->output_data.size == 0);
+
+      pbcrep_free (got);
+      pbcrep_free (expected);
+      free (packed);
+      pbcrep_printer_destroy (printer);
+    }
+
+  // Mixed records, compact and formatted.
+  Record records[N_MIXED_RECORDS];
+  make_mixed_records (records);
+  for (unsigned formatted = 0; formatted < 2; formatted++)
+    {
+      PBCREP_JSON_PrinterOptions options = { .formatted = formatted };
+      PBCREP_Printer *printer = pbcrep_printer_new_json (&foo__mixed__descriptor, &options);
+      for (unsigned i = 0; i < N_MIXED_RECORDS; i++)
+        {
+          PBCREP_Error *error = NULL;
+          Foo__Mixed *mixed = foo__mixed__unpack (NULL, records[i].len, records[i].data);
+          assert (mixed != NULL);
+          if (!pbcrep_printer_print (printer, &mixed->base, &error))
+            assert(0);
+          char *expected = pbcrep_buffer_empty_to_string (&printer->output_data);
+          foo__mixed__free_unpacked (mixed, NULL);
+          if (!pbcrep_printer_json_print_packed (printer, records[i].len,
+                                                 records[i].data, &error))
+            assert(0);
+          char *got = pbcrep_buffer_empty_to_string (&printer->output_data);
+          assert (strcmp (got, expected) == 0);
+          pbcrep_free (got);
+          pbcrep_free (expected);
+
+          if (records[i].len == 0)
+            continue;
+          assert (!pbcrep_printer_json_print_packed (printer, records[i].len - 1,
+                                                     records[i].data, &error));
+          assert (strcmp (error->error_code_str, "PROTOBUF_MALFORMED") == 0);
+          pbcrep_error_destroy (error);
+          assert (printer->output_data.size == 0);
+        }
+      pbcrep_printer_destroy (printer);
+    }
+  free_mixed_records (records);
+
+  PBCREP_Printer *printer = pbcrep_make_printer ("json", &foo__mixed__descriptor);
+  PBCREP_Error *error = NULL;
+  Record bad[N_HIDDEN_BAD_RECORDS];
+  make_hidden_bad_records (bad);
+  for (unsigned i = 0; i < N_HIDDEN_BAD_RECORDS; i++)
+    {
+      assert (!pbcrep_printer_json_print_packed (printer, bad[i].len, bad[i].data, &error));
+      assert (strcmp (error->error_code_str, "PROTOBUF_MALFORMED") == 0);
+      pbcrep_error_destroy (error);
+      assert (printer->output_data.size == 0);
+      free (bad[i].data);
+    }
+  pbcrep_printer_destroy (printer);
+}
+
+static unsigned
+person_field_id (const char *name)
+{
+  return protobuf_c_message_descriptor_get_field_by_name (&foo__person__descriptor, name)->id;
+}
+
+static bool view_matches (PBCREP_MessageView *view, const ProtobufCMessage *message);
+
+// 'got' is as the view gives it, 'member' as the message holds it.
+static bool
+view_value_matches (const ProtobufCFieldDescriptor *f, const void *got, const void *member)
+{
+  switch (f->type)
+    {
+    case PROTOBUF_C_TYPE_MESSAGE:
+      {
+        PBCREP_MessageView *sub = * (PBCREP_MessageView * const *) got;
+        const ProtobufCMessage *m = * (const ProtobufCMessage * const *) member;
+        if (m == NULL)
+          return sub == NULL;
+        return sub != NULL && view_matches (sub, m);
+      }
+    case PROTOBUF_C_TYPE_STRING:
+      {
+        const ProtobufCBinaryData *bd = got;
+        const char *str = * (const char * const *) member;
+        if (str == NULL)
+          str = "";
+        return bd->len == strlen (str) && memcmp (bd->data, str, bd->len) == 0;
+      }
+    case PROTOBUF_C_TYPE_BYTES:
+      {
+        const ProtobufCBinaryData *a = got, *b = member;
+        return a->len == b->len && (a->len == 0 || memcmp (a->data, b->data, a->len) == 0);
+      }
+    default:
+      return memcmp (got, member, pbcrep_wire_member_size (f->type)) == 0;
+    }
+}
+
+// Whether the view gives every field as 'message' holds it.
+static bool
+view_matches (PBCREP_MessageView *view, const ProtobufCMessage *message)
+{
+  const ProtobufCMessageDescriptor *desc = message->descriptor;
+  PBCREP_Error *error = NULL;
+  for (unsigned i = 0; i < desc->n_fields; i++)
+    {
+      const ProtobufCFieldDescriptor *f = desc->fields + i;
+      const char *member = (const char *) message + f->offset;
+      const void *quantifier = (const char *) message + f->quantifier_offset;
+      size_t count;
+      if (!pbcrep_message_view_get_count (view, f->id, &count, &error))
+        assert(0);
+      if (f->label == PROTOBUF_C_LABEL_REPEATED)
+        {
+          size_t n;
+          const void *values;
+          if (!pbcrep_message_view_get_values (view, f->id, &n, &values, &error))
+            assert(0);
+          if (n != count || n != * (const size_t *) quantifier)
+            return false;
+          size_t got_size = f->type == PROTOBUF_C_TYPE_STRING || f->type == PROTOBUF_C_TYPE_BYTES
+                          ? sizeof (ProtobufCBinaryData)
+                          : pbcrep_wire_member_size (f->type);
+          const char *array = * (const char * const *) member;
+          for (size_t j = 0; j < n; j++)
+            if (!view_value_matches (f, (const char *) values + j * got_size,
+                                     array + j * pbcrep_wire_member_size (f->type)))
+              return false;
+          continue;
+        }
+
+      bool present;
+      if (f->flags & PROTOBUF_C_FIELD_FLAG_ONEOF)
+        present = * (const uint32_t *) quantifier == f->id;
+      else if (f->type == PROTOBUF_C_TYPE_MESSAGE || f->type == PROTOBUF_C_TYPE_STRING)
+        present = * (const void * const *) member != NULL;
+      else if (f->label == PROTOBUF_C_LABEL_OPTIONAL)
+        present = * (const protobuf_c_boolean *) quantifier;
+      else
+        present = true;
+      if (count != present)
+        return false;
+      // another oneof member is in the union
+      if (!present && (f->flags & PROTOBUF_C_FIELD_FLAG_ONEOF))
+        continue;
+      union {
+        ProtobufCBinaryData bd;
+        PBCREP_MessageView *view;
+        uint64_t u64;
+        double d;
+      } value;
+      if (!pbcrep_message_view_get_value (view, f->id, &value, &error))
+        assert(0);
+      if (!view_value_matches (f, &value, member))
+        return false;
+    }
+  return true;
+}
+
+static void
+test_message_view (void)
+{
+  size_t len;
+  uint8_t *frame = transcode (basic_json__str, 4096, &len);
+  PBCREP_Error *error = NULL;
+  size_t frame_size;
+  PBCREP_MessageView *view = pbcrep_message_view_new_from_frame (&foo__person__descriptor,
+                                                                 PBCREP_LENGTH_PREFIXED_B128,
+                                                                 len, frame, &frame_size,
+                                                                 &error);
+  assert (view != NULL);
+  assert (frame_size == len);
+
+  int32_t id;
+  if (!pbcrep_message_view_get_value (view, person_field_id ("id"), &id, &error))
+    assert(0);
+  assert (id == 42);
+  ProtobufCBinaryData name;
+  if (!pbcrep_message_view_get_value (view, person_field_id ("name"), &name, &error))
+    assert(0);
+  assert (name.len == 5 && memcmp (name.data, "daveb", 5) == 0);
+
+  size_t n;
+  const void *values;
+  if (!pbcrep_message_view_get_values (view, person_field_id ("test_ints"), &n, &values, &error))
+    assert(0);
+  assert (n == 3);
+  assert (((const int32_t *) values)[2] == 3);
+
+  if (!pbcrep_message_view_get_values (view, person_field_id ("phone"), &n, &values, &error))
+    assert(0);
+  assert (n == 2);
+  PBCREP_MessageView *phone = ((PBCREP_MessageView * const *) values)[1];
+  const ProtobufCFieldDescriptor *type_field =
+    protobuf_c_message_descriptor_get_field_by_name (&foo__person__phone_number__descriptor, "type");
+  int32_t type;
+  if (!pbcrep_message_view_get_value (phone, type_field->id, &type, &error))
+    assert(0);
+  assert (type == FOO__PERSON__PHONE_TYPE__WORK);
+
+  assert (!pbcrep_message_view_get_value (view, person_field_id ("phone"), &type, &error));
+  assert (strcmp (error->error_code_str, "BAD_FIELD_LABEL") == 0);
+  pbcrep_error_destroy (error);
+
+  pbcrep_message_view_destroy (view);
+  free (frame);
+
+  // long_int_array has a two-byte length-prefix.
+  frame = transcode (long_int_array__str, 4096, &len);
+  view = pbcrep_message_view_new_from_frame (&foo__person__descriptor,
+                                             PBCREP_LENGTH_PREFIXED_B128,
+                                             len, frame, &frame_size, &error);
+  assert (view != NULL);
+  assert (frame_size == len);
+  Foo__Person *person = foo__person__unpack (NULL, len - 2, frame + 2);
+  assert (view_matches (view, &person->base));
+  foo__person__free_unpacked (person, NULL);
+  pbcrep_message_view_destroy (view);
+  free (frame);
+
+  Record records[N_MIXED_RECORDS];
+  make_mixed_records (records);
+  for (unsigned i = 0; i < N_MIXED_RECORDS; i++)
+    {
+      view = pbcrep_message_view_new (&foo__mixed__descriptor, records[i].len, records[i].data);
+      Foo__Mixed *mixed = foo__mixed__unpack (NULL, records[i].len, records[i].data);
+      assert (mixed != NULL);
+      assert (view_matches (view, &mixed->base));
+      foo__mixed__free_unpacked (mixed, NULL);
+      pbcrep_message_view_destroy (view);
+
+      if (records[i].len == 0)
+        continue;
+      view = pbcrep_message_view_new (&foo__mixed__descriptor, records[i].len - 1, records[i].data);
+      assert (!pbcrep_message_view_index (view, &error));
+      assert (strcmp (error->error_code_str, "PROTOBUF_MALFORMED") == 0);
+      pbcrep_error_destroy (error);
+      pbcrep_message_view_destroy (view);
+    }
+  free_mixed_records (records);
+}
+
+static void
+test_field_path (void)
+{
+  size_t len;
+  uint8_t *frame = transcode (basic_json__str, 4096, &len);
+  PBCREP_Error *error = NULL;
+  PBCREP_FieldPath *id_path = pbcrep_field_path_new (&foo__person__descriptor, "id", &error);
+  PBCREP_FieldPath *email_path = pbcrep_field_path_new (&foo__person__descriptor, "email", &error);
+  assert (id_path != NULL && email_path != NULL);
+
+  // skip the one-byte length-prefix
+  assert (frame[0] == len - 1);
+  int32_t id;
+  bool found;
+  if (!pbcrep_field_path_extract (id_path, len - 1, frame + 1, &id, &found, &error))
+    assert(0);
+  assert (found && id == 42);
+  ProtobufCBinaryData email;
+  if (!pbcrep_field_path_extract (email_path, len - 1, frame + 1, &email, &found, &error))
+    assert(0);
+  assert (found && email.len == 13 && memcmp (email.data, "dave@dave.com", 13) == 0);
+
+  assert (pbcrep_field_path_new (&foo__person__descriptor, "phone.number", &error) == NULL);
+  assert (strcmp (error->error_code_str, "BAD_FIELD_PATH") == 0);
+  pbcrep_error_destroy (error);
+
+  pbcrep_field_path_destroy (id_path);
+  pbcrep_field_path_destroy (email_path);
+  free (frame);
+}
+
+static uint64_t
+hash_key (const char *path_str, size_t len, const uint8_t *data)
+{
+  PBCREP_Error *error = NULL;
+  PBCREP_FieldPath *path = pbcrep_field_path_new (&foo__mixed__descriptor, path_str, &error);
+  assert (path != NULL);
+  uint64_t hash;
+  if (!pbcrep_field_path_hash (path, len, data, &hash, &error))
+    assert(0);
+  pbcrep_field_path_destroy (path);
+  return hash;
+}
+
+static size_t
+pack_mixed (const Foo__Mixed *mixed, uint8_t *out)
+{
+  assert (foo__mixed__get_packed_size (mixed) <= 128);
+  return foo__mixed__pack (mixed, out);
+}
+
+/* Equal keys hash equally however they are encoded:  as int32 or
+ * sint32, in canonical or over-long varints, after other values of
+ * the field, among packed and unknown fields, or in a sub-message
+ * that is merged from several occurrences. */
+static void
+test_field_path_hash (void)
+{
+  static const int32_t values[] = { 0, 1, -1, 5, 300, -300, INT32_MAX, INT32_MIN };
+  uint64_t hashes[N_ELEMENTS(values)];
+  for (unsigned i = 0; i < N_ELEMENTS(values); i++)
+    {
+      int32_t v = values[i];
+      uint8_t buf[256];
+      size_t len;
+
+      // int32, among packed and unknown fields
+      Foo__Mixed mixed = FOO__MIXED__INIT;
+      int32_t ints[2] = { v, v ^ 1 };
+      mixed.n_packed_ints = 2;
+      mixed.packed_ints = ints;
+      mixed.has_i32 = true;
+      mixed.i32 = v;
+      len = pack_mixed (&mixed, buf);
+      len += pbcrep_wire_encode_varint (100 << 3 | PBCREP_WIRE_TYPE_VARINT, buf + len);
+      buf[len++] = 1;
+      uint64_t h = hash_key ("i32", len, buf);
+      hashes[i] = h;
+
+      // sint32
+      foo__mixed__init (&mixed);
+      mixed.has_s32 = true;
+      mixed.s32 = v;
+      len = pack_mixed (&mixed, buf);
+      assert (hash_key ("s32", len, buf) == h);
+
+      // an over-long varint, after another value
+      len = 0;
+      buf[len++] = 9 << 3 | PBCREP_WIRE_TYPE_VARINT;
+      len += pbcrep_wire_encode_varint ((uint64_t) (int64_t) (v ^ 1), buf + len);
+      buf[len++] = 9 << 3 | PBCREP_WIRE_TYPE_VARINT;
+      unsigned n = pbcrep_wire_encode_varint ((uint32_t) v, buf + len);
+      buf[len + n - 1] |= 0x80;
+      buf[len + n] = 0;
+      len += n + 1;
+      assert (hash_key ("i32", len, buf) == h);
+
+      // in a sub-message, whole or merged from two occurrences
+      Foo__Mixed child = FOO__MIXED__INIT;
+      child.has_i32 = true;
+      child.i32 = v;
+      foo__mixed__init (&mixed);
+      mixed.child = &child;
+      len = pack_mixed (&mixed, buf);
+      assert (hash_key ("child.i32", len, buf) == h);
+      child.has_i32 = false;
+      child.has_d = true;
+      child.d = 1.5;
+      len += pack_mixed (&mixed, buf + len);
+      assert (hash_key ("child.i32", len, buf) == h);
+
+      for (unsigned j = 0; j < i; j++)
+        assert (hashes[j] != h);
+    }
+}
+
+static void
+test_unpacker (void)
+{
+  size_t len;
+  uint8_t *frame = transcode (basic_json__str, 4096, &len);
+  PBCREP_Error *error = NULL;
+  PBCREP_Plan *plan = pbcrep_plan_new (&foo__person__descriptor);
+  PBCREP_Unpacker *unpacker = pbcrep_unpacker_new (plan);
+  pbcrep_plan_unref (plan);
+
+  // skip the one-byte length-prefix
+  assert (frame[0] == len - 1);
+  Foo__Person *person = (Foo__Person *) pbcrep_unpacker_unpack (unpacker, len - 1, frame + 1, &error);
+  assert (person != NULL);
+  Foo__Person *expected = foo__person__unpack (NULL, len - 1, frame + 1);
+  assert (strcmp (person->name, expected->name) == 0);
+  assert (person->id == expected->id);
+  assert (strcmp (person->email, expected->email) == 0);
+  assert (person->n_phone == expected->n_phone);
+  for (size_t i = 0; i < person->n_phone; i++)
+    {
+      assert (strcmp (person->phone[i]->number, expected->phone[i]->number) == 0);
+      assert (person->phone[i]->type == expected->phone[i]->type);
+    }
+  assert (person->n_test_ints == expected->n_test_ints);
+  assert (memcmp (person->test_ints, expected->test_ints, sizeof (int32_t) * person->n_test_ints) == 0);
+  foo__person__free_unpacked (expected, NULL);
+  pbcrep_unpacker_free_message (&person->base);
+
+  assert (pbcrep_unpacker_unpack (unpacker, len - 2, frame + 1, &error) == NULL);
+  assert (strcmp (error->error_code_str, "PROTOBUF_MALFORMED") == 0);
+  pbcrep_error_destroy (error);
+  free (frame);
+
+  // long_int_array has a two-byte length-prefix.
+  frame = transcode (long_int_array__str, 4096, &len);
+  person = (Foo__Person *) pbcrep_unpacker_unpack (unpacker, len - 2, frame + 2, &error);
+  assert (person != NULL);
+  expected = foo__person__unpack (NULL, len - 2, frame + 2);
+  assert (messages_equal (&person->base, &expected->base));
+  foo__person__free_unpacked (expected, NULL);
+  pbcrep_unpacker_free_message (&person->base);
+  pbcrep_unpacker_destroy (unpacker);
+  free (frame);
+
+  plan = pbcrep_plan_new (&foo__mixed__descriptor);
+  unpacker = pbcrep_unpacker_new (plan);
+  pbcrep_plan_unref (plan);
+  Record records[N_MIXED_RECORDS];
+  make_mixed_records (records);
+  for (unsigned i = 0; i < N_MIXED_RECORDS; i++)
+    {
+      ProtobufCMessage *got = pbcrep_unpacker_unpack (unpacker, records[i].len, records[i].data, &error);
+      assert (got != NULL);
+      Foo__Mixed *want = foo__mixed__unpack (NULL, records[i].len, records[i].data);
+      assert (want != NULL);
+      assert (messages_equal (got, &want->base));
+      foo__mixed__free_unpacked (want, NULL);
+      pbcrep_unpacker_free_message (got);
+    }
+  free_mixed_records (records);
+
+  Record bad[N_HIDDEN_BAD_RECORDS];
+  make_hidden_bad_records (bad);
+  for (unsigned i = 0; i < N_HIDDEN_BAD_RECORDS; i++)
+    {
+      assert (pbcrep_unpacker_unpack (unpacker, bad[i].len, bad[i].data, &error) == NULL);
+      assert (strcmp (error->error_code_str, "PROTOBUF_MALFORMED") == 0);
+      pbcrep_error_destroy (error);
+      free (bad[i].data);
+    }
+  pbcrep_unpacker_destroy (unpacker);
+}
+
+static size_t largest_malloc;
+static void *(*counted_malloc_next) (size_t size);
+
+static void *
+counted_malloc (size_t size)
+{
+  if (size > largest_malloc)
+    largest_malloc = size;
+  return counted_malloc_next (size);
+}
+
+/* After a message that unpacks to many times its size, a large
+ * message mustn't get a first block sized by that ratio. */
+static void
+test_unpacker_arena (void)
+{
+  PBCREP_Plan *plan = pbcrep_plan_new (&foo__mixed__descriptor);
+  PBCREP_Unpacker *unpacker = pbcrep_unpacker_new (plan);
+  pbcrep_plan_unref (plan);
+  PBCREP_Error *error = NULL;
+
+  // Empty children:  two bytes each, a whole Mixed unpacked.
+  Record rec = { NULL, 0, 0 };
+  for (unsigned i = 0; i < 1000; i++)
+    {
+      record_append_tag (&rec, 15, PBCREP_WIRE_TYPE_LENGTH_PREFIXED);
+      record_append_varint (&rec, 0);
+    }
+  ProtobufCMessage *msg = pbcrep_unpacker_unpack (unpacker, rec.len, rec.data, &error);
+  assert (msg != NULL);
+  assert (((Foo__Mixed *) msg)->n_children == 1000);
+  pbcrep_unpacker_free_message (msg);
+
+  // A megabyte of blob.
+  rec.len = 0;
+  record_append_tag (&rec, 16, PBCREP_WIRE_TYPE_LENGTH_PREFIXED);
+  record_append_varint (&rec, 1 << 20);
+  size_t start = rec.len;
+  for (unsigned i = 0; i < (1 << 20) / 8; i++)
+    record_append (&rec, 8, "blobblob");
+  largest_malloc = 0;
+  counted_malloc_next = pbcrep_malloc;
+  pbcrep_malloc = counted_malloc;
+  msg = pbcrep_unpacker_unpack (unpacker, rec.len, rec.data, &error);
+  pbcrep_malloc = counted_malloc_next;
+  assert (msg != NULL);
+  const Foo__Mixed *mixed = (const Foo__Mixed *) msg;
+  assert (mixed->has_blob && mixed->blob.len == 1 << 20);
+  assert (memcmp (mixed->blob.data, rec.data + start, 1 << 20) == 0);
+  assert (largest_malloc < 2 * rec.len);
+  pbcrep_unpacker_free_message (msg);
+
+  free (rec.data);
+  pbcrep_unpacker_destroy (unpacker);
+}
+
+/* The packer must give what protobuf_c_message_pack() gives,
+ * appending to what is in the buffer;  packed in one go or
+ * measured first. */
+static void
+check_packer (PBCREP_Packer *packer, const ProtobufCMessage *message)
+{
+  size_t expected_size = protobuf_c_message_get_packed_size (message);
+  uint8_t *expected = malloc (expected_size + 1);
+  protobuf_c_message_pack (message, expected);
+  uint8_t *got = malloc (expected_size + 3);
+  for (unsigned measure_first = 0; measure_first < 2; measure_first++)
+    {
+      PBCREP_Buffer buffer = PBCREP_BUFFER_INIT;
+      pbcrep_buffer_append_small (&buffer, 3, "abc");
+      if (measure_first)
+        {
+          assert (pbcrep_packer_measure (packer, message) == expected_size);
+          pbcrep_packer_pack_measured (packer, message, &buffer);
+        }
+      else
+        assert (pbcrep_packer_pack (packer, message, &buffer) == expected_size);
+      assert (buffer.size == expected_size + 3);
+      pbcrep_buffer_read (&buffer, expected_size + 3, got);
+      assert (memcmp (got, "abc", 3) == 0);
+      assert (memcmp (got + 3, expected, expected_size) == 0);
+    }
+  free (got);
+  free (expected);
+}
+
+static void
+test_packer (void)
+{
+  size_t len;
+  uint8_t *frame = transcode (basic_json__str, 4096, &len);
+  Foo__Person *person = foo__person__unpack (NULL, len - 1, frame + 1);
+  assert (person != NULL);
+
+  size_t expected_size = protobuf_c_message_get_packed_size (&person->base);
+  uint8_t *expected = malloc (expected_size);
+  protobuf_c_message_pack (&person->base, expected);
+
+  PBCREP_Packer *packer = pbcrep_packer_new ();
+  PBCREP_Buffer buffer = PBCREP_BUFFER_INIT;
+  assert (pbcrep_packer_pack (packer, &person->base, &buffer) == expected_size);
+  assert (buffer.size == expected_size);
+  uint8_t *packed = malloc (expected_size);
+  pbcrep_buffer_read (&buffer, expected_size, packed);
+  assert (memcmp (packed, expected, expected_size) == 0);
+  pbcrep_packer_destroy (packer);
+
+  free (packed);
+  free (expected);
+  foo__person__free_unpacked (person, NULL);
+  free (frame);
+
+  packer = pbcrep_packer_new ();
+
+  // long_int_array has a two-byte length-prefix.
+  frame = transcode (long_int_array__str, 4096, &len);
+  person = foo__person__unpack (NULL, len - 2, frame + 2);
+  check_packer (packer, &person->base);
+  foo__person__free_unpacked (person, NULL);
+  free (frame);
+
+  // Packed, oneof, unknown, merged and large.
+  Record records[N_MIXED_RECORDS];
+  make_mixed_records (records);
+  for (unsigned i = 0; i < N_MIXED_RECORDS; i++)
+    {
+      Foo__Mixed *mixed = foo__mixed__unpack (NULL, records[i].len, records[i].data);
+      assert (mixed != NULL);
+      check_packer (packer, &mixed->base);
+      foo__mixed__free_unpacked (mixed, NULL);
+    }
+  free_mixed_records (records);
+
+  // Packed fields around PACKED_BATCH (64) values, of each kind.
+  static const unsigned counts[] = { 1, 63, 64, 65, 127, 128, 129, 1000 };
+  int32_t ints[1000];
+  int64_t sints[1000];
+  uint32_t fixed[1000];
+  double doubles[1000];
+  protobuf_c_boolean bools[1000];
+  for (unsigned i = 0; i < 1000; i++)
+    {
+      // large values on some batches only
+      ints[i] = (i / 64) % 2 ? (int32_t) (i * 2654435761u) : (int32_t) i;
+      sints[i] = (i / 64) % 2 ? -((int64_t) i << 40) : -(int64_t) i;
+      fixed[i] = i * 2654435761u;
+      doubles[i] = i / 7.0;
+      bools[i] = i % 3 == 0;
+    }
+  for (unsigned c = 0; c < N_ELEMENTS(counts); c++)
+    {
+      Foo__Mixed mixed = FOO__MIXED__INIT;
+      mixed.n_packed_ints = counts[c];
+      mixed.packed_ints = ints;
+      mixed.n_packed_sints = counts[c];
+      mixed.packed_sints = sints;
+      mixed.n_packed_fixed = counts[c];
+      mixed.packed_fixed = fixed;
+      mixed.n_packed_doubles = counts[c];
+      mixed.packed_doubles = doubles;
+      mixed.n_packed_bools = counts[c];
+      mixed.packed_bools = bools;
+      mixed.n_ints = counts[c];
+      mixed.ints = ints;
+      check_packer (packer, &mixed.base);
+    }
+
+  // Deeply nested, with sub-messages and packed fields at every level,
+  // before and after the nested one, so that the sizes of both are
+  // interleaved in the side array;  the outer levels' lengths take
+  // several bytes.
+  enum { DEPTH = 60 };
+  Foo__Mixed levels[DEPTH];
+  Foo__Mixed leaves[DEPTH];
+  Foo__Mixed *children[DEPTH][2];
+  for (unsigned i = 0; i < DEPTH; i++)
+    {
+      foo__mixed__init (levels + i);
+      foo__mixed__init (leaves + i);
+      leaves[i].n_packed_ints = 20 + i % 5;
+      leaves[i].packed_ints = ints + 60;
+      leaves[i].str = i % 2 ? "leaf" : NULL;
+      levels[i].n_packed_ints = i % 7;
+      levels[i].packed_ints = ints + 120;
+      levels[i].n_packed_doubles = 10 + i % 3;
+      levels[i].packed_doubles = doubles;
+      levels[i].child = i + 1 < DEPTH ? levels + i + 1 : NULL;
+      children[i][0] = leaves + i;
+      children[i][1] = leaves + (DEPTH - 1 - i);
+      levels[i].n_children = 2;
+      levels[i].children = children[i];
+      levels[i].n_packed_sints = i % 4;
+      levels[i].packed_sints = sints + 64;
+      if (i % 3 == 0)
+        {
+          levels[i].choice_case = FOO__MIXED__CHOICE_CHOICE_INT;
+          levels[i].choice_int = i;
+        }
+    }
+  assert (foo__mixed__get_packed_size (levels) > 16384);
+  check_packer (packer, &levels[0].base);
+
+  pbcrep_packer_destroy (packer);
+}
+
+/* A message too long for a fixed-width length-prefix is refused,
+ * and nothing is printed. */
+static void
+test_print_length_prefixed_too_long (void)
+{
+  static const struct {
+    const char *repstr;
+    size_t max_length;
+  } formats[] = {
+    { "length_prefixed_u8", 0xff },
+    { "length_prefixed_u16_le", 0xffff },
+    { "length_prefixed_u16_be", 0xffff },
+  };
+  uint8_t *blob = calloc (1, 0x10000);
+  for (unsigned i = 0; i < N_ELEMENTS(formats); i++)
+    {
+      PBCREP_Printer *printer = pbcrep_make_printer (formats[i].repstr, &foo__mixed__descriptor);
+      PBCREP_Error *error = NULL;
+      Foo__Mixed mixed = FOO__MIXED__INIT;
+      mixed.has_blob = true;
+      mixed.blob.data = blob;
+      mixed.blob.len = formats[i].max_length - 8;
+      while (foo__mixed__get_packed_size (&mixed) < formats[i].max_length)
+        mixed.blob.len++;
+      assert (foo__mixed__get_packed_size (&mixed) == formats[i].max_length);
+      if (!pbcrep_printer_print (printer, &mixed.base, &error))
+        assert(0);
+      size_t printed = printer->output_data.size;
+      assert (printed > formats[i].max_length);
+
+      mixed.blob.len++;
+      assert (!pbcrep_printer_print (printer, &mixed.base, &error));
+      assert (strcmp (error->error_code_str, "MESSAGE_TOO_LONG") == 0);
+      pbcrep_error_destroy (error);
+      assert (printer->output_data.size == printed);
+      pbcrep_printer_destroy (printer);
+    }
+  free (blob);
+}
+
+static void
+test_validate_wire (void)
+{
+  size_t len;
+  uint8_t *frame = transcode (basic_json__str, 4096, &len);
+  PBCREP_Error *error = NULL;
+
+  // skip the one-byte length-prefix
+  assert (frame[0] == len - 1);
+  if (!pbcrep_validate_wire (&foo__person__descriptor, len - 1, frame + 1, &error))
+    assert(0);
+  assert (!pbcrep_validate_wire (&foo__person__descriptor, len - 2, frame + 1, &error));
+  assert (strcmp (error->error_code_str, "PROTOBUF_MALFORMED") == 0);
+  pbcrep_error_destroy (error);
+
+  // the first field is the name, "daveb":  make it bad UTF-8
+  assert (frame[3] == 'd');
+  frame[3] = 0xc0;
+  assert (!pbcrep_validate_wire (&foo__person__descriptor, len - 1, frame + 1, &error));
+  assert (strcmp (error->error_code_str, "BAD_UTF8") == 0);
+  pbcrep_error_destroy (error);
+  frame[3] = 'd';
+
+  PBCREP_Parser *parser = pbcrep_parser_new_length_prefixed (PBCREP_LENGTH_PREFIXED_B128,
+                                                             &foo__person__descriptor);
+  pbcrep_parser_length_prefixed_set_validate_only (parser, true);
+  for (unsigned i = 0; i < 3; i++)
+    if (!pbcrep_parser_feed (parser, len, frame, &error))
+      assert(0);
+  if (!pbcrep_parser_end_feed (parser, &error))
+    assert(0);
+  pbcrep_parser_advance (parser);
+  assert (parser->current_message == NULL);
+  assert (pbcrep_parser_length_prefixed_get_n_validated (parser) == 3);
+  pbcrep_parser_destroy (parser);
+  free (frame);
+
+  // long_int_array has a two-byte length-prefix.
+  frame = transcode (long_int_array__str, 4096, &len);
+  if (!pbcrep_validate_wire (&foo__person__descriptor, len - 2, frame + 2, &error))
+    assert(0);
+  free (frame);
+
+  Record records[N_MIXED_RECORDS];
+  make_mixed_records (records);
+  for (unsigned i = 0; i < N_MIXED_RECORDS; i++)
+    {
+      if (!pbcrep_validate_wire (&foo__mixed__descriptor, records[i].len, records[i].data, &error)
+       || !pbcrep_validate_wire_unpackable (&foo__mixed__descriptor, records[i].len, records[i].data, &error))
+        assert(0);
+      if (records[i].len == 0)
+        continue;
+      assert (!pbcrep_validate_wire (&foo__mixed__descriptor, records[i].len - 1, records[i].data, &error));
+      assert (strcmp (error->error_code_str, "PROTOBUF_MALFORMED") == 0);
+      pbcrep_error_destroy (error);
+    }
+  free_mixed_records (records);
+
+  // Broken records:  protobuf-c must reject them too,
+  // except for bad UTF-8, which it doesn't check.
+  static const char *codes[] = {
+    "PROTOBUF_MALFORMED", "PROTOBUF_MALFORMED", "PROTOBUF_MALFORMED",
+    "PROTOBUF_MALFORMED", "BAD_UTF8"
+  };
+  Record bad[N_ELEMENTS(codes)];
+  memset (bad, 0, sizeof (bad));
+
+  // packed fixed32 of 3 bytes
+  record_append_tag (bad + 0, 6, PBCREP_WIRE_TYPE_LENGTH_PREFIXED);
+  record_append_varint (bad + 0, 3);
+  record_append (bad + 0, 3, "abc");
+
+  // packed varints, the last unfinished
+  record_append_tag (bad + 1, 3, PBCREP_WIRE_TYPE_LENGTH_PREFIXED);
+  record_append_varint (bad + 1, 2);
+  record_append (bad + 1, 2, "\1\x80");
+
+  // an int32 as a 64-bit value
+  record_append_tag (bad + 2, 9, PBCREP_WIRE_TYPE_64BIT);
+  record_append (bad + 2, 8, "abcdefgh");
+
+  // a oneof Person without its required id, after another member
+  Foo__Mixed mixed = FOO__MIXED__INIT;
+  mixed.choice_case = FOO__MIXED__CHOICE_CHOICE_INT;
+  mixed.choice_int = 1;
+  record_append_mixed (bad + 3, &mixed);
+  record_append_tag (bad + 3, 13, PBCREP_WIRE_TYPE_LENGTH_PREFIXED);
+  record_append_varint (bad + 3, 3);
+  record_append (bad + 3, 3, "\12\1x");
+
+  // bad UTF-8 in a Person, in a oneof, in a sub-message
+  Foo__Person person = FOO__PERSON__INIT;
+  person.name = "\xc0\x80";
+  person.id = 1;
+  Foo__Mixed child = FOO__MIXED__INIT;
+  child.choice_case = FOO__MIXED__CHOICE_CHOICE_PERSON;
+  child.choice_person = &person;
+  foo__mixed__init (&mixed);
+  mixed.child = &child;
+  record_append_mixed (bad + 4, &mixed);
+
+  for (unsigned i = 0; i < N_ELEMENTS(codes); i++)
+    {
+      assert (!pbcrep_validate_wire (&foo__mixed__descriptor, bad[i].len, bad[i].data, &error));
+      assert (strcmp (error->error_code_str, codes[i]) == 0);
+      pbcrep_error_destroy (error);
+      bool unpackable = pbcrep_validate_wire_unpackable (&foo__mixed__descriptor,
+                                                         bad[i].len, bad[i].data, NULL);
+      assert (unpackable == (strcmp (codes[i], "BAD_UTF8") == 0));
+      Foo__Mixed *unpacked = foo__mixed__unpack (NULL, bad[i].len, bad[i].data);
+      assert ((unpacked != NULL) == unpackable);
+      if (unpacked != NULL)
+        foo__mixed__free_unpacked (unpacked, NULL);
+      free (bad[i].data);
+    }
+}
+
+static void
+test_frame_index (void)
+{
+  size_t len;
+  uint8_t *frame = transcode (basic_json__str, 4096, &len);
+  PBCREP_Error *error = NULL;
+
+  uint8_t *data = malloc (len * 3);
+  for (unsigned i = 0; i < 3; i++)
+    memcpy (data + len * i, frame, len);
+
+  PBCREP_FrameIndex *index = pbcrep_frame_index_build (PBCREP_LENGTH_PREFIXED_B128, 2,
+                                                       len * 3, data, &error);
+  if (index == NULL)
+    assert(0);
+  assert (index->n_records == 3);
+  assert (index->n_offsets == 2);
+  assert (index->offsets[0] == 0);
+  assert (index->offsets[1] == len * 2);
+  uint64_t n_skip;
+  assert (pbcrep_frame_index_seek (index, 1, &n_skip) == 0 && n_skip == 1);
+  assert (pbcrep_frame_index_seek (index, 2, &n_skip) == len * 2 && n_skip == 0);
+  uint64_t offsets[4], first_records[4];
+  assert (pbcrep_frame_index_split (index, 4, offsets, first_records) == 2);
+  assert (offsets[1] == len * 2 && first_records[1] == 2);
+
+  PBCREP_Buffer buffer = PBCREP_BUFFER_INIT;
+  pbcrep_frame_index_serialize (index, &buffer);
+  size_t index_len = buffer.size;
+  uint8_t *index_data = malloc (index_len);
+  pbcrep_buffer_read (&buffer, index_len, index_data);
+  pbcrep_buffer_clear (&buffer);
+  PBCREP_FrameIndex *parsed = pbcrep_frame_index_parse (index_len, index_data, &error);
+  if (parsed == NULL)
+    assert(0);
+  assert (parsed->n_records == 3 && parsed->stride == 2);
+  assert (parsed->offsets[1] == index->offsets[1]);
+  pbcrep_frame_index_destroy (parsed);
+  assert (pbcrep_frame_index_parse (index_len - 1, index_data, &error) == NULL);
+  assert (strcmp (error->error_code_str, "BAD_FRAME_INDEX") == 0);
+  pbcrep_error_destroy (error);
+  free (index_data);
+  pbcrep_frame_index_destroy (index);
+
+  assert (pbcrep_frame_index_build (PBCREP_LENGTH_PREFIXED_B128, 1,
+                                    len * 3 - 1, data, &error) == NULL);
+  assert (strcmp (error->error_code_str, "PARTIAL_RECORD") == 0);
+  pbcrep_error_destroy (error);
+  free (data);
+  free (frame);
+}
+
+/* Records on both sides of each prefix-size boundary, in every format;
+ * the index must agree with pbcrep_length_prefix_decode(). */
+static void
+test_frame_index_formats (void)
+{
+  static const size_t lengths[] = {
+    128, 1, 127, 129, 255, 256, 16383, 16384, 16385,
+    65535, 65536, 70000, 3, 0
+  };
+  PBCREP_Error *error = NULL;
+  for (unsigned f = 0; f < N_ELEMENTS(all_lp_formats); f++)
+    {
+      PBCREP_LengthPrefixed_Format format = all_lp_formats[f];
+      size_t max_length = pbcrep_length_prefix_max_length (format);
+      size_t data_alloced = 0;
+      for (unsigned i = 0; i < N_ELEMENTS(lengths); i++)
+        data_alloced += PBCREP_LENGTH_PREFIX_MAX_SIZE + lengths[i];
+      uint8_t *data = malloc (data_alloced);
+      size_t len = 0;
+      unsigned n_records = 0;
+      for (unsigned i = 0; i < N_ELEMENTS(lengths); i++)
+        {
+          if (lengths[i] > max_length)
+            continue;
+          len += pbcrep_length_prefix_encode (format, lengths[i], data + len);
+          for (size_t j = 0; j < lengths[i]; j++)
+            data[len++] = j * 31 + i;
+          n_records++;
+        }
+
+      // Where the records start, and where their bodies do.
+      size_t starts[N_ELEMENTS(lengths) + 1], bodies[N_ELEMENTS(lengths)];
+      size_t at = 0;
+      for (unsigned r = 0; r < n_records; r++)
+        {
+          size_t record_length;
+          int prefix_len = pbcrep_length_prefix_decode (format, len - at, data + at, &record_length);
+          assert (prefix_len > 0);
+          starts[r] = at;
+          bodies[r] = at + prefix_len;
+          at += prefix_len + record_length;
+        }
+      assert (at == len);
+      starts[n_records] = len;
+
+      for (unsigned stride = 1; stride <= 3; stride += 2)
+        {
+          PBCREP_FrameIndex *index = pbcrep_frame_index_build (format, stride, len, data, &error);
+          if (index == NULL)
+            assert(0);
+          assert (index->n_records == n_records);
+          assert (index->n_offsets == (n_records + stride - 1) / stride);
+          for (unsigned r = 0; r < n_records; r++)
+            {
+              uint64_t n_skip;
+              uint64_t offset = pbcrep_frame_index_seek (index, r, &n_skip);
+              assert (n_skip == r % stride);
+              assert (offset == starts[r - n_skip]);
+            }
+          pbcrep_frame_index_destroy (index);
+        }
+
+      // Cut inside each prefix and at the end of each body.
+      for (unsigned r = 0; r < n_records; r++)
+        {
+          size_t cuts[2] = { starts[r] + 1, starts[r + 1] - 1 };
+          for (unsigned c = 0; c < 2; c++)
+            {
+              size_t cut = cuts[c];
+              if (cut <= starts[r] || cut >= starts[r + 1])
+                continue;       // a one-byte record
+              const char *where = cut < bodies[r] ? "length-prefix" : "data body";
+              assert (pbcrep_frame_index_build (format, 1, cut, data, &error) == NULL);
+              assert (strcmp (error->error_code_str, "PARTIAL_RECORD") == 0);
+              assert (strstr (error->error_message, where) != NULL);
+              pbcrep_error_destroy (error);
+              assert (pbcrep_frame_index_build (format, 1, cut, data, NULL) == NULL);
+            }
+        }
+      free (data);
+    }
+
+  // A base-128 prefix of more than PBCREP_LENGTH_PREFIX_MAX_SIZE bytes.
+  uint8_t overlong[PBCREP_LENGTH_PREFIX_MAX_SIZE + 1];
+  memset (overlong, 0xff, PBCREP_LENGTH_PREFIX_MAX_SIZE);
+  overlong[PBCREP_LENGTH_PREFIX_MAX_SIZE] = 1;
+  PBCREP_LengthPrefixed_Format b128_formats[] = {
+    PBCREP_LENGTH_PREFIXED_B128, PBCREP_LENGTH_PREFIXED_B128_BE
+  };
+  for (unsigned f = 0; f < N_ELEMENTS(b128_formats); f++)
+    {
+      assert (pbcrep_frame_index_build (b128_formats[f], 1, sizeof (overlong), overlong, &error) == NULL);
+      assert (strcmp (error->error_code_str, "BAD_B128") == 0);
+      pbcrep_error_destroy (error);
+      assert (pbcrep_frame_index_build (b128_formats[f], 1, sizeof (overlong), overlong, NULL) == NULL);
+    }
+
+  assert (pbcrep_frame_index_parse (4, (const uint8_t *) "PBCR", NULL) == NULL);
+}
+
 static void
 usage (const char *prog_name)
 {
@@ -369,5 +2650,77 @@ int main(int argc, char **argv)
         }
       fprintf (stderr, " done.\n");
     }
+  fprintf (stderr, "Test slab adaptation: ");
+  test_slab_adaptation ();
+  fprintf (stderr, " done.\n");
+  fprintf (stderr, "Test print round-trip: ");
+  test_print_round_trip ();
+  fprintf (stderr, " done.\n");
+  fprintf (stderr, "Test print locale: ");
+  test_print_locale ();
+  fprintf (stderr, " done.\n");
+  fprintf (stderr, "Test print null required: ");
+  test_print_null_required ();
+  fprintf (stderr, " done.\n");
+  fprintf (stderr, "Test plan: ");
+  test_plan ();
+  fprintf (stderr, " done.\n");
+  fprintf (stderr, "Test factories: ");
+  test_factories ();
+  fprintf (stderr, " done.\n");
+  fprintf (stderr, "Test factory cache: ");
+  test_factory_cache ();
+  fprintf (stderr, " done.\n");
+  fprintf (stderr, "Test length-prefixed feed: ");
+  test_length_prefixed_feed ();
+  fprintf (stderr, " done.\n");
+  fprintf (stderr, "Test transcode: ");
+  test_transcode ();
+  fprintf (stderr, " done.\n");
+  fprintf (stderr, "Test print packed: ");
+  test_print_packed ();
+  fprintf (stderr, " done.\n");
+  fprintf (stderr, "Test message view: ");
+  test_message_view ();
+  fprintf (stderr, " done.\n");
+  fprintf (stderr, "Test field path: ");
+  test_field_path ();
+  fprintf (stderr, " done.\n");
+  fprintf (stderr, "Test field path hash: ");
+  test_field_path_hash ();
+  fprintf (stderr, " done.\n");
+  fprintf (stderr, "Test unpacker: ");
+  test_unpacker ();
+  fprintf (stderr, " done.\n");
+  fprintf (stderr, "Test unpacker arena: ");
+  test_unpacker_arena ();
+  fprintf (stderr, " done.\n");
+  fprintf (stderr, "Test packer: ");
+  test_packer ();
+  fprintf (stderr, " done.\n");
+  fprintf (stderr, "Test print length-prefixed too long: ");
+  test_print_length_prefixed_too_long ();
+  fprintf (stderr, " done.\n");
+  fprintf (stderr, "Test validate wire: ");
+  test_validate_wire ();
+  fprintf (stderr, " done.\n");
+  fprintf (stderr, "Test frame index: ");
+  test_frame_index ();
+  fprintf (stderr, " done.\n");
+  fprintf (stderr, "Test frame index formats: ");
+  test_frame_index_formats ();
+  fprintf (stderr, " done.\n");
+  fprintf (stderr, "Test transfer reframed: ");
+  test_transfer_reframed ();
+  fprintf (stderr, " done.\n");
+  fprintf (stderr, "Test transfer transcoded: ");
+  test_transfer_transcoded ();
+  fprintf (stderr, " done.\n");
+  fprintf (stderr, "Test transfer sharded: ");
+  test_transfer_sharded ();
+  fprintf (stderr, " done.\n");
+  fprintf (stderr, "Test pipelined transfer: ");
+  test_pipelined_transfer ();
+  fprintf (stderr, " done.\n");
   return 0;
 }
@@ -0,0 +1,190 @@
+/*
+ * pbcrep-index:  write an index of where the records of
+ * a length-prefixed file begin, or describe an existing index.
+ *
+ *   pbcrep-index [--format=REP] [--every=N] DATA-FILE [INDEX-FILE]
+ *   pbcrep-index --info [--record=K] [--chunks=N] INDEX-FILE
+ *
+ * REP is one of the length_prefixed_* representations
+ * (default length_prefixed_b128);  INDEX-FILE defaults to DATA-FILE.idx.
+ */
+#include "../pbcrep.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static void
+usage (void)
+{
+  fprintf (stderr,
+           "usage: pbcrep-index [--format=REP] [--every=N] DATA-FILE [INDEX-FILE]\n"
+           "       pbcrep-index --info [--record=K] [--chunks=N] INDEX-FILE\n"
+           "\n"
+           "REP is one of the length_prefixed_* representations\n"
+           "(default length_prefixed_b128).  Every Nth record is indexed\n"
+           "(default 1).  INDEX-FILE defaults to DATA-FILE.idx.\n");
+  exit (1);
+}
+
+static void
+die_error (PBCREP_Error *error)
+{
+  fprintf (stderr, "pbcrep-index: %s (%s)\n",
+           error->error_message, error->error_code_str);
+  exit (1);
+}
+
+static unsigned long long
+parse_number (const char *arg, const char *str)
+{
+  char *end;
+  unsigned long long rv = strtoull (str, &end, 10);
+  if (str[0] < '0' || str[0] > '9' || *end != 0)
+    {
+      fprintf (stderr, "pbcrep-index: bad number for %s: %s\n", arg, str);
+      exit (1);
+    }
+  return rv;
+}
+
+static int
+print_info (const char *index_filename,
+            bool        has_record,
+            uint64_t    record,
+            unsigned    n_chunks)
+{
+  PBCREP_Error *error = NULL;
+  PBCREP_FrameIndex *index = pbcrep_frame_index_load (index_filename, &error);
+  if (index == NULL)
+    die_error (error);
+  printf ("records: %llu\n", (unsigned long long) index->n_records);
+  printf ("data size: %llu\n", (unsigned long long) index->data_size);
+  printf ("every: %u\n", index->stride);
+  printf ("offsets: %llu\n", (unsigned long long) index->n_offsets);
+
+  if (has_record)
+    {
+      if (record >= index->n_records)
+        {
+          fprintf (stderr, "pbcrep-index: record %llu out of range\n",
+                   (unsigned long long) record);
+          pbcrep_frame_index_destroy (index);
+          return 1;
+        }
+      uint64_t n_skip;
+      uint64_t offset = pbcrep_frame_index_seek (index, record, &n_skip);
+      printf ("record %llu: offset %llu, skipping %llu\n",
+              (unsigned long long) record,
+              (unsigned long long) offset,
+              (unsigned long long) n_skip);
+    }
+
+  if (n_chunks > 0)
+    {
+      uint64_t *offsets = pbcrep_malloc (sizeof (uint64_t) * n_chunks);
+      uint64_t *first_records = pbcrep_malloc (sizeof (uint64_t) * n_chunks);
+      unsigned n = pbcrep_frame_index_split (index, n_chunks, offsets, first_records);
+      for (unsigned i = 0; i < n; i++)
+        {
+          uint64_t end = i + 1 < n ? offsets[i + 1] : index->data_size;
+          printf ("chunk %u: bytes %llu..%llu, from record %llu\n",
+                  i,
+                  (unsigned long long) offsets[i],
+                  (unsigned long long) end,
+                  (unsigned long long) first_records[i]);
+        }
+      pbcrep_free (offsets);
+      pbcrep_free (first_records);
+    }
+  pbcrep_frame_index_destroy (index);
+  return 0;
+}
+
+int
+main (int argc, char **argv)
+{
+  const char *format_name = "length_prefixed_b128";
+  unsigned long long every = 1;
+  bool info = false;
+  bool has_record = false;
+  unsigned long long record = 0;
+  unsigned long long n_chunks = 0;
+  const char *filenames[2] = { NULL, NULL };
+  unsigned n_filenames = 0;
+
+  for (int i = 1; i < argc; i++)
+    {
+      const char *arg = argv[i];
+      if (strncmp (arg, "--format=", 9) == 0)
+        format_name = arg + 9;
+      else if (strncmp (arg, "--every=", 8) == 0)
+        every = parse_number ("--every", arg + 8);
+      else if (strcmp (arg, "--info") == 0)
+        info = true;
+      else if (strncmp (arg, "--record=", 9) == 0)
+        {
+          has_record = true;
+          record = parse_number ("--record", arg + 9);
+        }
+      else if (strncmp (arg, "--chunks=", 9) == 0)
+        n_chunks = parse_number ("--chunks", arg + 9);
+      else if (arg[0] == '-' && arg[1] != 0)
+        usage ();
+      else if (n_filenames == 2)
+        usage ();
+      else
+        filenames[n_filenames++] = arg;
+    }
+
+  if (info)
+    {
+      if (n_filenames != 1 || n_chunks > 1000000)
+        usage ();
+      return print_info (filenames[0], has_record, record, n_chunks);
+    }
+
+  if (n_filenames == 0 || has_record || n_chunks > 0)
+    usage ();
+  if (every == 0 || every > UINT32_MAX)
+    {
+      fprintf (stderr, "pbcrep-index: --every must be between 1 and %u\n",
+               (unsigned) UINT32_MAX);
+      return 1;
+    }
+
+  PBCREP_Error *error = NULL;
+  PBCREP_Representation *rep = pbcrep_representation_from_string (format_name, &error);
+  if (rep == NULL)
+    die_error (error);
+  PBCREP_LengthPrefixed_Format format;
+  if (!pbcrep_representation_is_length_prefixed (rep, &format))
+    {
+      fprintf (stderr, "pbcrep-index: %s is not a length-prefixed format\n",
+               format_name);
+      return 1;
+    }
+
+  PBCREP_FrameIndex *index = pbcrep_frame_index_build_file (format, every, filenames[0], &error);
+  if (index == NULL)
+    die_error (error);
+
+  char *default_index_filename = NULL;
+  const char *index_filename = filenames[1];
+  if (n_filenames == 1)
+    {
+      size_t len = strlen (filenames[0]);
+      default_index_filename = pbcrep_malloc (len + 5);
+      memcpy (default_index_filename, filenames[0], len);
+      memcpy (default_index_filename + len, ".idx", 5);
+      index_filename = default_index_filename;
+    }
+  if (!pbcrep_frame_index_save (index, index_filename, &error))
+    die_error (error);
+  fprintf (stderr, "pbcrep-index: %llu records, %llu indexed, written to %s\n",
+           (unsigned long long) index->n_records,
+           (unsigned long long) index->n_offsets,
+           index_filename);
+  pbcrep_free (default_index_filename);
+  pbcrep_frame_index_destroy (index);
+  return 0;
+}